@@ -21,6 +21,32 @@
 // TODO Set linker ROM ranges to 'default,-0-7FF' under "Memory model" pull-down.
 // TODO Set linker code offset to '800' under "Additional options" pull-down.
 
+// Program variable definitions
+unsigned char pattern_task = TASK_NONE; // Scheduler slot of the SW2 pattern
+unsigned char pattern_step;             // Next step of the SW2 light pattern
+
+// Light pattern task. The scheduler runs this function every 100 ms while the
+// pattern plays, so the main loop keeps checking the pushbuttons in between.
+void flash_pattern(void)
+{
+    switch(pattern_step)
+    {
+        case 0: LED2 = 1; break;
+        case 1: LED3 = 1; break;
+        case 2: LED4 = 1; break;
+        case 3: LED5 = 1; break;
+        case 4: LED2 = 0; break;
+        case 5: LED3 = 0; break;
+        case 6: LED4 = 0; break;
+        case 7: LED5 = 0; break;
+        default:                // Pattern finished, free its scheduler slot
+            TASK_remove(pattern_task);
+            pattern_task = TASK_NONE;
+            return;
+    }
+    pattern_step ++;
+}
+
 // The main function is a required part of every C program. The microcontroller
 // begins executing the program starting at the first line in the main function.
 
@@ -29,33 +55,23 @@ int main(void)
     // The configuration functions run once during program start-up.
     OSC_config();               // Configure internal oscillator for 48 MHz
     UBMP4_config();             // Configure I/O for on-board UBMP4 devices
+    BOOT_mark(BOOT_LOOP);       // Record the start-up time (see BOOT_time)
     
     // The contents of the while loop repeat continuously.
     while(1)
 	{
-        // If SW2 is pressed, make a flashy light pattern
-        if(SW2 == 0)
+        // If SW2 is pressed, start a flashy light pattern
+        if(SW2 == 0 && pattern_task == TASK_NONE)
         {
-            LED2 = 1;
-            __delay_ms(100);
-            LED3 = 1;
-            __delay_ms(100);
-            LED4 = 1;
-            __delay_ms(100);
-            LED5 = 1;
-            __delay_ms(100);
-            LED2 = 0;
-            __delay_ms(100);
-            LED3 = 0;
-            __delay_ms(100);
-            LED4 = 0;
-            __delay_ms(100);
-            LED5 = 0;
-            __delay_ms(100);
+            pattern_step = 0;
+            pattern_task = TASK_add(flash_pattern, 100, 0);
         }
 
         // Add your Program Analysis Activities and Programming Activities code here:
 
+        // Run any scheduled tasks that are due
+        TASK_run();
+
         // Reset the microcontroller and start the bootloader if SW1 is pressed.
         if(SW1 == 0)
         {
@@ -74,12 +90,11 @@ int main(void)
  *    pattern stop immediately when you let go of SW2?
  * 
  *    Now, examine the program and try to match your observations of the light
- *    pattern to the program code. How many LED control and delay statements
- *    are grouped together inside the curly braces that follow the SW2 'if'
- *    statement? Did all of these actions happen when you pressed and let go of
- *    SW2? Can you explain why the microcontroller will always complete all of
- *    the actions inside the braces, and not skip any of the steps each time
- *    pushbutton SW2 is pressed?
+ *    pattern to the program code. How many LED control statements are in the
+ *    flash_pattern() function, and how often does the scheduler run it? Did
+ *    all of these actions happen when you pressed and let go of SW2? Can you
+ *    explain why the pattern always completes all of its steps, even though
+ *    the main loop keeps running and checking SW1 between each step?
  * 
  * 2. Explain the difference between the statements: LED2 = 1; and LED2 = 0;
  *    How does setting LED2 as 1 or 0 in the program code actually turn LED2 on
@@ -96,7 +111,8 @@ int main(void)
  *    of the LEDs as the program outputs a 0, and again when it outputs a 1.
  *    The voltage will change quickly so you may need to use a 'peak hold' or
  *    'max' feature if your multimeter has one, or slow down the light pattern
- *    in your program by increasing the time delays.
+ *    in your program by increasing the task period (see Programming Activity
+ *    1, below).
  * 
  *    Next, refer to the schematic and find one of the microcontroller pins that
  *    connects to one of the LEDs, and measure between the microcontroller pin
@@ -121,7 +137,7 @@ int main(void)
  *    of using individual LED commands.
  * 
  *    Copy the block of code (below) and pasted it after the closing SW2 'if'
- *    structure brace in your program -- the code comment located on line 56
+ *    structure brace in your program -- the code comment located on line 70
  *    of the program, above, shows where to paste this code.
 
         if(SW3 == 0)
@@ -230,16 +246,23 @@ int main(void)
  * 
  * Programming Activities
  * 
- * 1. The statement '__delay_ms(100);' creates a 100ms delay. Try changing one
- *    or more of the delay values in the program to 500ms and see what happens.
+ * 1. The statement 'TASK_add(flash_pattern, 100, 0);' tells the scheduler to
+ *    run the flash_pattern() function every 100 ms, so each step of the light
+ *    pattern lasts 100 ms. Try changing the task period (the 100) to 500 and
+ *    see what happens.
+ * 
+ *    Can the period be made even longer? Try 1000 ms. The period is stored in
+ *    an 'unsigned int' variable. How big can the period get before it stops
+ *    working as expected? (Hint: can you think of a fast and efficient way of
+ *    guessing an unknown number?)
  * 
- *    Can the delay be made even longer? Try 1000 ms. How big can the delay get
- *    before MPLAB-X produces an error message? (Hint: can you think of a fast
- *    and efficient way of guessing an unknown number?)
+ *    Unlike a time delay, the task period doesn't stop the main loop. Press
+ *    SW2 and then SW1 while the pattern is playing. Does SW1 still work?
  * 
- * 2. The '__delay_ms();' function accepts only integers as delay values. To
- *    create delays shorter than 1 ms, a different function must be used. Use
- *    the '__delay_us();' function to specify delays in microseconds.
+ * 2. Time delays can also be made using the '__delay_ms();' function, which
+ *    stops the program for a number of milliseconds. To create delays shorter
+ *    than 1 ms, a different function must be used. Use the '__delay_us();'
+ *    function to specify delays in microseconds.
  * 
  *    You won't be able to see microsecond length LED flashes with your eyes,
  *    but you can measure them using an oscilloscope, or hear them if they are
@@ -8,63 +8,649 @@
  UBMP4 I/O devices, and ADC (analog-to-digital converter), as well as ADC
  channel selection and conversion functions. Include the UBMP4.h file in your
  main program to call these functions. Add or modify functions as needed.
+ 
+ The interrupt service routine at the end of this file runs the background
+ services: a TMR0 system tick that counts milliseconds, which the cooperative
+ task scheduler uses to run task functions from the main loop without blocking
+ on time delays, and a background ADC sampler that converts a list of channels
+ into a double-buffered result table and can stream one channel's results into
+ a ring buffer. A TMR2 interrupt generates beeper tones in the background, and
+ the TMR0 tick debounces the pushbuttons into a queue of button events and
+ plays output patterns through the LED and header output shadow latch. A TMR1
+ interrupt controls LED brightness using bit angle modulation. Comparator C2
+ edge interrupts on IRIN are decoded into IR remote codes, and the TMR2 PWM1
+ carrier is gated from a mark/space table to send IR codes. Comparator C1 edge
+ interrupts on a header input are timestamped to measure frequency, period and
+ duty cycle. The USB interrupt runs a CDC serial port that streams ADC samples
+ straight from the ring buffer, and TMR2 also times a software UART on the H1
+ and H2 pins. Command frames from either one are run by CMD_poll. Optional
+ trace markers record timestamped events for profiling, and boot phase
+ timestamps measure the start-up path. When nothing is left to do, IDLE_sleep
+ puts the microcontroller to sleep until a pushbutton interrupt-on-change or
+ the watchdog timer wakes it up again.
 ==============================================================================*/
 
 #include    "xc.h"              // XC compiler general include file
 #include    "stdint.h"          // Include integer definitions
 #include    "stdbool.h"         // Include Boolean (true/false) definitions
+#include    "stddef.h"          // Include NULL pointer definition
 
 #include    "UBMP4.h"           // Include UBMP4 constant & function definitions
 
+// Compile-time pin table checks. Each pin table entry declares an enumeration
+// constant named after its pin (e.g. PINMAP_PORT_C_5), so two owners of the
+// same pin cause a 'redeclared enumerator' compiler error naming the pin.
+#define PINMAP_OWNER(x, owner, port, bit, dir, wpu, ana) PINMAP_##port##_##bit,
+enum pinmap_owners { UBMP4_PIN_TABLE(PINMAP_OWNER, 0) PINMAP_PINS };
+
+// Analog pins must be inputs, and PORTC pins do not have weak pull-ups. A
+// negative array size compiler error on these names means a pin table mistake.
+#define PINMAP_ANA_OUT(x, owner, port, bit, dir, wpu, ana) || ((ana) == ANA_ON && (dir) == PIN_OUT)
+#define PINMAP_WPU_C(x, owner, port, bit, dir, wpu, ana) || ((port) == PORT_C && (wpu) == WPU_ON)
+typedef char pinmap_analog_pin_is_output[(0 UBMP4_PIN_TABLE(PINMAP_ANA_OUT, 0)) ? -1 : 1];
+typedef char pinmap_portc_pin_has_pullup[(0 UBMP4_PIN_TABLE(PINMAP_WPU_C, 0)) ? -1 : 1];
+
+// The UBMP4 board's table gives the values UBMP4_config and ADC_config used to
+// set by hand. Update these if the pin table is changed for another board.
+typedef char pinmap_porta_check[(PINMAP_TRISA == 0b00001111 && PINMAP_WPUA == 0b00001000 && PINMAP_ANSELA == 0) ? 1 : -1];
+typedef char pinmap_portb_check[(PINMAP_TRISB == 0b11110000 && PINMAP_WPUB == 0b11110000 && PINMAP_ANSELB == 0) ? 1 : -1];
+typedef char pinmap_portc_check[(PINMAP_TRISC == 0b00001111 && PINMAP_ANSELC == 0b00001000) ? 1 : -1];
+
+// Buffers that are always written before they are read are __persistent, so
+// the C start-up code does not spend time clearing them after every reset.
+
+// Boot phase timestamps
+static unsigned int boot_pll_spins;     // PLL lock wait loop passes
+static unsigned int boot_times[BOOT_PHASES];    // Phase timestamps
+static unsigned char boot_marked;       // Phases recorded (bit mask)
+typedef char boot_phases_check[(BOOT_PHASES <= 8 && BOOT_CONFIG < BOOT_LOOP && BOOT_USER < BOOT_PHASES) ? 1 : -1];
+
+// System tick variables
+static volatile unsigned int tick_ms;   // Milliseconds since start-up
+static unsigned int tick_cycles;        // Cycles not yet counted as a ms
+static volatile unsigned char tick_count;   // TMR0 overflows (timestamp MSB)
+static volatile unsigned char tick_count_h; // tick_count overflows
+
+// TICK_CYCLES must match the TMR0 div-16 overflow set by UBMP4_config, and be
+// shorter than 1 ms so each tick adds at most 1 to tick_ms
+typedef char tick_check[(TICK_CYCLES == 16 * 256 && TICK_CYCLES < TICK_MS_CYCLES) ? 1 : -1];
+
+// The time hef_write_row adds to tick_cycles must fit in it
+typedef char hef_stall_check[(2UL * HEF_STALL_MS * TICK_MS_CYCLES - TICK_CYCLES + TICK_MS_CYCLES < 65536UL) ? 1 : -1];
+
+// Task scheduler slots
+typedef struct
+{
+    task_function_t function;   // Task function, or NULL if the slot is free
+    unsigned int period;        // Task repeat period in ms (0 = one-shot)
+    unsigned int due;           // TICK_ms() time when the task next runs
+} task_t;
+
+static task_t tasks[TASK_SLOTS];
+typedef char task_slots_check[(TASK_SLOTS < TASK_NONE) ? 1 : -1];
+
+// USB RAM map. The USB module reads and writes buffer descriptors and endpoint
+// buffers directly, so they are placed at fixed addresses in the USB dual-port
+// RAM (the first 512 bytes of linear RAM). The ADC stream ring buffer is also
+// here so that USB_stream can send samples straight from the ring.
+#define USB_EP0_SIZE        8       // EP0 control endpoint packet size
+#define USB_RX_SIZE         16      // EP2 OUT packet size (two buffers)
+#define USB_HEADER_SIZE     (4 + USB_STREAM_EVENTS)
+#define USB_BDT_ADDRESS     0x2000  // 10 buffer descriptors (ping-pong on EP1-2)
+#define USB_EP0_OUT_ADDRESS (USB_BDT_ADDRESS + 40)
+#define USB_EP0_IN_ADDRESS  (USB_EP0_OUT_ADDRESS + USB_EP0_SIZE)
+#define USB_RX_ADDRESS      (USB_EP0_IN_ADDRESS + USB_EP0_SIZE)
+#define USB_HEADER_ADDRESS  (USB_RX_ADDRESS + 2 * USB_RX_SIZE)
+#define USB_TX_ADDRESS      (USB_HEADER_ADDRESS + USB_HEADER_SIZE)
+#define USB_RING_ADDRESS    (USB_TX_ADDRESS + USB_WRITE_SIZE)
+typedef char usb_ram_map_too_large[(USB_RING_ADDRESS + 2 * ADC_RING_SIZE > 0x2200) ? -1 : 1];
+typedef char usb_packet_too_large[(2 * ADC_RING_SIZE > 64 || USB_HEADER_SIZE > 64 || USB_WRITE_SIZE > 64) ? -1 : 1];    // EP2 IN is 64 bytes
+
+// USB buffer descriptor. The USB module owns the descriptor and its buffer
+// while the UOWN bit of stat is set.
+typedef struct
+{
+    unsigned char stat;         // Status: UOWN, DTS, DTSEN, BSTALL / PID
+    unsigned char cnt;          // Byte count
+    unsigned char adrl;         // Buffer address
+    unsigned char adrh;
+} usb_bd_t;
+
+static volatile usb_bd_t usb_bdt[10] __at(USB_BDT_ADDRESS);
+static volatile unsigned char usb_ep0_out[USB_EP0_SIZE] __at(USB_EP0_OUT_ADDRESS);
+static volatile unsigned char usb_ep0_in[USB_EP0_SIZE] __at(USB_EP0_IN_ADDRESS);
+static volatile unsigned char usb_rx[2][USB_RX_SIZE] __at(USB_RX_ADDRESS);
+static volatile unsigned char usb_header[USB_HEADER_SIZE] __at(USB_HEADER_ADDRESS);
+static volatile unsigned char usb_tx[USB_WRITE_SIZE] __at(USB_TX_ADDRESS);
+
+// ADC configuration state. ADC_config runs on the first use of the ADC.
+static bool adc_configured;
+
+// Background ADC sampler variables
+static unsigned char adc_channels[ADC_SAMPLER_SLOTS];   // Channel list
+static unsigned char adc_count;         // Number of channels in the list
+static unsigned char adc_index;         // List position being converted
+static volatile bool adc_sampling;      // Sampler running, start conversions
+static bool adc_10bit;                  // Store 10-bit results
+static unsigned int adc_results[2][ADC_SAMPLER_SLOTS];  // Double result buffer
+static volatile unsigned char adc_front;    // Buffer read by ADC_get
+static volatile unsigned char adc_sweeps;   // Completed channel list sweeps
+static bool adc_auto;                   // ADCON2 auto-conversion trigger in use
+
+// The sampler converts one channel per tick (12 TAD at FOSC/64 fits easily),
+// and 0xFF marks list positions that are not in use
+typedef char adc_sampler_check[(12 * 16 < TICK_CYCLES && ADC_SAMPLER_SLOTS < 0xFF) ? 1 : -1];
+
+// ADC stream ring buffer variables
+static unsigned int adc_ring[ADC_RING_SIZE] __at(USB_RING_ADDRESS);
+static volatile unsigned char adc_ring_head;    // Written by ISR only
+static volatile unsigned char adc_ring_tail;    // Written by ADC_stream_read
+static unsigned char adc_stream_index = 0xFF;   // Streamed list position
+static volatile unsigned char adc_overruns;     // Dropped stream samples
+typedef char adc_ring_check[((ADC_RING_SIZE & (ADC_RING_SIZE - 1)) == 0 && ADC_RING_SIZE <= 128) ? 1 : -1];
+
+// ADC filter variables, one set for each sampler channel list position
+typedef struct
+{
+    unsigned char mode;         // FILTER_ mode
+    unsigned char n;            // Mode setting (bits or time constant)
+    unsigned char count;        // Samples summed, or moving average position
+    unsigned int sum;           // Oversample or moving average sum, IIR state
+    unsigned int value;         // Latest filtered value
+    unsigned int min;           // Lowest filtered value held
+    unsigned int max;           // Highest filtered value held
+    bool peaks_valid;           // min and max hold values
+} adc_filter_t;
+
+static adc_filter_t adc_filters[ADC_SAMPLER_SLOTS];
+static __persistent unsigned int adc_average[ADC_SAMPLER_SLOTS][FILTER_AVERAGE_SIZE];
+
+// Sums of 10-bit samples, and the IIR state difference plus its rounding, must
+// fit in 16 bits.
+typedef char adc_filter_check[((1023UL << (2 * FILTER_OVERSAMPLE_MAX)) + 2 < 65536 && (FILTER_AVERAGE_SIZE & (FILTER_AVERAGE_SIZE - 1)) == 0 && 1023UL * FILTER_AVERAGE_SIZE < 65536 && (1023UL << FILTER_IIR_SCALE) + (1 << (FILTER_IIR_SCALE - 1)) < 32768) ? 1 : -1];
+
+// ADC window variables, one set for each sampler channel list position
+typedef struct
+{
+    unsigned int low;           // Low threshold
+    unsigned int high;          // High threshold
+    unsigned char hysteresis;   // Distance past a threshold to leave a zone
+    unsigned char dwell;        // Values in a row to settle in a new zone
+    unsigned char zone;         // Settled ADC_ZONE_
+    unsigned char pending;      // Zone being settled
+    unsigned char count;        // Values in a row in the pending zone
+    bool on;                    // Window being watched
+} adc_window_t;
+
+static adc_window_t adc_windows[ADC_SAMPLER_SLOTS];
+static unsigned char adc_event_queue[ADC_EVENT_QUEUE_SIZE];
+static volatile unsigned char adc_event_head;   // Written by ISR only
+static volatile unsigned char adc_event_tail;   // Written by ADC_event
+typedef char adc_window_check[((ADC_EVENT_QUEUE_SIZE & (ADC_EVENT_QUEUE_SIZE - 1)) == 0 && ADC_SAMPLER_SLOTS <= ADC_EVENT_INDEX(0xFF) + 1 && ADC_EVENT_TYPE(ADC_ZONE_HIGH << 4) == ADC_EVENT_HIGH) ? 1 : -1];
+
+// Goertzel tone detector variables. Each filter is tuned to its tone's exact
+// frequency, k = N * hz / sample rate cycles per block, which need not be a
+// whole number: the power formula holds for any k, and a nominal tone up to
+// half a bin from the nearest whole k would otherwise read as little as 2/pi
+// of its magnitude. The coefficient 2cos(2 pi k / N) is made with a sine
+// series (accurate to 1e-7) so that it is a compile-time constant.
+#define GOERTZEL_Q      14          // Coefficient fraction bits
+#define GOERTZEL_SHIFT  2           // State scaling for the power (fits an int)
+#define GOERTZEL_KF(hz) ((double)GOERTZEL_BLOCK * (hz) * GOERTZEL_CHANNELS * 4 * TICK_CYCLES / _XTAL_FREQ)
+#define GOERTZEL_K(hz)  ((2UL * GOERTZEL_BLOCK * (hz) * GOERTZEL_CHANNELS * (4UL * TICK_CYCLES / 1024) + _XTAL_FREQ / 1024) / (2UL * (_XTAL_FREQ / 1024)))
+#define GOERTZEL_SIN(y) ((y) * (1 - (y) * (y) / 6 * (1 - (y) * (y) / 20 * (1 - (y) * (y) / 42 * (1 - (y) * (y) / 72 * (1 - (y) * (y) / 110))))))
+#define GOERTZEL_COS(x) (-GOERTZEL_SIN((x) - 1.5707963268))
+#define GOERTZEL_COEFF(hz)  (int)(2.0 * (1 << GOERTZEL_Q) * GOERTZEL_COS(6.2831853072 * GOERTZEL_KF(hz) / GOERTZEL_BLOCK) + ((GOERTZEL_KF(hz) * 4 > GOERTZEL_BLOCK) ? -0.5 : 0.5)),
+// A full-scale input (|x| <= 128) can grow the state to 128 * N / sin(2 pi k / N).
+// coeff * s1 fits a long while the state is below 65536, so sin(2 pi k / N) must
+// be above N / 512. sin() is at least 4d / N, where d is the distance of k from
+// 0 or N / 2 bins, so every tone needs d > N * N / 2048. The check uses the
+// nearest whole k (GOERTZEL_K), so it asks for one more bin to cover rounding.
+#define GOERTZEL_D_MIN  ((unsigned long)GOERTZEL_BLOCK * GOERTZEL_BLOCK / 2048 + 2)
+#define GOERTZEL_BAD_K(hz)  || GOERTZEL_K(hz) < GOERTZEL_D_MIN || GOERTZEL_K(hz) + GOERTZEL_D_MIN > GOERTZEL_BLOCK / 2
+typedef char goertzel_tone_out_of_range[(0 GOERTZEL_TONES(GOERTZEL_BAD_K)) ? -1 : 1];
+typedef char goertzel_check[(GOERTZEL_BLOCK < 256 && (GOERTZEL_QUEUE_SIZE & (GOERTZEL_QUEUE_SIZE - 1)) == 0 && GOERTZEL_QUEUE_SIZE <= 128 && GOERTZEL_CHANNELS <= ADC_SAMPLER_SLOTS && 128UL * GOERTZEL_BLOCK / 2 < 65536) ? 1 : -1];
+static const int goertzel_coeff[GOERTZEL_BINS] = { GOERTZEL_TONES(GOERTZEL_COEFF) };
+static unsigned char goertzel_index = 0xFF;     // Sampler list position
+static unsigned char goertzel_queue[GOERTZEL_QUEUE_SIZE];  // 8-bit samples
+static volatile unsigned char goertzel_head;    // Written by ISR only
+static volatile unsigned char goertzel_tail;    // Written by GOERTZEL_read
+static volatile bool goertzel_overrun;          // Samples lost, restart block
+static unsigned char goertzel_count;            // Samples in this block
+static long goertzel_s1[GOERTZEL_BINS];         // Filter states s[n - 1]
+static long goertzel_s2[GOERTZEL_BINS];         // and s[n - 2]
+
+// Temperature indicator variables
+#define TEMP_CAL_MARK   0xA5        // First calibration byte when saved
+static unsigned char temp_index = 0xFF;         // Sampler position (0xFF = off)
+static unsigned int temp_cal_count;             // Calibration ADC count
+static int temp_cal_tenths;                     // Temperature at that count
+static unsigned int temp_count = 0xFFFF;        // Count of temp_tenths
+static int temp_tenths;                         // Last calculated temperature
+typedef char temp_slope_check[(TEMP_SLOPE > 256 && TEMP_DEFAULT_COUNT < 1024 && 1023UL * TEMP_SLOPE / 256 < 16384) ? 1 : -1];   // int result
+
+// HEF ring logger variables
+#define LOG_ROW_ADDRESS(row) (HEF_ADDRESS + (LOG_FIRST_ROW + (row)) * HEF_ROW_SIZE)
+typedef char log_rows_outside_hef[(LOG_FIRST_ROW + LOG_ROWS > 4 || 2 + 2 * LOG_RECORDS > HEF_ROW_SIZE) ? -1 : 1];
+typedef char log_tags_overlap[(LOG_EVENT > (LOG_ADC | 0b00000011) && LOG_EVENT != LOG_END && LOG_ROWS > 1) ? 1 : -1];
+static unsigned char log_buffer[2 + 2 * LOG_RECORDS];  // Row being filled
+static unsigned char log_count;                 // Records in log_buffer
+static unsigned char log_row;                   // Next logger row to write
+static unsigned char log_sequence;              // Its sequence number
+
+// Pushbutton debouncer variables. The two vertical counter bytes hold a 2-bit
+// counter for each button, so all of the buttons are debounced together.
+static unsigned char button_ct0 = 0xFF, button_ct1 = 0xFF;
+static volatile unsigned char button_state;     // Debounced pressed buttons
+static unsigned char button_hold[5];            // Held time in samples
+static unsigned char button_sample_ms;          // ms since the last sample
+static __persistent unsigned char button_queue[BUTTON_QUEUE_SIZE];
+static volatile unsigned char button_head;      // Written by ISR only
+static volatile unsigned char button_tail;      // Written by BUTTON_event
+typedef char button_timing_check[((BUTTON_QUEUE_SIZE & (BUTTON_QUEUE_SIZE - 1)) == 0 && (BUTTON_LONG_MS + BUTTON_REPEAT_MS) / BUTTON_SAMPLE_MS < 256) ? 1 : -1];
+
+// Analog keypad variables
+static unsigned int keypad_levels[KEYPAD_KEYS_MAX];     // Rising key thresholds
+static unsigned char keypad_keys;               // Keys in the ladder
+static unsigned char keypad_index = 0xFF;       // Sampler list position
+static unsigned char keypad_hysteresis;         // Band overlap (result units)
+static unsigned char keypad_pin;                // PORTB pin made analog
+static volatile unsigned char keypad_button;    // Pushbutton it replaces
+static unsigned char keypad_raw = KEYPAD_NONE;  // Latest decoded key
+static unsigned char keypad_settle;             // Equal decodes in a row
+static volatile unsigned char keypad_key = KEYPAD_NONE;     // Settled key
+static unsigned char keypad_last = KEYPAD_NONE; // Key with events queued
+static unsigned char keypad_next = KEYPAD_NONE; // Settled key being debounced
+static unsigned char keypad_stable;             // Button samples it's been the same
+static unsigned char keypad_hold;               // Held time in samples
+typedef char keypad_check[(BUTTON_KEY(KEYPAD_KEYS_MAX - 1) <= 0x0F && KEYPAD_HYSTERESIS / 4 >= 1 && KEYPAD_HYSTERESIS < 128 && KEYPAD_SETTLE > 1 && KEYPAD_DEBOUNCE < 255) ? 1 : -1];
+
+// Output shadow latch variables
+static unsigned char out_latc, out_latc_changed;    // PORTC shadow and changes
+static volatile unsigned char latc_reserved;    // LATC bits in use (IR, UART, WS2812)
+static unsigned char out_lata, out_lata_changed;    // PORTA shadow and changes
+static const unsigned char *out_frames;         // Pattern frames (NULL = off)
+static unsigned char out_count;                 // Number of pattern frames
+static unsigned char out_frame;                 // Frame being shown
+static unsigned char out_mask;                  // PORTC bits the pattern sets
+static unsigned int out_ms, out_ms_left;        // Frame time and time left
+static bool out_repeat;                         // Repeat pattern at the end
+
+// The OUT_ masks cover each LATC bit once
+typedef char out_mask_check[((OUT_H1 | OUT_H2 | OUT_H3 | OUT_H4) == (unsigned char)~OUT_LEDS && (OUT_D2 | OUT_D3 | OUT_D4 | OUT_D5) == OUT_LEDS) ? 1 : -1];
+
+// LED brightness gamma correction table (gamma = 2.2), in program memory
+static const unsigned char led_gamma[256] =
+{
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   2,   2,   2,   2,   2,   2,   2,
+      3,   3,   3,   3,   3,   4,   4,   4,   4,   5,   5,   5,   5,   6,   6,   6,
+      6,   7,   7,   7,   8,   8,   8,   9,   9,   9,  10,  10,  11,  11,  11,  12,
+     12,  13,  13,  13,  14,  14,  15,  15,  16,  16,  17,  17,  18,  18,  19,  19,
+     20,  20,  21,  22,  22,  23,  23,  24,  25,  25,  26,  26,  27,  28,  28,  29,
+     30,  30,  31,  32,  33,  33,  34,  35,  35,  36,  37,  38,  39,  39,  40,  41,
+     42,  43,  43,  44,  45,  46,  47,  48,  49,  49,  50,  51,  52,  53,  54,  55,
+     56,  57,  58,  59,  60,  61,  62,  63,  64,  65,  66,  67,  68,  69,  70,  71,
+     73,  74,  75,  76,  77,  78,  79,  81,  82,  83,  84,  85,  87,  88,  89,  90,
+     91,  93,  94,  95,  97,  98,  99, 100, 102, 103, 105, 106, 107, 109, 110, 111,
+    113, 114, 116, 117, 119, 120, 121, 123, 124, 126, 127, 129, 130, 132, 133, 135,
+    137, 138, 140, 141, 143, 145, 146, 148, 149, 151, 153, 154, 156, 158, 159, 161,
+    163, 165, 166, 168, 170, 172, 173, 175, 177, 179, 181, 182, 184, 186, 188, 190,
+    192, 194, 196, 197, 199, 201, 203, 205, 207, 209, 211, 213, 215, 217, 219, 221,
+    223, 225, 227, 229, 231, 234, 236, 238, 240, 242, 244, 246, 248, 251, 253, 255
+};
+
+// TMR1 high byte reloads for each BAM time slot. TMR1 counts Fosc (4 counts
+// per cycle), so every slot is a whole number of TMR1H steps and only TMR1H is
+// reloaded while the timer keeps running. TMR1L keeps counting the time taken
+// to reach the ISR, so no compensation for the reload itself is needed. If the
+// ISR starts so late that the slot time has already passed, TMR1H wraps, and
+// the slot is ended within one TMR1H step (64 cycles) instead.
+#define LED_BAM_RELOAD(bit) (unsigned char)(256 - ((LED_BAM_UNIT * 4 / 256) << (bit)))
+static const unsigned char led_bam_reload[8] =
+{
+    LED_BAM_RELOAD(0), LED_BAM_RELOAD(1), LED_BAM_RELOAD(2), LED_BAM_RELOAD(3),
+    LED_BAM_RELOAD(4), LED_BAM_RELOAD(5), LED_BAM_RELOAD(6), LED_BAM_RELOAD(7)
+};
+
+// Slots must be whole TMR1H steps, the bit 7 slot must fit in 16 bits, and
+// the refresh must be fast enough not to flicker.
+typedef char led_bam_unit_check[(LED_BAM_UNIT % 64 == 0 && LED_BAM_UNIT <= 128 && LED_REFRESH_HZ >= 200) ? 1 : -1];
+
+// LED brightness variables. Bit planes hold the LATC (D2-D5) and LATA (D1)
+// output bits for each BAM time slot. The ISR shows the front planes while
+// new duty values are built into the back planes.
+static unsigned char led_duty[5];               // D1-D5 duty values
+static __persistent unsigned char led_plane_c[2][8];    // LATC bit planes
+static __persistent unsigned char led_plane_a[2][8];    // LATA bit planes
+static volatile unsigned char led_front;        // Planes shown by the ISR
+static volatile bool led_swap;                  // Show back planes next
+static unsigned char led_bit;                   // BAM slot being shown
+
+// Trace ring buffer variables
+typedef struct
+{
+    unsigned char id;           // Trace marker id
+    unsigned char time_h;       // Timestamp: TMR0 overflow count
+    unsigned char time_l;       // Timestamp: TMR0
+} trace_t;
+
+static __persistent trace_t trace_buffer[TRACE_SIZE];
+static unsigned char trace_head;                // Next entry to write
+static unsigned char trace_count;               // Entries in the buffer
+
+// The ring index wraps with a mask, and the dump bit time is whole timestamp
+// counts so its edges do not drift.
+typedef char trace_size_check[((TRACE_SIZE & (TRACE_SIZE - 1)) == 0 && TRACE_SIZE <= 64 && TRACE_BIT_US * 3 % 4 == 0) ? 1 : -1];
+
+// IR receiver variables
+#define IR_IDLE     0           // Waiting for a frame to start
+#define IR_NEC_LEADER 1         // NEC leader mark received
+#define IR_NEC_DATA 2           // Receiving NEC data bits
+#define IR_RC5_DATA 3           // Receiving RC5 bits
+
+// Accepted level times (us). Demodulators widen marks and shorten spaces by up
+// to about 160 us, so the short NEC and RC5 levels allow for that and for
+// interrupt latency, and RC5 splits half and whole bits at 1.5 half bits.
+#define IR_NEC_SHORT_MIN 250    // 562 us mark or space (0 bit)
+#define IR_NEC_SHORT_MAX 900
+#define IR_NEC_LONG_MIN 1300    // 1687 us space (1 bit)
+#define IR_NEC_LONG_MAX 2000
+#define IR_RC5_SHORT_MIN 500    // 889 us half bit
+#define IR_RC5_LONG_MIN 1334    // 1778 us whole bit
+#define IR_RC5_LONG_MAX 2300
+typedef char ir_timing_check[(IR_NEC_SHORT_MAX < IR_NEC_LONG_MIN && IR_NEC_LONG_MAX < 4000 && IR_RC5_SHORT_MIN < 889 - 160 && IR_RC5_LONG_MAX < 8000) ? 1 : -1];
+
+// RC5 Manchester decoder states and their transitions. Each state's table
+// entry holds the next state for each type of half-bit period (2 bits each).
+#define RC5_START1  0           // Between bits, last bit 1
+#define RC5_MID1    1           // Middle of a 1 bit
+#define RC5_MID0    2           // Middle of a 0 bit
+#define RC5_START0  3           // Between bits, last bit 0
+#define RC5_SHORT_SPACE 0       // Half-bit space (shift for the next state)
+#define RC5_SHORT_MARK  2       // Half-bit mark
+#define RC5_LONG_SPACE  4       // Full-bit space
+#define RC5_LONG_MARK   6       // Full-bit mark
+static const unsigned char rc5_next[4] = {0x01, 0x91, 0x9B, 0xFB};
+
+static unsigned char ir_state;                  // IR_ decoder state
+static unsigned char rc5_state;                 // RC5_ Manchester state
+static unsigned int ir_edge_time;               // Timestamp of the last edge
+static unsigned char ir_bits;                   // Bits received
+static unsigned long ir_data;                   // Received bits
+static unsigned int ir_nec_last;                // Last NEC code for repeats
+static __persistent ir_code_t ir_queue[IR_QUEUE_SIZE];
+static volatile unsigned char ir_head;          // Written by ISR only
+static volatile unsigned char ir_tail;          // Written by IR_receive
+
+// IR transmitter variables. The mark/space table holds the length of each
+// mark (even entries) and space (odd entries) of a frame in TMR2 interrupts.
+#define IR_TX_TICKS(us) (unsigned char)(((us) * (unsigned long)TONE_RATE + 500000) / 1000000)
+static __persistent unsigned char ir_tx_table[67];  // NEC: leader, 32 bits, stop
+static unsigned char ir_tx_count;               // Entries in the table
+static unsigned char ir_tx_index;               // Entry being sent
+static unsigned char ir_tx_left;                // TMR2 interrupts left in entry
+static volatile bool ir_tx_on;                  // Frame being sent
+
+// The table holds a whole NEC frame, and every entry fits its byte.
+typedef char ir_tx_check[(sizeof(ir_tx_table) == 2 + 2 * 32 + 1 && IR_TX_TICKS(9000) <= 255 && IR_TX_TICKS(562) >= 8) ? 1 : -1];
+
+// Capture engine variables
+#define CAPTURE_MASK    0x00FFFFFF  // 24-bit timestamp differences
+#define CAPTURE_GATE_COUNTS (CAPTURE_GATE_MS * 750UL)   // Gate time in counts
+#define CAPTURE_MIN_COUNTS (CAPTURE_MIN_MS * 750UL)     // Shortest time in counts
+typedef char capture_check[(_XTAL_FREQ / 4 / 16 == 750000UL && CAPTURE_MIN_MS < CAPTURE_GATE_MS && CAPTURE_GATE_MS < 256 && CAPTURE_GATE_COUNTS < CAPTURE_MASK / 2) ? 1 : -1];
+static bool capture_gated;                      // CAPTURE_GATED mode
+static unsigned char capture_ansel;             // ANSELC bit of the input
+static unsigned char capture_ansel_saved;       // Its setting before capture
+static bool capture_started;                    // First rising edge seen
+static unsigned long capture_rise;              // Last rising edge timestamp
+static unsigned int capture_count;              // Periods or edges so far
+static unsigned long capture_time;              // Time of periods so far
+static unsigned long capture_high;              // High time so far
+static unsigned long capture_pulse;             // High time of this period
+static bool capture_level;                      // C1OUT at the last edge
+static unsigned char capture_gate_ms;           // ms since the gate opened
+static unsigned long capture_gate_start;        // Gate opening timestamp
+static capture_t capture_result;                // Published result
+static volatile bool capture_new;               // Result not read yet
+
+// WS2812 LED strip variables
+static unsigned char ws_frame[WS_PIXELS * 3];   // Pixels in GRB wire order
+static unsigned char ws_bytes;                  // Bytes to send (0 = none)
+static bool ws_on;                              // WS_start called
+static bool ws_latching;                        // Frame sent, still latching
+static unsigned int ws_sent_time;               // Timestamp of the last frame
+
+// USB buffer descriptor table entries and status bits
+#define USB_BD_EP0_OUT  0           // EP0 OUT
+#define USB_BD_EP0_IN   1           // EP0 IN
+#define USB_BD_EP2_OUT  6           // EP2 OUT even (odd is next)
+#define USB_BD_EP2_IN   8           // EP2 IN even (odd is next)
+#define BD_UOWN         0x80        // USB module owns the descriptor
+#define BD_DTS          0x40        // DATA1 packet
+#define BD_DTSEN        0x08        // Check data toggle
+#define BD_BSTALL       0x04        // Stall the endpoint
+#define BD_PID(stat)    (((stat) >> 2) & 0x0F)  // Token PID after a transaction
+#define PID_SETUP       0x0D        // SETUP token
+
+// USB device descriptor, in program memory
+static const unsigned char usb_device_descriptor[18] =
+{
+    18, 1,                      // Descriptor length, DEVICE
+    0x00, 0x02,                 // USB 2.0
+    0x02, 0x00, 0x00,           // CDC device class
+    USB_EP0_SIZE,               // EP0 packet size
+    (unsigned char)USB_VID, (unsigned char)(USB_VID >> 8),
+    (unsigned char)USB_PID, (unsigned char)(USB_PID >> 8),
+    0x00, 0x01,                 // Device version 1.00
+    0, 0, 0,                    // No string descriptors
+    1                           // One configuration
+};
+
+// USB configuration descriptor for a CDC-ACM serial port, in program memory
+static const unsigned char usb_config_descriptor[67] =
+{
+    9, 2, 67, 0, 2, 1, 0, 0x80, 50,     // CONFIGURATION: 2 interfaces, 100 mA
+    9, 4, 0, 0, 1, 0x02, 0x02, 0x01, 0, // INTERFACE 0: CDC control, AT commands
+    5, 0x24, 0x00, 0x10, 0x01,          // CDC header, CDC 1.10
+    5, 0x24, 0x01, 0x00, 0x01,          // CDC call management: data on interface 1
+    4, 0x24, 0x02, 0x02,                // CDC ACM: line coding and line state
+    5, 0x24, 0x06, 0, 1,                // CDC union: interface 0 controls 1
+    7, 5, 0x81, 0x03, 8, 0, 255,        // ENDPOINT 1 IN: interrupt (not used)
+    9, 4, 1, 0, 2, 0x0A, 0, 0, 0,       // INTERFACE 1: CDC data
+    7, 5, 0x02, 0x02, USB_RX_SIZE, 0, 0,    // ENDPOINT 2 OUT: bulk
+    7, 5, 0x82, 0x02, 64, 0, 0          // ENDPOINT 2 IN: bulk
+};
+
+// USB device variables
+static bool usb_on;                             // USB module enabled
+static volatile bool usb_configured;            // Host set configuration 1
+static volatile bool usb_dtr;                   // Host opened the serial port
+static unsigned char usb_config;                // Configuration value
+static unsigned char usb_address;               // Address to set after status
+static unsigned char usb_reply[2];              // Status request reply
+static unsigned char usb_line_coding[7] = {0x80, 0x25, 0, 0, 0, 0, 8};  // 9600 8N1
+static bool usb_line_coding_out;                // Line coding data stage next
+
+// USB EP0 control transfer data stage variables
+static const unsigned char *usb_ep0_data;       // Data left to send
+static unsigned char usb_ep0_left;              // Number of bytes left
+static bool usb_ep0_short;                      // Reply shorter than requested
+static bool usb_ep0_more;                       // Another IN packet to send
+static unsigned char usb_ep0_dts;               // Next IN packet DATA0/DATA1
+
+// USB EP2 data variables
+static unsigned char usb_in_next;               // Next EP2 IN descriptor (odd)
+static volatile unsigned char usb_in_busy;      // EP2 IN descriptors armed
+static unsigned char usb_rx_next;               // EP2 OUT descriptor being read
+static unsigned char usb_rx_index;              // Next byte in its buffer
+static bool usb_streaming;                      // USB_stream on
+static unsigned char usb_stream_samples;        // Ring samples being sent
+static unsigned char usb_stream_sequence;       // Stream packet number
+static unsigned char usb_batch_ms;              // ms waited for a batch
+static unsigned char usb_events[USB_STREAM_EVENTS];
+static volatile unsigned char usb_event_count;  // Events waiting to be sent
+
+// Software UART variables
+static volatile bool uart_on;                   // UART using TMR2
+static unsigned char uart_rx_ticks;             // TMR2 interrupts to next sample
+static unsigned char uart_rx_bit;               // 0 idle, 1 start, 2-9 data, 10 stop
+static unsigned char uart_rx_shift;             // Byte being received
+static unsigned char uart_rx_queue[UART_RX_SIZE];
+static volatile unsigned char uart_rx_head;     // Written by ISR only
+static volatile unsigned char uart_rx_tail;     // Written by UART_read_byte
+static unsigned char uart_tx_ticks;             // TMR2 interrupts to next bit
+static unsigned int uart_tx_frame;              // Bits left to send, LSB first
+static unsigned char uart_tx_queue[UART_TX_SIZE];
+static volatile unsigned char uart_tx_head;     // Written by UART_write_byte
+static volatile unsigned char uart_tx_tail;     // Written by ISR only
+
+// Command protocol variables
+#define CMD_SOURCE_USB  0           // Frame arriving from USB
+#define CMD_SOURCE_UART 1           // Frame arriving from the software UART
+#define CMD_BAD         0xFF        // Handler result: arguments missing or invalid
+typedef unsigned char (*cmd_handler_t)(const unsigned char *args, unsigned char length);
+typedef char cmd_reply_too_large[(CMD_FRAME_SIZE + 3 > USB_WRITE_SIZE) ? -1 : 1];
+
+static unsigned char cmd_frame[CMD_FRAME_SIZE]; // Operations being received
+static unsigned char cmd_length;                // Operation bytes in the frame
+static unsigned char cmd_received;              // Frame bytes received (0 = none)
+static unsigned char cmd_check;                 // Sum of length and operations
+static unsigned char cmd_source;                // CMD_SOURCE_ of the frame
+static unsigned int cmd_byte_ms;                // TICK_ms of the last frame byte
+static unsigned char cmd_reply[CMD_FRAME_SIZE + 3]; // Reply frame
+static unsigned char cmd_reply_length;          // Reply status and result bytes
+static bool cmd_reply_waiting;                  // USB reply waiting for EP2 IN
+static unsigned int cmd_reply_ms;               // TICK_ms when the reply was made
+static unsigned char cmd_pattern_frames[CMD_PATTERN_FRAMES];
+
+// Tone generator phase increments for each NOTE_ number, in program memory
+static const unsigned int tone_notes[] =
+{
+    0,                  // NOTE_REST
+    TONE_INC(262),   // NOTE_C4
+    TONE_INC(277),   // NOTE_CS4
+    TONE_INC(294),   // NOTE_D4
+    TONE_INC(311),   // NOTE_DS4
+    TONE_INC(330),   // NOTE_E4
+    TONE_INC(349),   // NOTE_F4
+    TONE_INC(370),   // NOTE_FS4
+    TONE_INC(392),   // NOTE_G4
+    TONE_INC(415),   // NOTE_GS4
+    TONE_INC(440),   // NOTE_A4
+    TONE_INC(466),   // NOTE_AS4
+    TONE_INC(494),   // NOTE_B4
+    TONE_INC(523),   // NOTE_C5
+    TONE_INC(554),   // NOTE_CS5
+    TONE_INC(587),   // NOTE_D5
+    TONE_INC(622),   // NOTE_DS5
+    TONE_INC(659),   // NOTE_E5
+    TONE_INC(698),   // NOTE_F5
+    TONE_INC(740),   // NOTE_FS5
+    TONE_INC(784),   // NOTE_G5
+    TONE_INC(831),   // NOTE_GS5
+    TONE_INC(880),   // NOTE_A5
+    TONE_INC(932),   // NOTE_AS5
+    TONE_INC(988),   // NOTE_B5
+    TONE_INC(1047),  // NOTE_C6
+    TONE_INC(1109),  // NOTE_CS6
+    TONE_INC(1175),  // NOTE_D6
+    TONE_INC(1245),  // NOTE_DS6
+    TONE_INC(1319),  // NOTE_E6
+    TONE_INC(1397),  // NOTE_F6
+    TONE_INC(1480),  // NOTE_FS6
+    TONE_INC(1568),  // NOTE_G6
+    TONE_INC(1661),  // NOTE_GS6
+    TONE_INC(1760),  // NOTE_A6
+    TONE_INC(1865),  // NOTE_AS6
+    TONE_INC(1976),  // NOTE_B6
+    TONE_INC(2093),  // NOTE_C7
+};
+typedef char tone_notes_check[(sizeof(tone_notes) / sizeof(tone_notes[0]) == NOTE_C7 + 1 && 2093 <= TONE_MAX_HZ) ? 1 : -1];
+
+// Tone generator variables. Each voice adds its phase increment to its phase
+// accumulator at TONE_RATE, and the accumulator's top bit is its square wave.
+static unsigned int tone_phase[TONE_VOICES];    // Phase accumulators
+static volatile unsigned int tone_inc[TONE_VOICES]; // Increments (0 = silent)
+static volatile unsigned int tone_ms[TONE_VOICES];  // Time left (0 = no limit)
+static const tone_step_t *tone_sequence;        // Sequence step playing
+static bool tone_dither;                        // Mixer mid-level toggle
+static volatile bool tone_on;                   // Tone voices or sequence on
+
 // Configure oscillator for 48 MHz operation (required for USB bootloader).
 void OSC_config(void)
 {
     OSCCON = 0xFC;              // Set 16MHz HFINTOSC with 3x PLL enabled
     ACTCON = 0x90;              // Enable active clock tuning from USB clock
-    while(!PLLRDY);             // Wait for PLL lock (disable for simulation)
+#ifndef UBMP4_SIMULATION
+    while(!PLLRDY)              // Wait for PLL lock (not modelled by simulator)
+    {
+        boot_pll_spins ++;      // and count the wait for BOOT_pll_wait
+    }
+#endif
 }
 
 // Configure hardware ports and peripherals for on-board UBMP4 I/O devices.
 void UBMP4_config(void)
 {
-    OPTION_REG = 0b01010111;    // Enable port pull-ups, TMR0 internal, div-256
+    OPTION_REG = 0b01010011;    // Enable port pull-ups, TMR0 internal, div-16
+    TMR0 = 0;                   // Boot timestamps count from here
 
+    // Port settings are calculated from the pin table in UBMP4.h
     LATA = 0b00000000;          // Clear output latches before configuring PORTA
     ANSELA = 0b00000000;        // Disable analog input on all PORTA input pins
-    WPUA = 0b00001000;          // Enable weak pull-up on SW1 input only
-    TRISA = 0b00001111;         // Set LED D1 and Beeper pins as outputs
+    WPUA = PINMAP_WPUA;         // Enable weak pull-up on SW1 input only
+    TRISA = PINMAP_TRISA;       // Set LED D1 and Beeper pins as outputs
 
     LATB = 0b00000000;          // Clear output latches before configuring PORTB
     ANSELB = 0b00000000;        // Disable analog input on all PORTB input pins
-    WPUB = 0b11110000;          // Enable weak pull-ups on pushbutton inputs
-    TRISB = 0b11110000;         // Enable pushbutton pins as inputs (SW2-SW5)
+    WPUB = PINMAP_WPUB;         // Enable weak pull-ups on pushbutton inputs
+    TRISB = PINMAP_TRISB;       // Enable pushbutton pins as inputs (SW2-SW5)
 
     LATC = 0b00000000;          // Clear output latches before configuring PORTC
     ANSELC = 0b00000000;        // Disable analog input on all PORTC input pins
-    TRISC = 0b00001111;         // Set LED pins as outputs, H1-H4 pins as inputs
+    TRISC = PINMAP_TRISC;       // Set LED pins as outputs, H1-H4 pins as inputs
 
-    // TODO - Enable interrupts here, if required.
+    TMR0IF = 0;                 // Clear TMR0 overflow flag and enable the TMR0
+    TMR0IE = 1;                 // system tick interrupt (every 341.3us)
+    GIE = 1;                    // Enable interrupts
+    BOOT_mark(BOOT_CONFIG);     // Ports are ready for the first I/O
+
+    // Other peripherals are configured when they are first used, so nothing
+    // else delays the first input poll in the main loop.
 }
 
 // Configure ADC for 8-bit conversion from on-board phototransistor Q1 (AN7).
 void ADC_config(void)
 {
-    LATC = 0b00000000;          // Clear Port C latches before configuring PORTC
-    
-    // Enable analog input and disable digital output for each analog pin below:
-    TRISCbits.TRISC3 = 1;       // Disable Q1 output driver (TRISx.bit = 1)
-    ANSELC = 0b00001000;        // Enable Q1 analog input (ANSELx.bit = 1)
+    // Enable analog input on each pin marked ANA_ON in the UBMP4.h pin table.
+    // UBMP4_config already made these pins inputs and cleared their latches.
+    ANSELA = PINMAP_ANSELA;
+    ANSELB = PINMAP_ANSELB;
+    ANSELC = PINMAP_ANSELC;     // Enable Q1 analog input (ANSELx.bit = 1)
     
     // General ADC setup and configuration
     ADCON0 = 0b00011100;        // Set channel to AN7, leave A/D converter off
     ADCON1 = 0b01100000;        // Left justified result, FOSC/64 clock, +VDD ref
     ADCON2 = 0b00000000;        // Auto-conversion trigger disabled
+    adc_configured = true;
+}
+
+// Configure the ADC on its first use if the program has not called ADC_config.
+static void adc_init(void)
+{
+    if(!adc_configured)
+    {
+        ADC_config();
+    }
 }
 
 // Enable ADC and switch ADC input mux to the specified channel (use channel
 // constants defined in UBMP420.h header file - e.g. ANQ1).
 void ADC_select_channel(unsigned char channel)
 {
+    adc_init();
     ADON = 1;                   // Turn the A-D converter on
     ADCON0 = (ADCON0 & 0b10000011); // Clear channel select (CHS) bits by ANDing
     ADCON0 = (ADCON0 | channel);	// Set channel by ORing with channel constant
@@ -73,23 +659,3030 @@ void ADC_select_channel(unsigned char channel)
 // Convert the currently selected channel and return an 8-bit conversion result.
 unsigned char ADC_read(void)
 {
+    TRACE(TRACE_ADC_START);
     GO = 1;                     // Start the conversion by setting Go/~Done bit
 	while(GO)                   // Wait for the conversion to finish (GO==0)
         ;                       // Terminating loop on new line silences warning
+    TRACE(TRACE_ADC_DONE);
     return (ADRESH);            // Return the MSB (upper 8-bits) of the result
 }
 
+// Find a channel in the sampler's list and return its latest 8-bit result.
+static bool adc_sampled(unsigned char channel, unsigned char *result)
+{
+    unsigned char index = 0;
+    while(index != adc_count && adc_channels[index] != channel)
+    {
+        index ++;
+    }
+    if(index == adc_count)
+    {
+        return (false);
+    }
+    unsigned int sample = ADC_get(index);
+    *result = adc_10bit ? (unsigned char)(sample >> 2) : (unsigned char)sample;
+    return (true);
+}
+
 // Enable ADC, switch to specified channel, and return 8-bit conversion result.
 // Use channel constants defined in UBMP420.h header file (e.g. ANQ1).
 unsigned char ADC_read_channel(unsigned char channel)
 {
+    if(adc_sampling)            // Sampler owns the ADC, use its latest result
+    {
+        unsigned char result = 0;
+        adc_sampled(channel, &result);
+        return (result);
+    }
+    adc_init();
     ADON = 1;                   // Turn the ADC on
     ADCON0 = (ADCON0 & 0b10000011); // Clear channel select (CHS) bits by ANDing
     ADCON0 = (ADCON0 | channel);	// Set channel by ORing with chan. constant
     __delay_us(5);              // Allow input to settle (charges internal cap.)
+    TRACE(TRACE_ADC_START);
     GO = 1;                     // Start the conversion by setting Go/~Done bit
 	while(GO)                   // Wait for the conversion to finish (GO==0)
         ;                       // Terminating loop on new line silences warning
+    TRACE(TRACE_ADC_DONE);
     ADON = 0;                   // Turn the ADC off
     return (ADRESH);            // Return the MSB (upper 8-bits) of the result
-}
\ No newline at end of file
+}
+
+// Start converting a list of channels in the background, one per TMR0 tick.
+void ADC_sampler_start(const unsigned char *channels, unsigned char count, unsigned char bits)
+{
+    ADC_sampler_stop();
+    if(count > ADC_SAMPLER_SLOTS)
+    {
+        count = ADC_SAMPLER_SLOTS;
+    }
+    for(unsigned char i = 0; i != count; i++)
+    {
+        adc_channels[i] = channels[i];
+    }
+    adc_count = count;
+    adc_index = 0;
+    adc_10bit = (bits == ADC_10BIT);
+    if(count == 0)
+    {
+        return;
+    }
+    
+    adc_init();
+    ADFM = adc_10bit;           // Right justify 10-bit results, left for 8-bit
+    ADCON0 = adc_channels[0] | 0b00000001;  // Select first channel, ADC on
+    ADIF = 0;
+    ADIE = 1;                   // Enable ADC conversion complete interrupt
+    PEIE = 1;
+    adc_sampling = true;        // Next TMR0 tick starts the first conversion
+}
+
+// Stop the background ADC sampler and turn the ADC off.
+void ADC_sampler_stop(void)
+{
+    adc_sampling = false;
+    ADIE = 0;
+    while(GO)                   // Let a conversion in progress finish
+        ;
+    ADON = 0;
+    ADIF = 0;
+    ADFM = 0;                   // Left justify again for ADC_read's 8-bit ADRESH
+}
+
+// Return the latest result for the channel at position index in the list.
+unsigned int ADC_get(unsigned char index)
+{
+    return (adc_results[adc_front][index]);
+}
+
+// Return the number of complete sweeps of the channel list.
+unsigned char ADC_sweeps(void)
+{
+    return (adc_sweeps);
+}
+
+// Find the zone of a new filtered value and queue an event when it settles
+// in a different zone (called from the ISR).
+static void adc_window_sample(unsigned char index, unsigned int value)
+{
+    adc_window_t *window = &adc_windows[index];
+    unsigned int low = window->low;
+    unsigned int high = window->high;
+    
+    // Widen the current zone by the hysteresis so its value must go further
+    // to leave it
+    if(window->zone == ADC_ZONE_LOW)
+    {
+        low += window->hysteresis;
+    }
+    else if(window->zone == ADC_ZONE_HIGH)
+    {
+        high = (high > window->hysteresis) ? high - window->hysteresis : 0;
+    }
+    else if(window->zone == ADC_ZONE_IN)
+    {
+        low = (low > window->hysteresis) ? low - window->hysteresis : 0;
+        high += window->hysteresis;
+    }
+    unsigned char zone = ADC_ZONE_IN;
+    if(value < low)
+    {
+        zone = ADC_ZONE_LOW;
+    }
+    else if(value > high)
+    {
+        zone = ADC_ZONE_HIGH;
+    }
+    
+    if(zone == window->zone)
+    {
+        window->count = 0;
+        return;
+    }
+    if(zone != window->pending)
+    {
+        window->pending = zone;
+        window->count = 0;
+    }
+    if(++window->count >= window->dwell)
+    {
+        window->zone = zone;
+        window->count = 0;
+        unsigned char head = (adc_event_head + 1) & (ADC_EVENT_QUEUE_SIZE - 1);
+        if(head != adc_event_tail)
+        {
+            adc_event_queue[adc_event_head] = (unsigned char)(zone << 4) | index;
+            adc_event_head = head;
+        }
+    }
+}
+
+// Filter a new sample from sampler list position index (called from the ISR).
+static void adc_filter_sample(unsigned char index, unsigned int sample)
+{
+    adc_filter_t *filter = &adc_filters[index];
+    unsigned int value;
+    
+    switch(filter->mode)
+    {
+        case FILTER_OVERSAMPLE:
+            filter->sum += sample;
+            if(++filter->count != (unsigned char)(1 << (filter->n * 2)))
+            {
+                return;         // No new value until 4^n samples are summed
+            }
+            value = (filter->sum + (1 << (filter->n - 1))) >> filter->n;   // Round
+            filter->sum = 0;
+            filter->count = 0;
+            break;
+        case FILTER_AVERAGE:
+            // Keep a running sum by swapping the oldest sample for the newest
+            filter->sum += sample - adc_average[index][filter->count];
+            adc_average[index][filter->count] = sample;
+            filter->count = (filter->count + 1) & (FILTER_AVERAGE_SIZE - 1);
+            value = (filter->sum + FILTER_AVERAGE_SIZE / 2) / FILTER_AVERAGE_SIZE;
+            break;
+        case FILTER_IIR:
+            // State has FILTER_IIR_SCALE fraction bits to avoid losing small
+            // changes, and the difference always fits in a signed int. The
+            // step is rounded, as a floored step settles below the input.
+            filter->sum += ((int)(sample << FILTER_IIR_SCALE) - (int)filter->sum + (1 << (filter->n - 1))) >> filter->n;
+            value = (filter->sum + (1 << (FILTER_IIR_SCALE - 1))) >> FILTER_IIR_SCALE;
+            break;
+        default:
+            value = sample;
+            break;
+    }
+    
+    filter->value = value;
+    if(!filter->peaks_valid)
+    {
+        filter->min = value;
+        filter->max = value;
+        filter->peaks_valid = true;
+    }
+    else if(value < filter->min)
+    {
+        filter->min = value;
+    }
+    else if(value > filter->max)
+    {
+        filter->max = value;
+    }
+    if(adc_windows[index].on)
+    {
+        adc_window_sample(index, value);
+    }
+}
+
+// Set the filter mode for sampler list position index.
+void ADC_filter(unsigned char index, unsigned char mode, unsigned char n)
+{
+    bool adie = ADIE;
+    ADIE = 0;                   // Stop the ISR filtering while settings change
+    adc_filter_t *filter = &adc_filters[index];
+    
+    // Keep n in the range each mode supports (so that the sample count and sum
+    // can't overflow), and ignore unknown modes
+    if(mode == FILTER_OVERSAMPLE)
+    {
+        n = (n < 1) ? 1 : (n > FILTER_OVERSAMPLE_MAX) ? FILTER_OVERSAMPLE_MAX : n;
+    }
+    else if(mode == FILTER_IIR)
+    {
+        n = (n < 1) ? 1 : (n > FILTER_IIR_SCALE) ? FILTER_IIR_SCALE : n;
+    }
+    else if(mode != FILTER_AVERAGE)
+    {
+        mode = FILTER_NONE;
+    }
+    filter->mode = mode;
+    filter->n = n;
+    filter->count = 0;
+    filter->sum = 0;
+    filter->peaks_valid = false;
+    for(unsigned char i = 0; i != FILTER_AVERAGE_SIZE; i++)
+    {
+        adc_average[index][i] = 0;
+    }
+    ADIE = adie;
+}
+
+// Return the latest filtered value for sampler list position index.
+unsigned int ADC_filtered(unsigned char index)
+{
+    bool adie = ADIE;
+    ADIE = 0;                   // Read both bytes of the value together
+    unsigned int value = adc_filters[index].value;
+    ADIE = adie;
+    return (value);
+}
+
+// Return the lowest filtered value held for sampler list position index.
+unsigned int ADC_min(unsigned char index)
+{
+    bool adie = ADIE;
+    ADIE = 0;
+    unsigned int value = adc_filters[index].min;
+    ADIE = adie;
+    return (value);
+}
+
+// Return the highest filtered value held for sampler list position index.
+unsigned int ADC_max(unsigned char index)
+{
+    bool adie = ADIE;
+    ADIE = 0;
+    unsigned int value = adc_filters[index].max;
+    ADIE = adie;
+    return (value);
+}
+
+// Restart the min and max values of sampler list position index.
+void ADC_peaks_reset(unsigned char index)
+{
+    adc_filters[index].peaks_valid = false;
+}
+
+// Watch a sampler channel's filtered value and queue events on zone changes.
+void ADC_window(unsigned char index, unsigned int low, unsigned int high, unsigned char hysteresis, unsigned char dwell)
+{
+    adc_window_t *window = &adc_windows[index];
+    bool adie = ADIE;
+    ADIE = 0;                   // Stop the ISR checking while settings change
+    window->low = low;
+    window->high = high;
+    window->hysteresis = hysteresis;
+    window->dwell = dwell;
+    window->zone = ADC_ZONE_NONE;
+    window->pending = ADC_ZONE_NONE;
+    window->count = 0;
+    window->on = true;
+    ADIE = adie;
+}
+
+// Stop watching a sampler channel's window.
+void ADC_window_off(unsigned char index)
+{
+    adc_windows[index].on = false;
+    adc_windows[index].zone = ADC_ZONE_NONE;
+}
+
+// Return the settled zone of a sampler channel's window.
+unsigned char ADC_zone(unsigned char index)
+{
+    return (adc_windows[index].zone);
+}
+
+// Remove and return the oldest ADC window event, or ADC_EVENT_NONE.
+unsigned char ADC_event(void)
+{
+    unsigned char tail = adc_event_tail;
+    if(tail == adc_event_head)
+    {
+        return (ADC_EVENT_NONE);
+    }
+    unsigned char event = adc_event_queue[tail];
+    adc_event_tail = (tail + 1) & (ADC_EVENT_QUEUE_SIZE - 1);
+    return (event);
+}
+
+// Queue a tone detector sample as an 8-bit value (called from the ISR). The
+// filter steps run in GOERTZEL_read, outside the ISR.
+static void goertzel_sample(unsigned int sample)
+{
+    unsigned char head = (goertzel_head + 1) & (GOERTZEL_QUEUE_SIZE - 1);
+    if(head != goertzel_tail)
+    {
+        goertzel_queue[goertzel_head] = (unsigned char)(adc_10bit ? sample >> 2 : sample);
+        goertzel_head = head;
+    }
+    else
+    {
+        goertzel_overrun = true;
+    }
+}
+
+// Clear the filter states to start a new block.
+static void goertzel_restart(void)
+{
+    for(unsigned char bin = 0; bin != GOERTZEL_BINS; bin++)
+    {
+        goertzel_s1[bin] = 0;
+        goertzel_s2[bin] = 0;
+    }
+    goertzel_count = 0;
+}
+
+// Start detecting tones on a sampler channel if the list length matches.
+bool GOERTZEL_start(unsigned char index)
+{
+    GOERTZEL_stop();
+    if(adc_count != GOERTZEL_CHANNELS || index >= adc_count)
+    {
+        return (false);
+    }
+    goertzel_restart();
+    goertzel_tail = goertzel_head;
+    goertzel_overrun = false;
+    goertzel_index = index;
+    return (true);
+}
+
+// Stop tone detection.
+void GOERTZEL_stop(void)
+{
+    goertzel_index = 0xFF;
+}
+
+// Return the integer square root of value.
+static unsigned int goertzel_sqrt(unsigned long value)
+{
+    unsigned int root = 0;
+    for(unsigned int bit = 0x8000; bit != 0; bit >>= 1)
+    {
+        unsigned int trial = root | bit;
+        if((unsigned long)trial * trial <= value)
+        {
+            root = trial;
+        }
+    }
+    return (root);
+}
+
+// Run the filter steps for the queued samples, and calculate the magnitude of
+// each bin when a block is complete.
+bool GOERTZEL_read(unsigned int *magnitudes)
+{
+    if(goertzel_overrun)        // A block with missing samples is no use
+    {
+        goertzel_overrun = false;
+        goertzel_tail = goertzel_head;
+        goertzel_restart();
+    }
+    unsigned char tail = goertzel_tail;
+    while(tail != goertzel_head)
+    {
+        int x = (int)goertzel_queue[tail] - 128;
+        tail = (tail + 1) & (GOERTZEL_QUEUE_SIZE - 1);
+        goertzel_tail = tail;
+        for(unsigned char bin = 0; bin != GOERTZEL_BINS; bin++)
+        {
+            long s = x + (((long)goertzel_coeff[bin] * goertzel_s1[bin]) >> GOERTZEL_Q) - goertzel_s2[bin];
+            goertzel_s2[bin] = goertzel_s1[bin];
+            goertzel_s1[bin] = s;
+        }
+        if(++goertzel_count == GOERTZEL_BLOCK)
+        {
+            // Power = s1^2 + s2^2 - coeff * s1 * s2, which can't be negative
+            // except by rounding
+            for(unsigned char bin = 0; bin != GOERTZEL_BINS; bin++)
+            {
+                long s1 = goertzel_s1[bin] >> GOERTZEL_SHIFT;
+                long s2 = goertzel_s2[bin] >> GOERTZEL_SHIFT;
+                long power = s1 * s1 + s2 * s2 - ((goertzel_coeff[bin] * s1) >> GOERTZEL_Q) * s2;
+                magnitudes[bin] = (power > 0) ? goertzel_sqrt((unsigned long)power) << GOERTZEL_SHIFT : 0;
+            }
+            goertzel_restart();
+            return (true);
+        }
+    }
+    return (false);
+}
+
+// Select software (TMR0 ISR) or hardware (ADCON2 TMR0 overflow) triggering.
+void ADC_trigger(unsigned char trigger)
+{
+    adc_init();
+    ADCON2 = trigger;
+    adc_auto = (trigger != ADC_TRIGGER_SOFTWARE);
+}
+
+// Copy results for the channel at list position index into the ring buffer.
+void ADC_stream_start(unsigned char index)
+{
+    ADC_stream_stop();
+    adc_overruns = 0;
+    adc_stream_index = index;
+}
+
+// Stop streaming and empty the ring buffer.
+void ADC_stream_stop(void)
+{
+    adc_stream_index = 0xFF;
+    adc_ring_tail = adc_ring_head;
+}
+
+// Remove the oldest stream sample. Returns false if the ring buffer is empty.
+bool ADC_stream_read(unsigned int *sample)
+{
+    unsigned char tail = adc_ring_tail;
+    if(tail == adc_ring_head)
+    {
+        return (false);
+    }
+    *sample = adc_ring[tail];
+    adc_ring_tail = (tail + 1) & (ADC_RING_SIZE - 1);
+    return (true);
+}
+
+// Return the number of stream samples dropped because the ring was full.
+unsigned char ADC_stream_overruns(void)
+{
+    return (adc_overruns);
+}
+
+// Start a flash operation set up in PMCON1 (interrupts must be off).
+static void flash_unlock(void)
+{
+    PMCON2 = 0x55;              // Required unlock sequence
+    PMCON2 = 0xAA;
+    WR = 1;                     // The CPU stalls until the operation finishes
+    NOP();
+    NOP();
+}
+
+// Read the data byte stored in a high-endurance flash word.
+static unsigned char hef_read(unsigned int address)
+{
+    PMADRL = (unsigned char)address;
+    PMADRH = (unsigned char)(address >> 8);
+    CFGS = 0;                   // Program memory, not configuration words
+    RD = 1;
+    NOP();
+    NOP();
+    return (PMDATL);
+}
+
+// Erase the high-endurance flash row at address and write count data bytes
+// (up to HEF_ROW_SIZE) to the start of it. Interrupts wait until it is done.
+static void hef_write_row(unsigned int address, const unsigned char *data, unsigned char count)
+{
+    bool gie = GIE;
+    GIE = 0;
+    PMADRL = (unsigned char)address;
+    PMADRH = (unsigned char)(address >> 8);
+    PMCON1 = 0b00010100;        // Erase the row (FREE, WREN)
+    flash_unlock();
+    PMCON1 = 0b00100100;        // Load the write latches (LWLO, WREN)
+    for(unsigned char i = 0; i != count; i++)
+    {
+        PMADRL = (unsigned char)(address + i);
+        PMDATL = data[i];
+        PMDATH = 0b00111111;    // Unused high bits stay erased
+        if(i == count - 1)
+        {
+            LWLO = 0;           // Last byte: write the latches to the row
+        }
+        flash_unlock();
+    }
+    WREN = 0;
+    
+    // TMR0 overflowed several times during the erase and write stalls, but the
+    // ISR will only count one of them, so add the rest of the time now.
+    if(TMR0IE)
+    {
+        tick_cycles += 2 * HEF_STALL_MS * TICK_MS_CYCLES - TICK_CYCLES;
+        while(tick_cycles >= TICK_MS_CYCLES)
+        {
+            tick_cycles -= TICK_MS_CYCLES;
+            tick_ms ++;
+        }
+    }
+    GIE = gie;
+}
+
+// Turn on the temperature indicator and average its sampler results.
+void TEMP_start(unsigned char index)
+{
+    FVRCON |= 0b00110000;       // Temperature indicator on, high range (TSEN, TSRNG)
+    if(hef_read(TEMP_CAL_ADDRESS) == TEMP_CAL_MARK)
+    {
+        temp_cal_count = hef_read(TEMP_CAL_ADDRESS + 1);
+        temp_cal_count |= (unsigned int)hef_read(TEMP_CAL_ADDRESS + 2) << 8;
+        temp_cal_tenths = (int)(hef_read(TEMP_CAL_ADDRESS + 3) | ((unsigned int)hef_read(TEMP_CAL_ADDRESS + 4) << 8));
+    }
+    else
+    {
+        temp_cal_count = TEMP_DEFAULT_COUNT;
+        temp_cal_tenths = TEMP_DEFAULT_TENTHS;
+    }
+    ADC_filter(index, FILTER_AVERAGE, 0);
+    temp_count = 0xFFFF;
+    temp_index = index;
+}
+
+// Turn off the temperature indicator.
+void TEMP_stop(void)
+{
+    temp_index = 0xFF;
+    FVRCON &= 0b11001111;
+}
+
+// Return the averaged ANTIM result as a 10-bit count.
+static unsigned int temp_read(void)
+{
+    unsigned int count = ADC_filtered(temp_index);
+    if(!adc_10bit)
+    {
+        count <<= 2;            // 8-bit sampler results
+    }
+    return (count);
+}
+
+// Return the temperature in tenths of a degree C, recalculated on changes.
+int TEMP_get(void)
+{
+    if(temp_index == 0xFF)
+    {
+        return (0);
+    }
+    unsigned int count = temp_read();
+    if(count != temp_count)
+    {
+        long difference = (long)count - (long)temp_cal_count;
+        temp_tenths = temp_cal_tenths + (int)((difference * TEMP_SLOPE + 128) >> 8);   // Rounded
+        temp_count = count;
+    }
+    return (temp_tenths);
+}
+
+// Calibrate the current reading to the actual temperature and save it in HEF.
+void TEMP_calibrate(int tenths)
+{
+    if(temp_index == 0xFF)
+    {
+        return;
+    }
+    unsigned char calibration[5];
+    temp_cal_count = temp_read();
+    temp_cal_tenths = tenths;
+    calibration[0] = TEMP_CAL_MARK;
+    calibration[1] = (unsigned char)temp_cal_count;
+    calibration[2] = (unsigned char)(temp_cal_count >> 8);
+    calibration[3] = (unsigned char)tenths;
+    calibration[4] = (unsigned char)((unsigned int)tenths >> 8);
+    hef_write_row(TEMP_CAL_ADDRESS, calibration, sizeof(calibration));
+    temp_count = 0xFFFF;
+}
+
+// Return true if logger row holds a valid header with the given sequence number.
+static bool log_row_is(unsigned char row, unsigned char sequence)
+{
+    unsigned int address = LOG_ROW_ADDRESS(row);
+    return (hef_read(address) == sequence && hef_read(address + 1) == (unsigned char)~sequence);
+}
+
+// Find the newest logger row by binary search over the row sequence numbers.
+void LOG_start(void)
+{
+    unsigned char first = hef_read(LOG_ROW_ADDRESS(0));
+    log_count = 0;
+    if(hef_read(LOG_ROW_ADDRESS(0) + 1) != (unsigned char)~first)
+    {
+        // Row 0 is erased, or its write was cut off. If the last row was
+        // written, carry on from its sequence number so the rows written next
+        // can't repeat the numbers of the older rows still in the ring.
+        unsigned char last = hef_read(LOG_ROW_ADDRESS(LOG_ROWS - 1));
+        log_row = 0;
+        log_sequence = log_row_is(LOG_ROWS - 1, last) ? last + 1 : 0;
+        return;
+    }
+    
+    // Rows up to the newest one hold sequence numbers following row 0's. The
+    // rows after it are erased, or hold older sequence numbers from the last
+    // time around the ring.
+    unsigned char low = 0;
+    unsigned char high = LOG_ROWS - 1;
+    while(low != high)
+    {
+        unsigned char middle = (low + high + 1) / 2;
+        if(log_row_is(middle, first + middle))
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+    log_row = (low + 1 == LOG_ROWS) ? 0 : low + 1;
+    log_sequence = first + low + 1;
+}
+
+// Add a record to the RAM row buffer, writing the row when it is full.
+static void log_add(unsigned char tag, unsigned char data)
+{
+    log_buffer[2 + log_count * 2] = tag;
+    log_buffer[3 + log_count * 2] = data;
+    if(++log_count == LOG_RECORDS)
+    {
+        LOG_flush();
+    }
+}
+
+// Add an ADC sample to the log.
+void LOG_adc(unsigned int sample)
+{
+    log_add(LOG_ADC | ((sample >> 8) & 0b00000011), (unsigned char)sample);
+}
+
+// Add an event byte to the log.
+void LOG_event(unsigned char event)
+{
+    log_add(LOG_EVENT, event);
+}
+
+// Write the records in the RAM row buffer to the next logger row.
+void LOG_flush(void)
+{
+    if(log_count == 0)
+    {
+        return;
+    }
+    log_buffer[0] = log_sequence;
+    log_buffer[1] = ~log_sequence;
+    hef_write_row(LOG_ROW_ADDRESS(log_row), log_buffer, 2 + log_count * 2);
+    log_row = (log_row + 1 == LOG_ROWS) ? 0 : log_row + 1;
+    log_sequence ++;
+    log_count = 0;
+}
+
+// Copy the records of the logger row written 'age' rows before the newest one.
+unsigned char LOG_read(unsigned char age, unsigned char *records)
+{
+    if(age >= LOG_ROWS)
+    {
+        return (0);
+    }
+    unsigned char row = (log_row + LOG_ROWS - 1 - age) % LOG_ROWS;
+    if(!log_row_is(row, log_sequence - 1 - age))
+    {
+        return (0);
+    }
+    unsigned int address = LOG_ROW_ADDRESS(row) + 2;
+    unsigned char count = 0;
+    while(count != LOG_RECORDS && hef_read(address) != LOG_END)
+    {
+        *records++ = hef_read(address++);
+        *records++ = hef_read(address++);
+        count ++;
+    }
+    return (count);
+}
+
+// Start TMR2 interrupts at TONE_RATE, if TMR2 is not already running. TMR2
+// is shared by the tone generator, the IR transmitter, whose PWM1 carrier
+// frequency is set by the same TMR2 period, and the software UART.
+static void timer2_start(void)
+{
+    if(!TMR2ON)
+    {
+        PR2 = 78;               // TMR2: 3 MHz (Fosc/4, div-4), 79 count period
+        T2CON = 0b00001101;     // TMR2 on, 1:2 postscaler interrupts at TONE_RATE
+        TMR2IF = 0;
+    }
+    TMR2IE = 1;
+    PEIE = 1;
+}
+
+// Stop TMR2 once neither the tone generator nor the IR transmitter uses it.
+static void timer2_stop(void)
+{
+    if(!tone_on && !ir_tx_on && !uart_on)
+    {
+        TMR2IE = 0;
+        TMR2ON = 0;
+    }
+}
+
+// Play frequency Hz on a tone voice for ms milliseconds (0 = until stopped).
+void BEEPER_voice(unsigned char voice, unsigned int frequency, unsigned int ms)
+{
+    if(voice >= TONE_VOICES)
+    {
+        return;
+    }
+    if(frequency > TONE_MAX_HZ)
+    {
+        frequency = TONE_MAX_HZ;    // Higher steps alias (or truncate past TONE_RATE)
+    }
+    unsigned int inc = (unsigned int)(((unsigned long)frequency * 65536UL + TONE_RATE / 2) / TONE_RATE);
+    
+    tone_on = false;            // Stop the ISRs using the voice while it changes
+    if(voice == 0)
+    {
+        tone_sequence = NULL;   // A new tone replaces a playing sequence
+    }
+    tone_inc[voice] = inc;
+    tone_ms[voice] = ms;
+    if(inc == 0)
+    {
+        tone_phase[voice] = 0;  // A silent voice adds nothing to the mix
+    }
+    
+    if(tone_inc[0] == 0 && tone_inc[1] == 0)
+    {
+        BEEPER_stop();
+    }
+    else
+    {
+        tone_on = true;
+        timer2_start();
+    }
+}
+
+// Play frequency Hz on tone voice 0 for ms milliseconds (0 = until stopped).
+void BEEPER_tone(unsigned int frequency, unsigned int ms)
+{
+    BEEPER_voice(0, frequency, ms);
+}
+
+// Start playing a note sequence on tone voice 0.
+void BEEPER_play(const tone_step_t *sequence)
+{
+    if(sequence->ms == 0)
+    {
+        return;
+    }
+    tone_on = false;
+    tone_sequence = sequence;
+    tone_inc[0] = tone_notes[sequence->note];
+    tone_ms[0] = sequence->ms;
+    tone_phase[0] = 0;
+    tone_on = true;
+    timer2_start();
+}
+
+// Stop all tone voices and sequences and turn the beeper off.
+void BEEPER_stop(void)
+{
+    tone_on = false;
+    timer2_stop();
+    tone_sequence = NULL;
+    for(unsigned char voice = 0; voice != TONE_VOICES; voice++)
+    {
+        tone_inc[voice] = 0;
+        tone_ms[voice] = 0;
+        tone_phase[voice] = 0;
+    }
+    BEEPER = 0;
+}
+
+// Return true while a tone voice or sequence is playing.
+bool BEEPER_busy(void)
+{
+    return (tone_on);
+}
+
+// Add a button event to the queue (called from the ISR). Events are dropped if
+// the queue is full.
+static void button_queue_event(unsigned char event)
+{
+    unsigned char head = (button_head + 1) & (BUTTON_QUEUE_SIZE - 1);
+    if(head != button_tail)
+    {
+        button_queue[button_head] = event;
+        button_head = head;
+    }
+}
+
+// Count the held time of a pressed button and queue its long press and
+// auto-repeat events (called from the ISR).
+static void button_held(unsigned char *hold, unsigned char button)
+{
+    unsigned char time = ++(*hold);
+    if(time == BUTTON_LONG_MS / BUTTON_SAMPLE_MS)
+    {
+        button_queue_event(BUTTON_LONG | button);
+    }
+    else if(time == (BUTTON_LONG_MS + BUTTON_REPEAT_MS) / BUTTON_SAMPLE_MS)
+    {
+        *hold = BUTTON_LONG_MS / BUTTON_SAMPLE_MS;
+        button_queue_event(BUTTON_REPEAT | button);
+    }
+}
+
+// Debounce all pushbuttons and queue button events (called from the ISR).
+static void button_sample(void)
+{
+    // Read all buttons from one port snapshot each: SW1 to bit 0, SW2-SW5 to
+    // bits 1-4, and invert so that pressed buttons are 1s
+    // (a pin used by the analog keypad reads as released)
+    unsigned char pressed = ~(((PORTB >> 3) & 0b00011110) | ((PORTA >> 3) & 0b00000001)) & 0b00011111;
+    pressed &= ~keypad_button;
+    
+    // Vertical counter: buttons that differ from the debounced state count
+    // four samples before changing state, and reset their count if they bounce
+    unsigned char changed = button_state ^ pressed;
+    button_ct0 = ~(button_ct0 & changed);
+    button_ct1 = button_ct0 ^ (button_ct1 & changed);
+    changed &= button_ct0 & button_ct1;
+    button_state ^= changed;
+    
+    unsigned char mask = 0b00000001;
+    for(unsigned char button = 0; button != 5; button++, mask <<= 1)
+    {
+        if(changed & mask)
+        {
+            button_hold[button] = 0;
+            button_queue_event(((button_state & mask) ? BUTTON_PRESS : BUTTON_RELEASE) | button);
+        }
+        else if(button_state & mask)
+        {
+            button_held(&button_hold[button], button);
+        }
+    }
+    
+    // Analog keypad: the ADC interrupt settles the decoded key, and it is
+    // debounced and gets the same events as the pushbuttons from here
+    unsigned char key = keypad_key;
+    if(key != keypad_next)
+    {
+        keypad_next = key;
+        keypad_stable = 0;
+    }
+    else if(keypad_stable != KEYPAD_DEBOUNCE)
+    {
+        keypad_stable ++;
+    }
+    if(keypad_stable == KEYPAD_DEBOUNCE && key != keypad_last)
+    {
+        if(keypad_last != KEYPAD_NONE)
+        {
+            button_queue_event(BUTTON_RELEASE | BUTTON_KEY(keypad_last));
+        }
+        if(key != KEYPAD_NONE)
+        {
+            button_queue_event(BUTTON_PRESS | BUTTON_KEY(key));
+        }
+        keypad_last = key;
+        keypad_hold = 0;
+    }
+    else if(keypad_last != KEYPAD_NONE)
+    {
+        button_held(&keypad_hold, BUTTON_KEY(keypad_last));
+    }
+}
+
+// Remove and return the oldest button event, or BUTTON_NONE.
+unsigned char BUTTON_event(void)
+{
+    unsigned char tail = button_tail;
+    if(tail == button_head)
+    {
+        return (BUTTON_NONE);
+    }
+    unsigned char event = button_queue[tail];
+    button_tail = (tail + 1) & (BUTTON_QUEUE_SIZE - 1);
+    return (event);
+}
+
+// Return the debounced state of all pushbuttons (bit n = button n pressed).
+unsigned char BUTTON_state(void)
+{
+    return (button_state);
+}
+
+// Decode a keypad sample into a key, keeping the accepted key until the sample
+// leaves its band by more than the hysteresis (called from the ISR). The band
+// is the accepted key's, so one noisy sample over a threshold can't move it.
+static void keypad_decode(unsigned int sample)
+{
+    unsigned char key = keypad_key;
+    unsigned char last = keypad_keys - 1;
+    unsigned int low = (key == 0) ? 0 : keypad_levels[(key == KEYPAD_NONE) ? last : key - 1];
+    if(sample + keypad_hysteresis < low || (key != KEYPAD_NONE && sample >= keypad_levels[key] + keypad_hysteresis))
+    {
+        for(key = 0; key != keypad_keys && sample >= keypad_levels[key]; key++)
+            ;
+        if(key == keypad_keys)
+        {
+            key = KEYPAD_NONE;
+        }
+    }
+    
+    // Accept a key once it has decoded KEYPAD_SETTLE times in a row
+    if(key != keypad_raw)
+    {
+        keypad_raw = key;
+        keypad_settle = 1;
+    }
+    else if(keypad_settle != KEYPAD_SETTLE)
+    {
+        if(++keypad_settle == KEYPAD_SETTLE)
+        {
+            keypad_key = key;
+        }
+    }
+}
+
+// Decode a resistor ladder keypad from a sampler channel into button events.
+void KEYPAD_start(unsigned char index, const unsigned int *levels, unsigned char keys)
+{
+    KEYPAD_stop();
+    if(keys == 0 || keys > KEYPAD_KEYS_MAX || index >= adc_count)
+    {
+        return;
+    }
+    for(unsigned char i = 0; i != keys; i++)
+    {
+        keypad_levels[i] = levels[i];
+    }
+    keypad_keys = keys;
+    keypad_hysteresis = adc_10bit ? KEYPAD_HYSTERESIS : KEYPAD_HYSTERESIS / 4;
+    keypad_raw = KEYPAD_NONE;
+    keypad_settle = KEYPAD_SETTLE;
+    
+    // Take SW2 or SW3 away from the debouncer to use its pin as the input
+    if(adc_channels[index] == AN10)
+    {
+        keypad_pin = 0b00010000;
+        keypad_button = 1 << BUTTON_SW2;
+    }
+    else if(adc_channels[index] == AN11)
+    {
+        keypad_pin = 0b00100000;
+        keypad_button = 1 << BUTTON_SW3;
+    }
+    WPUB &= ~keypad_pin;
+    ANSELB |= keypad_pin;
+    keypad_index = index;
+}
+
+// Stop decoding the keypad and give its pin back to its pushbutton.
+void KEYPAD_stop(void)
+{
+    keypad_index = 0xFF;
+    keypad_key = KEYPAD_NONE;   // The TMR0 tick releases a held key
+    ANSELB &= ~keypad_pin;
+    WPUB |= keypad_pin;
+    keypad_pin = 0;
+    keypad_button = 0;
+}
+
+// Return the pressed keypad key, or KEYPAD_NONE.
+unsigned char KEYPAD_key(void)
+{
+    return (keypad_key);
+}
+
+// Change the PORTC output bits in mask to value in the shadow latch.
+void OUT_write(unsigned char mask, unsigned char value)
+{
+    out_latc = (out_latc & ~mask) | (value & mask);
+    out_latc_changed |= mask;
+}
+
+// Turn active-low LED D1 on or off in the shadow latch.
+void OUT_D1(bool on)
+{
+    out_lata = on ? 0b00000000 : 0b00100000;
+    out_lata_changed = 0b00100000;
+}
+
+// Write changed shadow latch bits to LATC and LATA, one write per port.
+void OUT_update(void)
+{
+    bool gie = GIE;
+    GIE = 0;                    // Keep ISRs from changing the latches between
+    unsigned char changed = out_latc_changed & ~latc_reserved;  // read & write
+    if(changed)
+    {
+        LATC = (LATC & ~changed) | (out_latc & changed);
+    }
+    if(out_lata_changed)
+    {
+        LATA = (LATA & ~out_lata_changed) | (out_lata & out_lata_changed);
+    }
+    out_latc_changed &= ~changed;   // Reserved bits are updated when released
+    out_lata_changed = 0;
+    GIE = gie;
+}
+
+// Show one frame of the pattern (called with the TMR0 interrupt disabled or
+// from the ISR).
+static void out_show_frame(void)
+{
+    unsigned char frame = out_frames[out_frame];
+    unsigned char mask = out_mask & ~latc_reserved;
+    LATC = (LATC & ~mask) | (frame & mask);
+    out_latc = (out_latc & ~out_mask) | (frame & out_mask);
+    out_ms_left = out_ms;
+}
+
+// Play a pattern of const frames in the background, ms milliseconds per frame.
+void OUT_pattern(const unsigned char *frames, unsigned char count, unsigned int ms, unsigned char mask, bool repeat)
+{
+    bool gie = GIE;
+    GIE = 0;                    // The first frame writes LATC, which ISRs share
+    out_count = count;
+    out_mask = mask;
+    out_ms = ms;
+    out_repeat = repeat;
+    out_frame = 0;
+    out_frames = NULL;
+    if(count != 0 && ms != 0)
+    {
+        out_frames = frames;
+        out_show_frame();
+    }
+    GIE = gie;
+}
+
+// Stop the pattern, leaving its last frame showing.
+void OUT_pattern_stop(void)
+{
+    TMR0IE = 0;
+    out_frames = NULL;
+    TMR0IE = 1;
+}
+
+// Return true while a pattern is playing.
+bool OUT_pattern_busy(void)
+{
+    return (out_frames != NULL);
+}
+
+// Rebuild the back bit planes from the duty values and ask the ISR to show
+// them from the start of its next refresh.
+static void led_build_planes(void)
+{
+    led_swap = false;           // Cancel a swap of planes not yet shown
+    unsigned char back = led_front ^ 1;
+    unsigned char mask = 0b00000001;
+    
+    for(unsigned char bit = 0; bit != 8; bit++, mask <<= 1)
+    {
+        led_plane_c[back][bit] = ((led_duty[1] & mask) ? OUT_D2 : 0)
+                               | ((led_duty[2] & mask) ? OUT_D3 : 0)
+                               | ((led_duty[3] & mask) ? OUT_D4 : 0)
+                               | ((led_duty[4] & mask) ? OUT_D5 : 0);
+        led_plane_a[back][bit] = (led_duty[0] & mask) ? 0b00000000 : 0b00100000;
+    }
+    led_swap = true;
+}
+
+// Start BAM brightness control of LEDs D1-D5 from the TMR1 interrupt.
+void LED_pwm_start(void)
+{
+    led_build_planes();
+    led_bit = 0;
+    T1CON = 0b01000000;         // TMR1 stopped, Fosc clock, 1:1 prescaler
+    TMR1L = 0;
+    TMR1H = led_bam_reload[0];
+    TMR1IF = 0;
+    TMR1IE = 1;
+    PEIE = 1;
+    TMR1ON = 1;
+}
+
+// Stop BAM brightness control and turn LEDs D1-D5 off.
+void LED_pwm_stop(void)
+{
+    TMR1IE = 0;
+    TMR1ON = 0;
+    bool gie = GIE;
+    GIE = 0;
+    LATC &= ~(OUT_LEDS & ~latc_reserved);   // Leave reserved pins alone
+    D1 = 1;
+    GIE = gie;
+}
+
+// Set the BAM duty (0-255) of LED 1-5.
+void LED_set_duty(unsigned char led, unsigned char duty)
+{
+    if(led >= 1 && led <= 5)
+    {
+        led_duty[led - 1] = duty;
+        led_build_planes();
+    }
+}
+
+// Set the gamma-corrected brightness level (0-255) of LED 1-5.
+void LED_set_level(unsigned char led, unsigned char level)
+{
+    LED_set_duty(led, led_gamma[level]);
+}
+
+// Return a timestamp of TMR0 overflows and TMR0 (call from the ISR, or with
+// interrupts disabled).
+static unsigned int timer_read(void)
+{
+    unsigned char time_l = TMR0;
+    unsigned char time_h = tick_count;
+    if(TMR0IF && time_l < 128)  // TMR0 overflowed but the ISR has not run yet
+    {
+        time_h ++;
+    }
+    return (((unsigned int)time_h << 8) | time_l);
+}
+
+// Record the time a boot phase is first reached, in TMR0 timestamp counts.
+void BOOT_mark(unsigned char phase)
+{
+    unsigned char bit = (unsigned char)(1 << phase);
+    if(boot_marked & bit)
+    {
+        return;                 // Keep the first time only
+    }
+    bool gie = GIE;
+    GIE = 0;
+    boot_times[phase] = timer_read();
+    GIE = gie;
+    boot_marked |= bit;
+}
+
+// Return a boot phase timestamp in counts of 1.333us (0xFFFF if not reached).
+unsigned int BOOT_time(unsigned char phase)
+{
+    if((boot_marked & (unsigned char)(1 << phase)) == 0)
+    {
+        return (0xFFFF);
+    }
+    return (boot_times[phase]);
+}
+
+// Return the number of PLL lock wait loop passes made by OSC_config.
+unsigned int BOOT_pll_wait(void)
+{
+    return (boot_pll_spins);
+}
+
+// Record a trace marker and timestamp, overwriting the oldest entry if full.
+void TRACE_mark(unsigned char id)
+{
+    bool gie = GIE;
+    GIE = 0;
+    unsigned int time = timer_read();
+    GIE = gie;
+#ifdef UBMP4_TRACE_PULSE
+    H8OUT = 1;                  // Mark the exact time on H8 for a logic analyzer
+    H8OUT = 0;
+#endif
+    trace_t *entry = &trace_buffer[trace_head];
+    entry->id = id;
+    entry->time_h = (unsigned char)(time >> 8);
+    entry->time_l = (unsigned char)time;
+    trace_head = (trace_head + 1) & (TRACE_SIZE - 1);
+    if(trace_count != TRACE_SIZE)
+    {
+        trace_count ++;
+    }
+}
+
+// Return a timestamp from main code with interrupts enabled.
+static unsigned int trace_time(void)
+{
+    GIE = 0;
+    unsigned int time = timer_read();
+    GIE = 1;
+    return (time);
+}
+
+// Send one 8N1 byte on H8OUT with each bit edge at a timestamp, starting at
+// 'time'. Interrupts stay enabled, so an ISR can only delay one edge a little
+// instead of stretching every following bit. Returns the next bit time.
+static unsigned int trace_send(unsigned char data, unsigned int time)
+{
+    unsigned int bits = ((unsigned int)data << 1) | 0b1000000000;  // Start, stop
+    for(unsigned char bit = 0; bit != 10; bit++)
+    {
+        while((int)(trace_time() - time) < 0)
+            ;
+        H8OUT = bits & 0b00000001;  // Start bit, data bits LSB first, stop bit
+        bits >>= 1;
+        time += TIME_US(TRACE_BIT_US);
+    }
+    return (time);
+}
+
+// Send the trace buffer as 9600 baud serial data on H8OUT, then empty it.
+bool TRACE_dump(void)
+{
+    if(!GIE)
+    {
+        return (false);         // Bit timing needs the TMR0 tick interrupt
+    }
+    GIE = 0;
+    if(latc_reserved & OUT_D5)
+    {
+        GIE = 1;
+        return (false);         // H8 is in use (WS2812 data)
+    }
+    latc_reserved |= OUT_D5;    // Keep LED and output updates off H8
+    bool level = H8OUT;
+    H8OUT = 1;                  // Idle (mark) level
+    GIE = 1;
+    
+    unsigned int time = trace_time() + TIME_US(TRACE_BIT_US);
+    time = trace_send(0x55, time);
+    time = trace_send(trace_count, time);
+    unsigned char index = (trace_head - trace_count) & (TRACE_SIZE - 1);
+    for(; trace_count != 0; trace_count--)
+    {
+        time = trace_send(trace_buffer[index].id, time);
+        time = trace_send(trace_buffer[index].time_h, time);
+        time = trace_send(trace_buffer[index].time_l, time);
+        index = (index + 1) & (TRACE_SIZE - 1);
+    }
+    while((int)(trace_time() - time) < 0)
+        ;                       // Let the last stop bit finish
+    
+    GIE = 0;
+    H8OUT = level;              // Put back the LED D5 / H8 output level
+    latc_reserved &= ~OUT_D5;
+    GIE = 1;
+    return (true);
+}
+
+// Add a received IR code to the queue (called from the ISR).
+static void ir_queue_code(unsigned char protocol, unsigned int code)
+{
+    unsigned char head = (ir_head + 1) & (IR_QUEUE_SIZE - 1);
+    if(head != ir_tail)
+    {
+        ir_queue[ir_head].protocol = protocol;
+        ir_queue[ir_head].code = code;
+        ir_head = head;
+    }
+}
+
+// Decode one IR level that has just ended (called from the ISR on each edge).
+// 'mark' is true if the level was a mark (IR carrier received).
+static void ir_decode(bool mark, unsigned int duration)
+{
+    unsigned char event;
+    
+    switch(ir_state)
+    {
+        case IR_IDLE:
+            if(!mark)
+            {
+                return;         // Frames start with a mark
+            }
+            if(duration >= TIME_US(8000) && duration <= TIME_US(10000))
+            {
+                ir_state = IR_NEC_LEADER;   // NEC 9 ms leader mark
+                return;
+            }
+            if(duration >= TIME_US(IR_RC5_SHORT_MIN) && duration <= TIME_US(IR_RC5_LONG_MAX))
+            {
+                ir_state = IR_RC5_DATA;     // RC5 frame started, the first
+                rc5_state = RC5_MID1;       // start bit (1) has been received
+                ir_data = 1;
+                ir_bits = 1;
+                break;          // Decode this mark as an RC5 half-bit below
+            }
+            return;
+        
+        case IR_NEC_LEADER:
+            if(duration >= TIME_US(4000) && duration <= TIME_US(5000))
+            {
+                ir_state = IR_NEC_DATA;     // 4.5 ms space: data follows
+                ir_bits = 0;
+                ir_data = 0;
+            }
+            else
+            {
+                if(duration >= TIME_US(1800) && duration <= TIME_US(2700))
+                {
+                    ir_queue_code(IR_NEC_REPEAT, ir_nec_last);  // 2.25 ms space
+                }
+                ir_state = IR_IDLE;
+            }
+            return;
+        
+        case IR_NEC_DATA:
+            if(mark)
+            {
+                if(duration < TIME_US(IR_NEC_SHORT_MIN) || duration > TIME_US(IR_NEC_SHORT_MAX))
+                {
+                    ir_state = IR_IDLE;     // Not a 562 us bit mark
+                }
+                return;
+            }
+            ir_data >>= 1;      // NEC sends bits LSB first
+            if(duration >= TIME_US(IR_NEC_LONG_MIN) && duration <= TIME_US(IR_NEC_LONG_MAX))
+            {
+                ir_data |= 0x80000000;      // 1.69 ms space: 1 bit
+            }
+            else if(duration < TIME_US(IR_NEC_SHORT_MIN) || duration > TIME_US(IR_NEC_SHORT_MAX))
+            {
+                ir_state = IR_IDLE;         // Not a 562 us space (0 bit)
+                return;
+            }
+            if(++ir_bits == 32)
+            {
+                // Bytes: address, address or extended address, command,
+                // inverted command. Only accept the frame if command checks.
+                unsigned char command = (unsigned char)(ir_data >> 16);
+                if(command == (unsigned char)~(ir_data >> 24))
+                {
+                    ir_nec_last = ((unsigned int)(unsigned char)ir_data << 8) | command;
+                    ir_queue_code(IR_NEC, ir_nec_last);
+                }
+                ir_state = IR_IDLE;
+            }
+            return;
+    }
+    
+    // RC5 half-bit decoder
+    if(duration >= TIME_US(IR_RC5_SHORT_MIN) && duration < TIME_US(IR_RC5_LONG_MIN))
+    {
+        event = mark ? RC5_SHORT_MARK : RC5_SHORT_SPACE;
+    }
+    else if(duration >= TIME_US(IR_RC5_LONG_MIN) && duration <= TIME_US(IR_RC5_LONG_MAX))
+    {
+        event = mark ? RC5_LONG_MARK : RC5_LONG_SPACE;
+    }
+    else
+    {
+        ir_state = IR_IDLE;
+        return;
+    }
+    unsigned char next = (rc5_next[rc5_state] >> event) & 0b00000011;
+    if(next == rc5_state)
+    {
+        ir_state = IR_IDLE;     // Not a valid Manchester sequence
+        return;
+    }
+    rc5_state = next;
+    if(next == RC5_MID0 || next == RC5_MID1)
+    {
+        ir_data = (ir_data << 1) | (next == RC5_MID1);
+        if(++ir_bits == 14)
+        {
+            // Drop the two start bits: toggle bit, 5 address and 6 command bits
+            ir_queue_code(IR_RC5, (unsigned int)ir_data & 0x0FFF);
+            ir_state = IR_IDLE;
+        }
+    }
+}
+
+// Start receiving IR codes on IRIN using comparator C2 edge interrupts.
+void IR_rx_start(void)
+{
+    ir_state = IR_IDLE;
+    ANSELCbits.ANSC2 = 1;       // IRIN is a comparator input (C12IN2-)
+    DACCON1 = 16;               // DAC output = VDD * 16/32
+    DACCON0 = 0b10000000;       // DAC on, VDD reference, output pins off
+    CM2CON1 = 0b11010010;       // Interrupt on both edges, + DAC, - C12IN2-
+    CM2CON0 = 0b10000110;       // C2 on, high speed, hysteresis, not inverted
+    C2IF = 0;
+    C2IE = 1;
+    PEIE = 1;
+}
+
+// Stop receiving IR codes.
+void IR_rx_stop(void)
+{
+    C2IE = 0;
+    CM2CON0 = 0;
+    if(!C1IE)
+    {
+        DACCON0 = 0;            // Turn off the DAC unless capture uses it
+    }
+    ANSELCbits.ANSC2 = 0;
+    ir_state = IR_IDLE;
+}
+
+// Remove the oldest received IR code. Returns false if there are none.
+bool IR_receive(ir_code_t *code)
+{
+    unsigned char tail = ir_tail;
+    if(tail == ir_head)
+    {
+        return (false);
+    }
+    *code = ir_queue[tail];
+    ir_tail = (tail + 1) & (IR_QUEUE_SIZE - 1);
+    return (true);
+}
+
+// Start sending a NEC IR frame (address << 8 | command) on IRLED. Returns false
+// if a frame is still being sent.
+bool IR_send(unsigned int code)
+{
+    if(ir_tx_on)
+    {
+        return (false);
+    }
+    
+    // Build the mark/space table: leader, 32 bits LSB first, stop mark
+    unsigned long data = (unsigned char)(code >> 8);
+    data |= (unsigned long)(unsigned char)~(code >> 8) << 8;
+    data |= (unsigned long)(unsigned char)code << 16;
+    data |= (unsigned long)(unsigned char)~code << 24;
+    unsigned char *entry = ir_tx_table;
+    *entry++ = IR_TX_TICKS(9000);
+    *entry++ = IR_TX_TICKS(4500);
+    for(unsigned char bit = 0; bit != 32; bit++, data >>= 1)
+    {
+        *entry++ = IR_TX_TICKS(562);
+        *entry++ = (data & 1) ? IR_TX_TICKS(1687) : IR_TX_TICKS(562);
+    }
+    *entry = IR_TX_TICKS(562);
+    ir_tx_count = sizeof(ir_tx_table);
+    
+    // Reserve LATC5 so LED D3 updates can't light the IR LED during spaces
+    bool gie = GIE;
+    GIE = 0;
+    latc_reserved |= OUT_D3;
+    IRLED = 0;
+    GIE = gie;
+    PWM1DCH = 26;               // PWM1 duty = 105 / 316 TMR2 counts (1/3)
+    PWM1DCL = 0b01000000;
+    PWM1CON = 0b11000000;       // PWM1 on, output on RC5: start leader mark
+    ir_tx_index = 0;
+    ir_tx_left = ir_tx_table[0];
+    ir_tx_on = true;
+    timer2_start();
+    return (true);
+}
+
+// Return true while an IR frame is being sent.
+bool IR_tx_busy(void)
+{
+    return (ir_tx_on);
+}
+
+// Read a 24-bit timestamp: TMR0 and a 16-bit TMR0 overflow count. (Call with
+// interrupts off.)
+static unsigned long timer_read_long(void)
+{
+    unsigned char time_l = TMR0;
+    unsigned char time_m = tick_count;
+    unsigned char time_h = tick_count_h;
+    if(TMR0IF && time_l < 128)  // TMR0 overflowed but the ISR has not run yet
+    {
+        if(++time_m == 0)
+        {
+            time_h ++;
+        }
+    }
+    return (((unsigned long)time_h << 16) | ((unsigned int)time_m << 8) | time_l);
+}
+
+// Publish a capture result and start the next one (called from the ISR).
+static void capture_publish(void)
+{
+    capture_result.periods = capture_count;
+    capture_result.time = capture_time;
+    capture_result.high = capture_high;
+    capture_new = true;
+    capture_count = 0;
+    capture_time = 0;
+    capture_high = 0;
+}
+
+// Start measuring a header input using comparator C1 edge interrupts.
+void CAPTURE_start(unsigned char input, unsigned char mode)
+{
+    CAPTURE_stop();
+    capture_gated = (mode == CAPTURE_GATED);
+    capture_started = false;
+    capture_count = 0;
+    capture_time = 0;
+    capture_high = 0;
+    capture_level = false;
+    capture_gate_ms = 0;
+    capture_new = false;
+    
+    capture_ansel = (unsigned char)(1 << input);    // C12INn- is on RCn
+    capture_ansel_saved = ANSELC & capture_ansel;
+    ANSELC |= capture_ansel;    // Comparator input
+    DACCON1 = 16;               // DAC output = VDD * 16/32
+    DACCON0 = 0b10000000;       // DAC on, VDD reference, output pins off
+    if(capture_gated)
+    {
+        CM1CON1 = 0b10010000 | input;   // Interrupt on rising edges, + DAC
+    }
+    else
+    {
+        CM1CON1 = 0b11010000 | input;   // Interrupt on both edges, + DAC
+    }
+    CM1CON0 = 0b10010110;       // C1 on, inverted (C1OUT = input high), fast, hysteresis
+    bool gie = GIE;
+    GIE = 0;
+    capture_gate_start = timer_read_long();
+    GIE = gie;
+    C1IF = 0;
+    C1IE = 1;
+    PEIE = 1;
+}
+
+// Stop measuring, and turn off the DAC unless the IR receiver uses it.
+void CAPTURE_stop(void)
+{
+    C1IE = 0;
+    CM1CON0 = 0;
+    if(!C2IE)
+    {
+        DACCON0 = 0;
+    }
+    ANSELC = (ANSELC & ~capture_ansel) | capture_ansel_saved;
+    capture_ansel = 0;
+    capture_ansel_saved = 0;
+}
+
+// Copy the newest capture result, if there is one that has not been read.
+bool CAPTURE_read(capture_t *result)
+{
+    if(!capture_new)
+    {
+        return (false);
+    }
+    bool gie = GIE;
+    GIE = 0;
+    *result = capture_result;
+    capture_new = false;
+    GIE = gie;
+    return (true);
+}
+
+// Return the frequency of a capture result in Hz, rounded.
+unsigned long CAPTURE_hz(const capture_t *result)
+{
+    if(result->time == 0)
+    {
+        return (0);
+    }
+    if(result->periods < 5726)  // periods * 750000 fits in 32 bits
+    {
+        return ((result->periods * 750000UL + result->time / 2) / result->time);
+    }
+    unsigned long scaled = result->periods * (750000UL / 16);
+    unsigned long remainder = scaled % result->time;    // Less than 2^24
+    return (scaled / result->time * 16 + (remainder * 16 + result->time / 2) / result->time);
+}
+
+// Return the average period of a capture result in microseconds, rounded.
+unsigned long CAPTURE_period_us(const capture_t *result)
+{
+    if(result->periods == 0)
+    {
+        return (0);
+    }
+    unsigned long divisor = 3UL * result->periods;
+    return ((result->time * 4 + divisor / 2) / divisor);
+}
+
+// Return the duty cycle of a reciprocal capture result in percent, rounded.
+unsigned char CAPTURE_duty(const capture_t *result)
+{
+    if(result->time == 0)
+    {
+        return (0);
+    }
+    return ((unsigned char)((result->high * 100 + result->time / 2) / result->time));
+}
+
+// WS2812 bit timing checks (see the WS_ definitions in UBMP4.h). The bit
+// cycle counts must match the instructions in ws_send(), and the pulse widths
+// they make at _XTAL_FREQ must be inside the WS2812 data sheet limits. A whole
+// frame is sent with interrupts off, so it must fit between two TMR0 ticks
+// with WS_TICK_MARGIN cycles to spare for setting up the send.
+#define WS_NS(cycles)   ((cycles) * 4000000UL / (_XTAL_FREQ / 1000))
+typedef char ws_t0h_check[(WS_NS(WS_T0H_CYCLES) >= 250 && WS_NS(WS_T0H_CYCLES) <= 550) ? 1 : -1];
+typedef char ws_t1h_check[(WS_NS(WS_T1H_CYCLES) >= 650 && WS_NS(WS_T1H_CYCLES) <= 950) ? 1 : -1];
+typedef char ws_bit_check[(WS_NS(WS_BIT_CYCLES) >= 1100 && WS_NS(WS_BIT_CYCLES) <= 1400) ? 1 : -1];
+#define WS_TICK_MARGIN  64          // Cycles from the window check to the send
+#define WS_FRAME_CYCLES(bytes)  ((unsigned int)(bytes) * 8 * WS_BIT_CYCLES + WS_TICK_MARGIN)
+typedef char ws_frame_check[(WS_FRAME_CYCLES(WS_PIXELS * 3UL) <= TICK_CYCLES) ? 1 : -1];
+typedef char ws_pin_check[(WS_BIT == 6 || WS_BIT == 7) ? 1 : -1];
+typedef char ws_reset_check[(WS_RESET_US >= 280 && TIME_US(WS_RESET_US) < 32768U) ? 1 : -1];   // WS2812B latch
+
+#define WS_STR(x)       #x
+#define WS_XSTR(x)      WS_STR(x)
+#define WS_HIGH()       asm("bsf BANKMASK(LATC)," WS_XSTR(WS_BIT))
+#define WS_LOW()        asm("bcf BANKMASK(LATC)," WS_XSTR(WS_BIT))
+
+// Send one data bit from the MSB of INDF0 in WS_BIT_CYCLES cycles (15). The
+// byte is rotated through carry, and carry sets the high time.
+#define WS_SEND_BIT() \
+    WS_HIGH();                  /* 0: every bit starts high */ \
+    asm("rlf INDF0,f");         /* 1: carry = next bit */ \
+    asm("nop");                 /* 2 */ \
+    asm("btfss STATUS,0");      /* 3 */ \
+    WS_LOW();                   /* 4: a 0 bit ends (WS_T0H_CYCLES) */ \
+    asm("nop");                 /* 5 */ \
+    asm("nop");                 /* 6 */ \
+    asm("nop");                 /* 7 */ \
+    asm("nop");                 /* 8 */ \
+    WS_LOW();                   /* 9: a 1 bit ends (WS_T1H_CYCLES) */ \
+    asm("nop");                 /* 10 */ \
+    asm("nop");                 /* 11 */ \
+    asm("nop");                 /* 12 */ \
+    asm("nop");                 /* 13 */ \
+    asm("nop")                  /* 14 */
+
+// Send the first ws_bytes bytes of ws_frame, MSB first, with cycle-exact bit
+// timing and no gaps between bytes. W counts the bytes and FSR0 points to them.
+// Each byte is rotated through carry nine times, which leaves it unchanged.
+// (Call with interrupts off and ws_bytes not 0.)
+static void ws_send(void)
+{
+    asm("movlw low(_ws_frame)");
+    asm("movwf FSR0L");
+    asm("movlw high(_ws_frame)");
+    asm("movwf FSR0H");
+    asm("banksel _ws_bytes");
+    asm("movf BANKMASK(_ws_bytes),w");
+    asm("banksel LATC");
+    asm("ws_send_byte:");
+    WS_SEND_BIT();
+    WS_SEND_BIT();
+    WS_SEND_BIT();
+    WS_SEND_BIT();
+    WS_SEND_BIT();
+    WS_SEND_BIT();
+    WS_SEND_BIT();
+    WS_HIGH();                  // 0: last bit, moving on to the next byte
+    asm("rlf INDF0,f");         // 1
+    asm("nop");                 // 2
+    asm("btfss STATUS,0");      // 3
+    WS_LOW();                   // 4
+    asm("rlf INDF0,f");         // 5: ninth rotation restores the byte
+    asm("addfsr FSR0,1");       // 6
+    asm("addlw 0xFF");          // 7: count the byte (Z = 1 when done)
+    asm("nop");                 // 8
+    WS_LOW();                   // 9
+    asm("nop");                 // 10
+    asm("nop");                 // 11
+    asm("btfss STATUS,2");      // 12
+    asm("goto ws_send_byte");   // 13, 14
+}
+
+// Take the WS2812 data pin from the output latch and clear all pixels.
+void WS_start(void)
+{
+    bool gie = GIE;
+    GIE = 0;
+    latc_reserved |= (unsigned char)(1 << WS_BIT);
+    LATC &= (unsigned char)~(1 << WS_BIT);  // Data idles low
+    GIE = gie;
+    for(unsigned char i = 0; i != WS_PIXELS * 3; i++)
+    {
+        ws_frame[i] = 0;
+    }
+    ws_bytes = WS_PIXELS * 3;   // Turn off every pixel on the next WS_show()
+    ws_latching = false;
+    ws_on = true;
+}
+
+// Return the WS2812 data pin to the output latch.
+void WS_stop(void)
+{
+    ws_on = false;
+    bool gie = GIE;
+    GIE = 0;
+    latc_reserved &= (unsigned char)~(1 << WS_BIT);
+    GIE = gie;
+}
+
+// Store a pixel colour in wire order and extend the changed range to include it.
+void WS_set(unsigned char pixel, unsigned char red, unsigned char green, unsigned char blue)
+{
+    if(pixel >= WS_PIXELS)
+    {
+        return;
+    }
+    unsigned char *grb = &ws_frame[pixel * 3];
+    if(grb[0] != green || grb[1] != red || grb[2] != blue)
+    {
+        grb[0] = green;
+        grb[1] = red;
+        grb[2] = blue;
+        if(ws_bytes < pixel * 3 + 3)
+        {
+            ws_bytes = pixel * 3 + 3;
+        }
+    }
+}
+
+// Send the frame up to the last changed pixel once the last frame has latched.
+bool WS_show(void)
+{
+    if(!ws_on || ws_bytes == 0)
+    {
+        return (false);
+    }
+    bool gie = GIE;
+    GIE = 0;
+    unsigned int now = timer_read();
+    GIE = gie;
+    if(ws_latching && (unsigned int)(now - ws_sent_time) < TIME_US(WS_RESET_US))
+    {
+        return (false);
+    }
+    if(TMR2IE)
+    {
+        return (false);         // Tone, IR transmit or UART is using TMR2
+    }
+    
+    // Send the frame with interrupts off in one piece, as any gap over 50us
+    // latches it early. Wait for a TMR0 tick to finish first, so that the frame
+    // ends before the next tick is due and no tick is lost. TMR0 is read before
+    // TMR0IF, so an overflow between the two reads is seen as a pending tick
+    // (the other way round, the tick would wait through the frame and the
+    // timestamp taken after it would be a whole tick early).
+    unsigned char last = (unsigned char)(256 - (WS_FRAME_CYCLES(ws_bytes) + 15) / 16);
+    while(1)
+    {
+        GIE = 0;
+        if(TMR0 <= last && (!TMR0IF || !gie))
+        {
+            break;
+        }
+        GIE = gie;
+    }
+    ws_send();
+    ws_sent_time = timer_read();
+    GIE = gie;
+    ws_latching = true;
+    ws_bytes = 0;
+    return (true);
+}
+
+// Hand buffer descriptor bd to the USB module to send or receive count bytes.
+static void usb_arm(unsigned char bd, unsigned int address, unsigned char count, unsigned char stat)
+{
+    usb_bdt[bd].adrl = (unsigned char)address;
+    usb_bdt[bd].adrh = (unsigned char)(address >> 8);
+    usb_bdt[bd].cnt = count;
+    usb_bdt[bd].stat = stat | BD_UOWN;  // Set UOWN last
+}
+
+// Send the next EP0 IN packet of a control transfer data or status stage.
+static void usb_ep0_send(void)
+{
+    unsigned char count = (usb_ep0_left < USB_EP0_SIZE) ? usb_ep0_left : USB_EP0_SIZE;
+    for(unsigned char i = 0; i != count; i++)
+    {
+        usb_ep0_in[i] = usb_ep0_data[i];
+    }
+    usb_ep0_data += count;
+    usb_ep0_left -= count;
+    
+    // A reply shorter than the host asked for ends with a short packet, so a
+    // full packet at its end must be followed by a zero-length packet
+    usb_ep0_more = (count == USB_EP0_SIZE && (usb_ep0_left != 0 || usb_ep0_short));
+    usb_arm(USB_BD_EP0_IN, USB_EP0_IN_ADDRESS, count, BD_DTSEN | usb_ep0_dts);
+    usb_ep0_dts ^= BD_DTS;
+}
+
+// Start a control transfer IN data stage (length 0 sends the status stage).
+static void usb_ep0_reply(const unsigned char *data, unsigned char length, unsigned char requested)
+{
+    if(length > requested)
+    {
+        length = requested;
+    }
+    usb_ep0_data = data;
+    usb_ep0_left = length;
+    usb_ep0_short = (length < requested);
+    usb_ep0_dts = BD_DTS;       // Data and status stages start with DATA1
+    usb_ep0_send();
+}
+
+// Enable the CDC endpoints and start receiving into both EP2 OUT buffers.
+static void usb_configure(void)
+{
+    usb_configured = (usb_config != 0);
+    UEP1 = 0;
+    UEP2 = 0;
+    usb_in_next = 0;
+    usb_in_busy = 0;
+    usb_stream_samples = 0;
+    usb_rx_next = 0;
+    usb_rx_index = 0;
+    for(unsigned char bd = 2; bd != 10; bd++)
+    {
+        usb_bdt[bd].stat = 0;
+    }
+    if(!usb_configured)
+    {
+        return;
+    }
+    
+    // Reset the ping-pong pointers, so even buffers carry DATA0 and odd
+    // buffers carry DATA1 from here on
+    PPBRST = 1;
+    PPBRST = 0;
+    usb_arm(USB_BD_EP2_OUT, USB_RX_ADDRESS, USB_RX_SIZE, BD_DTSEN);
+    usb_arm(USB_BD_EP2_OUT + 1, USB_RX_ADDRESS + USB_RX_SIZE, USB_RX_SIZE, BD_DTSEN | BD_DTS);
+    UEP1 = 0b00011010;          // EP1 IN, handshake, no SETUP
+    UEP2 = 0b00011110;          // EP2 IN and OUT, handshake, no SETUP
+}
+
+// Handle a SETUP packet received on EP0.
+static void usb_setup(void)
+{
+    unsigned char type = usb_ep0_out[0];
+    unsigned char request = usb_ep0_out[1];
+    unsigned char value = usb_ep0_out[2];
+    unsigned char descriptor = usb_ep0_out[3];
+    unsigned char requested = (usb_ep0_out[7] != 0) ? 0xFF : usb_ep0_out[6];
+    
+    usb_bdt[USB_BD_EP0_IN].stat = 0;    // Cancel any unfinished IN or stall
+    usb_ep0_more = false;
+    usb_line_coding_out = false;
+    
+    if((type & 0x60) == 0x00)   // Standard requests
+    {
+        switch(request)
+        {
+            case 0x00:          // GET_STATUS: not self powered, no halts
+                usb_reply[0] = 0;
+                usb_reply[1] = 0;
+                usb_ep0_reply(usb_reply, 2, requested);
+                break;
+            case 0x05:          // SET_ADDRESS: set after the status stage
+                usb_address = value;
+                usb_ep0_reply(NULL, 0, 0);
+                break;
+            case 0x06:          // GET_DESCRIPTOR
+                if(descriptor == 1)
+                {
+                    usb_ep0_reply(usb_device_descriptor, sizeof(usb_device_descriptor), requested);
+                }
+                else if(descriptor == 2)
+                {
+                    usb_ep0_reply(usb_config_descriptor, sizeof(usb_config_descriptor), requested);
+                }
+                else
+                {
+                    usb_bdt[USB_BD_EP0_IN].stat = BD_UOWN | BD_BSTALL;
+                }
+                break;
+            case 0x08:          // GET_CONFIGURATION
+                usb_reply[0] = usb_config;
+                usb_ep0_reply(usb_reply, 1, requested);
+                break;
+            case 0x09:          // SET_CONFIGURATION
+                usb_config = value;
+                usb_configure();
+                usb_ep0_reply(NULL, 0, 0);
+                break;
+            case 0x0A:          // GET_INTERFACE: only alternate setting 0
+                usb_reply[0] = 0;
+                usb_ep0_reply(usb_reply, 1, requested);
+                break;
+            case 0x01:          // CLEAR_FEATURE
+            case 0x03:          // SET_FEATURE
+            case 0x0B:          // SET_INTERFACE
+                usb_ep0_reply(NULL, 0, 0);
+                break;
+            default:
+                usb_bdt[USB_BD_EP0_IN].stat = BD_UOWN | BD_BSTALL;
+        }
+    }
+    else if((type & 0x60) == 0x20)  // CDC class requests
+    {
+        switch(request)
+        {
+            case 0x20:          // SET_LINE_CODING: 7 bytes follow on EP0 OUT
+                usb_line_coding_out = true;
+                break;
+            case 0x21:          // GET_LINE_CODING
+                usb_ep0_reply(usb_line_coding, sizeof(usb_line_coding), requested);
+                break;
+            case 0x22:          // SET_CONTROL_LINE_STATE: DTR is bit 0
+                usb_dtr = (value & 0x01);
+                usb_ep0_reply(NULL, 0, 0);
+                break;
+            case 0x23:          // SEND_BREAK
+                usb_ep0_reply(NULL, 0, 0);
+                break;
+            default:
+                usb_bdt[USB_BD_EP0_IN].stat = BD_UOWN | BD_BSTALL;
+        }
+    }
+    else
+    {
+        usb_bdt[USB_BD_EP0_IN].stat = BD_UOWN | BD_BSTALL;
+    }
+    
+    // EP0 OUT always accepts the next packet without a data toggle check, so
+    // data stage packets, status stages and new SETUPs are all received
+    usb_arm(USB_BD_EP0_OUT, USB_EP0_OUT_ADDRESS, USB_EP0_SIZE, 0);
+    PKTDIS = 0;                 // Let the USB module process packets again
+}
+
+// Hand an EP2 IN packet to the next ping-pong buffer descriptor.
+static void usb_in_send(unsigned int address, unsigned char count)
+{
+    usb_arm(USB_BD_EP2_IN + usb_in_next, address, count, BD_DTSEN | (usb_in_next ? BD_DTS : 0));
+    usb_in_next ^= 1;
+    usb_in_busy ++;
+}
+
+// Send the next stream batch when both EP2 IN buffers are free: the header
+// from one buffer, then the samples straight from the ADC stream ring buffer.
+// Each batch sends the samples up to the end of the ring, and the ring space
+// is freed when the host has read them.
+static void usb_stream_send(bool frame)
+{
+    if(!usb_configured || !usb_dtr || !usb_streaming || usb_in_busy != 0)
+    {
+        return;
+    }
+    if(frame && usb_batch_ms != USB_BATCH_MS)
+    {
+        usb_batch_ms ++;
+    }
+    unsigned char tail = adc_ring_tail;
+    unsigned char samples = (adc_ring_head - tail) & (ADC_RING_SIZE - 1);
+    if((samples == 0 && usb_event_count == 0) || (samples < USB_BATCH_SAMPLES && usb_batch_ms != USB_BATCH_MS))
+    {
+        return;                 // Wait for a batch to fill
+    }
+    if(samples > ADC_RING_SIZE - tail)
+    {
+        samples = ADC_RING_SIZE - tail; // The rest is sent in the next batch
+    }
+    usb_batch_ms = 0;
+    
+    unsigned char events = usb_event_count;
+    usb_header[0] = USB_STREAM_SYNC;
+    usb_header[1] = usb_stream_sequence++;
+    usb_header[2] = samples * 2;
+    usb_header[3] = events;
+    for(unsigned char i = 0; i != events; i++)
+    {
+        usb_header[4 + i] = usb_events[i];
+    }
+    usb_event_count = 0;
+    usb_in_send(USB_HEADER_ADDRESS, 4 + events);
+    if(samples != 0)
+    {
+        usb_in_send(USB_RING_ADDRESS + tail * 2, samples * 2);
+        usb_stream_samples = samples;
+    }
+}
+
+// Handle a completed USB transaction (called from the ISR).
+static void usb_transaction(unsigned char status)
+{
+    unsigned char endpoint = status >> 3;
+    bool in = (status & 0b00000100);
+    
+    if(endpoint == 0 && !in)
+    {
+        if(BD_PID(usb_bdt[USB_BD_EP0_OUT].stat) == PID_SETUP)
+        {
+            usb_setup();
+            return;
+        }
+        if(usb_line_coding_out)
+        {
+            for(unsigned char i = 0; i != sizeof(usb_line_coding); i++)
+            {
+                usb_line_coding[i] = usb_ep0_out[i];
+            }
+            usb_line_coding_out = false;
+            usb_ep0_reply(NULL, 0, 0);
+        }
+        usb_arm(USB_BD_EP0_OUT, USB_EP0_OUT_ADDRESS, USB_EP0_SIZE, 0);
+    }
+    else if(endpoint == 0)
+    {
+        if(usb_address != 0)
+        {
+            UADDR = usb_address;
+            usb_address = 0;
+        }
+        if(usb_ep0_more)
+        {
+            usb_ep0_send();
+        }
+    }
+    else if(endpoint == 2 && in)
+    {
+        // Free the ring space of a sent batch (unless ADC_stream_stop already
+        // emptied the ring), then send the next batch if one is ready
+        if(--usb_in_busy == 0)
+        {
+            if(((adc_ring_head - adc_ring_tail) & (ADC_RING_SIZE - 1)) >= usb_stream_samples)
+            {
+                adc_ring_tail = (adc_ring_tail + usb_stream_samples) & (ADC_RING_SIZE - 1);
+            }
+            usb_stream_samples = 0;
+            usb_stream_send(false);
+        }
+    }
+}
+
+// Return the USB device to its default state after a bus reset.
+static void usb_reset(void)
+{
+    UADDR = 0;
+    usb_address = 0;
+    usb_config = 0;
+    usb_dtr = false;
+    usb_configure();
+    while(TRNIF)                // Empty the USTAT transaction FIFO
+    {
+        TRNIF = 0;
+    }
+    PPBRST = 1;
+    PPBRST = 0;
+    usb_bdt[USB_BD_EP0_IN].stat = 0;
+    usb_arm(USB_BD_EP0_OUT, USB_EP0_OUT_ADDRESS, USB_EP0_SIZE, 0);
+    UEP0 = 0b00010110;          // EP0 control: IN, OUT and SETUP, handshake
+    PKTDIS = 0;
+}
+
+// Enable the USB module and attach to the host as a CDC serial port.
+void USB_start(void)
+{
+    if(usb_on)
+    {
+        return;
+    }
+    UCON = 0;                   // USB off (the bootloader may have used it)
+    UIE = 0;
+    UCFG = 0b00010111;          // Pull-up on, full speed, ping-pong on EP1-EP7
+    usb_reset();
+    UIR = 0;
+    UIE = 0b01001001;           // SOF, transaction complete and reset interrupts
+    usb_on = true;
+    USBIF = 0;
+    USBIE = 1;
+    PEIE = 1;
+    UCON = 0b00001000;          // USB on, attach to the bus
+}
+
+// Detach from the host and turn the USB module off.
+void USB_stop(void)
+{
+    USBIE = 0;
+    UCON = 0;
+    UIE = 0;
+    usb_on = false;
+    usb_configured = false;
+    usb_dtr = false;
+}
+
+// Return true if the host configured the device and opened the serial port.
+bool USB_ready(void)
+{
+    return (usb_configured && usb_dtr);
+}
+
+// Send a packet of up to USB_WRITE_SIZE bytes, if the EP2 IN buffers are free.
+bool USB_write(const unsigned char *data, unsigned char count)
+{
+    bool sent = false;
+    if(!usb_on || count > USB_WRITE_SIZE)
+    {
+        return (false);
+    }
+    USBIE = 0;
+    if(usb_configured && usb_in_busy == 0)
+    {
+        for(unsigned char i = 0; i != count; i++)
+        {
+            usb_tx[i] = data[i];
+        }
+        usb_in_send(USB_TX_ADDRESS, count);
+        sent = true;
+    }
+    USBIE = 1;
+    return (sent);
+}
+
+// Read the next received byte, handing each emptied buffer back for more data.
+bool USB_read_byte(unsigned char *byte)
+{
+    bool read = false;
+    if(!usb_on)
+    {
+        return (false);
+    }
+    USBIE = 0;
+    volatile usb_bd_t *bd = &usb_bdt[USB_BD_EP2_OUT + usb_rx_next];
+    if(usb_configured && (bd->stat & BD_UOWN) == 0)
+    {
+        if(usb_rx_index != bd->cnt)
+        {
+            *byte = usb_rx[usb_rx_next][usb_rx_index++];
+            read = true;
+        }
+        if(usb_rx_index == bd->cnt)
+        {
+            unsigned int address = USB_RX_ADDRESS + usb_rx_next * USB_RX_SIZE;
+            usb_arm(USB_BD_EP2_OUT + usb_rx_next, address, USB_RX_SIZE, BD_DTSEN | (usb_rx_next ? BD_DTS : 0));
+            usb_rx_next ^= 1;
+            usb_rx_index = 0;
+        }
+    }
+    USBIE = 1;
+    return (read);
+}
+
+// Turn streaming of the ADC stream ring buffer to the host on or off.
+void USB_stream(bool on)
+{
+    USBIE = 0;
+    usb_streaming = on;
+    usb_batch_ms = 0;
+    USBIE = usb_on;
+}
+
+// Queue an event byte for the next stream packet header.
+bool USB_stream_event(unsigned char event)
+{
+    bool queued = false;
+    USBIE = 0;
+    if(usb_event_count != USB_STREAM_EVENTS)
+    {
+        usb_events[usb_event_count++] = event;
+        queued = true;
+    }
+    USBIE = usb_on;
+    return (queued);
+}
+
+// Start the software UART: H1 serial output, H2 serial input.
+void UART_start(void)
+{
+    uart_rx_bit = 0;
+    uart_tx_ticks = 4;
+    bool gie = GIE;
+    GIE = 0;
+    latc_reserved |= OUT_H1;    // Keep output updates away from the UART pin
+    H1OUT = 1;                  // Idle (stop bit) level
+    GIE = gie;
+    TRISCbits.TRISC0 = 0;
+    uart_on = true;
+    timer2_start();
+}
+
+// Stop the software UART once the transmit queue is empty.
+void UART_stop(void)
+{
+    while(uart_tx_head != uart_tx_tail || uart_tx_frame != 0)
+        ;
+    uart_on = false;
+    timer2_stop();
+    TRISCbits.TRISC0 = 1;
+    bool gie = GIE;
+    GIE = 0;
+    latc_reserved &= ~OUT_H1;
+    GIE = gie;
+}
+
+// Remove the oldest byte from the receive queue, if there is one.
+bool UART_read_byte(unsigned char *byte)
+{
+    unsigned char tail = uart_rx_tail;
+    if(tail == uart_rx_head)
+    {
+        return (false);
+    }
+    *byte = uart_rx_queue[tail];
+    uart_rx_tail = (tail + 1) & (UART_RX_SIZE - 1);
+    return (true);
+}
+
+// Add a byte to the transmit queue, if there is space.
+bool UART_write_byte(unsigned char byte)
+{
+    unsigned char head = (uart_tx_head + 1) & (UART_TX_SIZE - 1);
+    if(head == uart_tx_tail)
+    {
+        return (false);
+    }
+    uart_tx_queue[uart_tx_head] = byte;
+    uart_tx_head = head;
+    return (true);
+}
+
+// Add a result byte to the command reply, if there is space.
+static bool cmd_result(unsigned char result)
+{
+    if(cmd_reply_length == CMD_FRAME_SIZE)
+    {
+        return (false);
+    }
+    cmd_reply[2 + cmd_reply_length++] = result;
+    return (true);
+}
+
+// Command operation handlers. Each one is passed the bytes after its opcode,
+// and returns the number of argument bytes it used, or CMD_BAD.
+static unsigned char cmd_nop(const unsigned char *args, unsigned char length)
+{
+    (void)args;
+    (void)length;
+    return (0);
+}
+
+static unsigned char cmd_out_write(const unsigned char *args, unsigned char length)
+{
+    if(length < 2)
+    {
+        return (CMD_BAD);
+    }
+    OUT_write(args[0], args[1]);
+    return (2);
+}
+
+// While the sampler runs, a blocking conversion would turn the ADC off under
+// it, so the channel's latest sampler result is returned instead (or CMD_BAD if
+// the channel is not in the sampler list).
+// Check that a host byte is one of the AN* channel constants in UBMP4.h.
+static bool cmd_adc_channel(unsigned char channel)
+{
+    return ((channel >= AN4 && channel <= AN11 && (channel & 0b00000011) == 0) || channel == ANTIM);
+}
+
+static unsigned char cmd_adc_read(const unsigned char *args, unsigned char length)
+{
+    if(length < 1 || !cmd_adc_channel(args[0]))
+    {
+        return (CMD_BAD);
+    }
+    unsigned char result;
+    if(adc_sampling)
+    {
+        if(!adc_sampled(args[0], &result))
+        {
+            return (CMD_BAD);
+        }
+    }
+    else
+    {
+        result = ADC_read_channel(args[0]);
+    }
+    return (cmd_result(result) ? 1 : CMD_BAD);
+}
+
+static unsigned char cmd_pattern(const unsigned char *args, unsigned char length)
+{
+    if(length < 4 || args[0] > CMD_PATTERN_FRAMES || length < 4 + args[0])
+    {
+        return (CMD_BAD);
+    }
+    unsigned char count = args[0];
+    unsigned int ms = args[1] | ((unsigned int)args[2] << 8);
+    OUT_pattern_stop();         // Free the frame buffer before changing it
+    for(unsigned char i = 0; i != count; i++)
+    {
+        cmd_pattern_frames[i] = args[4 + i];
+    }
+    if(count != 0)
+    {
+        OUT_pattern(cmd_pattern_frames, count, ms, OUT_LEDS, args[3]);
+    }
+    return (4 + count);
+}
+
+static unsigned char cmd_buttons(const unsigned char *args, unsigned char length)
+{
+    (void)args;
+    (void)length;
+    return (cmd_result(BUTTON_state()) ? 0 : CMD_BAD);
+}
+
+static unsigned char cmd_beep(const unsigned char *args, unsigned char length)
+{
+    if(length < 4)
+    {
+        return (CMD_BAD);
+    }
+    BEEPER_tone(args[0] | ((unsigned int)args[1] << 8), args[2] | ((unsigned int)args[3] << 8));
+    return (4);
+}
+
+static unsigned char cmd_led_level(const unsigned char *args, unsigned char length)
+{
+    if(length < 2 || args[0] < 1 || args[0] > 5)
+    {
+        return (CMD_BAD);
+    }
+    LED_set_level(args[0], args[1]);
+    return (2);
+}
+
+static unsigned char cmd_tick(const unsigned char *args, unsigned char length)
+{
+    (void)args;
+    (void)length;
+    unsigned int now = TICK_ms();
+    if(!cmd_result((unsigned char)now) || !cmd_result((unsigned char)(now >> 8)))
+    {
+        return (CMD_BAD);
+    }
+    return (0);
+}
+
+// Command operation handlers by opcode, in program memory
+static const cmd_handler_t cmd_table[CMD_OPCODES] =
+{
+    cmd_nop,                    // CMD_NOP
+    cmd_out_write,              // CMD_OUT_WRITE
+    cmd_adc_read,               // CMD_ADC_READ
+    cmd_pattern,                // CMD_PATTERN
+    cmd_buttons,                // CMD_BUTTONS
+    cmd_beep,                   // CMD_BEEP
+    cmd_led_level,              // CMD_LED_LEVEL
+    cmd_tick                    // CMD_TICK
+};
+
+// Run the operations in a received frame and send the reply frame.
+static void cmd_execute(bool check_ok)
+{
+    unsigned char status = CMD_OK;
+    unsigned char index = 0;
+    
+    cmd_reply_length = 1;       // Status byte
+    if(!check_ok)
+    {
+        status = CMD_BAD_CHECK;
+        index = cmd_length;
+    }
+    while(index != cmd_length)
+    {
+        unsigned char opcode = cmd_frame[index++];
+        if(opcode >= CMD_OPCODES)
+        {
+            status = CMD_BAD_OPCODE;
+            break;
+        }
+        unsigned char used = cmd_table[opcode](&cmd_frame[index], cmd_length - index);
+        if(used == CMD_BAD)
+        {
+            status = (cmd_reply_length == CMD_FRAME_SIZE) ? CMD_REPLY_FULL : CMD_BAD_ARGS;
+            break;
+        }
+        index += used;
+    }
+    OUT_update();               // Apply CMD_OUT_WRITE changes together
+    
+    unsigned char check = cmd_reply_length + status;
+    cmd_reply[0] = CMD_SYNC;
+    cmd_reply[1] = cmd_reply_length;
+    cmd_reply[2] = status;
+    for(unsigned char i = 1; i != cmd_reply_length; i++)
+    {
+        check += cmd_reply[2 + i];
+    }
+    cmd_reply[2 + cmd_reply_length] = (unsigned char)-check;
+    
+    if(cmd_source == CMD_SOURCE_USB)
+    {
+        cmd_reply_waiting = true;   // Sent by cmd_usb_reply when EP2 IN is free
+        cmd_reply_ms = TICK_ms();
+    }
+    else
+    {
+        for(unsigned char i = 0; i != cmd_reply_length + 3; i++)
+        {
+            while(!UART_write_byte(cmd_reply[i]))
+                ;
+        }
+    }
+}
+
+// Send a waiting USB reply if EP2 IN is free (after a stream batch or the
+// last reply), or drop it if the host stops reading. Returns true if no reply
+// is left waiting.
+static bool cmd_usb_reply(void)
+{
+    if(cmd_reply_waiting)
+    {
+        if(USB_write(cmd_reply, cmd_reply_length + 3) || !USB_ready() || TICK_ms() - cmd_reply_ms >= CMD_TIMEOUT_MS)
+        {
+            cmd_reply_waiting = false;
+        }
+    }
+    return (!cmd_reply_waiting);
+}
+
+// Add a received byte to the command frame, running the frame when complete.
+static void cmd_receive(unsigned char byte, unsigned char source)
+{
+    unsigned int now = TICK_ms();
+    if(cmd_received != 0 && now - cmd_byte_ms > CMD_TIMEOUT_MS)
+    {
+        cmd_received = 0;       // Partial frame timed out, look for a new one
+    }
+    if(cmd_received != 0 && source != cmd_source)
+    {
+        return;                 // Other source is sending a frame, drop the byte
+    }
+    cmd_byte_ms = now;
+    
+    if(cmd_received == 0)
+    {
+        if(byte == CMD_SYNC)
+        {
+            cmd_source = source;
+            cmd_received = 1;
+        }
+    }
+    else if(cmd_received == 1)
+    {
+        if(byte > CMD_FRAME_SIZE)
+        {
+            cmd_received = 0;   // Not a frame, look for the next sync byte
+            return;
+        }
+        cmd_length = byte;
+        cmd_check = byte;
+        cmd_received = 2;
+    }
+    else if(cmd_received - 2 != cmd_length)
+    {
+        cmd_frame[cmd_received - 2] = byte;
+        cmd_check += byte;
+        cmd_received ++;
+    }
+    else
+    {
+        cmd_received = 0;
+        cmd_execute((unsigned char)(cmd_check + byte) == 0);
+    }
+}
+
+// Receive and run command frames from USB and the software UART. No more
+// bytes are read while a USB reply waits to be sent, so the reply buffer is
+// free for the next frame, and the USB host is held off by NAKs meanwhile.
+void CMD_poll(void)
+{
+    unsigned char byte;
+    while(cmd_usb_reply() && USB_read_byte(&byte))
+    {
+        cmd_receive(byte, CMD_SOURCE_USB);
+    }
+    while(cmd_usb_reply() && UART_read_byte(&byte))
+    {
+        cmd_receive(byte, CMD_SOURCE_UART);
+    }
+}
+
+// Return milliseconds counted by the TMR0 system tick since start-up.
+unsigned int TICK_ms(void)
+{
+    unsigned int ms;
+    TMR0IE = 0;                 // Stop the tick interrupt from changing tick_ms
+    ms = tick_ms;               // while both of its bytes are being read
+    TMR0IE = 1;
+    return (ms);
+}
+
+// Add a task that first runs after delay ms, then every period ms (0 = once).
+unsigned char TASK_add(task_function_t function, unsigned int period, unsigned int delay)
+{
+    for(unsigned char task = 0; task != TASK_SLOTS; task++)
+    {
+        if(tasks[task].function == NULL)
+        {
+            tasks[task].period = period;
+            tasks[task].due = TICK_ms() + delay;
+            tasks[task].function = function;
+            return (task);
+        }
+    }
+    return (TASK_NONE);         // All slots are in use
+}
+
+// Add a periodic task that runs every period ms.
+unsigned char TASK_every(task_function_t function, unsigned int period)
+{
+    return (TASK_add(function, period, period));
+}
+
+// Add a one-shot task that runs once after delay ms.
+unsigned char TASK_once(task_function_t function, unsigned int delay)
+{
+    return (TASK_add(function, 0, delay));
+}
+
+// Free the slot used by a task.
+void TASK_remove(unsigned char task)
+{
+    if(task < TASK_SLOTS)
+    {
+        tasks[task].function = NULL;
+    }
+}
+
+// Run each task that is due, once. Call from the main loop.
+void TASK_run(void)
+{
+    unsigned int now = TICK_ms();
+    
+    for(unsigned char task = 0; task != TASK_SLOTS; task++)
+    {
+        task_function_t function = tasks[task].function;
+        
+        // Signed difference keeps the comparison correct when TICK_ms() wraps
+        if(function != NULL && (int)(now - tasks[task].due) >= 0)
+        {
+            if(tasks[task].period == 0)
+            {
+                tasks[task].function = NULL;    // Free one-shot slot first so
+            }                                   // the task can add a new task
+            else
+            {
+                tasks[task].due += tasks[task].period;  // Stay on schedule
+            }
+            function();
+        }
+    }
+}
+
+// IDLE_WDT_ periods are 1 ms << WDTPS, and must fit TICK_ms and WDTPS.
+typedef char idle_wdt_check[(IDLE_WDT_2S < 16 && IDLE_WDT_OFF > 18) ? 1 : -1];
+
+// Sleep until a pushbutton or the watchdog wakes the microcontroller, if no
+// background service needs the TMR0 tick. The wdt period is shortened to end
+// before the next task is due.
+bool IDLE_sleep(unsigned char wdt)
+{
+    unsigned int now = TICK_ms();
+    unsigned int period = (wdt == IDLE_WDT_OFF) ? 0 : (1U << wdt);
+    
+#ifdef UBMP4_SIMULATION
+    return (false);             // Keep running so simulator stimulus is seen
+#endif
+    // Interrupts stay off from the idle checks until after the wake-up, so an
+    // ISR can't queue work that would then wait for the next wake-up. An IOC
+    // flag still wakes the SLEEP instruction while GIE is 0.
+    bool gie = GIE;
+    GIE = 0;
+    if(button_state != 0 || button_head != button_tail || TMR2IE || TMR1IE || adc_sampling || out_frames != NULL || ir_state != IR_IDLE || usb_on || C1IE)
+    {
+        GIE = gie;
+        return (false);
+    }
+    for(unsigned char task = 0; task != TASK_SLOTS; task++)
+    {
+        if(tasks[task].function == NULL)
+        {
+            continue;
+        }
+        
+        // Halve the watchdog period until it ends before the task is due
+        int wait = (int)(tasks[task].due - now);
+        while(wdt != IDLE_WDT_OFF && wdt != 0 && wait < (int)period)
+        {
+            wdt --;
+            period >>= 1;
+        }
+        if(wdt == IDLE_WDT_OFF || wait < (int)period)
+        {
+            GIE = gie;
+            return (false);
+        }
+    }
+    
+    // Enable interrupt-on-change for button presses before checking the pins,
+    // so a press after the check wakes the SLEEP instruction straight away
+    IOCAN = 0b00001000;         // SW1 falling edge
+    IOCBN = 0b11110000;         // SW2-SW5 falling edges
+    IOCAF = 0;
+    IOCBF = 0;
+    IOCIE = 1;
+    if(SW1 == 0 || (PORTB & 0b11110000) != 0b11110000)
+    {
+        IOCIE = 0;              // A button is still pressed or bouncing
+        GIE = gie;
+        return (false);
+    }
+    
+    if(period != 0)
+    {
+        WDTCON = (unsigned char)(wdt << 1) | 0b00000001;    // WDT on (SWDTEN)
+    }
+    VREGPM = 1;                 // Low-power voltage regulator mode during sleep
+    SLEEP();                    // Sleep until IOC or WDT wakes up the CPU
+    NOP();
+    WDTCON = 0;                 // WDT off
+    IOCIE = 0;
+    IOCAN = 0;
+    IOCBN = 0;
+    IOCAF = 0;                  // The ISR never sees this wake-up's flags
+    IOCBF = 0;
+#ifndef UBMP4_SIMULATION
+    while(!PLLRDY);             // Wait for PLL lock (not modelled by simulator)
+#endif
+    
+    // The TMR0 tick stops during sleep. A WDT time-out means a whole period
+    // passed, so it is added to tick_ms. A pushbutton (IOC) wake-up can come at
+    // any time in the period, and there is no running clock to measure how long
+    // the CPU slept, so that time never reaches tick_ms and TICK_ms falls
+    // behind real time by it.
+    if(!nTO)
+    {
+        tick_ms += period;
+    }
+    GIE = gie;
+    return (true);
+}
+
+// Interrupt service routine for the UBMP4 background services.
+void __interrupt() UBMP4_isr(void)
+{
+    // TMR2 is shared by the software UART, IR transmitter and tone generator
+    if(TMR2IE && TMR2IF)
+    {
+        TMR2IF = 0;
+        
+        // Software UART: sample H2 in the middle of each bit, after checking
+        // the middle of the start bit, and send the next bit on H1
+        if(uart_on)
+        {
+            if(uart_rx_bit == 0)
+            {
+                if(H2IN == 0)   // Start bit edge
+                {
+                    uart_rx_bit = 1;
+                    uart_rx_ticks = 2;
+                }
+            }
+            else if(--uart_rx_ticks == 0)
+            {
+                uart_rx_ticks = 4;
+                if(uart_rx_bit == 1)
+                {
+                    uart_rx_bit = (H2IN == 0) ? 2 : 0;  // Ignore glitches
+                }
+                else if(uart_rx_bit != 10)
+                {
+                    uart_rx_shift = (unsigned char)(uart_rx_shift >> 1) | (H2IN ? 0b10000000 : 0);
+                    uart_rx_bit ++;
+                }
+                else
+                {
+                    unsigned char head = (uart_rx_head + 1) & (UART_RX_SIZE - 1);
+                    if(H2IN && head != uart_rx_tail)    // Valid stop bit
+                    {
+                        uart_rx_queue[uart_rx_head] = uart_rx_shift;
+                        uart_rx_head = head;
+                    }
+                    uart_rx_bit = 0;
+                }
+            }
+            
+            if(--uart_tx_ticks == 0)
+            {
+                uart_tx_ticks = 4;
+                if(uart_tx_frame == 0 && uart_tx_tail != uart_tx_head)
+                {
+                    // Stop bit, data bits and start bit, sent from the LSB
+                    uart_tx_frame = (unsigned int)uart_tx_queue[uart_tx_tail] << 1;
+                    uart_tx_frame |= 0b1000000000;
+                    uart_tx_tail = (uart_tx_tail + 1) & (UART_TX_SIZE - 1);
+                }
+                if(uart_tx_frame != 0)
+                {
+                    H1OUT = uart_tx_frame & 1;
+                    uart_tx_frame >>= 1;
+                }
+            }
+        }
+        
+        // IR transmitter: count down the mark or space time, then switch the
+        // PWM1 carrier onto the IRLED pin for marks and off for spaces
+        if(ir_tx_on && --ir_tx_left == 0)
+        {
+            if(++ir_tx_index == ir_tx_count)
+            {
+                PWM1OE = 0;     // Frame sent
+                ir_tx_on = false;
+                latc_reserved &= ~OUT_D3;
+                timer2_stop();
+            }
+            else
+            {
+                PWM1OE = !(ir_tx_index & 1);    // Even entries are marks
+                ir_tx_left = ir_tx_table[ir_tx_index];
+            }
+        }
+        
+        // Tone generator: advance both voices and output the mixed square
+        // wave. Two voices that are both on give a high output, one voice on
+        // gives a toggling output that averages to the middle level.
+        if(tone_on)
+        {
+            tone_phase[0] += tone_inc[0];
+            tone_phase[1] += tone_inc[1];
+            unsigned char high = ((unsigned char)(tone_phase[0] >> 8) >> 7) + ((unsigned char)(tone_phase[1] >> 8) >> 7);
+            if(tone_inc[0] != 0 && tone_inc[1] != 0)
+            {
+                tone_dither = !tone_dither;
+                BEEPER = (high == 2) || (high == 1 && tone_dither);
+            }
+            else
+            {
+                BEEPER = (high != 0);
+            }
+        }
+    }
+    
+    // LED BAM: show the next bit plane for its bit-weighted time slot. The
+    // reload is added to the running TMR1H, so the time taken to get here is
+    // not lost.
+    if(TMR1IE && TMR1IF)
+    {
+        TMR1IF = 0;
+        unsigned char bit = led_bit;
+        unsigned char reload = led_bam_reload[bit];
+        TMR1H += reload;
+        if(TMR1H < reload)      // Wrapped: the slot time had already passed
+        {
+            TMR1H = 0xFF;       // End the slot within 64 cycles
+        }
+        if(bit == 0 && led_swap)
+        {
+            led_front ^= 1;     // Start showing new duty values
+            led_swap = false;
+        }
+        unsigned char mask = OUT_LEDS & ~latc_reserved;
+        LATC = (LATC & ~mask) | (led_plane_c[led_front][bit] & mask);
+        LATA = (LATA & 0b11011111) | led_plane_a[led_front][bit];
+        led_bit = (bit + 1) & 0b00000111;
+    }
+    
+    // TMR0 system tick: count 4096 cycles per overflow and convert to whole
+    // milliseconds, so the ms count stays exact even though a tick is not 1 ms.
+    if(TMR0IE && TMR0IF)
+    {
+        TMR0IF = 0;
+        if(++tick_count == 0)
+        {
+            tick_count_h ++;
+        }
+        tick_cycles += TICK_CYCLES;
+        if(tick_cycles >= TICK_MS_CYCLES)
+        {
+            tick_cycles -= TICK_MS_CYCLES;
+            tick_ms ++;
+            
+            // Sample the pushbuttons every BUTTON_SAMPLE_MS
+            if(++button_sample_ms == BUTTON_SAMPLE_MS)
+            {
+                button_sample_ms = 0;
+                button_sample();
+            }
+            
+            // Publish a gated capture result at the end of each gate time
+            if(capture_gated && C1IE && ++capture_gate_ms == CAPTURE_GATE_MS)
+            {
+                unsigned long now = timer_read_long();
+                capture_gate_ms = 0;
+                capture_time = (now - capture_gate_start) & CAPTURE_MASK;
+                capture_gate_start = now;
+                capture_publish();
+            }
+            
+            // Move the output pattern to its next frame
+            if(out_frames != NULL && --out_ms_left == 0)
+            {
+                if(++out_frame == out_count)
+                {
+                    out_frame = 0;
+                    if(!out_repeat)
+                    {
+                        out_frames = NULL;
+                    }
+                }
+                if(out_frames != NULL)
+                {
+                    out_show_frame();
+                }
+            }
+            
+            // Time tone voices, moving voice 0 to the next sequence step
+            if(tone_on)
+            {
+                for(unsigned char voice = 0; voice != TONE_VOICES; voice++)
+                {
+                    if(tone_ms[voice] != 0 && --tone_ms[voice] == 0)
+                    {
+                        if(voice == 0 && tone_sequence != NULL && (++tone_sequence)->ms != 0)
+                        {
+                            tone_inc[0] = tone_notes[tone_sequence->note];
+                            tone_ms[0] = tone_sequence->ms;
+                        }
+                        else
+                        {
+                            if(voice == 0)
+                            {
+                                tone_sequence = NULL;
+                            }
+                            tone_inc[voice] = 0;
+                            tone_phase[voice] = 0;
+                        }
+                    }
+                }
+                if(tone_inc[0] == 0 && tone_inc[1] == 0 && tone_sequence == NULL)
+                {
+                    tone_on = false;    // All voices finished
+                    timer2_stop();
+                    BEEPER = 0;
+                }
+            }
+        }
+        
+        // The sampler selected the next channel at the end of the previous
+        // conversion, so a whole tick of acquisition time has already passed.
+        // (The ADCON2 auto-conversion trigger does this in hardware instead.)
+        if(adc_sampling && !adc_auto)
+        {
+            GO = 1;
+        }
+    }
+    
+    // IR receiver: C2OUT is 1 while IRIN is low (IR carrier received), so the
+    // level that just ended was a mark if C2OUT is now 0. Levels longer than
+    // the longest valid level are gaps between frames.
+    if(C2IE && C2IF)
+    {
+        C2IF = 0;
+        unsigned int now = timer_read();
+        unsigned int duration = now - ir_edge_time;
+        ir_edge_time = now;
+        if(duration > TIME_US(12000))
+        {
+            ir_state = IR_IDLE;
+        }
+        else
+        {
+            ir_decode(!C2OUT, duration);
+        }
+    }
+    
+    // Capture engine: count rising edges in gated mode, or time whole periods
+    // and their high times from timestamps of both edges in reciprocal mode.
+    // C1OUT follows the input, so it shows which edge caused the interrupt.
+    // If it hasn't changed, a pulse shorter than the interrupt latency came
+    // and went, so the period being timed is dropped rather than counted.
+    if(C1IE && C1IF)
+    {
+        C1IF = 0;
+        if(capture_gated)
+        {
+            capture_count ++;
+        }
+        else
+        {
+            unsigned long now = timer_read_long();
+            bool level = C1OUT;
+            if(level == capture_level)
+            {
+                capture_rise = now;
+                capture_started = level;
+            }
+            else if(level)
+            {
+                if(capture_started)
+                {
+                    capture_time += (now - capture_rise) & CAPTURE_MASK;
+                    capture_high += capture_pulse;
+                    capture_count ++;
+                }
+                capture_rise = now;
+                capture_started = true;
+                if((capture_count >= CAPTURE_PERIODS && capture_time >= CAPTURE_MIN_COUNTS) || capture_time >= CAPTURE_GATE_COUNTS)
+                {
+                    capture_publish();
+                }
+            }
+            else
+            {
+                capture_pulse = (now - capture_rise) & CAPTURE_MASK;
+            }
+            capture_level = level;
+        }
+    }
+    
+    // USB: reset the device on a bus reset, send stream batches at each 1 ms
+    // start of frame, and handle each completed transaction in turn
+    if(USBIE && USBIF)
+    {
+        USBIF = 0;
+        if(URSTIF)
+        {
+            usb_reset();
+            URSTIF = 0;
+        }
+        if(SOFIF)
+        {
+            SOFIF = 0;
+            usb_stream_send(true);
+        }
+        while(TRNIF)
+        {
+            unsigned char status = USTAT;   // Read before TRNIF advances it
+            TRNIF = 0;
+            usb_transaction(status);
+        }
+    }
+    
+    // Interrupt-on-change: IDLE_sleep clears its own wake-up flags with GIE
+    // off, and the debouncer in the TMR0 tick reads the buttons, so any other
+    // IOC flags only need clearing here
+    if(IOCIE && IOCIF)
+    {
+        unsigned char flags = IOCAF;    // Clear only the flags read as set, so
+        IOCAF &= (unsigned char)~flags; // an edge arriving now isn't lost
+        flags = IOCBF;
+        IOCBF &= (unsigned char)~flags;
+    }
+    
+    // ADC sampler: store the result in the back buffer, then switch to the
+    // next channel so it can charge the sample capacitor until the next tick.
+    if(ADIE && ADIF)
+    {
+        ADIF = 0;
+        unsigned char back = adc_front ^ 1;
+        unsigned int result;
+        if(adc_10bit)
+        {
+            result = ((unsigned int)ADRESH << 8) | ADRESL;
+        }
+        else
+        {
+            result = ADRESH;
+        }
+        adc_results[back][adc_index] = result;
+        adc_filter_sample(adc_index, result);
+        if(adc_index == keypad_index)
+        {
+            keypad_decode(result);
+        }
+        if(adc_index == goertzel_index)
+        {
+            goertzel_sample(result);
+        }
+        
+        if(adc_index == adc_stream_index)
+        {
+            unsigned char head = (adc_ring_head + 1) & (ADC_RING_SIZE - 1);
+            if(head != adc_ring_tail)
+            {
+                adc_ring[adc_ring_head] = result;
+                adc_ring_head = head;
+            }
+            else
+            {
+                adc_overruns ++;
+            }
+        }
+        
+        adc_index ++;
+        if(adc_index == adc_count)
+        {
+            adc_index = 0;
+            adc_front = back;   // Publish the completed sweep
+            adc_sweeps ++;
+        }
+        ADCON0 = adc_channels[adc_index] | 0b00000001;  // Select next channel
+    }
+}
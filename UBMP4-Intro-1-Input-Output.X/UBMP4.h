@@ -14,11 +14,30 @@
  both an input definition as well as an output definition (e.g. H1IN and H1OUT).
  Add or modify symbolic definitions as needed.
  
+ Pin table section:
+ The pin table lists each physical pin used on UBMP4 once, along with the one
+ device that owns it and its direction, weak pull-up and analog settings. The
+ UBMP4_config and ADC_config functions set up the port registers using values
+ calculated from the table by the compiler, and UBMP4.c checks at compile time
+ that no two devices own the same pin. Edit the table when connecting devices
+ to the header pins.
+ 
  ADC input channel definitions section:
  Definitions representing the ADCON0 register channel select (CHS) bits, which
  are used to switch between ADC channels available on UBMP4. These definitions
  are used with the ADC_select_channel and ADC_read_channel functions.
  
+ Background service definitions sections:
+ Constants and sizes used by the interrupt-driven services in UBMP4.c, such as
+ the TMR0 system tick, the cooperative task scheduler, the background ADC
+ sampler with its filters, window events and Goertzel tone detector, the
+ temperature indicator and high-endurance flash logger, the beeper tone
+ generator, the pushbutton debouncer and analog keypad, the output shadow
+ latch, LED brightness control, IR remote receiving and sending, the capture
+ engine, WS2812 LED strips, USB serial streaming, the software UART and command
+ protocol, tracing, boot phase timing, and idle sleep. Adjust the sizes to
+ trade RAM for capacity.
+ 
  Function prototypes section:
  Function prototype definitions for each of the functions in the UBMP4.c file
  are located here. Function prototypes must exist for all external functions
@@ -76,6 +95,53 @@
 #define D5          LATCbits.LATC7  // LED D5 output
 #define LED5        LATCbits.LATC7  // LED D5 output
 
+// Pin table settings
+#define PORT_A      0               // Pin is on PORTA
+#define PORT_B      1               // Pin is on PORTB
+#define PORT_C      2               // Pin is on PORTC
+#define PIN_IN      0               // Input (TRISx.bit = 1)
+#define PIN_OUT     1               // Output (TRISx.bit = 0)
+#define WPU_OFF     0               // No weak pull-up
+#define WPU_ON      1               // Weak pull-up enabled (PORTA and PORTB only)
+#define ANA_OFF     0               // Digital input
+#define ANA_ON      1               // Analog input once ADC_config runs
+
+// UBMP4 pin table:
+//  PIN(x, owner, port, bit, direction, pull-up, analog)
+#define UBMP4_PIN_TABLE(PIN, x) \
+    PIN(x, SW1,     PORT_A, 3, PIN_IN,  WPU_ON,  ANA_OFF) \
+    PIN(x, BEEPER,  PORT_A, 4, PIN_OUT, WPU_OFF, ANA_OFF) \
+    PIN(x, D1,      PORT_A, 5, PIN_OUT, WPU_OFF, ANA_OFF) \
+    PIN(x, SW2,     PORT_B, 4, PIN_IN,  WPU_ON,  ANA_OFF) \
+    PIN(x, SW3,     PORT_B, 5, PIN_IN,  WPU_ON,  ANA_OFF) \
+    PIN(x, SW4,     PORT_B, 6, PIN_IN,  WPU_ON,  ANA_OFF) \
+    PIN(x, SW5,     PORT_B, 7, PIN_IN,  WPU_ON,  ANA_OFF) \
+    PIN(x, H1,      PORT_C, 0, PIN_IN,  WPU_OFF, ANA_OFF) \
+    PIN(x, H2,      PORT_C, 1, PIN_IN,  WPU_OFF, ANA_OFF) \
+    PIN(x, IRIN,    PORT_C, 2, PIN_IN,  WPU_OFF, ANA_OFF) \
+    PIN(x, Q1,      PORT_C, 3, PIN_IN,  WPU_OFF, ANA_ON)  \
+    PIN(x, D2,      PORT_C, 4, PIN_OUT, WPU_OFF, ANA_OFF) \
+    PIN(x, D3,      PORT_C, 5, PIN_OUT, WPU_OFF, ANA_OFF) \
+    PIN(x, D4,      PORT_C, 6, PIN_OUT, WPU_OFF, ANA_OFF) \
+    PIN(x, D5,      PORT_C, 7, PIN_OUT, WPU_OFF, ANA_OFF)
+
+// Pin table bit calculations. Each adds a pin's bit to a port register value
+// if the pin is on port x and has the setting being collected.
+#define PINMAP_BIT(x, port, bit, set) | (((port) == (x) && (set)) ? (1U << (bit)) : 0U)
+#define PINMAP_OUT(x, owner, port, bit, dir, wpu, ana)  PINMAP_BIT(x, port, bit, (dir) == PIN_OUT)
+#define PINMAP_WPU(x, owner, port, bit, dir, wpu, ana)  PINMAP_BIT(x, port, bit, (wpu) == WPU_ON)
+#define PINMAP_ANA(x, owner, port, bit, dir, wpu, ana)  PINMAP_BIT(x, port, bit, (ana) == ANA_ON)
+
+// Port register values calculated from the pin table. Unused pins are inputs.
+#define PINMAP_TRISA    (unsigned char)(0b00111111 & ~(0U UBMP4_PIN_TABLE(PINMAP_OUT, PORT_A)))
+#define PINMAP_TRISB    (unsigned char)(0b11110000 & ~(0U UBMP4_PIN_TABLE(PINMAP_OUT, PORT_B)))
+#define PINMAP_TRISC    (unsigned char)(0b11111111 & ~(0U UBMP4_PIN_TABLE(PINMAP_OUT, PORT_C)))
+#define PINMAP_WPUA     (unsigned char)(0U UBMP4_PIN_TABLE(PINMAP_WPU, PORT_A))
+#define PINMAP_WPUB     (unsigned char)(0U UBMP4_PIN_TABLE(PINMAP_WPU, PORT_B))
+#define PINMAP_ANSELA   (unsigned char)(0U UBMP4_PIN_TABLE(PINMAP_ANA, PORT_A))
+#define PINMAP_ANSELB   (unsigned char)(0U UBMP4_PIN_TABLE(PINMAP_ANA, PORT_B))
+#define PINMAP_ANSELC   (unsigned char)(0U UBMP4_PIN_TABLE(PINMAP_ANA, PORT_C))
+
 // ADC (A-D converter) input channel definitions
 #define AN4         0b00010000      // A-D converter channel 4 input
 #define ANH1        0b00010000      // External H1 header analogue input (Ch4))
@@ -97,6 +163,330 @@
 // Clock frequency definition for delay macros and simulation
 #define _XTAL_FREQ  48000000        // Set clock frequency for time delays
 
+// Simulation build option. Uncomment to run in the MPLAB X simulator, which
+// does not model PLL lock. Waits for PLL lock are skipped, and IDLE_sleep does
+// not sleep, so the simulator's stopwatch can time code from button stimulus.
+//#define UBMP4_SIMULATION
+
+// System tick and task scheduler definitions
+#define TICK_CYCLES 4096            // TMR0 (div-16) overflow period in cycles
+#define TICK_MS_CYCLES  (_XTAL_FREQ / 4000) // Instruction cycles per millisecond
+#define TASK_SLOTS  6               // Number of task scheduler slots
+#define TASK_NONE   0xFF            // Task ID returned if no slot is available
+
+// Task function type used by the task scheduler
+typedef void (*task_function_t)(void);
+
+// Background ADC sampler definitions
+#define ADC_SAMPLER_SLOTS   4       // Maximum number of channels in sampler list
+#define ADC_8BIT    0               // 8-bit results (ADRESH, left justified)
+#define ADC_10BIT   1               // 10-bit results (ADRESH:ADRESL, right just.)
+#define ADC_TRIGGER_SOFTWARE 0b00000000 // ADCON2: TMR0 tick ISR sets GO
+#define ADC_TRIGGER_TMR0 0b00110000 // ADCON2: TMR0 overflow sets GO in hardware
+#define ADC_TRIGGER_HZ  (_XTAL_FREQ / 4 / TICK_CYCLES) // Conversions per second
+#define ADC_RING_SIZE   32          // Stream ring buffer size (power of 2)
+
+// ADC filter definitions (filter modes for ADC_filter)
+#define FILTER_NONE     0           // Filtered value is the latest sample
+#define FILTER_OVERSAMPLE 1         // Sum 4^n samples, shift right n (+n bits)
+#define FILTER_AVERAGE  2           // Moving average of FILTER_AVERAGE_SIZE
+#define FILTER_IIR      3           // Low-pass: y += (x - y) / 2^n
+#define FILTER_OVERSAMPLE_MAX 2     // Most extra bits (4^n samples, 12-bit sum)
+#define FILTER_AVERAGE_SIZE 8       // Moving average length (power of 2)
+#define FILTER_IIR_SCALE    5       // IIR state fraction bits (10+5 bits fit)
+
+// ADC window definitions (zones for ADC_zone, and event types for ADC_event
+// that combine the zone entered with a sampler channel list position)
+#define ADC_ZONE_NONE   0           // Window off, or no zone settled yet
+#define ADC_ZONE_LOW    1           // Filtered value below the low threshold
+#define ADC_ZONE_IN     2           // Filtered value inside the window
+#define ADC_ZONE_HIGH   3           // Filtered value above the high threshold
+#define ADC_EVENT_NONE  0x00        // No event waiting
+#define ADC_EVENT_LOW   0x10        // Channel value fell below the window
+#define ADC_EVENT_IN    0x20        // Channel value entered the window
+#define ADC_EVENT_HIGH  0x30        // Channel value rose above the window
+#define ADC_EVENT_TYPE(e)   ((e) & 0xF0)    // Event type of an event
+#define ADC_EVENT_INDEX(e)  ((e) & 0x0F)    // Sampler list position of an event
+#define ADC_EVENT_QUEUE_SIZE 8      // Event queue size (power of 2)
+
+// Goertzel tone detector definitions. Each TONE(hz) in the tone list gets a
+// filter bin centred on that frequency, whose coefficient is calculated at
+// compile time for the sample rate of one channel in a sampler list of
+// GOERTZEL_CHANNELS channels. Bins are ADC_TRIGGER_HZ / GOERTZEL_CHANNELS /
+// GOERTZEL_BLOCK (about 23 Hz) wide, and tones must be GOERTZEL_BLOCK^2 / 2048
+// + 2 bins (10 bins, about 230 Hz, for 128 samples) or more from 0 Hz and from
+// Nyquist so that the filter state fits in 16 bits (checked in UBMP4.c). The
+// sample rate of about 2930 Hz puts Nyquist at about 1465 Hz, so the detector
+// can't reach the upper tones of a touch-tone (DTMF) pair (1336, 1477 and 1633
+// Hz) and is not a DTMF decoder. The example list is the four low tones, from
+// 697 to 941 Hz.
+#define GOERTZEL_TONES(TONE) \
+    TONE(697) \
+    TONE(770) \
+    TONE(852) \
+    TONE(941)                       // Tones to detect (Hz)
+#define GOERTZEL_CHANNELS   1       // Channels in the sampler list
+#define GOERTZEL_BLOCK      128     // Samples per magnitude block (44 ms, < 256)
+#define GOERTZEL_QUEUE_SIZE 32      // Sample queue size (power of 2, 11 ms)
+#define GOERTZEL_COUNT(hz)  + 1
+#define GOERTZEL_BINS       (0 GOERTZEL_TONES(GOERTZEL_COUNT))  // Filter bins
+
+// High-endurance flash (HEF) definitions. The last 128 words of program memory
+// are kept free of code (see the project's ROM ranges) for data, and each word
+// holds one data byte in its high-endurance low 8 bits.
+#define HEF_ADDRESS     0x1F80      // First HEF word (4 rows of 32 words)
+#define HEF_ROW_SIZE    32          // Bytes (words) erased and written together
+#define HEF_STALL_MS    2           // Row erase or write time (typical)
+
+// Temperature indicator definitions. With VDD above 3.6 V the high range
+// output is VDD - 4 Vt, where the diode voltage Vt falls 1.32 mV/C, so each
+// 10-bit ADC count (VDD reference) is TEMP_SLOPE / 256 tenths of a degree.
+#define TEMP_VDD_MV     5000        // Supply voltage (USB) in mV
+#define TEMP_SLOPE      (unsigned int)(TEMP_VDD_MV * 256000UL / (4UL * 1023 * 132))
+#define TEMP_DEFAULT_COUNT (unsigned int)(1023UL * (TEMP_VDD_MV - 4 * 573) / TEMP_VDD_MV)
+#define TEMP_DEFAULT_TENTHS 250     // 25.0 C gives Vt = 573 mV (typical)
+#define TEMP_CAL_ADDRESS HEF_ADDRESS    // HEF row holding the calibration
+
+// HEF ring logger definitions. The logger writes records to the HEF rows after
+// the temperature calibration row in turn. Each row starts with a sequence
+// number and its complement, followed by 2-byte records: a tag and a data byte.
+#define LOG_FIRST_ROW   1           // First HEF row used by the logger
+#define LOG_ROWS        3           // HEF rows used by the logger
+#define LOG_RECORDS     15          // Records written together in each row
+#define LOG_ADC         0x00        // Tag: ADC sample (tag bits 1-0 = sample bits 9-8)
+#define LOG_EVENT       0x10        // Tag: event byte (e.g. a BUTTON_event)
+#define LOG_END         0xFF        // Tag: no more records in the row (erased)
+
+// Beeper tone generator definitions
+#define TONE_RATE   (_XTAL_FREQ / 4 / 4 / 79 / 2)   // TMR2 interrupt rate (Hz)
+#define TONE_INC(f) (unsigned int)(((f) * 65536UL + TONE_RATE / 2) / TONE_RATE)
+#define TONE_VOICES 2               // Number of mixed tone voices
+#define TONE_MAX_HZ (TONE_RATE / 2)  // Highest tone before the phase step aliases
+
+// Musical note numbers for BEEPER_play sequences (equal temperament, A4=440Hz)
+#define NOTE_REST 0   // Silence
+#define NOTE_C4   1   // 262 Hz
+#define NOTE_CS4  2   // 277 Hz
+#define NOTE_D4   3   // 294 Hz
+#define NOTE_DS4  4   // 311 Hz
+#define NOTE_E4   5   // 330 Hz
+#define NOTE_F4   6   // 349 Hz
+#define NOTE_FS4  7   // 370 Hz
+#define NOTE_G4   8   // 392 Hz
+#define NOTE_GS4  9   // 415 Hz
+#define NOTE_A4   10  // 440 Hz
+#define NOTE_AS4  11  // 466 Hz
+#define NOTE_B4   12  // 494 Hz
+#define NOTE_C5   13  // 523 Hz
+#define NOTE_CS5  14  // 554 Hz
+#define NOTE_D5   15  // 587 Hz
+#define NOTE_DS5  16  // 622 Hz
+#define NOTE_E5   17  // 659 Hz
+#define NOTE_F5   18  // 698 Hz
+#define NOTE_FS5  19  // 740 Hz
+#define NOTE_G5   20  // 784 Hz
+#define NOTE_GS5  21  // 831 Hz
+#define NOTE_A5   22  // 880 Hz
+#define NOTE_AS5  23  // 932 Hz
+#define NOTE_B5   24  // 988 Hz
+#define NOTE_C6   25  // 1047 Hz
+#define NOTE_CS6  26  // 1109 Hz
+#define NOTE_D6   27  // 1175 Hz
+#define NOTE_DS6  28  // 1245 Hz
+#define NOTE_E6   29  // 1319 Hz
+#define NOTE_F6   30  // 1397 Hz
+#define NOTE_FS6  31  // 1480 Hz
+#define NOTE_G6   32  // 1568 Hz
+#define NOTE_GS6  33  // 1661 Hz
+#define NOTE_A6   34  // 1760 Hz
+#define NOTE_AS6  35  // 1865 Hz
+#define NOTE_B6   36  // 1976 Hz
+#define NOTE_C7   37  // 2093 Hz
+
+// Pushbutton event definitions. Button numbers are also bit numbers in the
+// BUTTON_state mask, and events combine an event type with a button number.
+#define BUTTON_SW1  0               // SW1 button number
+#define BUTTON_SW2  1               // SW2 button number
+#define BUTTON_SW3  2               // SW3 button number
+#define BUTTON_SW4  3               // SW4 button number
+#define BUTTON_SW5  4               // SW5 button number
+#define BUTTON_NONE     0x00        // No event waiting
+#define BUTTON_PRESS    0x10        // Button pressed (after debouncing)
+#define BUTTON_RELEASE  0x20        // Button released
+#define BUTTON_LONG     0x30        // Button held for BUTTON_LONG_MS
+#define BUTTON_REPEAT   0x40        // Button still held, every BUTTON_REPEAT_MS
+#define BUTTON_TYPE(e)  ((e) & 0xF0)    // Event type of an event
+#define BUTTON_ID(e)    ((e) & 0x0F)    // Button number of an event
+#define BUTTON_SAMPLE_MS    4       // Debouncer sample period (4 samples/change)
+#define BUTTON_LONG_MS      500     // Hold time for BUTTON_LONG (max. 900 ms)
+#define BUTTON_REPEAT_MS    100     // Auto-repeat period after BUTTON_LONG
+#define BUTTON_QUEUE_SIZE   8       // Event queue size (power of 2)
+
+// Analog keypad definitions. A resistor ladder on an ADC input gives each key
+// its own voltage, and keypad keys get button numbers after BUTTON_SW5.
+#define KEYPAD_KEYS_MAX     8       // Most keys in a keypad ladder
+#define KEYPAD_NONE         0xFF    // No keypad key pressed
+#define KEYPAD_HYSTERESIS   8       // Band overlap in 10-bit result units
+#define KEYPAD_SETTLE       3       // Equal decodes in a row to change key
+#define KEYPAD_DEBOUNCE     3       // Then further equal button samples (bounce)
+#define BUTTON_KEY(k)   (5 + (k))   // Button number of keypad key k
+
+// Output shadow latch bit masks (PORTC output latch bits) for OUT_write and
+// OUT_pattern frames. LED D1 is on PORTA and is set using OUT_D1 instead.
+#define OUT_H1      0b00000001      // External I/O header H1 output
+#define OUT_H2      0b00000010      // External I/O header H2 output
+#define OUT_H3      0b00000100      // External I/O header H3 output
+#define OUT_H4      0b00001000      // External I/O header H4 output
+#define OUT_D2      0b00010000      // LED D2 (H5) output
+#define OUT_D3      0b00100000      // LED D3 (H6) output
+#define OUT_D4      0b01000000      // LED D4 (H7) output
+#define OUT_D5      0b10000000      // LED D5 (H8) output
+#define OUT_LEDS    0b11110000      // LEDs D2-D5
+
+// LED brightness (bit angle modulation) definitions. Slots that start late
+// because other interrupts ran first are cut short (see UBMP4.c), so ISR
+// latency above LED_BAM_UNIT causes small brightness errors, not flicker.
+#define LED_BAM_UNIT    128         // Shortest (bit 0) BAM time slot in cycles
+#define LED_REFRESH_HZ  (_XTAL_FREQ / 4 / (255UL * LED_BAM_UNIT))  // ~367 Hz
+
+// Timestamp definitions. Timestamps count TMR0 at 16 cycles (1.333us) per
+// count in the low byte, and TMR0 overflows in the high byte.
+#define TIME_US(us) ((unsigned int)((us) * 3UL / 4))    // Microseconds to counts
+
+// IR receiver definitions
+#define IR_NEC          1           // NEC frame: code = address << 8 | command
+#define IR_NEC_REPEAT   2           // NEC repeat: code of the last NEC frame
+#define IR_RC5          3           // RC5 frame: code = toggle, address, command
+#define IR_QUEUE_SIZE   4           // Received code queue size (power of 2)
+
+// Received IR code
+typedef struct
+{
+    unsigned char protocol;         // IR_NEC, IR_NEC_REPEAT or IR_RC5
+    unsigned int code;              // Received code
+} ir_code_t;
+
+// Capture engine definitions. Comparator C1 compares one header input with
+// the DAC (VDD/2) and interrupts on its edges, which are timestamped using TMR0
+// with a 16-bit overflow count (24-bit timestamps, 1.333us per count). H1 is
+// not a comparator input, so it can't be captured.
+#define CAPTURE_H2      1           // H2 input (C12IN1-)
+#define CAPTURE_H3      2           // H3 input (C12IN2-, shared with IRIN)
+#define CAPTURE_H4      3           // H4 input (C12IN3-, shared with Q1)
+#define CAPTURE_RECIPROCAL 0        // Time whole periods and high times
+#define CAPTURE_GATED   1           // Count rising edges during a gate time
+#define CAPTURE_PERIODS 16          // Fewest periods timed for a reciprocal result
+#define CAPTURE_MIN_MS  10          // Shortest reciprocal time (averages latency)
+#define CAPTURE_GATE_MS 100         // Gate time, and longest reciprocal time
+
+// Capture result
+typedef struct
+{
+    unsigned int periods;           // Periods timed, or rising edges counted
+    unsigned long time;             // Time measured in timestamp counts
+    unsigned long high;             // Input high time (reciprocal mode only)
+} capture_t;
+
+// WS2812 addressable LED definitions. Pixels are stored in the LED strip's
+// GRB wire order, and each bit is sent in exactly WS_BIT_CYCLES instruction
+// cycles. A frame is sent in one piece with interrupts off, because a gap of
+// 50us latches the older WS2812 early, and it must fit between two TMR0 ticks
+// (checked in UBMP4.c), which limits the strip to 11 pixels.
+#define WS_BIT          7           // LATC data bit: 7 = H8OUT (D5), 6 = H7OUT (D4)
+#define WS_PIXELS       8           // Pixels in the LED strip (up to 11)
+#define WS_BIT_CYCLES   15          // Instruction cycles per data bit (1.25us)
+#define WS_T0H_CYCLES   4           // High cycles of a 0 bit (333ns)
+#define WS_T1H_CYCLES   9           // High cycles of a 1 bit (750ns)
+#define WS_RESET_US     300         // Low time that latches a frame
+// Time to send and latch a frame of pixels in us, not counting the wait for a
+// TMR0 tick to pass (8 pixels: 540us, 1851 fps)
+#define WS_FRAME_US(pixels) ((pixels) * 24UL * WS_BIT_CYCLES * 4 / (_XTAL_FREQ / 1000000) + WS_RESET_US)
+
+// USB CDC serial port definitions. USB_stream sends ADC stream samples and
+// queued events to the host in packets that each start with a 4-byte header:
+// USB_STREAM_SYNC, a sequence number, the number of sample bytes after the
+// header's events, and the number of event bytes following the header. Samples
+// are 16-bit little-endian values.
+#define USB_VID         0x04D8      // Microchip vendor ID
+#define USB_PID         0x000A      // Microchip CDC serial port product ID
+#define USB_WRITE_SIZE  32          // Largest USB_write packet in bytes
+#define USB_STREAM_SYNC 0xA5        // First byte of each stream packet
+#define USB_STREAM_EVENTS 8         // Largest number of events in a packet
+#define USB_BATCH_SAMPLES 16        // Samples to wait for before sending
+#define USB_BATCH_MS    8           // Longest wait for a batch to fill in ms
+
+// Software UART definitions. The UART sends on H1 and receives on H2, timing
+// each bit with 4 TMR2 interrupts, so its baud rate is set by TONE_RATE.
+#define UART_BAUD       (TONE_RATE / 4) // ~4747 baud (use 4800 baud, -1.1%)
+#define UART_RX_SIZE    16          // Receive queue size (power of 2)
+#define UART_TX_SIZE    32          // Transmit queue size (power of 2)
+
+// Command protocol definitions. A command frame is CMD_SYNC, a length byte,
+// up to CMD_FRAME_SIZE bytes of operations (an opcode followed by its argument
+// bytes) and a check byte that makes the 8-bit sum of the length, operation and
+// check bytes 0. The reply frame has the same format, holding a CMD_ status
+// byte followed by the result bytes of the operations in order.
+#define CMD_SYNC        0xC3        // First byte of each frame
+#define CMD_FRAME_SIZE  28          // Largest operations or reply length
+#define CMD_TIMEOUT_MS  50          // Longest gap between bytes of a frame
+#define CMD_PATTERN_FRAMES 8        // Largest CMD_PATTERN frame count
+
+// Command operations: opcode, argument bytes -> result bytes (16-bit values
+// are little-endian)
+#define CMD_NOP         0x00        // -> (nothing)
+#define CMD_OUT_WRITE   0x01        // mask, value -> (OUT_write, then OUT_update)
+#define CMD_ADC_READ    0x02        // AN* channel -> 8-bit result (sampler's if running)
+#define CMD_PATTERN     0x03        // count, ms (16), repeat, frames -> OUT_pattern
+#define CMD_BUTTONS     0x04        // -> BUTTON_state
+#define CMD_BEEP        0x05        // frequency (16), ms (16) -> BEEPER_tone
+#define CMD_LED_LEVEL   0x06        // LED (1-5), level -> LED_set_level
+#define CMD_TICK        0x07        // -> TICK_ms (16)
+#define CMD_OPCODES     8           // Number of opcodes
+
+// Command reply status codes
+#define CMD_OK          0           // All operations ran
+#define CMD_BAD_CHECK   1           // Check byte wrong, nothing ran
+#define CMD_BAD_OPCODE  2           // Unknown opcode, earlier operations ran
+#define CMD_BAD_ARGS    3           // Missing or invalid arguments, stopped
+#define CMD_REPLY_FULL  4           // Results did not fit in the reply, stopped
+
+// Trace build options. Uncomment UBMP4_TRACE to record TRACE(id) markers, and
+// also UBMP4_TRACE_PULSE to pulse H8OUT at each marker for a logic analyzer.
+// With UBMP4_TRACE commented out, TRACE markers compile to nothing.
+//#define UBMP4_TRACE
+//#define UBMP4_TRACE_PULSE
+#define TRACE_SIZE      16          // Trace ring buffer entries (power of 2)
+#define TRACE_BIT_US    104         // TRACE_dump bit time (9600 baud)
+#define TRACE_ADC_START 0xF0        // UBMP4.c marker: ADC conversion started
+#define TRACE_ADC_DONE  0xF1        // UBMP4.c marker: ADC conversion finished
+
+#ifdef UBMP4_TRACE
+#define TRACE(id)   TRACE_mark(id)  // Record trace marker id (0-0xEF)
+#else
+#define TRACE(id)   ((void)0)       // Trace markers removed from the build
+#endif
+
+// Idle sleep watchdog wake-up periods (WDTCON WDTPS values, period = 2^n ms)
+#define IDLE_WDT_OFF    0xFF        // Wake up on pushbutton changes only
+#define IDLE_WDT_32MS   5           // Also wake up every 32 ms
+#define IDLE_WDT_256MS  8           // Also wake up every 256 ms
+#define IDLE_WDT_1S     10          // Also wake up every 1 s
+#define IDLE_WDT_2S     11          // Also wake up every 2 s
+
+// Boot phase numbers for BOOT_mark and BOOT_time. UBMP4_config records
+// BOOT_CONFIG, and programs can record the other phases.
+#define BOOT_PHASES     4           // Boot phases recorded (max. 8)
+#define BOOT_CONFIG     0           // UBMP4_config finished, ports ready
+#define BOOT_LOOP       1           // Main loop started (first input poll)
+#define BOOT_USER       2           // First phase free for program use
+
+// Tone sequence step used by BEEPER_play. End a sequence with a 0 ms step.
+typedef struct
+{
+    unsigned char note;             // Note number (NOTE_REST for silence)
+    unsigned int ms;                // Note length in ms (0 ends the sequence)
+} tone_step_t;
+
 // Prototypes for UBMP420.c functions:
 
 /**
@@ -143,11 +533,1065 @@ unsigned char ADC_read(void);
  * Function: unsigned char ADC_read_channel(unsigned char channel)
  * 
  * Enable ADC, switch to the channel specified by one of the channel constants
- * defined above, and return an 8-bit conversion result.
+ * defined above, and return an 8-bit conversion result. While ADC_sampler_start
+ * is running, the ADC is left alone and the sampler's latest result for the
+ * channel is returned instead (0 if the channel is not in its list).
  * 
  * Example usage: light_level = ADC_read_channel(ANQ1);
  */
 unsigned char ADC_read_channel(unsigned char);
 
+/**
+ * Function: unsigned int TICK_ms(void)
+ * 
+ * Return the number of milliseconds counted by the TMR0 system tick interrupt
+ * since start-up. The count wraps around to 0 after 65535 ms, so compare times
+ * by subtracting them rather than by using < or >.
+ * 
+ * Example usage: start = TICK_ms();
+ */
+unsigned int TICK_ms(void);
+
+/**
+ * Function: unsigned char TASK_add(task_function_t function,
+ *                                  unsigned int period, unsigned int delay)
+ * 
+ * Add a task to a free scheduler slot. The task function first runs after
+ * 'delay' ms, and then every 'period' ms. A period of 0 makes a one-shot task
+ * that frees its slot after running once. Returns the task's slot ID, or
+ * TASK_NONE if all of the slots are in use.
+ * 
+ * Example usage: blink_task = TASK_add(blink, 500, 0);
+ */
+unsigned char TASK_add(task_function_t, unsigned int, unsigned int);
+
+/**
+ * Function: unsigned char TASK_every(task_function_t function,
+ *                                    unsigned int period)
+ * 
+ * Add a periodic task that runs every 'period' ms, starting 'period' ms from
+ * now. Returns the task's slot ID, or TASK_NONE if no slot is available.
+ * 
+ * Example usage: TASK_every(read_light_level, 50);
+ */
+unsigned char TASK_every(task_function_t, unsigned int);
+
+/**
+ * Function: unsigned char TASK_once(task_function_t function,
+ *                                   unsigned int delay)
+ * 
+ * Add a one-shot task that runs once, 'delay' ms from now. Returns the task's
+ * slot ID, or TASK_NONE if no slot is available.
+ * 
+ * Example usage: TASK_once(LED_off, 1000);
+ */
+unsigned char TASK_once(task_function_t, unsigned int);
+
+/**
+ * Function: void TASK_remove(unsigned char task)
+ * 
+ * Free the scheduler slot used by the task ID returned by TASK_add. A task may
+ * remove itself while it runs.
+ * 
+ * Example usage: TASK_remove(blink_task);
+ */
+void TASK_remove(unsigned char);
+
+/**
+ * Function: void TASK_run(void)
+ * 
+ * Run each task that is due, once. Call TASK_run from the main loop. Tasks run
+ * to completion one after the other, so each task must return quickly (without
+ * using long time delays) to keep the main loop responsive.
+ * 
+ * Example usage: TASK_run();
+ */
+void TASK_run(void);
+
+/**
+ * Function: void ADC_sampler_start(const unsigned char *channels,
+ *                                  unsigned char count, unsigned char bits)
+ * 
+ * Start the background ADC sampler. The sampler converts the listed channels
+ * (up to ADC_SAMPLER_SLOTS channel constants) in turn, one conversion per TMR0
+ * tick, from the ADC interrupt. Set bits to ADC_8BIT or ADC_10BIT. Configure
+ * the channels' pins as analog inputs first (see ADC_config), and do not use
+ * ADC_read or ADC_read_channel while the sampler is running.
+ * 
+ * Example usage: ADC_sampler_start(sensors, 2, ADC_10BIT);
+ */
+void ADC_sampler_start(const unsigned char *, unsigned char, unsigned char);
+
+/**
+ * Function: void ADC_sampler_stop(void)
+ * 
+ * Stop the background ADC sampler and turn the ADC off. The last results stay
+ * readable using ADC_get.
+ * 
+ * Example usage: ADC_sampler_stop();
+ */
+void ADC_sampler_stop(void);
+
+/**
+ * Function: unsigned int ADC_get(unsigned char index)
+ * 
+ * Return the latest result for the channel at position 'index' in the sampler
+ * channel list. Results come from the last complete sweep of the list, so all
+ * of the values returned between sweeps were sampled together. ADC_get never
+ * waits for a conversion.
+ * 
+ * Example usage: light_level = ADC_get(0);
+ */
+unsigned int ADC_get(unsigned char);
+
+/**
+ * Function: unsigned char ADC_sweeps(void)
+ * 
+ * Return the number of complete sweeps of the sampler channel list. The count
+ * changes when a new set of results is available from ADC_get.
+ * 
+ * Example usage: if(ADC_sweeps() != last_sweep) ...
+ */
+unsigned char ADC_sweeps(void);
+
+/**
+ * Function: void ADC_trigger(unsigned char trigger)
+ * 
+ * Select how the background sampler starts its conversions. ADC_TRIGGER_TMR0
+ * lets each TMR0 overflow start a conversion through the ADCON2 auto-conversion
+ * trigger, so the sample period is exactly TICK_CYCLES instruction cycles with
+ * no software jitter. ADC_TRIGGER_SOFTWARE (the default) sets GO from the TMR0
+ * interrupt. Each channel in a list of n channels is sampled at
+ * ADC_TRIGGER_HZ / n samples per second.
+ * 
+ * Example usage: ADC_trigger(ADC_TRIGGER_TMR0);
+ */
+void ADC_trigger(unsigned char);
+
+/**
+ * Function: void ADC_stream_start(unsigned char index)
+ * 
+ * Copy every new result for the channel at position 'index' in the sampler
+ * channel list into the stream ring buffer, for processing periodic samples in
+ * order. Results are dropped (and counted by ADC_stream_overruns) if the ring
+ * buffer is full.
+ * 
+ * Example usage: ADC_stream_start(0);
+ */
+void ADC_stream_start(unsigned char);
+
+/**
+ * Function: void ADC_stream_stop(void)
+ * 
+ * Stop copying results into the stream ring buffer and empty it.
+ * 
+ * Example usage: ADC_stream_stop();
+ */
+void ADC_stream_stop(void);
+
+/**
+ * Function: bool ADC_stream_read(unsigned int *sample)
+ * 
+ * Remove the oldest sample from the stream ring buffer. Returns false without
+ * waiting if the ring buffer is empty. USB_stream reads the ring buffer itself,
+ * so do not use ADC_stream_read while USB streaming is on.
+ * 
+ * Example usage: while(ADC_stream_read(&sample)) ...
+ */
+bool ADC_stream_read(unsigned int *);
+
+/**
+ * Function: unsigned char ADC_stream_overruns(void)
+ * 
+ * Return the number of stream samples dropped because the ring buffer was full.
+ * 
+ * Example usage: lost = ADC_stream_overruns();
+ */
+unsigned char ADC_stream_overruns(void);
+
+/**
+ * Function: void ADC_filter(unsigned char index, unsigned char mode,
+ *                           unsigned char n)
+ * 
+ * Filter each new result for the channel at position 'index' in the sampler
+ * channel list inside the ADC interrupt, so that ADC_filtered returns a
+ * filtered value without the main program doing any calculations. Modes:
+ * 
+ *  FILTER_NONE       - no filtering.
+ *  FILTER_OVERSAMPLE - add n extra bits of resolution (n = 1 to
+ *                      FILTER_OVERSAMPLE_MAX, for up to 12 bits from 10-bit
+ *                      results) by summing 4^n samples and shifting the sum
+ *                      right by n bits, rounded. The value changes once
+ *                      every 4^n samples.
+ *  FILTER_AVERAGE    - moving average of the last FILTER_AVERAGE_SIZE samples
+ *                      (n is not used).
+ *  FILTER_IIR        - integer low-pass filter with a time constant of 2^n
+ *                      samples (n = 1 to FILTER_IIR_SCALE).
+ * 
+ * All modes round their results instead of truncating them, so filtering
+ * does not bias the value down. Values of n outside these ranges are limited
+ * to the nearest valid value, and an unknown mode selects FILTER_NONE.
+ * Changing the filter also resets the channel's minimum and maximum values.
+ * 
+ * Example usage: ADC_filter(0, FILTER_OVERSAMPLE, 2);
+ */
+void ADC_filter(unsigned char, unsigned char, unsigned char);
+
+/**
+ * Function: unsigned int ADC_filtered(unsigned char index)
+ * 
+ * Return the latest filtered value for the channel at position 'index' in the
+ * sampler channel list.
+ * 
+ * Example usage: light_level = ADC_filtered(0);
+ */
+unsigned int ADC_filtered(unsigned char);
+
+/**
+ * Function: unsigned int ADC_min(unsigned char index)
+ * 
+ * Return the lowest filtered value held since the filter was set or the
+ * channel's peaks were reset using ADC_peaks_reset.
+ * 
+ * Example usage: darkest = ADC_min(0);
+ */
+unsigned int ADC_min(unsigned char);
+
+/**
+ * Function: unsigned int ADC_max(unsigned char index)
+ * 
+ * Return the highest filtered value held since the filter was set or the
+ * channel's peaks were reset using ADC_peaks_reset.
+ * 
+ * Example usage: brightest = ADC_max(0);
+ */
+unsigned int ADC_max(unsigned char);
+
+/**
+ * Function: void ADC_peaks_reset(unsigned char index)
+ * 
+ * Restart the minimum and maximum values of a channel from its next filtered
+ * value.
+ * 
+ * Example usage: ADC_peaks_reset(0);
+ */
+void ADC_peaks_reset(unsigned char);
+
+/**
+ * Function: void ADC_window(unsigned char index, unsigned int low,
+ *                           unsigned int high, unsigned char hysteresis,
+ *                           unsigned char dwell)
+ * 
+ * Watch the filtered value of the channel at position 'index' in the sampler
+ * channel list from the ADC interrupt, and queue an ADC_event each time it
+ * settles in a new zone: below 'low', inside the window from 'low' to 'high',
+ * or above 'high'. A value must go 'hysteresis' past a threshold to leave its
+ * zone, and stay in the new zone for 'dwell' filtered values in a row (1 for
+ * no delay), so noise near a threshold does not cause extra events. The first
+ * zone settled after ADC_window is also reported. The main loop only needs to
+ * check ADC_event instead of reading and comparing the channel itself.
+ * 
+ * Example usage: ADC_window(0, 300, 700, 10, 8);    // Light level in range
+ */
+void ADC_window(unsigned char, unsigned int, unsigned int, unsigned char, unsigned char);
+
+/**
+ * Function: void ADC_window_off(unsigned char index)
+ * 
+ * Stop watching a sampler channel's window.
+ * 
+ * Example usage: ADC_window_off(0);
+ */
+void ADC_window_off(unsigned char);
+
+/**
+ * Function: unsigned char ADC_zone(unsigned char index)
+ * 
+ * Return the settled zone of a sampler channel's window (ADC_ZONE_LOW,
+ * ADC_ZONE_IN or ADC_ZONE_HIGH), or ADC_ZONE_NONE.
+ * 
+ * Example usage: if(ADC_zone(0) == ADC_ZONE_HIGH) ...
+ */
+unsigned char ADC_zone(unsigned char);
+
+/**
+ * Function: unsigned char ADC_event(void)
+ * 
+ * Remove and return the oldest ADC window event from the event queue, or
+ * ADC_EVENT_NONE if no events are waiting.
+ * 
+ * Example usage:
+ * 
+ *  event = ADC_event();
+ *  if(event == (ADC_EVENT_LOW | 0)) LED2 = 1;   // Channel 0 went dark
+ */
+unsigned char ADC_event(void);
+
+/**
+ * Function: bool GOERTZEL_start(unsigned char index)
+ * 
+ * Start detecting the GOERTZEL_TONES frequencies on the channel at position
+ * 'index' in the sampler channel list, such as an ANH header input. The ADC
+ * interrupt only queues each new sample, and GOERTZEL_read runs the filters.
+ * Returns false if the sampler list does not have GOERTZEL_CHANNELS channels,
+ * since the coefficients only suit that sample rate. ADC_TRIGGER_TMR0 gives
+ * jitter-free sample timing.
+ * 
+ * Example usage: if(GOERTZEL_start(0)) ...
+ */
+bool GOERTZEL_start(unsigned char);
+
+/**
+ * Function: void GOERTZEL_stop(void)
+ * 
+ * Stop tone detection.
+ * 
+ * Example usage: GOERTZEL_stop();
+ */
+void GOERTZEL_stop(void);
+
+/**
+ * Function: bool GOERTZEL_read(unsigned int *magnitudes)
+ * 
+ * Run one Goertzel filter step per bin (a 16 x 32-bit multiply each) for
+ * every queued sample. When a block of GOERTZEL_BLOCK samples is complete,
+ * store the magnitude of each tone bin in the array 'magnitudes'
+ * (GOERTZEL_BINS entries, in GOERTZEL_TONES order) and return true. A tone
+ * with a peak amplitude of A 8-bit ADC counts gives a magnitude of about
+ * A * GOERTZEL_BLOCK / 2. Returns false without waiting if the block is not
+ * complete yet. Call GOERTZEL_read at least once every GOERTZEL_QUEUE_SIZE
+ * samples (e.g. from a task every 5 ms), since a block that loses queued
+ * samples is thrown away and restarted.
+ * 
+ * Example usage: if(GOERTZEL_read(levels) && levels[0] > 2000) LED2 = 1;
+ */
+bool GOERTZEL_read(unsigned int *);
+
+/**
+ * Function: void TEMP_start(unsigned char index)
+ * 
+ * Turn on the temperature indicator and average the ANTIM results from sampler
+ * channel list position 'index'. Start the ADC sampler with ANTIM in its
+ * channel list, preferably using ADC_10BIT. The sampler selects each channel a
+ * whole tick before converting it, which gives the indicator its 200us
+ * acquisition time. Each channel in the list is converted once per sweep, so
+ * adding ANTIM to a list of n channels lowers the sample rate of the other
+ * channels from ADC_TRIGGER_HZ / n to ADC_TRIGGER_HZ / (n + 1). The calibration
+ * saved by TEMP_calibrate is loaded from high-endurance flash.
+ * 
+ * Example usage: ADC_sampler_start(channels, 2, ADC_10BIT); TEMP_start(1);
+ */
+void TEMP_start(unsigned char);
+
+/**
+ * Function: void TEMP_stop(void)
+ * 
+ * Turn off the temperature indicator.
+ * 
+ * Example usage: TEMP_stop();
+ */
+void TEMP_stop(void);
+
+/**
+ * Function: int TEMP_get(void)
+ * 
+ * Return the temperature in tenths of a degree Celsius. The temperature is
+ * only recalculated when the averaged reading changes. Readings settle after
+ * FILTER_AVERAGE_SIZE sweeps of the sampler.
+ * 
+ * Example usage: if(TEMP_get() > 300) LED2 = 1;
+ */
+int TEMP_get(void);
+
+/**
+ * Function: void TEMP_calibrate(int tenths)
+ * 
+ * Calibrate the temperature indicator to read 'tenths' (the actual temperature
+ * in tenths of a degree Celsius) now, and save the calibration in
+ * high-endurance flash. The processor stalls for a few milliseconds while the
+ * flash row is written.
+ * 
+ * Example usage: TEMP_calibrate(215);
+ */
+void TEMP_calibrate(int);
+
+/**
+ * Function: void LOG_start(void)
+ * 
+ * Find the newest row of the HEF log, so new records are written after it.
+ * The rows hold consecutive sequence numbers up to the newest row, so it is
+ * found with a binary search that reads two bytes from only a few rows. A row
+ * whose write was cut off by a power loss reads as unwritten. Call LOG_start
+ * once before adding records.
+ * 
+ * Example usage: LOG_start();
+ */
+void LOG_start(void);
+
+/**
+ * Function: void LOG_adc(unsigned int sample)
+ * 
+ * Add an ADC sample (8 or 10 bits) to the log. Records are kept in RAM until
+ * LOG_RECORDS records fill a row, which is then erased and written in one
+ * operation that stalls the processor for a few milliseconds, overwriting the
+ * oldest row once all LOG_ROWS rows are used. Interrupts can't run during the
+ * stall, so the ADC sampler misses the conversions that fall in it.
+ * 
+ * Example usage: if(ADC_stream_read(&sample)) LOG_adc(sample);
+ */
+void LOG_adc(unsigned int);
+
+/**
+ * Function: void LOG_event(unsigned char event)
+ * 
+ * Add an event byte, such as a button event, to the log.
+ * 
+ * Example usage: if(event != BUTTON_NONE) LOG_event(event);
+ */
+void LOG_event(unsigned char);
+
+/**
+ * Function: void LOG_flush(void)
+ * 
+ * Write any records waiting in RAM to the next row now. The rest of the row
+ * is left empty, so only flush before the power is turned off.
+ * 
+ * Example usage: LOG_flush();
+ */
+void LOG_flush(void);
+
+/**
+ * Function: unsigned char LOG_read(unsigned char age, unsigned char *records)
+ * 
+ * Copy the records from a written row of the log into 'records' (2 bytes each,
+ * tag first, up to 2 * LOG_RECORDS bytes) and return the number of records.
+ * An 'age' of 0 reads the newest row, 1 the row before it, and so on. Returns
+ * 0 if the row has not been written.
+ * 
+ * Example usage: count = LOG_read(0, records);
+ */
+unsigned char LOG_read(unsigned char, unsigned char *);
+
+/**
+ * Function: void BEEPER_voice(unsigned char voice, unsigned int frequency,
+ *                             unsigned int ms)
+ * 
+ * Play a tone of 'frequency' Hz on tone voice 0 or 1 for 'ms' milliseconds, or
+ * until stopped if ms is 0. A frequency of 0 silences the voice. Tones are
+ * generated by the TMR2 interrupt, so the program continues running while they
+ * play, and two voices playing together are mixed. Frequencies above
+ * TONE_MAX_HZ (half of TONE_RATE, about 9.5 kHz) would alias to lower tones,
+ * so they are clamped to TONE_MAX_HZ. The beeper itself is loudest below about
+ * 4000 Hz.
+ * 
+ * Example usage: BEEPER_voice(1, 659, 250);
+ */
+void BEEPER_voice(unsigned char, unsigned int, unsigned int);
+
+/**
+ * Function: void BEEPER_tone(unsigned int frequency, unsigned int ms)
+ * 
+ * Play a tone of 'frequency' Hz on tone voice 0 for 'ms' milliseconds, or until
+ * stopped if ms is 0.
+ * 
+ * Example usage: BEEPER_tone(880, 100);
+ */
+void BEEPER_tone(unsigned int, unsigned int);
+
+/**
+ * Function: void BEEPER_play(const tone_step_t *sequence)
+ * 
+ * Play a sequence of notes on tone voice 0 in the background. The sequence is
+ * read from program memory as it plays, until a step with a length of 0 ms.
+ * 
+ * Example usage: BEEPER_play(startup_tune);
+ */
+void BEEPER_play(const tone_step_t *);
+
+/**
+ * Function: void BEEPER_stop(void)
+ * 
+ * Stop all tone voices and sequences, and turn the beeper output off.
+ * 
+ * Example usage: BEEPER_stop();
+ */
+void BEEPER_stop(void);
+
+/**
+ * Function: bool BEEPER_busy(void)
+ * 
+ * Return true while any tone voice or sequence is playing.
+ * 
+ * Example usage: if(!BEEPER_busy()) ...
+ */
+bool BEEPER_busy(void);
+
+/**
+ * Function: unsigned char BUTTON_event(void)
+ * 
+ * Remove and return the oldest pushbutton event from the event queue, or
+ * BUTTON_NONE if no events are waiting. The TMR0 tick debounces all five
+ * pushbuttons together and queues press, release, long press and auto-repeat
+ * events, so button handling code no longer needs to wait for buttons.
+ * 
+ * Example usage:
+ * 
+ *  event = BUTTON_event();
+ *  if(event == (BUTTON_PRESS | BUTTON_SW2)) ...
+ */
+unsigned char BUTTON_event(void);
+
+/**
+ * Function: unsigned char BUTTON_state(void)
+ * 
+ * Return the debounced state of all five pushbuttons. Bit n is 1 while button
+ * number n (BUTTON_SW1 to BUTTON_SW5) is pressed.
+ * 
+ * Example usage: if(BUTTON_state() & (1 << BUTTON_SW4)) ...
+ */
+unsigned char BUTTON_state(void);
+
+/**
+ * Function: void KEYPAD_start(unsigned char index, const unsigned int *levels,
+ *                             unsigned char keys)
+ * 
+ * Decode a resistor ladder keypad from the channel at position 'index' in the
+ * ADC sampler channel list. 'levels' is a table of 'keys' rising threshold
+ * values (up to KEYPAD_KEYS_MAX, in 8-bit or 10-bit sampler result units):
+ * key 0 is pressed below levels[0], key k between levels[k - 1] and levels[k],
+ * and no key at or above the last level. Each key stays decoded until the
+ * voltage moves KEYPAD_HYSTERESIS past its band, and must decode the same
+ * KEYPAD_SETTLE times in a row, so ladder noise is ignored. The key is then
+ * debounced like the pushbuttons (the same for KEYPAD_DEBOUNCE more button
+ * samples), so contact bounce, which can leave the voltage in another key's
+ * band for a millisecond or more, doesn't give extra events either. Keys get
+ * the same press, release, long press and auto-repeat events from
+ * BUTTON_event as the pushbuttons, using button numbers BUTTON_KEY(k). The
+ * decoding runs in the ADC interrupt, so the main loop does no scanning.
+ * 
+ * Using AN10 (SW2) or AN11 (SW3) turns the pin into an analog input without
+ * its weak pull-up, and removes that pushbutton from the debouncer. The
+ * ladder needs its own pull-up resistor to VDD.
+ * 
+ * Example usage:
+ * 
+ *  const unsigned int ladder[4] = {128, 384, 640, 896};
+ *  ADC_sampler_start(channels, 1, ADC_10BIT);  // channels[0] = AN10
+ *  KEYPAD_start(0, ladder, 4);
+ */
+void KEYPAD_start(unsigned char, const unsigned int *, unsigned char);
+
+/**
+ * Function: void KEYPAD_stop(void)
+ * 
+ * Stop decoding the keypad (a held key gets a release event) and return an
+ * AN10 or AN11 pin to its pushbutton.
+ * 
+ * Example usage: KEYPAD_stop();
+ */
+void KEYPAD_stop(void);
+
+/**
+ * Function: unsigned char KEYPAD_key(void)
+ * 
+ * Return the keypad key that is pressed (0 to keys - 1), or KEYPAD_NONE.
+ * 
+ * Example usage: if(KEYPAD_key() == 2) ...
+ */
+unsigned char KEYPAD_key(void);
+
+/**
+ * Function: void OUT_write(unsigned char mask, unsigned char value)
+ * 
+ * Change the PORTC output bits selected by 'mask' (OUT_ constants ORed
+ * together) to the matching bits in 'value' in the output shadow latch. The
+ * outputs do not change until OUT_update is called, so several LED and header
+ * output changes can be made at once without affecting other PORTC outputs.
+ * 
+ * Example usage: OUT_write(OUT_D2 | OUT_D3, OUT_D2);
+ */
+void OUT_write(unsigned char, unsigned char);
+
+/**
+ * Function: void OUT_D1(bool on)
+ * 
+ * Turn active-low LED D1 on (true) or off (false) in the output shadow latch.
+ * LED D1 changes when OUT_update is called.
+ * 
+ * Example usage: OUT_D1(true);
+ */
+void OUT_D1(bool);
+
+/**
+ * Function: void OUT_update(void)
+ * 
+ * Copy all of the shadow latch bits changed since the last update to LATC and
+ * LATA, using one write to each port latch.
+ * 
+ * Example usage: OUT_update();
+ */
+void OUT_update(void);
+
+/**
+ * Function: void OUT_pattern(const unsigned char *frames, unsigned char count,
+ *                            unsigned int ms, unsigned char mask, bool repeat)
+ * 
+ * Play a pattern of 'count' frames from a const table in the background,
+ * showing each frame for 'ms' milliseconds. Each frame holds PORTC output bits
+ * (OUT_ constants) and only the bits selected by 'mask' are changed. The
+ * pattern plays once, or over and over if 'repeat' is true.
+ * 
+ * Example usage: OUT_pattern(chaser, 4, 100, OUT_LEDS, true);
+ */
+void OUT_pattern(const unsigned char *, unsigned char, unsigned int, unsigned char, bool);
+
+/**
+ * Function: void OUT_pattern_stop(void)
+ * 
+ * Stop the pattern playing, leaving the outputs showing its last frame.
+ * 
+ * Example usage: OUT_pattern_stop();
+ */
+void OUT_pattern_stop(void);
+
+/**
+ * Function: bool OUT_pattern_busy(void)
+ * 
+ * Return true while a pattern is playing.
+ * 
+ * Example usage: if(!OUT_pattern_busy()) ...
+ */
+bool OUT_pattern_busy(void);
+
+/**
+ * Function: void LED_pwm_start(void)
+ * 
+ * Start controlling the brightness of LEDs D1-D5 using bit angle modulation
+ * (BAM) from the TMR1 interrupt. Each 8-bit brightness value is shown as eight
+ * bit-weighted time slots, so the interrupt runs only eight times per refresh
+ * and takes the same short time whatever the brightness values are. Other
+ * code should not write to the LED outputs while brightness control is on.
+ * 
+ * Example usage: LED_pwm_start();
+ */
+void LED_pwm_start(void);
+
+/**
+ * Function: void LED_pwm_stop(void)
+ * 
+ * Stop LED brightness control and turn LEDs D1-D5 off.
+ * 
+ * Example usage: LED_pwm_stop();
+ */
+void LED_pwm_stop(void);
+
+/**
+ * Function: void LED_set_duty(unsigned char led, unsigned char duty)
+ * 
+ * Set the on-time of LED 'led' (1-5 for D1-D5) to duty/255 of each refresh.
+ * 
+ * Example usage: LED_set_duty(3, 128);
+ */
+void LED_set_duty(unsigned char, unsigned char);
+
+/**
+ * Function: void LED_set_level(unsigned char led, unsigned char level)
+ * 
+ * Set the brightness of LED 'led' (1-5 for D1-D5) to 'level' (0-255). The level
+ * is gamma-corrected, so equal level steps look like equal brightness steps.
+ * 
+ * Example usage: LED_set_level(2, 64);
+ */
+void LED_set_level(unsigned char, unsigned char);
+
+/**
+ * Function: void IR_rx_start(void)
+ * 
+ * Start receiving IR remote control codes from the IR demodulator (U2) on
+ * IRIN. PORTC has no interrupt-on-change, so comparator C2 compares IRIN to
+ * half of VDD from the DAC and interrupts on every edge. Each edge is
+ * timestamped and decoded by a NEC and RC5 state machine, and received codes
+ * are queued for IR_receive. IRIN becomes an analog (comparator) input.
+ * 
+ * Example usage: IR_rx_start();
+ */
+void IR_rx_start(void);
+
+/**
+ * Function: void IR_rx_stop(void)
+ * 
+ * Stop receiving IR codes and turn off comparator C2 and the DAC.
+ * 
+ * Example usage: IR_rx_stop();
+ */
+void IR_rx_stop(void);
+
+/**
+ * Function: bool IR_receive(ir_code_t *code)
+ * 
+ * Remove the oldest received IR code from the queue. Returns false without
+ * waiting if no codes have been received.
+ * 
+ * Example usage: if(IR_receive(&remote)) ...
+ */
+bool IR_receive(ir_code_t *);
+
+/**
+ * Function: bool IR_send(unsigned int code)
+ * 
+ * Start sending a NEC IR remote frame from IRLED (LED D3/D6) and return
+ * without waiting. The code holds the address in its upper byte and the
+ * command in its lower byte. The 37.97 kHz carrier comes from PWM1, using the
+ * TMR2 period shared with the tone generator, and the TMR2 interrupt switches
+ * it on and off from a table of mark and space lengths. LED D3 updates from
+ * OUT_update, OUT_pattern and LED brightness control wait until the frame is
+ * sent. Returns false if the previous frame is still being sent.
+ * 
+ * Example usage: IR_send(0x04A5);
+ */
+bool IR_send(unsigned int);
+
+/**
+ * Function: bool IR_tx_busy(void)
+ * 
+ * Return true while an IR frame is being sent.
+ * 
+ * Example usage: while(IR_tx_busy()) ...
+ */
+bool IR_tx_busy(void);
+
+/**
+ * Function: void CAPTURE_start(unsigned char input, unsigned char mode)
+ * 
+ * Start measuring the signal on a header input (CAPTURE_H2, CAPTURE_H3 or
+ * CAPTURE_H4) in the background. CAPTURE_RECIPROCAL mode timestamps both edges
+ * of each period, and publishes a result once it has timed CAPTURE_PERIODS
+ * periods and CAPTURE_MIN_MS, or after CAPTURE_GATE_MS. It gives precise
+ * periods and duty cycles for slower signals (up to roughly 30 kHz at 50%
+ * duty). A pulse shorter than the interrupt latency (about 15us) is dropped
+ * from the result rather than mistimed. CAPTURE_GATED mode only counts rising
+ * edges for CAPTURE_GATE_MS at a time, which takes less interrupt time and
+ * suits faster signals (up to roughly 60 kHz). Inputs must cross VDD/2.
+ * 
+ * Example usage: CAPTURE_start(CAPTURE_H2, CAPTURE_RECIPROCAL);
+ */
+void CAPTURE_start(unsigned char, unsigned char);
+
+/**
+ * Function: void CAPTURE_stop(void)
+ * 
+ * Stop measuring.
+ * 
+ * Example usage: CAPTURE_stop();
+ */
+void CAPTURE_stop(void);
+
+/**
+ * Function: bool CAPTURE_read(capture_t *result)
+ * 
+ * Copy the newest capture result into 'result'. Returns false without waiting
+ * if there is no new result since the last call.
+ * 
+ * Example usage: if(CAPTURE_read(&result)) frequency = CAPTURE_hz(&result);
+ */
+bool CAPTURE_read(capture_t *);
+
+/**
+ * Function: unsigned long CAPTURE_hz(const capture_t *result)
+ * 
+ * Return the frequency of a capture result in Hz, rounded to the nearest Hz.
+ * 
+ * Example usage: frequency = CAPTURE_hz(&result);
+ */
+unsigned long CAPTURE_hz(const capture_t *);
+
+/**
+ * Function: unsigned long CAPTURE_period_us(const capture_t *result)
+ * 
+ * Return the average period of a capture result in microseconds.
+ * 
+ * Example usage: period = CAPTURE_period_us(&result);
+ */
+unsigned long CAPTURE_period_us(const capture_t *);
+
+/**
+ * Function: unsigned char CAPTURE_duty(const capture_t *result)
+ * 
+ * Return the duty cycle (percent of the time the input was high) of a
+ * reciprocal mode capture result.
+ * 
+ * Example usage: duty = CAPTURE_duty(&result);
+ */
+unsigned char CAPTURE_duty(const capture_t *);
+
+/**
+ * Function: void WS_start(void)
+ * 
+ * Start driving a WS2812 (NeoPixel) LED strip from header pin WS_BIT (H8OUT by
+ * default). The pin is taken away from the output latch and LED brightness
+ * functions, and all pixels are set to off.
+ * 
+ * Example usage: WS_start();
+ */
+void WS_start(void);
+
+/**
+ * Function: void WS_stop(void)
+ * 
+ * Stop driving the LED strip and return its pin to the output functions.
+ * 
+ * Example usage: WS_stop();
+ */
+void WS_stop(void);
+
+/**
+ * Function: void WS_set(unsigned char pixel, unsigned char red,
+ *                       unsigned char green, unsigned char blue)
+ * 
+ * Set the colour of one pixel (0 to WS_PIXELS - 1). The new colour is shown
+ * by the next WS_show().
+ * 
+ * Example usage: WS_set(0, 255, 128, 0);     // First pixel orange
+ */
+void WS_set(unsigned char, unsigned char, unsigned char, unsigned char);
+
+/**
+ * Function: bool WS_show(void)
+ * 
+ * Send the changed part of the frame to the LED strip. Pixels are sent from
+ * the start of the strip up to the last changed pixel, so changes near the
+ * start of a long strip are quicker to show. The frame is sent with interrupts
+ * off just after a TMR0 tick (waiting up to 341us for one), so interrupts are
+ * delayed by up to the frame time (30us per pixel): capture and IR receive
+ * edges in that time are timestamped late. Returns false without sending if
+ * nothing changed, the last frame has not latched yet (WS_RESET_US), or a tone,
+ * IR transmission or the UART is using TMR2, whose interrupts can't wait.
+ * 
+ * Example usage: WS_show();
+ */
+bool WS_show(void);
+
+/**
+ * Function: void USB_start(void)
+ * 
+ * Enable the USB module and connect to the host as a CDC serial port. The host
+ * enumerates the device in the background using the USB interrupt. IDLE_sleep
+ * stays awake while USB is on.
+ * 
+ * Example usage: USB_start();
+ */
+void USB_start(void);
+
+/**
+ * Function: void USB_stop(void)
+ * 
+ * Disconnect from the host and turn the USB module off.
+ * 
+ * Example usage: USB_stop();
+ */
+void USB_stop(void);
+
+/**
+ * Function: bool USB_ready(void)
+ * 
+ * Return true if the host has configured the device and opened the serial
+ * port (set DTR).
+ * 
+ * Example usage: if(USB_ready()) LED2 = 1;
+ */
+bool USB_ready(void);
+
+/**
+ * Function: bool USB_write(const unsigned char *data, unsigned char count)
+ * 
+ * Send one packet of up to USB_WRITE_SIZE bytes to the host. Returns false
+ * without waiting if USB is not configured or the previous packet or stream
+ * batch has not been sent yet.
+ * 
+ * Example usage: USB_write(message, 5);
+ */
+bool USB_write(const unsigned char *, unsigned char);
+
+/**
+ * Function: bool USB_read_byte(unsigned char *byte)
+ * 
+ * Read the next byte received from the host. Returns false without waiting if
+ * no data is waiting. The host waits to send more once both receive buffers
+ * are full.
+ * 
+ * Example usage: while(USB_read_byte(&command)) ...
+ */
+bool USB_read_byte(unsigned char *);
+
+/**
+ * Function: void USB_stream(bool on)
+ * 
+ * Turn streaming of the ADC stream ring buffer (see ADC_stream_start) to the
+ * host on or off. Samples are sent straight from the ring buffer, in batches
+ * of USB_BATCH_SAMPLES or after USB_BATCH_MS, whichever comes first. Ring
+ * space is freed when the host has read each batch, so if the host stops
+ * reading, new samples are dropped and counted by ADC_stream_overruns.
+ * 
+ * Example usage: ADC_stream_start(0); USB_stream(true);
+ */
+void USB_stream(bool);
+
+/**
+ * Function: bool USB_stream_event(unsigned char event)
+ * 
+ * Queue an event byte (such as a BUTTON_event) to send in the next stream
+ * packet. Returns false if USB_STREAM_EVENTS events are already waiting.
+ * 
+ * Example usage: if(event != BUTTON_NONE) USB_stream_event(event);
+ */
+bool USB_stream_event(unsigned char);
+
+/**
+ * Function: void UART_start(void)
+ * 
+ * Start the software UART: H1 becomes the serial output and H2 the serial
+ * input, at UART_BAUD with 8 data bits, no parity and 1 stop bit. TMR2 keeps
+ * running while the UART is on, so IDLE_sleep stays awake.
+ * 
+ * Example usage: UART_start();
+ */
+void UART_start(void);
+
+/**
+ * Function: void UART_stop(void)
+ * 
+ * Stop the software UART after any queued bytes are sent, and make H1 an input
+ * again.
+ * 
+ * Example usage: UART_stop();
+ */
+void UART_stop(void);
+
+/**
+ * Function: bool UART_read_byte(unsigned char *byte)
+ * 
+ * Remove the oldest received byte from the receive queue. Returns false without
+ * waiting if no byte is waiting.
+ * 
+ * Example usage: if(UART_read_byte(&data)) ...
+ */
+bool UART_read_byte(unsigned char *);
+
+/**
+ * Function: bool UART_write_byte(unsigned char byte)
+ * 
+ * Queue a byte to send. Returns false without waiting if the transmit queue is
+ * full.
+ * 
+ * Example usage: while(!UART_write_byte(data));
+ */
+bool UART_write_byte(unsigned char);
+
+/**
+ * Function: void CMD_poll(void)
+ * 
+ * Read command frame bytes from the USB serial port (once USB_start has run)
+ * and the software UART (once UART_start has run), run the operations in each
+ * complete frame in order, and send the reply frame back the same way. Call
+ * CMD_poll from the main loop. CMD_poll never waits for the USB host: a reply
+ * that can't be sent yet is sent by a later call, and no more frames are read
+ * until it has gone, so a host can send several frames before reading replies.
+ * 
+ * Example usage: CMD_poll();
+ */
+void CMD_poll(void);
+
+/**
+ * Function: void TRACE_mark(unsigned char id)
+ * 
+ * Record trace marker 'id' and a timestamp in the trace ring buffer, replacing
+ * the oldest entry when the buffer is full. Timestamps count 16 instruction
+ * cycles (1.333us) and wrap around every 87ms. Use the TRACE(id) macro instead
+ * of calling TRACE_mark, so that markers can be removed from the build, and do
+ * not use it inside an interrupt service routine.
+ * 
+ * Example usage: TRACE(1);
+ */
+void TRACE_mark(unsigned char);
+
+/**
+ * Function: bool TRACE_dump(void)
+ * 
+ * Send the trace ring buffer, oldest entry first, as 9600 baud 8N1 serial data
+ * on H8OUT (shared with LED D5), and return true. The data is a 0x55 sync byte
+ * and an entry count, followed by the id, timestamp high byte and timestamp
+ * low byte of each entry. Bits are timed by the TMR0 timestamp with interrupts
+ * enabled, so ISRs keep running while the data is sent (about 52 ms for a full
+ * buffer) and only delay single bit edges. H8 is reserved from LED and output
+ * updates while sending and is then put back to its previous level. Returns
+ * false without sending if interrupts are disabled or H8 is already in use
+ * (by WS_start). The buffer is empty afterwards.
+ * 
+ * Example usage: if(SW5 == 0) TRACE_dump();
+ */
+bool TRACE_dump(void);
+
+/**
+ * Function: bool IDLE_sleep(unsigned char wdt)
+ * 
+ * Put the microcontroller to sleep if it has nothing to do: no buttons are
+ * pressed or events waiting, no tones or output patterns are playing, LED
+ * brightness control and the ADC sampler are stopped. The watchdog wakes it up
+ * after the 'wdt' period (one of the IDLE_WDT_ constants), or after a shorter
+ * power-of-2 ms period that ends before the next scheduled task is due. With
+ * IDLE_WDT_OFF, it only sleeps if no tasks are scheduled. Pressing any
+ * pushbutton wakes it up. Returns true if it slept.
+ * The TMR0 tick stops during sleep, so only watchdog wake-up periods are added
+ * to TICK_ms, and time spent asleep before a pushbutton wake-up is not counted.
+ * 
+ * IDLE_sleep is optional. Only call it at the end of a main loop that does
+ * all of its work in tasks or in response to button events, since any other
+ * code in the loop stops running until the next wake-up.
+ * 
+ * Example usage:
+ * 
+ *  while(1)
+ *  {
+ *      TASK_run();
+ *      IDLE_sleep(IDLE_WDT_256MS); // Sleep until a button or watchdog wake-up
+ *  }
+ */
+bool IDLE_sleep(unsigned char);
+
+/**
+ * Function: void BOOT_mark(unsigned char phase)
+ * 
+ * Record the time that a boot phase (0 to BOOT_PHASES - 1) is first reached.
+ * Later calls for the same phase are ignored, so BOOT_mark can be called from
+ * inside a loop. Times count from the start of UBMP4_config. To keep start-up
+ * short, configure peripherals when they are first used (the ADC functions
+ * call ADC_config by themselves) and move other set-up code into a task using
+ * TASK_once(function, 0) so that it runs after the first input poll.
+ * 
+ * Example usage: BOOT_mark(BOOT_LOOP);
+ */
+void BOOT_mark(unsigned char);
+
+/**
+ * Function: unsigned int BOOT_time(unsigned char phase)
+ * 
+ * Return the time a boot phase was reached in timestamp counts (see TIME_US),
+ * or 0xFFFF if the phase has not been reached.
+ * 
+ * Example usage: if(BOOT_time(BOOT_LOOP) > TIME_US(1000)) LED2 = 1;
+ */
+unsigned int BOOT_time(unsigned char);
+
+/**
+ * Function: unsigned int BOOT_pll_wait(void)
+ * 
+ * Return the number of loop passes OSC_config made waiting for the PLL to lock
+ * before UBMP4_config started the boot timer. Each pass takes roughly 2us at
+ * the 16 MHz pre-PLL clock.
+ * 
+ * Example usage: spins = BOOT_pll_wait();
+ */
+unsigned int BOOT_pll_wait(void);
+
 // TODO - Add additional function prototypes for any new functions added to
 // the UBMP420.c file here.
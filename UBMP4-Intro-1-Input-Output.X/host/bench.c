@@ -0,0 +1,150 @@
+/*==============================================================================
+ File: bench.c                          Host benchmarks for UBMP4.c
+
+ Benchmark suite run in virtual time on the simulator:
+
+ - Button to LED latency: the Intro-1 program runs with scripted SW2 presses,
+   and each press is timed to the first rising edge of LED D2.
+ - ADC throughput: blocking ADC_read_channel conversions per second, and
+   background sampler sweeps per second with software and TMR0 triggers.
+ - Time blocked in delays: the share of each run spent in __delay_ms and
+   __delay_us, as counted by the simulated delay macros.
+
+ The program exits with an error if a result is outside its limit, so the
+ limits catch regressions rather than describe the hardware exactly.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+int16_t intro_main(void);              // Intro-1 main(), built as intro.o
+
+#define PRESSES     12
+
+static sim_edge_t edges[20000];
+static sim_step_t presses[PRESSES * 2 + 1];
+
+HOST static int intro(void)
+{
+    intro_main();
+    return (0);
+}
+
+// Time scripted SW2 presses in the Intro-1 program to the LED D2 turning on.
+HOST static void bench_button_latency(void)
+{
+    sim_reset();
+    for(unsigned int i = 0; i != PRESSES; i++)
+    {
+        // Presses 1.2 s apart (longer than the pattern) at varying tick phases
+        uint64_t press = (100 + 1200 * i) * SIM_CYCLES_PER_MS + i * 997;
+        presses[i * 2] = (sim_step_t){ press, SIM_BUTTON, SIM_SW2, 1 };
+        presses[i * 2 + 1] = (sim_step_t){ press + 30 * SIM_CYCLES_PER_MS, SIM_BUTTON, SIM_SW2, 0 };
+    }
+    presses[PRESSES * 2] = (sim_step_t){ 0, SIM_END, 0, 0 };
+    sim_script(presses);
+    sim_log(edges, sizeof(edges) / sizeof(edges[0]));
+    CHECK(sim_run_main(intro, (100 + 1200 * PRESSES) * SIM_CYCLES_PER_MS));
+    size_t count = sim_log_count();
+
+    double total = 0, worst = 0, best = 1e9;
+    for(unsigned int i = 0; i != PRESSES; i++)
+    {
+        uint64_t press = presses[i * 2].cycle;
+        bool level = false;
+        uint64_t on = 0;
+        for(size_t e = 0; e != count && on == 0; e++)
+        {
+            if(edges[e].reg != SIM_LATC)
+            {
+                continue;
+            }
+            bool led = (edges[e].value & 0b00010000) != 0;
+            if(edges[e].cycle >= press && led && !level)
+            {
+                on = edges[e].cycle;
+            }
+            level = led;
+        }
+        CHECK(on != 0);
+        double latency = SIM_US(on - press);
+        total += latency;
+        worst = latency > worst ? latency : worst;
+        best = latency < best ? latency : best;
+    }
+    printf("Button to LED latency (Intro-1, SW2 to D2)\n");
+    REPORT("best", "%8.1f us", best);
+    REPORT("average", "%8.1f us", total / PRESSES);
+    REPORT("worst", "%8.1f us", worst);
+    REPORT("time blocked in delays", "%8.2f %%", 100.0 * sim_delay_cycles / sim_cycles);
+    REPORT("interrupt load", "%8.2f %%", 100.0 * sim_isr_cycles / sim_cycles);
+    CHECK_RANGE(worst, 0, 2 * 1000.0 * TICK_CYCLES / SIM_CYCLES_PER_MS + 200);
+}
+
+// Count blocking conversions in one second of virtual time.
+HOST static void bench_adc_read(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    ADC_config();
+    sim_adc(7, 512);
+    uint64_t delays = sim_delay_cycles;
+    uint64_t start = sim_cycles;
+    unsigned long reads = 0;
+    while(sim_cycles - start < 1000 * SIM_CYCLES_PER_MS)
+    {
+        CHECK(ADC_read_channel(ANQ1) == 512 >> 2);
+        reads ++;
+    }
+    double seconds = SIM_MS(sim_cycles - start) / 1000;
+    printf("ADC throughput\n");
+    REPORT("ADC_read_channel", "%8.0f reads/s", reads / seconds);
+    REPORT("time blocked in delays", "%8.2f %%", 100.0 * (sim_delay_cycles - delays) / (sim_cycles - start));
+    CHECK_RANGE(reads / seconds, 20000, 1e6);
+}
+
+// Count sampler sweeps of two channels in one second of virtual time.
+HOST static void bench_adc_sampler(unsigned char trigger, const char *name)
+{
+    static const unsigned char channels[2] = { ANQ1, ANH1 };
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    ADC_config();
+    sim_adc(7, 300);
+    sim_adc(4, 700);
+    ADC_sampler_start(channels, 2, ADC_10BIT);
+    ADC_trigger(trigger);
+    sim_run(10 * SIM_CYCLES_PER_MS);
+    unsigned long conversions = sim_conversions;
+    uint64_t isr = sim_isr_cycles;
+    uint64_t start = sim_cycles;
+    sim_run(1000 * SIM_CYCLES_PER_MS);
+    double rate = (sim_conversions - conversions) / 2.0;
+    CHECK(ADC_get(0) == 300 && ADC_get(1) == 700);
+    ADC_sampler_stop();
+    REPORT(name, "%8.0f sweeps/s, %.2f %% CPU in interrupts", rate, 100.0 * (sim_isr_cycles - isr) / (sim_cycles - start));
+    CHECK_RANGE(rate, ADC_TRIGGER_HZ / 2.0 * 0.99, ADC_TRIGGER_HZ / 2.0 * 1.01);
+}
+
+// Start-up time and the share of it spent in time delays.
+HOST static void bench_boot(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    printf("Start-up\n");
+    REPORT("OSC_config + UBMP4_config", "%8.1f us", SIM_US(sim_cycles));
+    REPORT("time blocked in delays", "%8.2f %%", 100.0 * sim_delay_cycles / sim_cycles);
+}
+
+HOST int main(void)
+{
+    bench_button_latency();
+    bench_adc_read();
+    bench_adc_sampler(ADC_TRIGGER_SOFTWARE, "sampler, software trigger");
+    bench_adc_sampler(ADC_TRIGGER_TMR0, "sampler, TMR0 trigger");
+    bench_boot();
+    TEST_DONE();
+}
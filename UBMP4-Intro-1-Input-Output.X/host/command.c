@@ -0,0 +1,169 @@
+/*==============================================================================
+ File: command.c                        Host library for the command protocol
+
+ See command.h.
+==============================================================================*/
+
+#include    <string.h>
+
+#include    "command.h"
+
+// Add an operation of 'length' bytes with 'results' result bytes.
+static bool add(command_batch_t *batch, const unsigned char *op, unsigned char length, unsigned char results)
+{
+    // The reply holds a status byte and the results
+    if(batch->length + length > CMD_FRAME_SIZE || 1 + batch->results + results > CMD_FRAME_SIZE)
+    {
+        return (false);
+    }
+    memcpy(&batch->ops[batch->length], op, length);
+    batch->length += length;
+    batch->results += results;
+    batch->count ++;
+    return (true);
+}
+
+void command_begin(command_batch_t *batch)
+{
+    memset(batch, 0, sizeof(*batch));
+}
+
+bool command_out_write(command_batch_t *batch, unsigned char mask, unsigned char value)
+{
+    const unsigned char op[] = { CMD_OUT_WRITE, mask, value };
+    return (add(batch, op, sizeof(op), 0));
+}
+
+bool command_adc_read(command_batch_t *batch, unsigned char channel)
+{
+    const unsigned char op[] = { CMD_ADC_READ, channel };
+    return (add(batch, op, sizeof(op), 1));
+}
+
+bool command_pattern(command_batch_t *batch, const unsigned char *frames, unsigned char count, uint16_t ms, unsigned char repeat)
+{
+    unsigned char op[5 + CMD_PATTERN_FRAMES] = { CMD_PATTERN, count, (unsigned char)ms, (unsigned char)(ms >> 8), repeat };
+    if(count > CMD_PATTERN_FRAMES)
+    {
+        return (false);
+    }
+    memcpy(&op[5], frames, count);
+    return (add(batch, op, 5 + count, 0));
+}
+
+bool command_buttons(command_batch_t *batch)
+{
+    const unsigned char op[] = { CMD_BUTTONS };
+    return (add(batch, op, sizeof(op), 1));
+}
+
+bool command_beep(command_batch_t *batch, uint16_t frequency, uint16_t ms)
+{
+    const unsigned char op[] = { CMD_BEEP, (unsigned char)frequency, (unsigned char)(frequency >> 8), (unsigned char)ms, (unsigned char)(ms >> 8) };
+    return (add(batch, op, sizeof(op), 0));
+}
+
+bool command_led_level(command_batch_t *batch, unsigned char led, unsigned char level)
+{
+    const unsigned char op[] = { CMD_LED_LEVEL, led, level };
+    return (add(batch, op, sizeof(op), 0));
+}
+
+bool command_tick(command_batch_t *batch)
+{
+    const unsigned char op[] = { CMD_TICK };
+    return (add(batch, op, sizeof(op), 2));
+}
+
+size_t command_frame(const command_batch_t *batch, unsigned char *frame)
+{
+    unsigned char check = batch->length;
+    frame[0] = CMD_SYNC;
+    frame[1] = batch->length;
+    for(unsigned char i = 0; i != batch->length; i++)
+    {
+        frame[2 + i] = batch->ops[i];
+        check += batch->ops[i];
+    }
+    frame[2 + batch->length] = (unsigned char)-check;
+    return (batch->length + 3U);
+}
+
+void command_reader_init(command_reader_t *reader)
+{
+    reader->count = 0;
+}
+
+int command_read(command_reader_t *reader, unsigned char byte, command_reply_t *reply)
+{
+    if(reader->count == 0 && byte != CMD_SYNC)
+    {
+        return (0);             // Look for the start of a frame
+    }
+    if(reader->count == 1 && (byte == 0 || byte > CMD_FRAME_SIZE))
+    {
+        reader->count = (byte == CMD_SYNC);     // Not a length, maybe a new sync
+        return (0);
+    }
+    reader->bytes[reader->count++] = byte;
+    if(reader->count < 3 || reader->count != reader->bytes[1] + 3)
+    {
+        return (0);
+    }
+
+    reader->count = 0;
+    unsigned char check = 0;
+    for(unsigned char i = 1; i != reader->bytes[1] + 3; i++)
+    {
+        check += reader->bytes[i];
+    }
+    if(check != 0)
+    {
+        return (-1);
+    }
+    reply->status = reader->bytes[2];
+    reply->length = reader->bytes[1] - 1;
+    memcpy(reply->results, &reader->bytes[3], reply->length);
+    return (1);
+}
+
+size_t command_run(const command_link_t *link, const command_batch_t *batches, size_t count, command_reply_t *replies)
+{
+    command_reader_t reader;
+    unsigned char frame[COMMAND_FRAME_BYTES];
+    unsigned int depth = link->depth ? link->depth : 1;
+    size_t sent = 0, received = 0;
+
+    command_reader_init(&reader);
+    while(received != count)
+    {
+        // Keep up to 'depth' frames in flight
+        while(sent != count && sent - received < depth)
+        {
+            size_t length = command_frame(&batches[sent], frame);
+            if(!link->send(link->context, frame, length))
+            {
+                return (received);
+            }
+            sent ++;
+        }
+        int byte = link->receive(link->context);
+        if(byte < 0)
+        {
+            return (received);
+        }
+        int result = command_read(&reader, (unsigned char)byte, &replies[received]);
+        if(result < 0)
+        {
+            return (received);
+        }
+        received += (size_t)result;
+    }
+    return (received);
+}
+
+const char *command_status_name(unsigned char status)
+{
+    static const char *const names[] = { "OK", "bad check", "bad opcode", "bad arguments", "reply full" };
+    return (status < sizeof(names) / sizeof(names[0]) ? names[status] : "unknown status");
+}
@@ -0,0 +1,87 @@
+/*==============================================================================
+ File: command.h                        Host library for the command protocol
+
+ Builds command frames for CMD_poll (see the CMD_ definitions in UBMP4.h),
+ reads reply frames from a byte stream, and runs a list of frames over a
+ serial link with several frames in flight. The link is a pair of callbacks,
+ so the same code drives a USB CDC or UART port (see ubmp4cmd.c) and the
+ simulated device in the host tests.
+==============================================================================*/
+
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include    <stdbool.h>
+#include    <stddef.h>
+#include    <stdint.h>
+
+#ifndef CMD_SYNC                // UBMP4.h has no include guard, and the tests
+#include    "build/UBMP4.h"     // include it through build/UBMP4.c
+#endif
+
+#define COMMAND_FRAME_BYTES (CMD_FRAME_SIZE + 3)    // Sync, length and check bytes
+
+// A frame of operations being built, and the result bytes its reply will hold
+typedef struct
+{
+    unsigned char ops[CMD_FRAME_SIZE];
+    unsigned char length;       // Operation bytes
+    unsigned char results;      // Result bytes expected, after the status byte
+    unsigned char count;        // Operations
+} command_batch_t;
+
+// A reply frame
+typedef struct
+{
+    unsigned char status;       // CMD_OK or a CMD_ error
+    unsigned char length;       // Result bytes
+    unsigned char results[CMD_FRAME_SIZE];
+} command_reply_t;
+
+// Reply frame reader state
+typedef struct
+{
+    unsigned char bytes[COMMAND_FRAME_BYTES];
+    unsigned char count;
+} command_reader_t;
+
+// A serial link to the device. send writes all the bytes or returns false.
+// receive returns the next byte, or -1 if none arrives in time.
+typedef struct
+{
+    void *context;
+    bool (*send)(void *context, const unsigned char *bytes, size_t count);
+    int (*receive)(void *context);
+    unsigned int depth;         // Frames sent ahead of their replies (1 or more)
+} command_link_t;
+
+// Start an empty batch.
+void command_begin(command_batch_t *batch);
+
+// Add an operation. Each returns false, leaving the batch unchanged, if the
+// operation or its results would not fit in the frame.
+bool command_out_write(command_batch_t *batch, unsigned char mask, unsigned char value);
+bool command_adc_read(command_batch_t *batch, unsigned char channel);
+bool command_pattern(command_batch_t *batch, const unsigned char *frames, unsigned char count, uint16_t ms, unsigned char repeat);
+bool command_buttons(command_batch_t *batch);
+bool command_beep(command_batch_t *batch, uint16_t frequency, uint16_t ms);
+bool command_led_level(command_batch_t *batch, unsigned char led, unsigned char level);
+bool command_tick(command_batch_t *batch);
+
+// Write the frame for a batch and return its length.
+size_t command_frame(const command_batch_t *batch, unsigned char *frame);
+
+// Add a received byte. Returns 1 with *reply filled in when a reply frame is
+// complete, -1 if a frame had a bad check byte, and 0 otherwise.
+void command_reader_init(command_reader_t *reader);
+int command_read(command_reader_t *reader, unsigned char byte, command_reply_t *reply);
+
+// Send the batches with up to link->depth frames in flight and collect their
+// replies in order. Returns the number of replies received, which is less
+// than count if the link fails or a reply times out.
+size_t command_run(const command_link_t *link, const command_batch_t *batches, size_t count, command_reply_t *replies);
+
+// Return a name for a CMD_ status code.
+const char *command_status_name(unsigned char status);
+
+#endif
@@ -0,0 +1,989 @@
+/*==============================================================================
+ File: sim.c                            Host simulator for UBMP4.c
+
+ Virtual clock, SFR file and peripheral models behind the host xc.h. The
+ models cover what UBMP4.c uses: port inputs with interrupt-on-change, TMR0,
+ TMR1 (Fosc/4 and Fosc clocks), TMR2 and the PWM1 output, the ADC with software
+ and TMR0 auto-conversion triggers, comparator outputs, program memory reads,
+ row erases and writes, PLL lock, SLEEP with IOC and WDT wake-up, and the
+ interrupt controller. USB registers are plain storage that a test drives.
+==============================================================================*/
+
+#include    <setjmp.h>
+#include    <stdarg.h>
+
+#include    "sim.h"
+
+void UBMP4_isr(void);
+
+// SFR bit positions used by the models
+#define INTCON_GIE      0x80
+#define INTCON_PEIE     0x40
+#define INTCON_TMR0IE   0x20
+#define INTCON_IOCIE    0x08
+#define INTCON_TMR0IF   0x04
+#define INTCON_IOCIF    0x01
+#define PIR1_TMR1IF     0x01
+#define PIR1_TMR2IF     0x02
+#define PIR1_ADIF       0x40
+#define PWM1CON_EN      0x80
+#define PWM1CON_OUT     0x20
+#define PIR2_USBIF      0x08
+#define PIR2_C1IF       0x20
+#define PIR2_C2IF       0x40
+#define ADCON0_ADON     0x01
+#define ADCON0_GO       0x02
+#define PMCON1_RD       0x01
+#define PMCON1_WR       0x02
+#define PMCON1_WREN     0x04
+#define PMCON1_FREE     0x10
+#define PMCON1_LWLO     0x20
+#define PMCON1_CFGS     0x40
+#define STATUS_NPD      0x08
+#define STATUS_NTO      0x10
+#define OSCSTAT_PLLRDY  0x40
+#define FVRCON_TSEN     0x20
+#define ADC_TEMPERATURE 29              // Temperature indicator channel
+
+volatile unsigned char sim_sfr[SIM_REGISTERS];
+unsigned int sim_flash[SIM_FLASH_WORDS];
+
+uint64_t sim_cycles;
+uint64_t sim_isr_cycles;
+uint64_t sim_isr_max;
+uint64_t sim_isr_count;
+uint64_t sim_delay_cycles;
+uint64_t sim_sleep_cycles;
+uint64_t sim_gie_off_max;
+uint64_t sim_access_count[SIM_REGISTERS];
+unsigned long sim_flash_erases[SIM_FLASH_WORDS / SIM_FLASH_ROW];
+unsigned long sim_flash_writes[SIM_FLASH_WORDS / SIM_FLASH_ROW];
+unsigned long sim_conversions;
+unsigned long sim_wakes;
+
+unsigned int (*sim_adc_source)(unsigned char channel);
+
+static const sim_step_t *script;        // Next scripted stimulus step
+static unsigned char inputs[3];         // Input pin levels of PORTA-C
+static bool comparators[2];             // Comparator output levels
+static unsigned int adc_values[32];     // Scripted ADC channel values
+
+static unsigned int tmr0_prescale;
+static unsigned int tmr1_prescale;
+static unsigned int tmr2_prescale;
+static unsigned int tmr2_postscale;
+static unsigned int adc_left;           // Cycles until the conversion ends
+static unsigned char adc_channel;       // Channel being converted
+static bool wdt_on;
+static uint64_t wdt_due;
+static unsigned int flash_latches[SIM_FLASH_ROW];
+
+static bool in_isr;
+static bool gie_off;                    // GIE clear in main code
+static uint64_t gie_off_since;
+
+static const unsigned char logged[4] = { SIM_LATA, SIM_LATB, SIM_LATC, SIM_PWM1CON };
+static unsigned char outputs[4];        // Last logged values
+static sim_edge_t *edge_log;
+static size_t edge_size;
+static size_t edge_count;
+
+static jmp_buf run_jump;
+static bool run_jump_set;
+static uint64_t run_deadline;
+
+static void advance(unsigned long cycles);
+
+// Print a failure message and stop the test program.
+void sim_fail(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "FAIL at cycle %llu: ", (unsigned long long)sim_cycles);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+    exit(1);
+}
+
+// Record any output latch or PWM1CON changes since the last check.
+static void log_outputs(void)
+{
+    for(unsigned int i = 0; i != sizeof(logged); i++)
+    {
+        unsigned char value = sim_sfr[logged[i]];
+        if(value != outputs[i])
+        {
+            outputs[i] = value;
+            if(edge_log != NULL && edge_count != edge_size)
+            {
+                edge_log[edge_count].cycle = sim_cycles;
+                edge_log[edge_count].reg = logged[i];
+                edge_log[edge_count].value = value;
+                edge_count ++;
+            }
+        }
+    }
+}
+
+// Change an input pin, setting its interrupt-on-change flag on an enabled edge.
+static void set_input(unsigned char port, unsigned char bit, bool level)
+{
+    unsigned char mask = (unsigned char)(1 << bit);
+    bool old = (inputs[port] & mask) != 0;
+    if(old == level)
+    {
+        return;
+    }
+    inputs[port] ^= mask;
+    if(port == SIM_PORT_A || port == SIM_PORT_B)
+    {
+        unsigned char positive = sim_sfr[port == SIM_PORT_A ? SIM_IOCAP : SIM_IOCBP];
+        unsigned char negative = sim_sfr[port == SIM_PORT_A ? SIM_IOCAN : SIM_IOCBN];
+        if((level && (positive & mask)) || (!level && (negative & mask)))
+        {
+            sim_sfr[port == SIM_PORT_A ? SIM_IOCAF : SIM_IOCBF] |= mask;
+        }
+    }
+}
+
+// Change a comparator output, setting its interrupt flag on an enabled edge.
+static void set_comparator(unsigned char comparator, bool level)
+{
+    unsigned char con0 = (comparator == 1) ? SIM_CM1CON0 : SIM_CM2CON0;
+    unsigned char con1 = (comparator == 1) ? SIM_CM1CON1 : SIM_CM2CON1;
+    unsigned char out = (unsigned char)(1 << (comparator - 1));
+    if(comparators[comparator - 1] == level)
+    {
+        return;
+    }
+    comparators[comparator - 1] = level;
+    sim_sfr[con0] = level ? (sim_sfr[con0] | 0x40) : (sim_sfr[con0] & ~0x40);
+    sim_sfr[SIM_CMOUT] = level ? (sim_sfr[SIM_CMOUT] | out) : (sim_sfr[SIM_CMOUT] & ~out);
+    if((sim_sfr[con0] & 0x80) && ((level && (sim_sfr[con1] & 0x80)) || (!level && (sim_sfr[con1] & 0x40))))
+    {
+        sim_sfr[SIM_PIR2] |= (comparator == 1) ? PIR2_C1IF : PIR2_C2IF;
+    }
+}
+
+// Apply one scripted stimulus step.
+static void apply(const sim_step_t *step)
+{
+    switch(step->kind)
+    {
+        case SIM_BUTTON:
+            sim_button(step->a, step->b != 0);
+            break;
+        case SIM_PIN:
+            set_input(step->a >> 3, step->a & 7, step->b != 0);
+            break;
+        case SIM_ADC:
+            adc_values[step->a & 31] = step->b;
+            break;
+        case SIM_COMPARATOR:
+            set_comparator(step->a, step->b != 0);
+            break;
+    }
+}
+
+static void apply_script(void)
+{
+    while(script != NULL && script->kind != SIM_END && script->cycle <= sim_cycles)
+    {
+        apply(script);
+        script ++;
+    }
+}
+
+// ADC conversion time: 11.5 TAD plus the start-up cycle.
+static unsigned int adc_conversion_cycles(void)
+{
+    static const unsigned char tad_quarters[8] = { 2, 8, 32, 48, 4, 16, 64, 48 };
+    return (tad_quarters[(sim_sfr[SIM_ADCON1] >> 4) & 7] * 23 / 8 + 1);
+}
+
+static void adc_finish(void)
+{
+    unsigned int value = sim_adc_source ? sim_adc_source(adc_channel) : adc_values[adc_channel];
+    if(adc_channel == ADC_TEMPERATURE && !(sim_sfr[SIM_FVRCON] & FVRCON_TSEN))
+    {
+        value = 0;              // Indicator off
+    }
+    if(value > 1023)
+    {
+        value = 1023;
+    }
+    if(sim_sfr[SIM_ADCON1] & 0x80)      // ADFM: right justified
+    {
+        sim_sfr[SIM_ADRESH] = (unsigned char)(value >> 8);
+        sim_sfr[SIM_ADRESL] = (unsigned char)value;
+    }
+    else
+    {
+        sim_sfr[SIM_ADRESH] = (unsigned char)(value >> 2);
+        sim_sfr[SIM_ADRESL] = (unsigned char)(value << 6);
+    }
+    sim_sfr[SIM_ADCON0] &= (unsigned char)~ADCON0_GO;
+    sim_sfr[SIM_PIR1] |= PIR1_ADIF;
+    sim_conversions ++;
+}
+
+// Erase a row, load a write latch or write the latches to a row (CPU stalls).
+static void flash_operation(void)
+{
+    unsigned int address = (sim_sfr[SIM_PMADRL] | (sim_sfr[SIM_PMADRH] << 8)) & (SIM_FLASH_WORDS - 1);
+    unsigned int row = address & ~(SIM_FLASH_ROW - 1);
+    unsigned char con = sim_sfr[SIM_PMCON1];
+    sim_sfr[SIM_PMCON1] &= (unsigned char)~PMCON1_WR;
+    if(!(con & PMCON1_WREN) || (con & PMCON1_CFGS))
+    {
+        return;
+    }
+    if(con & PMCON1_FREE)
+    {
+        for(unsigned int i = 0; i != SIM_FLASH_ROW; i++)
+        {
+            sim_flash[row + i] = 0x3FFF;
+        }
+        sim_flash_erases[row / SIM_FLASH_ROW] ++;
+    }
+    else
+    {
+        flash_latches[address & (SIM_FLASH_ROW - 1)] = (sim_sfr[SIM_PMDATL] | (sim_sfr[SIM_PMDATH] << 8)) & 0x3FFF;
+        if(con & PMCON1_LWLO)
+        {
+            return;             // Latch loaded, no stall
+        }
+        for(unsigned int i = 0; i != SIM_FLASH_ROW; i++)
+        {
+            sim_flash[row + i] &= flash_latches[i];     // Programming clears bits
+            flash_latches[i] = 0x3FFF;
+        }
+        sim_flash_writes[row / SIM_FLASH_ROW] ++;
+    }
+    for(unsigned long i = 0; i != SIM_FLASH_CYCLES; i++)
+    {
+        advance(0);             // Peripherals keep running while the CPU stalls
+    }
+}
+
+// Advance the peripheral models by one instruction cycle.
+static void tick(void)
+{
+    sim_cycles ++;
+    apply_script();
+
+    // TMR0: Fosc/4 clock through the prescaler (OPTION_REG PSA, PS)
+    unsigned char option = sim_sfr[SIM_OPTION_REG];
+    if(!(option & 0x20))
+    {
+        unsigned int ratio = (option & 0x08) ? 1 : (2U << (option & 7));
+        if(++tmr0_prescale >= ratio)
+        {
+            tmr0_prescale = 0;
+            if(++sim_sfr[SIM_TMR0] == 0)
+            {
+                sim_sfr[SIM_INTCON] |= INTCON_TMR0IF;
+                if((sim_sfr[SIM_ADCON2] >> 4) == 0b0011 && (sim_sfr[SIM_ADCON0] & ADCON0_ADON))
+                {
+                    sim_sfr[SIM_ADCON0] |= ADCON0_GO;   // Auto-conversion trigger
+                }
+            }
+        }
+    }
+
+    // TMR1: Fosc/4 (1 count) or Fosc (4 counts) per cycle through the prescaler
+    unsigned char t1con = sim_sfr[SIM_T1CON];
+    if(t1con & 0x01)
+    {
+        unsigned int source = t1con >> 6;
+        unsigned int ratio = 1U << ((t1con >> 4) & 3);
+        tmr1_prescale += (source == 0) ? 1 : (source == 1) ? 4 : 0;
+        while(tmr1_prescale >= ratio)
+        {
+            tmr1_prescale -= ratio;
+            if(++sim_sfr[SIM_TMR1L] == 0 && ++sim_sfr[SIM_TMR1H] == 0)
+            {
+                sim_sfr[SIM_PIR1] |= PIR1_TMR1IF;
+            }
+        }
+    }
+
+    // TMR2: prescaler, PR2 period match and postscaler
+    static const unsigned char ratios[4] = { 1, 4, 16, 64 };
+    unsigned char t2con = sim_sfr[SIM_T2CON];
+    if(t2con & 0x04)
+    {
+        if(++tmr2_prescale >= ratios[t2con & 3])
+        {
+            tmr2_prescale = 0;
+            if(sim_sfr[SIM_TMR2] == sim_sfr[SIM_PR2])
+            {
+                sim_sfr[SIM_TMR2] = 0;
+                if(++tmr2_postscale > ((t2con >> 3) & 15U))
+                {
+                    tmr2_postscale = 0;
+                    sim_sfr[SIM_PIR1] |= PIR1_TMR2IF;
+                }
+            }
+            else
+            {
+                sim_sfr[SIM_TMR2] ++;
+            }
+        }
+    }
+
+    // PWM1: the output is high from each TMR2 period start until TMR2, with
+    // the prescaler count as its fraction, reaches the 10-bit duty cycle. The
+    // PWM1OUT bit shows the output level.
+    unsigned char pwm1con = sim_sfr[SIM_PWM1CON];
+    if((pwm1con & PWM1CON_EN) && (t2con & 0x04))
+    {
+        unsigned int ratio = ratios[t2con & 3];
+        unsigned int duty = ((unsigned int)sim_sfr[SIM_PWM1DCH] << 2) | (sim_sfr[SIM_PWM1DCL] >> 6);
+        bool high = (sim_sfr[SIM_TMR2] * ratio + tmr2_prescale) * 4 < duty * ratio;
+        sim_sfr[SIM_PWM1CON] = high ? (pwm1con | PWM1CON_OUT) : (pwm1con & ~PWM1CON_OUT);
+    }
+
+    // ADC: GO starts a conversion of the selected channel
+    if(adc_left != 0)
+    {
+        if(--adc_left == 0)
+        {
+            adc_finish();
+        }
+    }
+    else if((sim_sfr[SIM_ADCON0] & (ADCON0_GO | ADCON0_ADON)) == (ADCON0_GO | ADCON0_ADON))
+    {
+        adc_channel = (sim_sfr[SIM_ADCON0] >> 2) & 31;
+        adc_left = adc_conversion_cycles();
+    }
+
+    // Program memory reads and writes
+    unsigned char pmcon1 = sim_sfr[SIM_PMCON1];
+    if(pmcon1 & PMCON1_RD)
+    {
+        unsigned int address = (sim_sfr[SIM_PMADRL] | (sim_sfr[SIM_PMADRH] << 8)) & (SIM_FLASH_WORDS - 1);
+        unsigned int data = (pmcon1 & PMCON1_CFGS) ? 0x3FFF : sim_flash[address];
+        sim_sfr[SIM_PMDATL] = (unsigned char)data;
+        sim_sfr[SIM_PMDATH] = (unsigned char)(data >> 8);
+        sim_sfr[SIM_PMCON1] &= (unsigned char)~PMCON1_RD;
+    }
+    if(pmcon1 & PMCON1_WR)
+    {
+        flash_operation();
+    }
+
+    // PLL lock, watchdog and derived interrupt flags
+    if(sim_cycles >= SIM_PLL_LOCK_CYCLES)
+    {
+        sim_sfr[SIM_OSCSTAT] |= OSCSTAT_PLLRDY;
+    }
+    bool wdt = (sim_sfr[SIM_WDTCON] & 0x01) != 0;
+    if(wdt && !wdt_on)
+    {
+        wdt_due = sim_cycles + (SIM_CYCLES_PER_MS << ((sim_sfr[SIM_WDTCON] >> 1) & 31));
+    }
+    wdt_on = wdt;
+    if(wdt_on && sim_cycles >= wdt_due)
+    {
+        sim_fail("watchdog time-out reset while running");
+    }
+    if(sim_sfr[SIM_IOCAF] | sim_sfr[SIM_IOCBF])
+    {
+        sim_sfr[SIM_INTCON] |= INTCON_IOCIF;
+    }
+    else
+    {
+        sim_sfr[SIM_INTCON] &= (unsigned char)~INTCON_IOCIF;
+    }
+    if(sim_sfr[SIM_UIR] & sim_sfr[SIM_UIE])
+    {
+        sim_sfr[SIM_PIR2] |= PIR2_USBIF;
+    }
+
+    log_outputs();
+}
+
+// True if an enabled interrupt is waiting.
+static bool interrupt_pending(void)
+{
+    unsigned char intcon = sim_sfr[SIM_INTCON];
+    if((intcon & INTCON_TMR0IE) && (intcon & INTCON_TMR0IF))
+    {
+        return (true);
+    }
+    if((intcon & INTCON_IOCIE) && (intcon & INTCON_IOCIF))
+    {
+        return (true);
+    }
+    return ((intcon & INTCON_PEIE) && ((sim_sfr[SIM_PIE1] & sim_sfr[SIM_PIR1]) || (sim_sfr[SIM_PIE2] & sim_sfr[SIM_PIR2])));
+}
+
+// Run the interrupt service routine with GIE cleared, as the hardware does.
+static void interrupt(void)
+{
+    uint64_t start = sim_cycles;
+    in_isr = true;
+    sim_sfr[SIM_INTCON] &= (unsigned char)~INTCON_GIE;
+    for(unsigned int i = 0; i != SIM_ISR_ENTRY_CYCLES; i++)
+    {
+        tick();
+    }
+    UBMP4_isr();
+    for(unsigned int i = 0; i != SIM_ISR_EXIT_CYCLES; i++)
+    {
+        tick();
+    }
+    sim_sfr[SIM_INTCON] |= INTCON_GIE;
+    in_isr = false;
+
+    uint64_t length = sim_cycles - start;
+    sim_isr_cycles += length;
+    sim_isr_count ++;
+    if(length > sim_isr_max)
+    {
+        sim_isr_max = length;
+    }
+}
+
+// Run a number of main code instruction cycles, taking interrupts between
+// them, so interrupts stretch the elapsed time as they do on the PIC. A count
+// of 0 advances one cycle without taking interrupts (CPU stalled).
+static void advance(unsigned long cycles)
+{
+    if(cycles == 0)
+    {
+        tick();
+        return;
+    }
+    while(cycles-- != 0)
+    {
+        tick();
+        if(in_isr)
+        {
+            continue;
+        }
+        bool gie = (sim_sfr[SIM_INTCON] & INTCON_GIE) != 0;
+        if(!gie && !gie_off)
+        {
+            gie_off_since = sim_cycles;
+        }
+        else if(gie && gie_off && sim_cycles - gie_off_since > sim_gie_off_max)
+        {
+            sim_gie_off_max = sim_cycles - gie_off_since;
+        }
+        gie_off = !gie;
+        if(gie && interrupt_pending())
+        {
+            interrupt();
+        }
+        if(run_jump_set && sim_cycles >= run_deadline)
+        {
+            longjmp(run_jump, 1);
+        }
+    }
+}
+
+// Each basic block of device code compiled with -fsanitize-coverage=trace-pc
+// costs SIM_BLOCK_CYCLES.
+__attribute__((no_sanitize_coverage)) void __sanitizer_cov_trace_pc(void)
+{
+    advance(SIM_BLOCK_CYCLES);
+}
+
+volatile unsigned char *sim_access(unsigned char reg)
+{
+    log_outputs();
+    advance(SIM_ACCESS_CYCLES);
+    sim_access_count[reg] ++;
+    if(reg <= SIM_PORTC)
+    {
+        // Output pins read their latch, digital input pins their level, and
+        // analog input pins read 0
+        unsigned char tris = sim_sfr[SIM_TRISA + reg];
+        unsigned char ansel = sim_sfr[SIM_ANSELA + reg];
+        unsigned char pins = inputs[reg];
+        if(reg == SIM_PORTA)
+        {
+            tris |= 0b00001000;         // RA3 is input only
+        }
+        sim_sfr[reg] = (sim_sfr[SIM_LATA + reg] & ~tris) | (pins & tris & ~ansel);
+    }
+    return (&sim_sfr[reg]);
+}
+
+void sim_delay(unsigned long cycles)
+{
+    sim_delay_cycles += cycles;
+    advance(cycles);
+}
+
+void sim_nop(void)
+{
+    advance(1);
+}
+
+// SLEEP: the oscillator stops, so the timers stop, and time jumps to the next
+// stimulus step or watchdog time-out until IOC, a comparator edge or the WDT
+// wakes the CPU. An enabled interrupt flag wakes it even with GIE clear.
+void sim_sleep(void)
+{
+    advance(1);
+    sim_sfr[SIM_STATUS] |= STATUS_NTO;
+    sim_sfr[SIM_STATUS] &= (unsigned char)~STATUS_NPD;
+    uint64_t start = sim_cycles;
+    while(1)
+    {
+        unsigned char intcon = sim_sfr[SIM_INTCON];
+        if((intcon & INTCON_IOCIE) && (sim_sfr[SIM_IOCAF] | sim_sfr[SIM_IOCBF]))
+        {
+            break;
+        }
+        if(sim_sfr[SIM_PIE2] & sim_sfr[SIM_PIR2] & (PIR2_C1IF | PIR2_C2IF))
+        {
+            break;
+        }
+        uint64_t next = UINT64_MAX;
+        if(script != NULL && script->kind != SIM_END)
+        {
+            next = script->cycle;
+        }
+        if(wdt_on && wdt_due < next)
+        {
+            next = wdt_due;
+        }
+        if(next == UINT64_MAX)
+        {
+            sim_fail("SLEEP with no wake-up source");
+        }
+        if(next > sim_cycles)
+        {
+            sim_cycles = next;
+        }
+        apply_script();
+        if(wdt_on && sim_cycles >= wdt_due)
+        {
+            sim_sfr[SIM_STATUS] &= (unsigned char)~STATUS_NTO;  // WDT wake-up
+            wdt_due = sim_cycles + (SIM_CYCLES_PER_MS << ((sim_sfr[SIM_WDTCON] >> 1) & 31));
+            break;
+        }
+    }
+    sim_sleep_cycles += sim_cycles - start;
+    gie_off_since += sim_cycles - start;    // Asleep doesn't count as masked
+    sim_wakes ++;
+    tick();                     // Update IOCIF before the next instruction
+}
+
+// RESET(): end sim_run_main, or fail if the device resets outside of it.
+void sim_device_reset(void)
+{
+    if(run_jump_set)
+    {
+        longjmp(run_jump, 2);
+    }
+    sim_fail("RESET instruction");
+}
+
+void sim_reset(void)
+{
+    memset((void *)sim_sfr, 0, sizeof(sim_sfr));
+    sim_sfr[SIM_TRISA] = 0xFF;
+    sim_sfr[SIM_TRISB] = 0xFF;
+    sim_sfr[SIM_TRISC] = 0xFF;
+    sim_sfr[SIM_ANSELA] = 0b00010000;
+    sim_sfr[SIM_ANSELB] = 0b00110000;
+    sim_sfr[SIM_ANSELC] = 0b11001111;
+    sim_sfr[SIM_WPUA] = 0b00111000;
+    sim_sfr[SIM_WPUB] = 0b11110000;
+    sim_sfr[SIM_OPTION_REG] = 0xFF;
+    sim_sfr[SIM_PR2] = 0xFF;
+    sim_sfr[SIM_STATUS] = STATUS_NTO | STATUS_NPD;
+    sim_sfr[SIM_OSCSTAT] = 0b00000001;
+    for(unsigned int i = 0; i != SIM_FLASH_WORDS; i++)
+    {
+        sim_flash[i] = 0x3FFF;
+    }
+    for(unsigned int i = 0; i != SIM_FLASH_ROW; i++)
+    {
+        flash_latches[i] = 0x3FFF;
+    }
+    memset(sim_flash_erases, 0, sizeof(sim_flash_erases));
+    memset(sim_flash_writes, 0, sizeof(sim_flash_writes));
+    memset(sim_access_count, 0, sizeof(sim_access_count));
+    memset(adc_values, 0, sizeof(adc_values));
+    inputs[0] = inputs[1] = inputs[2] = 0xFF;   // Pull-ups hold inputs high
+    comparators[0] = comparators[1] = false;
+    sim_cycles = sim_isr_cycles = sim_isr_max = sim_isr_count = 0;
+    sim_delay_cycles = sim_sleep_cycles = sim_gie_off_max = 0;
+    sim_conversions = sim_wakes = 0;
+    tmr0_prescale = tmr1_prescale = tmr2_prescale = tmr2_postscale = 0;
+    adc_left = 0;
+    wdt_on = false;
+    in_isr = false;
+    gie_off = true;
+    gie_off_since = 0;
+    script = NULL;
+    sim_adc_source = NULL;
+    for(unsigned int i = 0; i != sizeof(logged); i++)
+    {
+        outputs[i] = sim_sfr[logged[i]];
+    }
+    edge_log = NULL;
+    edge_count = 0;
+}
+
+void sim_script(const sim_step_t *steps)
+{
+    script = steps;
+    apply_script();
+}
+
+// Idle in main code (interrupts still run) until virtual time reaches a cycle.
+void sim_run_until(uint64_t cycle)
+{
+    while(sim_cycles < cycle)
+    {
+        advance(1);
+    }
+}
+
+void sim_run(uint64_t cycles)
+{
+    sim_run_until(sim_cycles + cycles);
+}
+
+// Run a main() function for a number of cycles. Returns false if the program
+// executed RESET() first.
+bool sim_run_main(int (*main_function)(void), uint64_t cycles)
+{
+    run_deadline = sim_cycles + cycles;
+    int reason = setjmp(run_jump);
+    if(reason == 0)
+    {
+        run_jump_set = true;
+        main_function();
+        sim_fail("main() returned");
+    }
+    run_jump_set = false;
+    in_isr = false;             // The deadline is only checked in main code
+    return (reason == 1);
+}
+
+void sim_log(sim_edge_t *log, size_t size)
+{
+    log_outputs();
+    edge_log = log;
+    edge_size = size;
+    edge_count = 0;
+}
+
+size_t sim_log_count(void)
+{
+    log_outputs();
+    return (edge_count);
+}
+
+void sim_button(unsigned char button, bool pressed)
+{
+    static const unsigned char pins[5] = { 0 * 8 + 3, 1 * 8 + 4, 1 * 8 + 5, 1 * 8 + 6, 1 * 8 + 7 };
+    if(button < 5)
+    {
+        set_input(pins[button] >> 3, pins[button] & 7, !pressed);
+    }
+}
+
+void sim_pin(unsigned char port, unsigned char bit, bool level)
+{
+    set_input(port, bit, level);
+}
+
+void sim_adc(unsigned char channel, unsigned int value)
+{
+    adc_values[channel & 31] = value;
+}
+
+void sim_comparator(unsigned char comparator, bool level)
+{
+    set_comparator(comparator, level);
+}
+
+/*
+ * Inline assembly interpreter. The asm() lines of a function are collected
+ * until its final "goto" and then run with cycle-exact timing: one cycle per
+ * instruction, two for a goto, and a skipped instruction runs as a NOP. Only
+ * the instructions used by ws_send() are understood, and C variables named in
+ * the assembly must be registered with sim_asm_symbol.
+ */
+#define ASM_LINES   160
+#define ASM_SYMBOLS 8
+#define ASM_BASE    0x2000          // Linear address of the first symbol
+
+static const char *asm_lines[ASM_LINES];
+static unsigned int asm_count;
+
+static struct
+{
+    const char *name;
+    volatile unsigned char *address;
+    size_t size;
+    unsigned int linear;
+} asm_symbols[ASM_SYMBOLS];
+static unsigned int asm_symbol_count;
+
+void sim_asm_symbol(const char *name, volatile void *address, size_t size)
+{
+    unsigned int linear = ASM_BASE;
+    for(unsigned int i = 0; i != asm_symbol_count; i++)
+    {
+        if(strcmp(asm_symbols[i].name, name) == 0)
+        {
+            asm_symbols[i].address = address;
+            asm_symbols[i].size = size;
+            return;
+        }
+        linear = asm_symbols[i].linear + ((asm_symbols[i].size + 0xFF) & ~0xFFU);
+    }
+    if(asm_symbol_count == ASM_SYMBOLS)
+    {
+        sim_fail("too many asm symbols");
+    }
+    asm_symbols[asm_symbol_count].name = name;
+    asm_symbols[asm_symbol_count].address = address;
+    asm_symbols[asm_symbol_count].size = size;
+    asm_symbols[asm_symbol_count].linear = linear;
+    asm_symbol_count ++;
+}
+
+static unsigned int asm_symbol(const char *name, size_t length)
+{
+    for(unsigned int i = 0; i != asm_symbol_count; i++)
+    {
+        if(strlen(asm_symbols[i].name) == length && strncmp(asm_symbols[i].name, name, length) == 0)
+        {
+            return (i);
+        }
+    }
+    sim_fail("asm symbol %.*s is not registered", (int)length, name);
+}
+
+// Map a linear data address (FSR or symbol) to host memory.
+static volatile unsigned char *asm_memory(unsigned int linear)
+{
+    for(unsigned int i = 0; i != asm_symbol_count; i++)
+    {
+        if(linear >= asm_symbols[i].linear && linear < asm_symbols[i].linear + asm_symbols[i].size)
+        {
+            return (asm_symbols[i].address + (linear - asm_symbols[i].linear));
+        }
+    }
+    sim_fail("asm access to unmapped address 0x%04X", linear);
+}
+
+// Parse a literal: a number, low(_sym) or high(_sym).
+static unsigned int asm_literal(const char *text)
+{
+    if(strncmp(text, "low(", 4) == 0 || strncmp(text, "high(", 5) == 0)
+    {
+        bool high = text[0] == 'h';
+        const char *name = strchr(text, '(') + 1;
+        unsigned int linear = asm_symbols[asm_symbol(name, strcspn(name, ")"))].linear;
+        return (high ? linear >> 8 : linear & 0xFF);
+    }
+    return ((unsigned int)strtoul(text, NULL, 0) & 0xFF);
+}
+
+// Resolve a file register operand: an SFR name or BANKMASK(_sym) variable.
+static volatile unsigned char *asm_file(const char *text, unsigned int *fsr0)
+{
+    static unsigned char fsr0l, fsr0h;
+    if(strncmp(text, "BANKMASK(", 9) == 0)
+    {
+        text += 9;
+    }
+    size_t length = strcspn(text, "),");
+    if(strncmp(text, "LATC", length) == 0 && length == 4)
+    {
+        return (&sim_sfr[SIM_LATC]);
+    }
+    if(strncmp(text, "INDF0", length) == 0 && length == 5)
+    {
+        return (asm_memory(*fsr0));
+    }
+    if(strncmp(text, "FSR0L", length) == 0 && length == 5)
+    {
+        fsr0l = (unsigned char)*fsr0;
+        return (&fsr0l);
+    }
+    if(strncmp(text, "FSR0H", length) == 0 && length == 5)
+    {
+        fsr0h = (unsigned char)(*fsr0 >> 8);
+        return (&fsr0h);
+    }
+    if(text[0] == '_')
+    {
+        return (asm_symbols[asm_symbol(text, length)].address);
+    }
+    sim_fail("asm operand %s is not modelled", text);
+}
+
+static void asm_run(void)
+{
+    unsigned int w = 0;
+    unsigned int fsr0 = 0;
+    bool carry = false;
+    bool zero = false;
+    bool skip = false;
+    unsigned int pc = 0;
+
+    while(pc != asm_count)
+    {
+        const char *line = asm_lines[pc++];
+        char op[8];
+        size_t length = strcspn(line, " :");
+        if(line[length] == ':')
+        {
+            continue;           // Label
+        }
+        if(length >= sizeof(op))
+        {
+            sim_fail("asm instruction %s is not modelled", line);
+        }
+        memcpy(op, line, length);
+        op[length] = 0;
+        const char *operand = line + length + (line[length] == ' ');
+        const char *comma = strchr(operand, ',');
+
+        if(skip)
+        {
+            skip = false;
+            advance(1);         // Skipped instruction runs as a NOP
+            continue;
+        }
+        if(strcmp(op, "nop") == 0 || strcmp(op, "banksel") == 0)
+        {
+        }
+        else if(strcmp(op, "movlw") == 0)
+        {
+            w = asm_literal(operand);
+        }
+        else if(strcmp(op, "addlw") == 0)
+        {
+            unsigned int sum = w + asm_literal(operand);
+            carry = sum > 0xFF;
+            w = sum & 0xFF;
+            zero = (w == 0);
+        }
+        else if(strcmp(op, "movwf") == 0)
+        {
+            if(strncmp(operand, "FSR0L", 5) == 0)
+            {
+                fsr0 = (fsr0 & 0xFF00) | w;
+            }
+            else if(strncmp(operand, "FSR0H", 5) == 0)
+            {
+                fsr0 = (fsr0 & 0x00FF) | (w << 8);
+            }
+            else
+            {
+                *asm_file(operand, &fsr0) = (unsigned char)w;
+            }
+        }
+        else if(strcmp(op, "movf") == 0 || strcmp(op, "addwf") == 0 || strcmp(op, "incf") == 0 || strcmp(op, "rlf") == 0)
+        {
+            bool to_w = comma != NULL && comma[1] == 'w';
+            unsigned int value;
+            bool fsr_high = strncmp(operand, "FSR0H", 5) == 0;
+            volatile unsigned char *file = fsr_high ? NULL : asm_file(operand, &fsr0);
+            unsigned int data = fsr_high ? fsr0 >> 8 : *file;
+            if(op[0] == 'm')
+            {
+                value = data;
+                zero = (value == 0);
+            }
+            else if(op[0] == 'a')
+            {
+                value = data + w;
+                carry = value > 0xFF;
+                value &= 0xFF;
+                zero = (value == 0);
+            }
+            else if(op[0] == 'i')
+            {
+                value = (data + 1) & 0xFF;
+                zero = (value == 0);
+            }
+            else
+            {
+                value = ((data << 1) | carry) & 0xFF;
+                carry = (data & 0x80) != 0;
+            }
+            if(to_w)
+            {
+                w = value;
+            }
+            else if(fsr_high)
+            {
+                fsr0 = (fsr0 & 0x00FF) | (value << 8);
+            }
+            else
+            {
+                *file = (unsigned char)value;
+            }
+        }
+        else if(strcmp(op, "addfsr") == 0)
+        {
+            fsr0 = (fsr0 + asm_literal(comma + 1)) & 0xFFFF;
+        }
+        else if(strcmp(op, "bsf") == 0 || strcmp(op, "bcf") == 0)
+        {
+            volatile unsigned char *file = asm_file(operand, &fsr0);
+            unsigned char mask = (unsigned char)(1 << atoi(comma + 1));
+            *file = (op[1] == 's') ? (*file | mask) : (*file & ~mask);
+            log_outputs();      // Pin changes at this cycle
+        }
+        else if(strcmp(op, "btfss") == 0 || strcmp(op, "btfsc") == 0)
+        {
+            if(strncmp(operand, "STATUS", 6) != 0)
+            {
+                sim_fail("asm bit test of %s is not modelled", operand);
+            }
+            int bit = atoi(comma + 1);
+            bool set = (bit == 0) ? carry : (bit == 2) ? zero : false;
+            skip = (op[4] == 's') ? set : !set;
+        }
+        else if(strcmp(op, "goto") == 0)
+        {
+            unsigned int target = 0;
+            while(target != asm_count && !(strncmp(asm_lines[target], operand, strlen(operand)) == 0 && asm_lines[target][strlen(operand)] == ':'))
+            {
+                target ++;
+            }
+            if(target == asm_count)
+            {
+                sim_fail("asm label %s not found", operand);
+            }
+            pc = target;
+            advance(1);
+        }
+        else
+        {
+            sim_fail("asm instruction %s is not modelled", line);
+        }
+        advance(1);
+    }
+}
+
+void sim_asm(const char *line)
+{
+    if(asm_count == ASM_LINES)
+    {
+        sim_fail("asm function too long");
+    }
+    asm_lines[asm_count++] = line;
+    if(strncmp(line, "goto ", 5) == 0)
+    {
+        asm_run();
+        asm_count = 0;
+    }
+}
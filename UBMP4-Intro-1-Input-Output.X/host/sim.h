@@ -0,0 +1,152 @@
+/*==============================================================================
+ File: sim.h                            Host simulator for UBMP4.c
+
+ Simulated PIC16F1459 for building and testing the UBMP4 functions on a Linux
+ host. Every SFR access made through the host xc.h calls sim_access(), which
+ advances virtual time, runs the timer, ADC, flash and interrupt models, and
+ calls UBMP4_isr() whenever an enabled interrupt is pending and GIE is set.
+
+ Virtual time is counted in instruction cycles (Fosc / 4, 12 MHz). It is a
+ cost model rather than an instruction-accurate simulation: each SFR access
+ costs SIM_ACCESS_CYCLES, each basic block of device code (counted by
+ -fsanitize-coverage=trace-pc) costs SIM_BLOCK_CYCLES, interrupts cost
+ SIM_ISR_ENTRY_CYCLES + SIM_ISR_EXIT_CYCLES on top of the ISR body, and the
+ __delay_ macros advance exactly the number of cycles they would spin for.
+ Inline assembly (the WS2812 sender) is interpreted instruction by
+ instruction, so its timing is exact.
+==============================================================================*/
+
+#ifndef SIM_H
+#define SIM_H
+
+#include    <stdbool.h>
+#include    <stddef.h>
+#include    <stdint.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+
+// Cost model (instruction cycles)
+#define SIM_ACCESS_CYCLES       1   // Each SFR read or write
+#define SIM_BLOCK_CYCLES        4   // Each basic block of device C code
+#define SIM_ISR_ENTRY_CYCLES    12  // Interrupt latency and context save
+#define SIM_ISR_EXIT_CYCLES     4   // Context restore and RETFIE
+#define SIM_CYCLES_PER_MS       12000UL
+#define SIM_CYCLES_PER_US       12UL
+
+// Peripheral model timing (instruction cycles)
+#define SIM_PLL_LOCK_CYCLES     (2 * SIM_CYCLES_PER_MS) // PLL lock after reset
+#define SIM_FLASH_CYCLES        (2 * SIM_CYCLES_PER_MS) // Row erase or write
+#define SIM_FLASH_WORDS         8192
+#define SIM_FLASH_ROW           32
+
+// SFR file. 16-bit registers are stored low byte first, so TMR1, ADRES, PMADR
+// and PMDAT can be read as words starting at their low byte.
+enum sim_register
+{
+    SIM_PORTA, SIM_PORTB, SIM_PORTC, SIM_LATA, SIM_LATB, SIM_LATC, SIM_TRISA,
+    SIM_TRISB, SIM_TRISC, SIM_ANSELA, SIM_ANSELB, SIM_ANSELC, SIM_WPUA,
+    SIM_WPUB, SIM_IOCAP, SIM_IOCAN, SIM_IOCAF, SIM_IOCBP, SIM_IOCBN, SIM_IOCBF,
+    SIM_OPTION_REG, SIM_INTCON, SIM_PIR1, SIM_PIE1, SIM_PIR2, SIM_PIE2,
+    SIM_OSCCON, SIM_OSCSTAT, SIM_ACTCON, SIM_ADCON0, SIM_ADCON1, SIM_ADCON2,
+    SIM_ADRESL, SIM_ADRESH, SIM_TMR0, SIM_TMR1L, SIM_TMR1H, SIM_TMR2, SIM_PR2,
+    SIM_T1CON, SIM_T1GCON, SIM_T2CON, SIM_PWM1CON, SIM_PWM1DCH, SIM_PWM1DCL,
+    SIM_PWM2CON, SIM_PWM2DCH, SIM_PWM2DCL, SIM_FVRCON, SIM_CM1CON0,
+    SIM_CM1CON1, SIM_CM2CON0, SIM_CM2CON1, SIM_CMOUT, SIM_DACCON0,
+    SIM_DACCON1, SIM_WDTCON, SIM_STATUS, SIM_PCON, SIM_PMCON1, SIM_PMCON2,
+    SIM_PMADRL, SIM_PMADRH, SIM_PMDATL, SIM_PMDATH, SIM_UCON, SIM_UCFG,
+    SIM_USTAT, SIM_UIR, SIM_UIE, SIM_UADDR, SIM_UEP0, SIM_UEP1, SIM_UEP2,
+    SIM_UEP3, SIM_UEIR, SIM_UFRML, SIM_UFRMH, SIM_BORCON, SIM_VREGCON,
+    SIM_REGISTERS
+};
+
+// Pushbutton numbers for sim_button (same numbering as BUTTON_SW1-5)
+#define SIM_SW1     0
+#define SIM_SW2     1
+#define SIM_SW3     2
+#define SIM_SW4     3
+#define SIM_SW5     4
+
+// Port numbers for sim_pin
+#define SIM_PORT_A  0
+#define SIM_PORT_B  1
+#define SIM_PORT_C  2
+
+// Scripted stimulus. A script is an array of steps sorted by time, ended by a
+// step of kind SIM_END. Steps are applied as soon as virtual time reaches them,
+// including while the device is asleep.
+enum sim_kind
+{
+    SIM_END,
+    SIM_BUTTON,                 // a = button number, b = 1 pressed, 0 released
+    SIM_PIN,                    // a = port * 8 + bit, b = input level
+    SIM_ADC,                    // a = ADC channel number (0-31), b = 10-bit value
+    SIM_COMPARATOR              // a = comparator 1 or 2, b = output level
+};
+
+typedef struct
+{
+    uint64_t cycle;             // Virtual time to apply the step
+    unsigned char kind;
+    unsigned char a;
+    unsigned int b;
+} sim_step_t;
+
+// Output log entry: an output latch or PWM1CON value that changed. PWM1CON's
+// PWM1OUT bit follows the PWM1 output, which drives RC5 while PWM1OE is set.
+typedef struct
+{
+    uint64_t cycle;
+    unsigned char reg;          // SIM_LATA, SIM_LATB, SIM_LATC or SIM_PWM1CON
+    unsigned char value;        // New value
+} sim_edge_t;
+
+// SFR file and simulated program memory
+extern volatile unsigned char sim_sfr[SIM_REGISTERS];
+extern unsigned int sim_flash[SIM_FLASH_WORDS];
+
+// Virtual time and statistics
+extern uint64_t sim_cycles;             // Instruction cycles since reset
+extern uint64_t sim_isr_cycles;         // Cycles spent in UBMP4_isr
+extern uint64_t sim_isr_max;            // Longest single interrupt
+extern uint64_t sim_isr_count;          // Interrupts taken
+extern uint64_t sim_delay_cycles;       // Cycles blocked in __delay_ macros
+extern uint64_t sim_sleep_cycles;       // Cycles asleep
+extern uint64_t sim_gie_off_max;        // Longest time with GIE clear in main code
+extern uint64_t sim_access_count[SIM_REGISTERS];    // SFR accesses per register
+extern unsigned long sim_flash_erases[SIM_FLASH_WORDS / SIM_FLASH_ROW];
+extern unsigned long sim_flash_writes[SIM_FLASH_WORDS / SIM_FLASH_ROW];
+extern unsigned long sim_conversions;   // ADC conversions completed
+extern unsigned long sim_wakes;         // Wake-ups from SLEEP
+
+// Optional models set up by a test
+extern unsigned int (*sim_adc_source)(unsigned char channel);   // Overrides SIM_ADC values
+
+// Set up and run
+void sim_reset(void);                   // Power-on reset of the whole model
+void sim_script(const sim_step_t *script);
+void sim_run(uint64_t cycles);          // Main code idles, interrupts run
+void sim_run_until(uint64_t cycle);
+bool sim_run_main(int (*main_function)(void), uint64_t cycles);
+void sim_log(sim_edge_t *log, size_t size); // Record output changes
+size_t sim_log_count(void);
+
+// Stimulus applied now
+void sim_button(unsigned char button, bool pressed);
+void sim_pin(unsigned char port, unsigned char bit, bool level);
+void sim_adc(unsigned char channel, unsigned int value);    // ANTIM (29) reads 0 until TSEN
+void sim_comparator(unsigned char comparator, bool level);
+
+// Used by the host xc.h
+volatile unsigned char *sim_access(unsigned char reg);
+void sim_delay(unsigned long cycles);
+void sim_nop(void);
+void sim_sleep(void);
+void sim_device_reset(void);
+void sim_asm(const char *line);
+void sim_asm_symbol(const char *name, volatile void *address, size_t size);
+
+// Test helpers
+void sim_fail(const char *format, ...) __attribute__((noreturn, format(printf, 1, 2)));
+
+#endif
@@ -0,0 +1,46 @@
+/*==============================================================================
+ File: test.h                           Host tests for UBMP4.c
+
+ Checks for the host test and benchmark programs. A test program includes
+ this file and then the type-rewritten build/UBMP4.c, so it can reach the
+ static functions and variables. Mark test functions HOST so they run in zero
+ virtual time: only the device code counts basic blocks. The device code's
+ unsigned int and long are uint16_t and uint32_t on the host (see Makefile),
+ so pass those types to its functions.
+==============================================================================*/
+
+#ifndef TEST_H
+#define TEST_H
+
+#include    <inttypes.h>
+#include    <math.h>
+
+#include    "sim.h"
+
+#define HOST    __attribute__((no_sanitize_coverage))
+
+static unsigned int test_checks;
+
+// Fail the test program if a condition is false.
+#define CHECK(condition) \
+    do { test_checks ++; if(!(condition)) sim_fail("%s:%d: CHECK(%s)", __FILE__, __LINE__, #condition); } while(0)
+
+// Fail the test program unless low <= value <= high, printing the value.
+#define CHECK_RANGE(value, low, high) \
+    do { double check_value = (double)(value); test_checks ++; \
+        if(!(check_value >= (double)(low) && check_value <= (double)(high))) \
+            sim_fail("%s:%d: %s = %g, expected %g to %g", __FILE__, __LINE__, #value, check_value, (double)(low), (double)(high)); \
+    } while(0)
+
+// Print a named result.
+#define REPORT(name, format, ...)   printf("  %-36s " format "\n", name, __VA_ARGS__)
+
+// Print the number of checks that passed.
+#define TEST_DONE() \
+    do { printf("%s: %u checks passed\n", __FILE__, test_checks); return (0); } while(0)
+
+// Cycles to milliseconds and microseconds
+#define SIM_MS(cycles)  ((double)(cycles) / SIM_CYCLES_PER_MS)
+#define SIM_US(cycles)  ((double)(cycles) / SIM_CYCLES_PER_US)
+
+#endif
@@ -0,0 +1,129 @@
+/*==============================================================================
+ File: test_adc_sampler.c               Host tests for the ADC sampler
+
+ Measures the background sampler's samples per second and the CPU fraction
+ its interrupts use, compared with blocking ADC_read_channel calls, and
+ checks that the double buffer keeps each sweep's results together.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+static const unsigned char channels[ADC_SAMPLER_SLOTS] = { ANQ1, ANH1, ANH2, ANTIM };
+
+// Every channel reads the number of the sweep it was converted in.
+HOST static unsigned int sweep_number(unsigned char channel)
+{
+    (void)channel;
+    return ((unsigned int)(sim_conversions / adc_count) & 1023);
+}
+
+HOST static void boot(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    ADC_config();
+}
+
+// Samples per second and interrupt CPU use for 1 to ADC_SAMPLER_SLOTS channels.
+HOST static void test_rate(void)
+{
+    for(unsigned char count = 1; count <= ADC_SAMPLER_SLOTS; count++)
+    {
+        boot();
+        ADC_sampler_start(channels, count, ADC_10BIT);
+        sim_run(10 * SIM_CYCLES_PER_MS);
+        unsigned long conversions = sim_conversions;
+        uint64_t isr = sim_isr_cycles;
+        uint64_t start = sim_cycles;
+        unsigned char sweeps = ADC_sweeps();
+        sim_run(1000 * SIM_CYCLES_PER_MS);
+        double seconds = SIM_MS(sim_cycles - start) / 1000;
+        double rate = (sim_conversions - conversions) / seconds;
+        double cpu = 100.0 * (sim_isr_cycles - isr) / (sim_cycles - start);
+        char name[40];
+        snprintf(name, sizeof(name), "sampler, %u channel%s", count, count == 1 ? "" : "s");
+        REPORT(name, "%6.0f samples/s, %.2f %% CPU (incl. tick)", rate, cpu);
+        CHECK_RANGE(rate, ADC_TRIGGER_HZ - 1, ADC_TRIGGER_HZ + 1);
+        unsigned char counted = ADC_sweeps() - sweeps;
+        unsigned long expected = (sim_conversions - conversions) / count;
+        CHECK(counted == (unsigned char)expected || counted == (unsigned char)(expected + 1));
+        CHECK_RANGE(cpu, 0, 10);
+        ADC_sampler_stop();
+    }
+
+    // ADC_read_channel blocks the CPU for its whole conversion
+    boot();
+    uint64_t start = sim_cycles;
+    ADC_read_channel(ANQ1);
+    REPORT("ADC_read_channel", "%6.1f us blocked per call", SIM_US(sim_cycles - start));
+}
+
+// Values read between two sweeps all come from the same sweep.
+HOST static void test_double_buffer(void)
+{
+    boot();
+    sim_adc_source = sweep_number;
+    ADC_sampler_start(channels, 3, ADC_10BIT);
+    unsigned long coherent = 0;
+    while(sim_cycles < 500 * SIM_CYCLES_PER_MS)
+    {
+        unsigned char sweeps = ADC_sweeps();
+        unsigned int a = ADC_get(0);
+        unsigned int b = ADC_get(1);
+        unsigned int c = ADC_get(2);
+        if(ADC_sweeps() == sweeps && sweeps != 0)
+        {
+            CHECK(a == b && b == c);
+            coherent ++;
+        }
+    }
+    CHECK(coherent > 1000);
+    ADC_sampler_stop();
+}
+
+// 8-bit results are ADRESH and 10-bit results are right justified. The ADC
+// is left as ADC_read expects when the sampler stops.
+HOST static void test_results(void)
+{
+    boot();
+    sim_adc(7, 0x2A5);
+    sim_adc(4, 0x15A);
+    ADC_sampler_start(channels, 2, ADC_10BIT);
+    sim_run(3 * TICK_CYCLES);
+    CHECK(ADC_get(0) == 0x2A5 && ADC_get(1) == 0x15A);
+    ADC_sampler_start(channels, 2, ADC_8BIT);
+    sim_run(3 * TICK_CYCLES);
+    CHECK(ADC_get(0) == 0x2A5 >> 2 && ADC_get(1) == 0x15A >> 2);
+    ADC_sampler_stop();
+    CHECK(!ADON && !ADFM);
+    CHECK(ADC_read_channel(ANQ1) == 0x2A5 >> 2);
+}
+
+// ADC_read_channel returns the sampler's result without touching the ADC.
+HOST static void test_read_while_sampling(void)
+{
+    boot();
+    sim_adc(7, 800);
+    sim_adc(4, 400);
+    ADC_sampler_start(channels, 2, ADC_10BIT);
+    sim_run(3 * TICK_CYCLES);
+    GIE = 0;                    // Any ADCON0 access now comes from the reads
+    uint64_t accesses = sim_access_count[SIM_ADCON0];
+    CHECK(ADC_read_channel(ANQ1) == 800 >> 2);
+    CHECK(ADC_read_channel(ANH1) == 400 >> 2);
+    CHECK(ADC_read_channel(ANH8) == 0);
+    CHECK(sim_access_count[SIM_ADCON0] == accesses);
+    GIE = 1;
+    ADC_sampler_stop();
+}
+
+HOST int main(void)
+{
+    test_rate();
+    test_double_buffer();
+    test_results();
+    test_read_while_sampling();
+    TEST_DONE();
+}
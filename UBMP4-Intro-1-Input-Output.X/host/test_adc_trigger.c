@@ -0,0 +1,115 @@
+/*==============================================================================
+ File: test_adc_trigger.c               Host tests for ADC auto-conversion
+
+ Times each conversion of the sampler against virtual time to check that the
+ ADCON2 TMR0 trigger samples exactly every TICK_CYCLES at 48 MHz, compares its
+ jitter with the software trigger while another interrupt source is busy, and
+ checks the stream ring buffer keeps the samples in order.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+#define SAMPLES 3000
+
+static uint64_t times[SAMPLES];
+static unsigned int samples;
+
+// Record the time of each conversion and return its sequence number.
+HOST static unsigned int timed_source(unsigned char channel)
+{
+    (void)channel;
+    if(samples != SAMPLES)
+    {
+        times[samples] = sim_cycles;
+    }
+    return (samples++ & 1023);
+}
+
+// Sample one channel for one second and return the worst period error (us).
+HOST static double sample_period(unsigned char trigger, const char *name)
+{
+    static const unsigned char channel = ANQ1;
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    LED_pwm_start();            // A second interrupt source competing with the tick
+    for(unsigned char led = 1; led <= 5; led++)
+    {
+        LED_set_duty(led, led * 50);
+    }
+    ADC_sampler_start(&channel, 1, ADC_10BIT);
+    ADC_trigger(trigger);
+    sim_run(5 * SIM_CYCLES_PER_MS);
+    samples = 0;
+    sim_adc_source = timed_source;
+    sim_run(1000 * SIM_CYCLES_PER_MS);
+    sim_adc_source = NULL;
+    ADC_sampler_stop();
+    LED_pwm_stop();
+
+    double mean = (double)(times[samples - 1] - times[0]) / (samples - 1);
+    double worst = 0;
+    for(unsigned int i = 1; i != samples; i++)
+    {
+        double error = fabs((double)(times[i] - times[i - 1]) - TICK_CYCLES);
+        worst = error > worst ? error : worst;
+    }
+    REPORT(name, "%.4f Hz, %.3f us worst period error", SIM_CYCLES_PER_MS * 1000.0 / mean, SIM_US(worst));
+    CHECK_RANGE(samples, 2929, 2930);
+    CHECK_RANGE(mean, TICK_CYCLES - 0.5, TICK_CYCLES + 0.5);
+    return (SIM_US(worst));
+}
+
+// The TMR0 trigger has no jitter, unlike the software trigger from the ISR.
+HOST static void test_period(void)
+{
+    double hardware = sample_period(ADC_TRIGGER_TMR0, "TMR0 trigger, BAM running");
+    double software = sample_period(ADC_TRIGGER_SOFTWARE, "software trigger, BAM running");
+    CHECK(hardware == 0);
+    CHECK(software > hardware);
+}
+
+// Streamed samples arrive in order, and a full ring counts overruns.
+HOST static void test_stream(void)
+{
+    static const unsigned char channels[2] = { ANQ1, ANH1 };
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    samples = 0;
+    sim_adc_source = timed_source;
+    ADC_sampler_start(channels, 2, ADC_10BIT);
+    ADC_trigger(ADC_TRIGGER_TMR0);
+    ADC_stream_start(1);
+
+    uint16_t sample;
+    unsigned int last = 0, count = 0;
+    while(sim_cycles < 200 * SIM_CYCLES_PER_MS)
+    {
+        while(ADC_stream_read(&sample))
+        {
+            CHECK(sample & 1);  // Odd conversions are list position 1
+            CHECK(count == 0 || sample == ((last + 2) & 1023));
+            last = sample;
+            count ++;
+        }
+    }
+    CHECK(ADC_stream_overruns() == 0);
+    CHECK_RANGE(count, 200 * ADC_TRIGGER_HZ / 2000 - 2, 200 * ADC_TRIGGER_HZ / 2000 + 2);
+
+    // Stop reading: the ring fills and later samples are dropped
+    sim_run(ADC_RING_SIZE * 2 * TICK_CYCLES + 20 * TICK_CYCLES);
+    CHECK_RANGE(ADC_stream_overruns(), 9, 11);
+    ADC_stream_stop();
+    CHECK(!ADC_stream_read(&sample));
+    ADC_sampler_stop();
+    sim_adc_source = NULL;
+}
+
+HOST int main(void)
+{
+    test_period();
+    test_stream();
+    TEST_DONE();
+}
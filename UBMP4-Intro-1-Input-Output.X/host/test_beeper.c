@@ -0,0 +1,197 @@
+/*==============================================================================
+ File: test_beeper.c                    Host tests for the tone generator
+
+ Records the BEEPER (LATA4) edges in virtual time to measure each tone's
+ frequency error and the interrupt cost per output edge, and checks tone
+ lengths, sequences, the two-voice mixer and the TONE_MAX_HZ clamp.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+#define BEEPER_MASK 0b00010000
+
+static sim_edge_t edges[40000];
+static size_t edge_count;
+
+HOST static void boot(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+}
+
+// Return the average frequency of the rising BEEPER edges, and their count.
+HOST static double edge_frequency(unsigned long *rising)
+{
+    bool level = false;
+    uint64_t first = 0, last = 0;
+    *rising = 0;
+    for(size_t i = 0; i != edge_count; i++)
+    {
+        if(edges[i].reg != SIM_LATA)
+        {
+            continue;
+        }
+        bool high = (edges[i].value & BEEPER_MASK) != 0;
+        if(high && !level)
+        {
+            first = (*rising == 0) ? edges[i].cycle : first;
+            last = edges[i].cycle;
+            (*rising) ++;
+        }
+        level = high;
+    }
+    return (*rising < 2 ? 0 : (*rising - 1) * 1000.0 * SIM_CYCLES_PER_MS / (last - first));
+}
+
+// Return the Fourier magnitude of the BEEPER output at a frequency, from the
+// output's piecewise constant level between edges.
+HOST static double edge_magnitude(double hz, uint64_t start, uint64_t end)
+{
+    double w = 2 * M_PI * hz / (1000.0 * SIM_CYCLES_PER_MS);
+    double re = 0, im = 0;
+    bool level = false;
+    uint64_t from = start;
+    for(size_t i = 0; i <= edge_count; i++)
+    {
+        uint64_t to = (i == edge_count) ? end : edges[i].cycle;
+        if(i != edge_count && edges[i].reg != SIM_LATA)
+        {
+            continue;
+        }
+        if(level && to > from)
+        {
+            re += (sin(w * to) - sin(w * from)) / w;
+            im += (cos(w * to) - cos(w * from)) / w;
+        }
+        from = to;
+        if(i != edge_count)
+        {
+            level = (edges[i].value & BEEPER_MASK) != 0;
+        }
+    }
+    return (sqrt(re * re + im * im) / (end - start));
+}
+
+// Frequency error and interrupt cost of single tones over one second.
+HOST static void test_frequency(void)
+{
+    static const unsigned int tones[] = { 100, 262, 440, 1000, 2093, 4000, 9000 };
+    double worst = 0;
+    boot();
+    uint64_t isr = sim_isr_cycles;
+    sim_run(1000 * SIM_CYCLES_PER_MS);
+    uint64_t tick_isr = sim_isr_cycles - isr;
+
+    for(unsigned int i = 0; i != sizeof(tones) / sizeof(tones[0]); i++)
+    {
+        boot();
+        sim_log(edges, sizeof(edges) / sizeof(edges[0]));
+        BEEPER_tone(tones[i], 0);
+        isr = sim_isr_cycles;
+        sim_run(1000 * SIM_CYCLES_PER_MS);
+        BEEPER_stop();
+        edge_count = sim_log_count();
+        unsigned long rising;
+        double hz = edge_frequency(&rising);
+        double error = 100.0 * fabs(hz - tones[i]) / tones[i];
+        double per_edge = (double)(sim_isr_cycles - isr - tick_isr) / (2 * rising);
+        char name[40];
+        snprintf(name, sizeof(name), "%u Hz tone", tones[i]);
+        REPORT(name, "%9.3f Hz, %.4f %% error, %.0f ISR cycles/edge", hz, error, per_edge);
+        worst = error > worst ? error : worst;
+        CHECK(!BEEPER_busy() && !TMR2IE);
+    }
+    CHECK_RANGE(worst, 0, 0.1);
+
+    // Cost of each TMR2 interrupt with one voice on
+    boot();
+    BEEPER_tone(440, 0);
+    isr = sim_isr_cycles;
+    sim_run(100 * SIM_CYCLES_PER_MS);
+    double per_interrupt = (double)(sim_isr_cycles - isr - tick_isr / 10) / (TONE_RATE / 10.0);
+    REPORT("TMR2 interrupt", "%.0f cycles, %.1f %% CPU at TONE_RATE", per_interrupt, 100.0 * per_interrupt * TONE_RATE / (1000.0 * SIM_CYCLES_PER_MS));
+    CHECK_RANGE(per_interrupt, 20, 250);
+    BEEPER_stop();
+}
+
+// Tones stop after their length, and sequences play each note for its length.
+HOST static void test_lengths(void)
+{
+    static const tone_step_t tune[] =
+    {
+        { NOTE_A4, 50 },
+        { NOTE_REST, 20 },
+        { NOTE_A5, 30 },
+        { NOTE_REST, 0 }
+    };
+    boot();
+    sim_log(edges, sizeof(edges) / sizeof(edges[0]));
+    BEEPER_tone(1000, 100);
+    sim_run(99 * SIM_CYCLES_PER_MS);
+    CHECK(BEEPER_busy());
+    sim_run(2 * SIM_CYCLES_PER_MS);
+    CHECK(!BEEPER_busy() && BEEPER == 0);
+    edge_count = sim_log_count();
+    unsigned long rising;
+    edge_frequency(&rising);
+    CHECK_RANGE(rising, 99, 101);
+
+    boot();
+    uint64_t start = sim_cycles;
+    BEEPER_play(tune);
+    sim_log(edges, sizeof(edges) / sizeof(edges[0]));
+    sim_run(50 * SIM_CYCLES_PER_MS);
+    edge_count = sim_log_count();
+    CHECK_RANGE(edge_frequency(&rising), 439, 441);
+    while(BEEPER_busy() && sim_cycles - start < 200 * SIM_CYCLES_PER_MS)
+    {
+        sim_run(SIM_CYCLES_PER_MS / 10);
+    }
+    REPORT("50 + 20 + 30 ms sequence", "%.1f ms", SIM_MS(sim_cycles - start));
+    CHECK_RANGE(SIM_MS(sim_cycles - start), 99, 102);
+}
+
+// Two voices are both present in the mixed output.
+HOST static void test_mixer(void)
+{
+    boot();
+    BEEPER_voice(0, 500, 0);
+    BEEPER_voice(1, 700, 0);
+    sim_run(10 * SIM_CYCLES_PER_MS);
+    uint64_t start = sim_cycles;
+    sim_log(edges, sizeof(edges) / sizeof(edges[0]));
+    sim_run(200 * SIM_CYCLES_PER_MS);
+    edge_count = sim_log_count();
+    double a = edge_magnitude(500, start, sim_cycles);
+    double b = edge_magnitude(700, start, sim_cycles);
+    double c = edge_magnitude(600, start, sim_cycles);
+    REPORT("mixer 500 + 700 Hz", "%.3f, %.3f (600 Hz: %.3f)", a, b, c);
+    CHECK(a > 0.1 && b > 0.1 && c < a / 10 && c < b / 10);
+    BEEPER_stop();
+}
+
+// Frequencies above TONE_MAX_HZ are clamped, not aliased to low tones.
+HOST static void test_clamp(void)
+{
+    boot();
+    sim_log(edges, sizeof(edges) / sizeof(edges[0]));
+    BEEPER_tone(15000, 0);
+    sim_run(100 * SIM_CYCLES_PER_MS);
+    edge_count = sim_log_count();
+    unsigned long rising;
+    double hz = edge_frequency(&rising);
+    REPORT("15000 Hz tone (clamped)", "%.1f Hz", hz);
+    CHECK_RANGE(hz, TONE_MAX_HZ - 10, TONE_MAX_HZ + 10);
+    BEEPER_stop();
+}
+
+HOST int main(void)
+{
+    test_frequency();
+    test_lengths();
+    test_mixer();
+    test_clamp();
+    TEST_DONE();
+}
@@ -0,0 +1,213 @@
+/*==============================================================================
+ File: test_boot.c                      Host boot time report
+
+ Times each boot phase in virtual time: the PLL lock wait in OSC_config,
+ UBMP4_config up to BOOT_CONFIG, and the Intro-1 program up to BOOT_LOOP, and
+ checks the BOOT_time timestamps against the simulator's clock. Then reports
+ the start-up cost of each peripheral that is brought up on first use, so a
+ subsystem added to the boot path shows up as a number, and compares eager
+ set-up before the main loop with set-up deferred to a TASK_once task.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+int16_t intro_main(void);              // Intro-1 main(), built as intro.o
+
+#define COUNT_CYCLES    16              // BOOT_time counts (TMR0 at 1:16)
+
+HOST static int intro(void)
+{
+    intro_main();
+    return (0);
+}
+
+// Reset the simulator and the device state that start-up depends on.
+HOST static void power_on(void)
+{
+    sim_reset();
+    boot_marked = 0;            // Device variables keep their values from the last run
+    boot_pll_spins = 0;
+    tick_count = 0;
+    adc_configured = false;
+    memset(tasks, 0, sizeof(tasks));
+}
+
+// Time the boot phases of the Intro-1 program.
+HOST static void test_phases(void)
+{
+    // The phases one call at a time, timed by the simulator
+    power_on();
+    OSC_config();
+    uint64_t osc = sim_cycles;
+    UBMP4_config();
+    uint64_t config = sim_cycles - osc;
+    printf("Boot phases\n");
+    REPORT("OSC_config (PLL lock)", "%8.1f us, %u wait loop passes", SIM_US(osc), BOOT_pll_wait());
+    REPORT("UBMP4_config", "%8.1f us", SIM_US(config));
+    CHECK_RANGE(osc, SIM_PLL_LOCK_CYCLES, SIM_PLL_LOCK_CYCLES + 50);
+    CHECK(BOOT_pll_wait() > 0);
+    CHECK_RANGE(SIM_US(config), 1, 100);
+
+    // BOOT_CONFIG counts from TMR0 = 0 near the start of UBMP4_config
+    CHECK(BOOT_time(BOOT_CONFIG) != 0xFFFF && BOOT_time(BOOT_LOOP) == 0xFFFF);
+    CHECK_RANGE(BOOT_time(BOOT_CONFIG) * COUNT_CYCLES, (double)config - 3 * COUNT_CYCLES, config);
+
+    // The whole program from reset to the first input poll
+    power_on();
+    CHECK(sim_run_main(intro, 10 * SIM_CYCLES_PER_MS));
+    unsigned int loop = BOOT_time(BOOT_LOOP);
+    REPORT("Intro-1 BOOT_CONFIG", "%8.1f us after TMR0 = 0", SIM_US(BOOT_time(BOOT_CONFIG) * COUNT_CYCLES));
+    REPORT("Intro-1 BOOT_LOOP", "%8.1f us after TMR0 = 0", SIM_US(loop * COUNT_CYCLES));
+    REPORT("Intro-1 reset to BOOT_LOOP", "%8.1f us", SIM_US(osc + loop * COUNT_CYCLES));
+    CHECK(loop != 0xFFFF && loop >= BOOT_time(BOOT_CONFIG));
+    CHECK_RANGE(SIM_US(loop * COUNT_CYCLES), 1, 100);
+    CHECK(BOOT_time(BOOT_USER) == 0xFFFF);
+
+    // Only the first mark of a phase counts
+    unsigned int first = BOOT_time(BOOT_CONFIG);
+    sim_run(SIM_CYCLES_PER_MS);
+    BOOT_mark(BOOT_CONFIG);
+    CHECK(BOOT_time(BOOT_CONFIG) == first);
+}
+
+// Subsystem bring-up calls, timed from the call to the return.
+HOST static void adc_first(void)
+{
+    ADC_read_channel(ANQ1);
+}
+
+HOST static void led_first(void)
+{
+    LED_pwm_start();
+}
+
+HOST static void beeper_first(void)
+{
+    BEEPER_tone(440, 0);
+}
+
+HOST static void ir_first(void)
+{
+    IR_rx_start();
+}
+
+HOST static void ws_first(void)
+{
+    WS_start();
+}
+
+HOST static void uart_first(void)
+{
+    UART_start();
+}
+
+HOST static void log_first(void)
+{
+    LOG_start();
+}
+
+HOST static void stop_all(void)
+{
+    LED_pwm_stop();
+    BEEPER_stop();
+    IR_rx_stop();
+    WS_stop();
+    UART_stop();
+}
+
+// Start-up cost of each subsystem on its first call and on a later call.
+HOST static void test_subsystems(void)
+{
+    static const struct
+    {
+        void (*start)(void);
+        const char *name;
+    } subsystems[] =
+    {
+        { adc_first, "ADC_read_channel (ADC_config)" },
+        { led_first, "LED_pwm_start" },
+        { beeper_first, "BEEPER_tone" },
+        { ir_first, "IR_rx_start" },
+        { ws_first, "WS_start" },
+        { uart_first, "UART_start" },
+        { log_first, "LOG_start" },
+    };
+    printf("Subsystem start-up, first call / later call\n");
+    for(unsigned int i = 0; i != sizeof(subsystems) / sizeof(subsystems[0]); i++)
+    {
+        power_on();
+        OSC_config();
+        UBMP4_config();
+        uint64_t start = sim_cycles;
+        subsystems[i].start();
+        uint64_t first = sim_cycles - start;
+        stop_all();
+        start = sim_cycles;
+        subsystems[i].start();
+        uint64_t later = sim_cycles - start;
+        stop_all();
+        REPORT(subsystems[i].name, "%8.1f us / %8.1f us", SIM_US(first), SIM_US(later));
+        CHECK(later <= first + 4);
+        CHECK_RANGE(SIM_US(first), 0, 500);
+    }
+
+    // The ADC is configured once, by its first user
+    power_on();
+    OSC_config();
+    UBMP4_config();
+    CHECK(!adc_configured && ANSELC == 0);
+    adc_first();
+    CHECK(adc_configured && ANSELC == PINMAP_ANSELC);
+}
+
+// Set-up code the Intro-1 program might add: a PWM LED and a tone.
+HOST static void program_setup(void)
+{
+    LED_pwm_start();
+    LED_set_duty(2, 128);
+    BEEPER_tone(1000, 50);
+    ADC_read_channel(ANQ1);
+}
+
+// Run a boot path with program_setup before the main loop or as a task.
+HOST static unsigned int boot_with_setup(bool deferred)
+{
+    power_on();
+    OSC_config();
+    UBMP4_config();
+    if(deferred)
+    {
+        TASK_once(program_setup, 0);
+    }
+    else
+    {
+        program_setup();
+    }
+    BOOT_mark(BOOT_LOOP);
+    TASK_run();
+    BOOT_mark(BOOT_USER);       // Set-up done either way
+    stop_all();
+    return (BOOT_time(BOOT_LOOP));
+}
+
+// Deferring set-up to a task moves its cost after the first input poll.
+HOST static void test_deferred(void)
+{
+    unsigned int eager = boot_with_setup(false);
+    unsigned int user = BOOT_time(BOOT_USER);
+    unsigned int deferred = boot_with_setup(true);
+    REPORT("set-up before the loop: BOOT_LOOP", "%8.1f us", SIM_US(eager * COUNT_CYCLES));
+    REPORT("set-up in TASK_once: BOOT_LOOP", "%8.1f us", SIM_US(deferred * COUNT_CYCLES));
+    REPORT("set-up in TASK_once: BOOT_USER", "%8.1f us", SIM_US(BOOT_time(BOOT_USER) * COUNT_CYCLES));
+    CHECK(deferred < eager && BOOT_time(BOOT_USER) > deferred);
+    CHECK_RANGE((double)BOOT_time(BOOT_USER), user - 10, user + 40);
+}
+
+HOST int main(void)
+{
+    test_phases();
+    test_subsystems();
+    test_deferred();
+    TEST_DONE();
+}
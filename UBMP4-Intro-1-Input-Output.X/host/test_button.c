@@ -0,0 +1,179 @@
+/*==============================================================================
+ File: test_button.c                    Host tests for the button debouncer
+
+ Replays pushbutton traces with contact bounce and measures the latency from
+ the first contact and the last bounce to each debounced event, and counts
+ missed and extra events. Also checks long-press and auto-repeat timing and
+ simultaneous presses of all five buttons.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+#define PRESSES     200
+#define MAX_STEPS   (PRESSES * 24 + 1)
+
+static sim_step_t script[MAX_STEPS];
+static unsigned int steps;
+static uint32_t random_state = 12345;
+
+typedef struct
+{
+    uint64_t cycle;             // First contact change
+    uint64_t settled;           // Last bounce
+    unsigned char button;
+    bool pressed;
+} contact_t;
+
+static contact_t contacts[PRESSES * 2];
+
+HOST static unsigned int random_below(unsigned int limit)
+{
+    random_state = random_state * 1103515245 + 12345;
+    return ((random_state >> 16) % limit);
+}
+
+// Add a contact change that bounces for up to 'bounces' extra transitions,
+// 30-900 us apart, before settling. Returns the time it settles.
+HOST static uint64_t add_bouncy(uint64_t cycle, unsigned char button, bool pressed, unsigned int bounces)
+{
+    unsigned int transitions = 1 + 2 * random_below(bounces / 2 + 1);
+    for(unsigned int i = 0; i != transitions; i++)
+    {
+        bool level = (i & 1) ? !pressed : pressed;
+        script[steps++] = (sim_step_t){ cycle, SIM_BUTTON, button, level };
+        cycle += 30 * SIM_CYCLES_PER_US + random_below(870) * SIM_CYCLES_PER_US;
+    }
+    return (cycle);
+}
+
+HOST static void boot(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    sim_run(50 * SIM_CYCLES_PER_MS);    // Debounce the released state
+    while(BUTTON_event() != BUTTON_NONE)
+        ;
+}
+
+// Bouncy presses of random buttons: each gives exactly one press and one
+// release event, within four samples after the contacts stop bouncing.
+HOST static void test_bounce(void)
+{
+    boot();
+    steps = 0;
+    uint64_t cycle = sim_cycles + 10 * SIM_CYCLES_PER_MS;
+    for(unsigned int i = 0; i != PRESSES; i++)
+    {
+        unsigned char button = (unsigned char)random_below(5);
+        contacts[i * 2] = (contact_t){ cycle, 0, button, true };
+        cycle = add_bouncy(cycle, button, true, 10);
+        contacts[i * 2].settled = script[steps - 1].cycle;
+        cycle += (40 + random_below(200)) * SIM_CYCLES_PER_MS;
+        contacts[i * 2 + 1] = (contact_t){ cycle, 0, button, false };
+        cycle = add_bouncy(cycle, button, false, 10);
+        contacts[i * 2 + 1].settled = script[steps - 1].cycle;
+        cycle += (40 + random_below(200)) * SIM_CYCLES_PER_MS;
+    }
+    script[steps] = (sim_step_t){ 0, SIM_END, 0, 0 };
+    sim_script(script);
+
+    // Main loop drains the queue and times each event against its contact
+    unsigned int next = 0, missed = 0, extra = 0;
+    double total = 0, worst = 0, worst_settled = 0;
+    while(sim_cycles < cycle + 50 * SIM_CYCLES_PER_MS)
+    {
+        unsigned char event = BUTTON_event();
+        if(event == BUTTON_NONE)
+        {
+            continue;
+        }
+        if(BUTTON_TYPE(event) == BUTTON_LONG || BUTTON_TYPE(event) == BUTTON_REPEAT)
+        {
+            continue;           // Holds longer than BUTTON_LONG_MS
+        }
+        bool pressed = BUTTON_TYPE(event) == BUTTON_PRESS;
+        while(next != PRESSES * 2 && (contacts[next].button != BUTTON_ID(event) || contacts[next].pressed != pressed))
+        {
+            missed ++;
+            next ++;
+        }
+        if(next == PRESSES * 2)
+        {
+            extra ++;
+            continue;
+        }
+        double latency = SIM_MS(sim_cycles - contacts[next].cycle);
+        total += latency;
+        worst = latency > worst ? latency : worst;
+        latency = SIM_MS(sim_cycles - contacts[next].settled);
+        worst_settled = latency > worst_settled ? latency : worst_settled;
+        next ++;
+    }
+    REPORT("bouncy presses and releases", "%u events, %u missed, %u extra", PRESSES * 2, missed + (PRESSES * 2 - next), extra);
+    REPORT("latency from first contact", "%.2f ms average, %.2f ms worst", total / (PRESSES * 2), worst);
+    REPORT("latency from last bounce", "%.2f ms worst", worst_settled);
+    CHECK(missed == 0 && next == PRESSES * 2 && extra == 0);
+    CHECK_RANGE(worst_settled, 0, 5 * BUTTON_SAMPLE_MS + 1);
+}
+
+// A held button gives BUTTON_LONG then BUTTON_REPEAT events on time.
+HOST static void test_hold(void)
+{
+    boot();
+    uint64_t press = sim_cycles;
+    sim_button(SIM_SW3, true);
+    uint64_t times[8];
+    unsigned char events[8];
+    unsigned int count = 0;
+    while(sim_cycles < press + (BUTTON_LONG_MS + 3 * BUTTON_REPEAT_MS + 20) * SIM_CYCLES_PER_MS && count != 8)
+    {
+        unsigned char event = BUTTON_event();
+        if(event != BUTTON_NONE)
+        {
+            times[count] = sim_cycles;
+            events[count++] = event;
+        }
+    }
+    sim_button(SIM_SW3, false);
+    CHECK(count == 5);
+    CHECK(events[0] == (BUTTON_PRESS | BUTTON_SW3) && events[1] == (BUTTON_LONG | BUTTON_SW3));
+    CHECK(events[2] == (BUTTON_REPEAT | BUTTON_SW3) && events[4] == (BUTTON_REPEAT | BUTTON_SW3));
+    CHECK_RANGE(SIM_MS(times[1] - times[0]), BUTTON_LONG_MS - 1, BUTTON_LONG_MS + 1);
+    CHECK_RANGE(SIM_MS(times[3] - times[2]), BUTTON_REPEAT_MS - 1, BUTTON_REPEAT_MS + 1);
+}
+
+// All five buttons pressed together give five press events and the state.
+HOST static void test_together(void)
+{
+    boot();
+    for(unsigned char button = 0; button != 5; button++)
+    {
+        sim_button(button, true);
+    }
+    sim_run(5 * BUTTON_SAMPLE_MS * SIM_CYCLES_PER_MS);
+    CHECK(BUTTON_state() == 0b00011111);
+    unsigned char seen = 0;
+    unsigned char event;
+    while((event = BUTTON_event()) != BUTTON_NONE)
+    {
+        CHECK(BUTTON_TYPE(event) == BUTTON_PRESS);
+        seen |= (unsigned char)(1 << BUTTON_ID(event));
+    }
+    CHECK(seen == 0b00011111);
+    for(unsigned char button = 0; button != 5; button++)
+    {
+        sim_button(button, false);
+    }
+    sim_run(5 * BUTTON_SAMPLE_MS * SIM_CYCLES_PER_MS);
+    CHECK(BUTTON_state() == 0);
+}
+
+HOST int main(void)
+{
+    test_bounce();
+    test_hold();
+    test_together();
+    TEST_DONE();
+}
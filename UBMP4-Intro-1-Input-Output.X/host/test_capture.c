@@ -0,0 +1,262 @@
+/*==============================================================================
+ File: test_capture.c                   Host tests for the capture engine
+
+ Feeds square waves into comparator C1 as scripted edges at exact (fractional
+ cycle) times, and checks every published result against the wave. A result
+ may be off by the timestamp resolution plus the longest time an edge can
+ wait for the other interrupts, and no more. Sweeps the frequency up in both
+ modes to find the fastest wave measured without losing edges, and reports
+ the interrupt CPU it takes. Also checks that CAPTURE_read doesn't wait and
+ that CAPTURE_stop gives the input pin back.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+#define CHUNK       1024        // Script steps loaded at a time
+#define SLICE_US    100         // Results are read this often
+#define COUNT_CYCLES 16         // Instruction cycles per timestamp count
+
+// Worst errors of the results of one wave.
+typedef struct
+{
+    unsigned long results;
+    double lost;                // Periods not timed, fraction of the wave
+    double hz;                  // Worst frequency error, relative
+    double period;              // Worst period error, relative
+    double duty;                // Worst duty cycle error, percentage points
+    double allowed_hz;          // Largest frequency error allowed, relative
+    double allowed_duty;        // Largest duty error allowed, points
+    double cpu;                 // ISR CPU, percent
+} wave_t;
+
+// Boot and start capturing H2.
+HOST static void boot(unsigned char mode)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    CAPTURE_start(CAPTURE_H2, mode);
+}
+
+HOST static double worse(double error, double worst)
+{
+    error = fabs(error);
+    return (error > worst ? error : worst);
+}
+
+// Check a result against the wave. The timestamps can be off by a count
+// each, plus the longest interrupt an edge can wait behind.
+HOST static void check_result(wave_t *wave, const capture_t *result, unsigned char mode, double hz, double duty)
+{
+    double jitter = 1 + (double)sim_isr_max / COUNT_CYCLES;
+    wave->results ++;
+    CHECK(result->periods != 0 && result->time != 0);
+    if(result->periods == 0 || result->time == 0)
+    {
+        return;
+    }
+    double raw = result->periods * 750000.0 / result->time;
+    CHECK(fabs(CAPTURE_hz(result) - raw) <= 0.5 + raw * 1e-6);
+    double allowed;
+    if(mode == CAPTURE_GATED)
+    {
+        // One edge either way at each end of the gate
+        allowed = (2 + hz * jitter / 750000) / result->periods + 2 * jitter / result->time;
+    }
+    else
+    {
+        allowed = 2 * jitter / result->time;
+        double exact = 100 * result->high / (double)result->time;
+        CHECK(fabs(CAPTURE_duty(result) - exact) <= 0.5 + 1e-9);
+        double allowed_duty = 100 * 2 * jitter * result->periods / result->time;
+        wave->duty = worse(exact - 100 * duty, wave->duty);
+        wave->allowed_duty = allowed_duty > wave->allowed_duty ? allowed_duty : wave->allowed_duty;
+        double period = 4.0 * result->time / 3 / result->periods;
+        CHECK(fabs(CAPTURE_period_us(result) - period) <= 0.5 + 1e-9);
+        wave->period = worse((period - 1e6 / hz) * hz / 1e6, wave->period);
+    }
+    wave->hz = worse((raw - hz) / hz, wave->hz);
+    wave->allowed_hz = allowed > wave->allowed_hz ? allowed : wave->allowed_hz;
+}
+
+// Run a square wave into the comparator for some time, reading each result
+// as it comes. The first result of each mode can start part way through the
+// wave's first period (gated) and is skipped.
+HOST static wave_t run_wave(unsigned char mode, double hz, double duty, unsigned int ms)
+{
+    static sim_step_t steps[CHUNK + 1];
+    wave_t wave = { 0 };
+    boot(mode);
+    sim_run(SIM_CYCLES_PER_MS);
+    capture_t result;
+    CAPTURE_read(&result);
+    double period = SIM_CYCLES_PER_MS * 1000.0 / hz;
+    double start = (double)sim_cycles + 100;
+    uint64_t end = sim_cycles + ms * SIM_CYCLES_PER_MS;
+    uint64_t isr = sim_isr_cycles;
+    uint64_t begin = sim_cycles;
+    sim_isr_max = 0;
+    bool first = true;
+    uint64_t first_cycle = 0, last_cycle = 0;
+    unsigned long periods = 0;
+    unsigned long edge = 0;
+    while(sim_cycles < end)
+    {
+        unsigned int n;
+        for(n = 0; n != CHUNK; n++, edge++)
+        {
+            double at = start + (edge >> 1) * period + ((edge & 1) ? duty * period : 0);
+            steps[n] = (sim_step_t){ (uint64_t)ceil(at), SIM_COMPARATOR, 1, !(edge & 1) };
+        }
+        steps[n].kind = SIM_END;
+        sim_script(steps);
+        uint64_t last = steps[CHUNK - 1].cycle;
+        while(sim_cycles < last && sim_cycles < end)
+        {
+            uint64_t next = sim_cycles + SLICE_US * SIM_CYCLES_PER_US;
+            sim_run_until(next < last ? next : last);   // Don't run past the last step
+            if(CAPTURE_read(&result))
+            {
+                if(!first)
+                {
+                    check_result(&wave, &result, mode, hz, duty);
+                    periods += result.periods;
+                    last_cycle = sim_cycles;
+                }
+                else
+                {
+                    first_cycle = sim_cycles;
+                }
+                first = false;
+            }
+        }
+    }
+    sim_script(NULL);
+
+    // Reciprocal results time every period between the first and last one
+    // read, give or take what a read slice holds
+    double expected = (last_cycle - first_cycle) * hz / (SIM_CYCLES_PER_MS * 1000.0);
+    double slack = 2 * SLICE_US * hz / 1e6 + 1;
+    if(mode == CAPTURE_RECIPROCAL && wave.results != 0 && periods + slack < expected)
+    {
+        wave.lost = (expected - periods) / expected;
+    }
+    wave.cpu = 100.0 * (sim_isr_cycles - isr) / (sim_cycles - begin);
+    CAPTURE_stop();
+    return (wave);
+}
+
+// Every result is within the timestamp and interrupt latency error.
+HOST static bool accurate(const wave_t *wave)
+{
+    return (wave->results != 0 && wave->hz <= wave->allowed_hz + 1e-9 && wave->duty <= wave->allowed_duty + 1e-9);
+}
+
+// Reciprocal results follow the wave's frequency and duty cycle. Pulses
+// shorter than the interrupt latency are dropped rather than mistimed, so
+// results stay accurate, but only slower waves have every period timed.
+HOST static void test_reciprocal(void)
+{
+    static const double frequencies[] = { 10, 50, 440, 1000, 5000, 10000, 20000 };
+    static const double duties[] = { 0.25, 0.5, 0.75 };
+    printf("Reciprocal mode\n");
+    for(unsigned char f = 0; f != sizeof(frequencies) / sizeof(frequencies[0]); f++)
+    {
+        double worst_hz = 0, worst_duty = 0, worst_period = 0, worst_lost = 0;
+        unsigned long results = 0;
+        for(unsigned char d = 0; d != 3; d++)
+        {
+            wave_t wave = run_wave(CAPTURE_RECIPROCAL, frequencies[f], duties[d], frequencies[f] < 100 ? 600 : 250);
+            CHECK(accurate(&wave));
+            CHECK(frequencies[f] > 5000 || wave.lost == 0);
+            worst_lost = worse(wave.lost, worst_lost);
+            worst_hz = worse(wave.hz, worst_hz);
+            worst_period = worse(wave.period, worst_period);
+            worst_duty = worse(wave.duty, worst_duty);
+            results += wave.results;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "%.0f Hz", frequencies[f]);
+        REPORT(name, "%3lu results, %6.4f %% frequency, %6.4f %% period, %4.2f points duty worst error, %4.1f %% lost",
+            results, 100 * worst_hz, 100 * worst_period, worst_duty, 100 * worst_lost);
+    }
+}
+
+// Gated results count the wave's edges to within one at each end of the gate.
+HOST static void test_gated(void)
+{
+    static const double frequencies[] = { 1000, 5000, 12345, 30000 };
+    printf("Gated mode, %u ms gate\n", CAPTURE_GATE_MS);
+    for(unsigned char f = 0; f != sizeof(frequencies) / sizeof(frequencies[0]); f++)
+    {
+        wave_t wave = run_wave(CAPTURE_GATED, frequencies[f], 0.5, 5 * CAPTURE_GATE_MS + 50);
+        CHECK(wave.results >= 4);
+        CHECK(accurate(&wave));
+        char name[32];
+        snprintf(name, sizeof(name), "%.0f Hz", frequencies[f]);
+        REPORT(name, "%lu results, %7.4f %% worst error, %.1f %% ISR CPU", wave.results, 100 * wave.hz, wave.cpu);
+    }
+}
+
+// Fastest wave measured without losing edges: raise the frequency in 2%
+// steps until a period is lost or a result is off.
+HOST static double fastest(unsigned char mode, double from, double *cpu)
+{
+    double hz = from;
+    double good = 0;
+    for(;;)
+    {
+        wave_t wave = run_wave(mode, hz, 0.5, mode == CAPTURE_GATED ? 3 * CAPTURE_GATE_MS + 50 : 120);
+        if(!accurate(&wave) || wave.lost != 0)
+        {
+            return (good);
+        }
+        good = hz;
+        *cpu = wave.cpu;
+        hz *= 1.02;
+    }
+}
+
+HOST static void test_fastest(void)
+{
+    printf("Fastest wave measured, 50 %% duty\n");
+    double cpu;
+    double reciprocal = fastest(CAPTURE_RECIPROCAL, 10000, &cpu);
+    REPORT("reciprocal", "%.1f kHz, %.0f %% ISR CPU there", reciprocal / 1000, cpu);
+    CHECK_RANGE(reciprocal, 25000, 40000);      // UBMP4.h says about 30 kHz
+    double gated = fastest(CAPTURE_GATED, 40000, &cpu);
+    REPORT("gated", "%.1f kHz, %.0f %% ISR CPU there", gated / 1000, cpu);
+    CHECK_RANGE(gated, 50000, 80000);           // UBMP4.h says about 60 kHz
+}
+
+// CAPTURE_read doesn't wait for a result, and CAPTURE_stop gives the pin back.
+HOST static void test_read_stop(void)
+{
+    boot(CAPTURE_RECIPROCAL);
+    capture_t result;
+    uint64_t start = sim_cycles;
+    CHECK(!CAPTURE_read(&result));
+    uint64_t cycles = sim_cycles - start;
+    REPORT("CAPTURE_read, no result", "%llu cycles", (unsigned long long)cycles);
+    CHECK(cycles < 100);
+    CHECK(sim_sfr[SIM_ANSELC] & (1 << CAPTURE_H2));
+    CAPTURE_stop();
+    CHECK((sim_sfr[SIM_ANSELC] & (1 << CAPTURE_H2)) == 0);
+    CHECK(sim_sfr[SIM_CM1CON0] == 0 && sim_sfr[SIM_DACCON0] == 0);
+
+    // No wave: nothing is published, even after the gate time
+    boot(CAPTURE_RECIPROCAL);
+    sim_run(3 * CAPTURE_GATE_MS * SIM_CYCLES_PER_MS);
+    CHECK(!CAPTURE_read(&result));
+    CAPTURE_stop();
+}
+
+HOST int main(void)
+{
+    test_reciprocal();
+    test_gated();
+    test_fastest();
+    test_read_stop();
+    TEST_DONE();
+}
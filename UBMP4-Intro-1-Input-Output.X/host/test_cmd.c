@@ -0,0 +1,395 @@
+/*==============================================================================
+ File: test_cmd.c                       Host tests for the command protocol
+
+ Runs the host command library in command.c against CMD_poll, over the USB
+ SIE model in usb_host.h and over the software UART with the serial line
+ driven bit by bit on H2 and decoded from H1. The device main loop calls
+ CMD_poll every LOOP_US, and the PC reads replies once per 1 ms USB frame. Checks each operation's effect and result, the error
+ statuses, and the partial frame timeout, then benchmarks the round trip and
+ operation rate with one operation or a full frame of operations per frame,
+ and with one or two frames in flight.
+==============================================================================*/
+
+#include    "test.h"
+#include    "trace.h"
+#include    "build/UBMP4.c"
+#include    "usb_host.h"
+#include    "command.h"
+
+#define LOOP_US         50              // Device main loop period
+#define REPLY_MS        100             // Host reply timeout
+#define PC_READ_US      1000            // PC reads EP2 IN once per USB frame
+#define UART_BIT_CYCLES (4.0 * SIM_CYCLES_PER_MS * 1000 / TONE_RATE)   // 4 TMR2 interrupts
+
+// Frames must fit the device's two EP2 OUT buffers and its UART receive queue
+typedef char cmd_frame_too_large[(COMMAND_FRAME_BYTES > 2 * USB_RX_SIZE || COMMAND_FRAME_BYTES > 2 * UART_RX_SIZE) ? -1 : 1];
+typedef char cmd_table_size[(sizeof(cmd_table) / sizeof(cmd_table[0]) == CMD_OPCODES && CMD_TICK == CMD_OPCODES - 1) ? 1 : -1];
+
+// PC side of the USB serial port
+static unsigned char pc_rx[1024];
+static size_t pc_rx_head, pc_rx_tail;
+static uint64_t pc_next_read;           // Time of the PC's next EP2 IN read
+static unsigned long loops;             // Device main loop passes
+
+// One pass of the device main loop, with the PC reading EP2 IN each frame.
+HOST static void device_loop(void)
+{
+    unsigned char packet[64];
+    CMD_poll();
+    loops ++;
+    sim_run(LOOP_US * SIM_CYCLES_PER_US);
+    if(sim_cycles < pc_next_read)
+    {
+        return;
+    }
+    pc_next_read += PC_READ_US * SIM_CYCLES_PER_US;
+    int count;
+    while((count = bus_in(2, packet)) != NAK)
+    {
+        for(int i = 0; i != count; i++)
+        {
+            pc_rx[pc_rx_head++ % sizeof(pc_rx)] = packet[i];
+        }
+    }
+}
+
+// Send a frame in EP2 OUT packets, waiting while the device NAKs.
+HOST static bool usb_send(void *context, const unsigned char *bytes, size_t count)
+{
+    (void)context;
+    uint64_t start = sim_cycles;
+    while(count != 0)
+    {
+        unsigned char length = (unsigned char)(count < USB_RX_SIZE ? count : USB_RX_SIZE);
+        if(bus_out(2, PID_OUT, bytes, length))
+        {
+            bytes += length;
+            count -= length;
+        }
+        else if(sim_cycles - start > REPLY_MS * SIM_CYCLES_PER_MS)
+        {
+            return (false);
+        }
+        else
+        {
+            device_loop();
+        }
+    }
+    return (true);
+}
+
+// Return the next byte from EP2 IN, running the device until one arrives.
+HOST static int usb_receive(void *context)
+{
+    (void)context;
+    uint64_t start = sim_cycles;
+    while(pc_rx_tail == pc_rx_head)
+    {
+        if(sim_cycles - start > REPLY_MS * SIM_CYCLES_PER_MS)
+        {
+            return (-1);
+        }
+        device_loop();
+    }
+    return (pc_rx[pc_rx_tail++ % sizeof(pc_rx)]);
+}
+
+static const command_link_t usb_link = { NULL, usb_send, usb_receive, 1 };
+
+// Boot and enumerate, with the command state of earlier runs cleared.
+HOST static void attach(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    USB_stop();
+    usb_stream_sequence = 0;    // Device variables keep their values from the last run
+    usb_event_count = 0;
+    usb_streaming = false;
+    cmd_received = 0;
+    cmd_reply_waiting = false;
+    pc_rx_head = pc_rx_tail = 0;
+    usb_host_attach();
+    pc_next_read = sim_cycles;
+}
+
+// Run one batch over USB and return its reply.
+HOST static command_reply_t run_one(const command_batch_t *batch)
+{
+    command_reply_t reply = { 0xFF, 0, { 0 } };
+    CHECK(command_run(&usb_link, batch, 1, &reply) == 1);
+    return (reply);
+}
+
+// Each operation has its effect and returns its results.
+HOST static void test_operations(void)
+{
+    attach();
+    sim_adc(7, 0x2A5);          // Q1 is channel 7
+    sim_button(SIM_SW3, true);
+    sim_run(50 * SIM_CYCLES_PER_MS);
+
+    command_batch_t batch;
+    command_begin(&batch);
+    CHECK(command_out_write(&batch, OUT_D2 | OUT_H2, OUT_D2));
+    CHECK(command_adc_read(&batch, ANQ1));
+    CHECK(command_buttons(&batch));
+    CHECK(command_tick(&batch));
+    CHECK(command_led_level(&batch, 3, 64));
+    CHECK(batch.count == 5 && batch.results == 4);
+    uint16_t before = TICK_ms();
+    command_reply_t reply = run_one(&batch);
+    CHECK(reply.status == CMD_OK && reply.length == 4);
+    CHECK(reply.results[0] == 0x2A5 >> 2);
+    CHECK(reply.results[1] == 1 << BUTTON_SW3);
+    CHECK_RANGE((double)(reply.results[2] | reply.results[3] << 8), before, TICK_ms());
+    CHECK((sim_sfr[SIM_LATC] & (OUT_D2 | OUT_H2)) == OUT_D2);
+
+    // A pattern plays its frames on the LEDs once
+    static const unsigned char frames[] = { OUT_D2, OUT_D2 << 1, OUT_D2 << 2 };
+    command_begin(&batch);
+    CHECK(command_pattern(&batch, frames, 3, 10, 0));
+    reply = run_one(&batch);
+    CHECK(reply.status == CMD_OK && reply.length == 0);
+    CHECK(out_frames != NULL);
+    sim_run(50 * SIM_CYCLES_PER_MS);
+    CHECK(out_frames == NULL);
+
+    // A beep starts the tone on TMR2
+    command_begin(&batch);
+    CHECK(command_beep(&batch, 1000, 20));
+    reply = run_one(&batch);
+    CHECK(reply.status == CMD_OK && TMR2IE);
+    sim_run(40 * SIM_CYCLES_PER_MS);
+    CHECK(!TMR2IE);
+    LED_pwm_stop();
+    CHECK(toggle_errors == 0);
+}
+
+// Send raw frame bytes over USB and return the reply.
+HOST static command_reply_t run_raw(const unsigned char *frame, size_t length)
+{
+    command_reader_t reader;
+    command_reply_t reply = { 0xFF, 0, { 0 } };
+    command_reader_init(&reader);
+    CHECK(usb_send(NULL, frame, length));
+    int byte, result = 0;
+    while(result == 0 && (byte = usb_receive(NULL)) >= 0)
+    {
+        result = command_read(&reader, (unsigned char)byte, &reply);
+    }
+    CHECK(result == 1);
+    return (reply);
+}
+
+// Bad frames and operations get error statuses, and stop where they failed.
+HOST static void test_errors(void)
+{
+    attach();
+    command_batch_t batch;
+    unsigned char frame[COMMAND_FRAME_BYTES];
+
+    // A wrong check byte runs nothing
+    command_begin(&batch);
+    command_out_write(&batch, OUT_D3, OUT_D3);
+    size_t length = command_frame(&batch, frame);
+    frame[length - 1] ^= 0x55;
+    command_reply_t reply = run_raw(frame, length);
+    CHECK(reply.status == CMD_BAD_CHECK && reply.length == 0);
+    CHECK((sim_sfr[SIM_LATC] & OUT_D3) == 0);
+
+    // Operations before an unknown opcode run, with their results
+    command_begin(&batch);
+    command_buttons(&batch);
+    batch.ops[batch.length++] = CMD_OPCODES;
+    batch.count ++;
+    command_tick(&batch);
+    reply = run_raw(frame, command_frame(&batch, frame));
+    CHECK(reply.status == CMD_BAD_OPCODE && reply.length == 1);
+
+    // Missing and out of range arguments
+    static const unsigned char short_beep[] = { CMD_BEEP, 0xE8, 0x03 };
+    static const unsigned char bad_led[] = { CMD_LED_LEVEL, 6, 10 };
+    static const unsigned char bad_channel[] = { CMD_ADC_READ, 0x03 };
+    static const struct { const unsigned char *ops; unsigned char length; } bad[] =
+    {
+        { short_beep, sizeof(short_beep) }, { bad_led, sizeof(bad_led) }, { bad_channel, sizeof(bad_channel) }
+    };
+    for(unsigned int i = 0; i != sizeof(bad) / sizeof(bad[0]); i++)
+    {
+        command_begin(&batch);
+        memcpy(batch.ops, bad[i].ops, bad[i].length);
+        batch.length = bad[i].length;
+        reply = run_raw(frame, command_frame(&batch, frame));
+        CHECK(reply.status == CMD_BAD_ARGS && reply.length == 0);
+    }
+
+    // More results than a reply holds
+    command_begin(&batch);
+    for(unsigned int i = 0; i != CMD_FRAME_SIZE; i++)
+    {
+        batch.ops[batch.length++] = CMD_TICK;
+    }
+    reply = run_raw(frame, command_frame(&batch, frame));
+    CHECK(reply.status == CMD_REPLY_FULL && reply.length == CMD_FRAME_SIZE - 1);
+
+    // The library won't build a batch whose results don't fit
+    command_begin(&batch);
+    unsigned int ticks = 0;
+    while(command_tick(&batch))
+    {
+        ticks ++;
+    }
+    CHECK(ticks == (CMD_FRAME_SIZE - 1) / 2 && batch.count == ticks);
+
+    // A partial frame is dropped after CMD_TIMEOUT_MS, and the next one runs
+    command_begin(&batch);
+    command_out_write(&batch, OUT_D4, OUT_D4);
+    length = command_frame(&batch, frame);
+    CHECK(usb_send(NULL, frame, length - 1));
+    uint64_t start = sim_cycles;
+    while(sim_cycles - start < (CMD_TIMEOUT_MS + 5) * SIM_CYCLES_PER_MS)
+    {
+        device_loop();
+    }
+    CHECK(pc_rx_head == pc_rx_tail && (sim_sfr[SIM_LATC] & OUT_D4) == 0);
+    reply = run_raw(frame, length);
+    CHECK(reply.status == CMD_OK && (sim_sfr[SIM_LATC] & OUT_D4) == OUT_D4);
+    CHECK(toggle_errors == 0);
+}
+
+// Round trip and operation rate for a list of batches at a depth. Returns
+// operations per second.
+HOST static double benchmark(const char *name, command_batch_t *batches, size_t count, unsigned int depth)
+{
+    static command_reply_t replies[64];
+    command_link_t link = usb_link;
+    link.depth = depth;
+    unsigned long ops = 0;
+    for(size_t i = 0; i != count; i++)
+    {
+        ops += batches[i].count;
+    }
+    uint64_t start = sim_cycles;
+    unsigned long start_loops = loops;
+    size_t received = command_run(&link, batches, count, replies);
+    double ms = SIM_MS(sim_cycles - start);
+    REPORT(name, "%6.3f ms per frame, %7.0f operations/s, %5.1f loops per frame", ms / count, ops * 1000 / ms,
+        (double)(loops - start_loops) / count);
+    CHECK(received == count);
+    for(size_t i = 0; i != received; i++)
+    {
+        CHECK(replies[i].status == CMD_OK && replies[i].length == batches[i].results);
+    }
+    return (ops * 1000 / ms);
+}
+
+// USB round trips with single operations and full frames, 1 and 2 in flight.
+// The device holds one reply at a time, so a second frame in flight only
+// saves the PC's send time, and batching is what raises the operation rate.
+HOST static void test_benchmark(void)
+{
+    static command_batch_t single[64], full[64];
+    for(unsigned int i = 0; i != 64; i++)
+    {
+        command_begin(&single[i]);
+        command_buttons(&single[i]);
+        command_begin(&full[i]);
+        while(command_buttons(&full[i]) && command_out_write(&full[i], OUT_D5, (i & 1) ? OUT_D5 : 0))
+            ;
+    }
+    attach();
+    printf("USB round trips, %u us main loop, PC reads every %u us\n", LOOP_US, PC_READ_US);
+    double one = benchmark("1 operation per frame, depth 1", single, 64, 1);
+    double piped = benchmark("1 operation per frame, depth 2", single, 64, 2);
+    double batched = benchmark("full frames, depth 1", full, 64, 1);
+    benchmark("full frames, depth 2", full, 64, 2);
+    CHECK(full[0].count >= 10);
+    CHECK(piped >= 0.95 * one && batched >= 0.8 * full[0].count * one);
+    CHECK(toggle_errors == 0);
+}
+
+// Script 8N1 bytes on the H2 input at UART_BAUD, from a start time.
+HOST static size_t uart_script(sim_step_t *script, uint64_t start, const unsigned char *bytes, size_t count)
+{
+    size_t steps = 0;
+    for(size_t i = 0; i != count; i++)
+    {
+        unsigned int bits = (unsigned int)bytes[i] << 1 | 0x200;    // Start, data, stop
+        for(unsigned int bit = 0; bit != 10; bit++)
+        {
+            double at = start + (i * 12 + bit) * UART_BIT_CYCLES;  // 2 idle bits between bytes
+            script[steps++] = (sim_step_t){ (uint64_t)at, SIM_PIN, SIM_PORT_C * 8 + 1, (bits >> bit) & 1 };
+        }
+    }
+    script[steps] = (sim_step_t){ 0, SIM_END, 0, 0 };
+    return (steps);
+}
+
+// A frame sent to H2 is run and its reply is sent on H1.
+HOST static void test_uart(void)
+{
+    static sim_step_t script[COMMAND_FRAME_BYTES * 10 + 1];
+    static sim_edge_t edges[1024];
+    attach();
+    USB_stop();
+    sim_pin(SIM_PORT_C, 1, true);   // Idle line
+    UART_start();
+    sim_adc(7, 0x100);
+    sim_run(SIM_CYCLES_PER_MS);
+
+    command_batch_t batch;
+    unsigned char frame[COMMAND_FRAME_BYTES];
+    command_begin(&batch);
+    command_adc_read(&batch, ANQ1);
+    command_tick(&batch);
+    command_out_write(&batch, OUT_D2, OUT_D2);
+    size_t length = command_frame(&batch, frame);
+    uint64_t start = sim_cycles + SIM_CYCLES_PER_MS;
+    uart_script(script, start, frame, length);
+    sim_log(edges, sizeof(edges) / sizeof(edges[0]));
+    sim_script(script);
+
+    // The main loop runs CMD_poll until the reply has gone out
+    uint64_t sent = start + (uint64_t)(length * 12 * UART_BIT_CYCLES);
+    unsigned char bytes[COMMAND_FRAME_BYTES];
+    unsigned int framing = 0;
+    size_t count = 0;
+    uint64_t end = 0;
+    while(sim_cycles < sent + 100 * SIM_CYCLES_PER_MS)
+    {
+        device_loop();
+        count = trace_uart(edges, sim_log_count(), SIM_LATC, 0, true, UART_BIT_CYCLES, bytes, sizeof(bytes), &framing);
+        if(count == 7 && end == 0)
+        {
+            end = sim_cycles;
+        }
+    }
+    command_reader_t reader;
+    command_reply_t reply = { 0xFF, 0, { 0 } };
+    command_reader_init(&reader);
+    int result = 0;
+    for(size_t i = 0; i != count && result == 0; i++)
+    {
+        result = command_read(&reader, bytes[i], &reply);
+    }
+    printf("UART round trip at %u baud\n", UART_BAUD);
+    REPORT("3 operations, 9 + 7 bytes", "%6.2f ms from the first bit to the last", SIM_MS(end - start));
+    CHECK(length == 9);
+    CHECK(count == 7 && framing == 0 && result == 1);
+    CHECK(reply.status == CMD_OK && reply.length == 3 && reply.results[0] == 0x100 >> 2);
+    CHECK((sim_sfr[SIM_LATC] & OUT_D2) == OUT_D2);
+    double wire = SIM_MS(((length - 1) * 12 + 10 + 7 * 10) * UART_BIT_CYCLES);  // Bit times on the line
+    CHECK_RANGE(SIM_MS(end - start), 0.9 * wire, wire + 5);
+    sim_log(NULL, 0);
+    UART_stop();
+}
+
+HOST int main(void)
+{
+    test_operations();
+    test_errors();
+    test_benchmark();
+    test_uart();
+    TEST_DONE();
+}
@@ -0,0 +1,152 @@
+/*==============================================================================
+ File: test_filter.c                    Host tests for the ADC filters
+
+ Feeds the sampler a known level plus Gaussian noise and measures the noise
+ left in ADC_filtered as effective bits of resolution for each filter mode,
+ the bias of each mode, and the interrupt cycles per sample of each mode
+ (including the system tick, which runs in the same interrupt).
+ The simulator charges for basic blocks and SFR accesses, so the cost shows
+ the branches each mode takes (oversampling skips the peak tracking until a
+ value is ready) but not the PIC's multi-instruction 16-bit arithmetic. Also
+ checks that min/max tracking follows a sine wave's peaks.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+#define OUTPUTS     500         // Filtered values measured per mode
+#define SPACING     32          // Samples between measured values
+#define NOISE_LSB   0.5         // Input noise (rms, 10-bit LSBs)
+
+static const unsigned char channel = ANQ1;
+static double level;            // True input level (10-bit LSBs)
+static double sine_amplitude;
+static uint32_t random_state = 2024;
+
+HOST static double random_uniform(void)
+{
+    random_state = random_state * 1103515245 + 12345;
+    return (((random_state >> 8) & 0xFFFF) + 0.5) / 65536.0;
+}
+
+// Return Gaussian noise with an rms value of 1.
+HOST static double random_gaussian(void)
+{
+    return (sqrt(-2 * log(random_uniform())) * cos(2 * M_PI * random_uniform()));
+}
+
+// Quantize the level plus noise (and an optional slow sine) to 10 bits.
+HOST static unsigned int noisy_source(unsigned char ch)
+{
+    (void)ch;
+    double x = level + NOISE_LSB * random_gaussian();
+    x += sine_amplitude * sin(2 * M_PI * sim_conversions / 500.0);
+    x = floor(x + 0.5);
+    return ((unsigned int)(x < 0 ? 0 : x > 1023 ? 1023 : x));
+}
+
+HOST static void boot(unsigned char mode, unsigned char n)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    ADC_config();
+    sim_adc_source = noisy_source;
+    ADC_sampler_start(&channel, 1, ADC_10BIT);
+    ADC_filter(0, mode, n);
+    sim_run(64 * TICK_CYCLES);  // Fill the filter
+}
+
+// Interrupt cycles spent per sample over a number of samples.
+HOST static double isr_per_sample(unsigned int samples)
+{
+    uint64_t isr = sim_isr_cycles;
+    unsigned long conversions = sim_conversions;
+    sim_run(samples * TICK_CYCLES);
+    return ((double)(sim_isr_cycles - isr) / (sim_conversions - conversions));
+}
+
+// Resolution, bias and cost of each filter mode.
+HOST static void test_modes(void)
+{
+    static const struct
+    {
+        unsigned char mode, n, bits;
+        const char *name;
+    } modes[] =
+    {
+        { FILTER_NONE, 0, 10, "none" },
+        { FILTER_OVERSAMPLE, 1, 11, "oversample n=1 (11 bits)" },
+        { FILTER_OVERSAMPLE, 2, 12, "oversample n=2 (12 bits)" },
+        { FILTER_AVERAGE, 0, 10, "moving average" },
+        { FILTER_IIR, 2, 10, "IIR n=2" },
+        { FILTER_IIR, 4, 10, "IIR n=4" },
+    };
+    double enob[6], cost[6];
+    level = 0;
+    sine_amplitude = 0;
+    for(unsigned int m = 0; m != sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        boot(modes[m].mode, modes[m].n);
+        cost[m] = isr_per_sample(500);
+
+        // Values at several levels, so the noise is measured across codes
+        double scale = 1 << (modes[m].bits - 10);
+        double squares = 0, bias = 0;
+        for(unsigned int i = 0; i != OUTPUTS; i++)
+        {
+            if(i % 25 == 0)
+            {
+                level = 100 + 41.37 * (i / 25);
+                ADC_filter(0, modes[m].mode, modes[m].n);
+                sim_run(256 * TICK_CYCLES); // IIR state starts from 0
+            }
+            sim_run(SPACING * TICK_CYCLES);
+            double error = ADC_filtered(0) / scale - level;
+            squares += error * error;
+            bias += error;
+        }
+        double rms = sqrt(squares / OUTPUTS) * scale;   // Output LSBs
+        enob[m] = modes[m].bits - log2(rms * sqrt(12));
+        bias /= OUTPUTS;
+        char name[48];
+        snprintf(name, sizeof(name), "filter %s", modes[m].name);
+        REPORT(name, "%5.2f effective bits, %+.2f LSB bias, %3.0f ISR cycles/sample", enob[m], bias, cost[m]);
+        CHECK_RANGE(bias, -0.3, 0.3);
+    }
+    REPORT("input noise", "%.1f LSB rms on 10-bit samples", NOISE_LSB);
+    CHECK(enob[1] > enob[0] + 0.6 && enob[2] > enob[1] + 0.6);
+    CHECK(enob[2] > 10.5);
+    CHECK(enob[3] > enob[0] + 0.5);         // Limited by its 10-bit output
+    CHECK(enob[4] > enob[0] + 0.5 && enob[5] > enob[0] + 0.5);
+    for(unsigned int m = 1; m != sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        CHECK_RANGE(cost[m], cost[0] - 20, cost[0] + 20);
+    }
+}
+
+// Min and max follow a slow sine's peaks.
+HOST static void test_peaks(void)
+{
+    level = 512;
+    sine_amplitude = 200;
+    boot(FILTER_AVERAGE, 0);
+    ADC_peaks_reset(0);
+    sim_run(2000 * TICK_CYCLES);
+    REPORT("min/max of 512 +/- 200 sine", "%u to %u", ADC_min(0), ADC_max(0));
+    CHECK_RANGE(ADC_min(0), 308, 316);
+    CHECK_RANGE(ADC_max(0), 708, 716);
+    ADC_filter(0, FILTER_NONE, 0);
+    sim_run(2 * TICK_CYCLES);
+    CHECK(ADC_max(0) - ADC_min(0) < 20);    // Filter changes restart the peaks
+    sine_amplitude = 0;
+    ADC_sampler_stop();
+    sim_adc_source = NULL;
+}
+
+HOST int main(void)
+{
+    test_modes();
+    test_peaks();
+    TEST_DONE();
+}
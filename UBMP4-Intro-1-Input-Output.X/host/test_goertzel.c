@@ -0,0 +1,347 @@
+/*==============================================================================
+ File: test_goertzel.c                  Host tests for the Goertzel tone detector
+
+ Feeds synthetic tones plus Gaussian noise into ANH1 through the ADC sampler
+ and checks each block's magnitudes against a double-precision Goertzel of
+ the same 8-bit samples, including full-scale square waves that drive the
+ filter state to its largest values. Reports each bin's response to its
+ tone and to the tone 1.5 % off frequency, the detection accuracy of random tones at several noise levels, and
+ the cost of the filter steps per sample per bin. The simulator charges for
+ basic blocks and SFR accesses, so the cost shows the loop structure but not
+ the PIC's multi-instruction 32-bit multiplies. Also checks that a late
+ GOERTZEL_read throws away the broken block and the next one is whole.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+#define ANH1_CHANNEL    (ANH1 >> 2)     // ADC channel number for the source
+#define SAMPLE_HZ   ((double)ADC_TRIGGER_HZ / GOERTZEL_CHANNELS)
+#define SAMPLES_MAX 8192
+#define READ_US     5000        // GOERTZEL_read is called this often
+#define TRIALS      100         // Random tones per noise level
+
+static const unsigned int tones[GOERTZEL_BINS] = {
+#define TONE_HZ(hz) hz,
+    GOERTZEL_TONES(TONE_HZ)
+};
+
+static double tone_hz;          // Tone frequency (0 for none)
+static double amplitude;        // Peak amplitude, 8-bit counts
+static double phase;
+static double noise;            // Gaussian noise, 8-bit counts rms
+static bool square;             // Full-scale square wave instead of a sine
+static unsigned char samples[SAMPLES_MAX];  // 8-bit samples queued
+static unsigned int sample_count;
+static uint32_t random_state = 697;
+
+HOST static double random_uniform(void)
+{
+    random_state = random_state * 1103515245 + 12345;
+    return (((random_state >> 8) & 0xFFFF) + 0.5) / 65536.0;
+}
+
+HOST static double random_gaussian(void)
+{
+    return (sqrt(-2 * log(random_uniform())) * cos(2 * M_PI * random_uniform()));
+}
+
+// The input at the time of a conversion, as a 10-bit count. Each sample the
+// detector will queue is kept for the reference.
+HOST static unsigned int tone_source(unsigned char channel)
+{
+    if(channel != ANH1_CHANNEL)
+    {
+        return (0);
+    }
+    double t = (double)sim_cycles / (SIM_CYCLES_PER_MS * 1000.0);
+    double wave = sin(2 * M_PI * tone_hz * t + phase);
+    double level = 128 + (square ? (wave >= 0 ? 127.9 : -128) : amplitude * wave) + noise * random_gaussian();
+    unsigned int count = (unsigned int)floor(level * 4 + 0.5);
+    count = level < 0 ? 0 : count > 1023 ? 1023 : count;
+    if(goertzel_index != 0xFF && sample_count != SAMPLES_MAX)
+    {
+        samples[sample_count++] = (unsigned char)(count >> 2);
+    }
+    return (count);
+}
+
+// Double-precision Goertzel magnitude of a block of samples for a bin.
+HOST static double reference(const unsigned char *block, unsigned int bin)
+{
+    double k = GOERTZEL_KF(tones[bin]);
+    double coeff = 2 * cos(2 * M_PI * k / GOERTZEL_BLOCK);
+    double s1 = 0, s2 = 0;
+    for(unsigned int i = 0; i != GOERTZEL_BLOCK; i++)
+    {
+        double s = (block[i] - 128.0) + coeff * s1 - s2;
+        s2 = s1;
+        s1 = s;
+    }
+    return (sqrt(fmax(0, s1 * s1 + s2 * s2 - coeff * s1 * s2)));
+}
+
+// Boot with the sampler converting ANH1 and the detector started.
+HOST static void boot(void)
+{
+    static const unsigned char channel = ANH1;
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    sim_adc_source = tone_source;
+    ADC_sampler_start(&channel, 1, ADC_8BIT);
+    sample_count = 0;
+    CHECK(GOERTZEL_start(0));
+}
+
+HOST static void finish(void)
+{
+    GOERTZEL_stop();
+    ADC_sampler_stop();
+    sim_adc_source = NULL;
+}
+
+// Run until a block is complete, calling GOERTZEL_read every READ_US, and
+// return the queued samples it was made from. Adds the cycles spent in
+// GOERTZEL_read to *cycles.
+HOST static const unsigned char *next_block(uint16_t *magnitudes, uint64_t *cycles)
+{
+    for(;;)
+    {
+        sim_run(READ_US * SIM_CYCLES_PER_US);
+        uint64_t start = sim_cycles;
+        bool done = GOERTZEL_read(magnitudes);
+        *cycles += sim_cycles - start;
+        if(done)
+        {
+            // Samples still queued came after the block
+            unsigned int waiting = (goertzel_head - goertzel_tail) & (GOERTZEL_QUEUE_SIZE - 1);
+            CHECK(sample_count >= GOERTZEL_BLOCK + waiting);
+            return (&samples[sample_count - waiting - GOERTZEL_BLOCK]);
+        }
+    }
+}
+
+// Largest difference between the detector and the reference for a block, as
+// a fraction of the block's full-scale magnitude.
+HOST static double block_error(const uint16_t *magnitudes, const unsigned char *block)
+{
+    double worst = 0;
+    for(unsigned int bin = 0; bin != GOERTZEL_BINS; bin++)
+    {
+        double error = fabs(magnitudes[bin] - reference(block, bin)) / (128.0 * GOERTZEL_BLOCK / 2);
+        worst = error > worst ? error : worst;
+    }
+    return (worst);
+}
+
+// Each bin follows the reference, and reads about A * N / 2 for its tone.
+// Tones off frequency read lower, by sinc of the offset in bins: 1.5 % is
+// about half a bin.
+HOST static void test_response(void)
+{
+    uint16_t magnitudes[GOERTZEL_BINS];
+    uint64_t cycles = 0;
+    double worst = 0;
+    printf("Bins, %.1f samples/s, %u-sample blocks (%.1f Hz wide)\n", SAMPLE_HZ, GOERTZEL_BLOCK, SAMPLE_HZ / GOERTZEL_BLOCK);
+    for(unsigned int bin = 0; bin != GOERTZEL_BINS; bin++)
+    {
+        double gain[2];
+        for(unsigned char off = 0; off != 2; off++)
+        {
+            boot();
+            tone_hz = tones[bin] * (off ? 1.015 : 1);
+            amplitude = 64;
+            noise = 0;
+            phase = 1;
+            next_block(magnitudes, &cycles);    // The first block can start with old samples
+            const unsigned char *block = next_block(magnitudes, &cycles);
+            gain[off] = magnitudes[bin] / (amplitude * GOERTZEL_BLOCK / 2);
+            double error = block_error(magnitudes, block);
+            worst = error > worst ? error : worst;
+            for(unsigned int other = 0; other != GOERTZEL_BINS; other++)
+            {
+                CHECK(other == bin || magnitudes[other] < magnitudes[bin] / 2);
+            }
+            finish();
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "%u Hz (k = %.2f)", tones[bin], GOERTZEL_KF(tones[bin]));
+        double d = 0.015 * GOERTZEL_KF(tones[bin]);     // Bins off
+        double sinc = sin(M_PI * d) / (M_PI * d);
+        REPORT(name, "%.3f of A*N/2, %.3f at 1.5 %% high (sinc %.3f)", gain[0], gain[1], sinc);
+        CHECK_RANGE(gain[0], 0.97, 1.03);
+        CHECK_RANGE(gain[1], sinc - 0.03, sinc + 0.03);
+    }
+    REPORT("fixed point vs double", "%.5f of full scale worst difference", worst);
+    CHECK(worst < 0.002);
+}
+
+// Full-scale square waves, the largest state the filter can see, read the
+// same as the reference: nothing overflows.
+HOST static void test_full_scale(void)
+{
+    uint16_t magnitudes[GOERTZEL_BINS];
+    uint64_t cycles = 0;
+    double worst = 0;
+    square = true;
+    noise = 0;
+    for(unsigned int bin = 0; bin != GOERTZEL_BINS; bin++)
+    {
+        boot();
+        tone_hz = tones[bin];
+        next_block(magnitudes, &cycles);
+        for(unsigned char i = 0; i != 4; i++)
+        {
+            double error = block_error(magnitudes, next_block(magnitudes, &cycles));
+            worst = error > worst ? error : worst;
+        }
+        CHECK(magnitudes[bin] > 128 * GOERTZEL_BLOCK / 2);      // 4/pi of a sine
+        finish();
+    }
+    square = false;
+    REPORT("full-scale square waves", "%.5f of full scale worst difference", worst);
+    CHECK(worst < 0.002);
+}
+
+// Random tones (or none) at random phases, up to 1.5 % off frequency, with
+// noise. A tone is detected when its bin is the largest and above a threshold
+// of a quarter of its nominal magnitude.
+HOST static void test_detection(void)
+{
+    static const double sigmas[] = { 2, 8, 16, 32 };
+    uint16_t magnitudes[GOERTZEL_BINS];
+    uint64_t cycles = 0;
+    amplitude = 32;
+    unsigned int threshold = (unsigned int)(amplitude * GOERTZEL_BLOCK / 2 / 4);
+    printf("Detection, %.0f-count tones, %u trials, threshold %u\n", amplitude, TRIALS, threshold);
+    for(unsigned char s = 0; s != sizeof(sigmas) / sizeof(sigmas[0]); s++)
+    {
+        noise = sigmas[s];
+        unsigned int correct = 0, wrong = 0, missed = 0, false_alarms = 0, silent = 0;
+        boot();
+        for(unsigned int trial = 0; trial != TRIALS; trial++)
+        {
+            unsigned int tone = (unsigned int)(random_uniform() * (GOERTZEL_BINS + 1));
+            tone_hz = (tone == GOERTZEL_BINS) ? 0 : tones[tone] * (1 + 0.03 * (random_uniform() - 0.5));
+            phase = 2 * M_PI * random_uniform();
+            next_block(magnitudes, &cycles);    // Block straddling the change
+            next_block(magnitudes, &cycles);
+            unsigned int best = 0;
+            for(unsigned int bin = 1; bin != GOERTZEL_BINS; bin++)
+            {
+                best = magnitudes[bin] > magnitudes[best] ? bin : best;
+            }
+            bool detected = magnitudes[best] >= threshold;
+            if(tone == GOERTZEL_BINS)
+            {
+                silent ++;
+                false_alarms += detected;
+            }
+            else if(!detected)
+            {
+                missed ++;
+            }
+            else
+            {
+                correct += (best == tone);
+                wrong += (best != tone);
+            }
+        }
+        finish();
+        char name[40];
+        snprintf(name, sizeof(name), "noise %2.0f counts rms (%4.1f dB SNR)", noise, 10 * log10(amplitude * amplitude / 2 / (noise * noise)));
+        REPORT(name, "%5.1f %% correct, %u wrong, %u missed, %u false alarms in %u silent blocks",
+            100.0 * correct / (TRIALS - silent), wrong, missed, false_alarms, silent);
+        if(noise <= 8)
+        {
+            CHECK(correct == TRIALS - silent && false_alarms == 0);
+        }
+    }
+}
+
+// Filter step cost per sample per bin in GOERTZEL_read, and the interrupt
+// cost of queueing each sample.
+HOST static void test_cost(void)
+{
+    uint16_t magnitudes[GOERTZEL_BINS];
+    tone_hz = tones[0];
+    amplitude = 32;
+    noise = 4;
+    double isr[2];
+    for(unsigned char with = 0; with != 2; with++)
+    {
+        boot();
+        if(!with)
+        {
+            GOERTZEL_stop();
+        }
+        uint64_t start = sim_isr_cycles;
+        unsigned long conversions = sim_conversions;
+        sim_run(200 * SIM_CYCLES_PER_MS);
+        isr[with] = (double)(sim_isr_cycles - start) / (sim_conversions - conversions);
+        finish();
+    }
+
+    boot();
+    next_block(magnitudes, &(uint64_t){ 0 });
+    uint64_t cycles = 0;
+    unsigned int blocks = 20;
+    for(unsigned int i = 0; i != blocks; i++)
+    {
+        next_block(magnitudes, &cycles);
+    }
+    double main_cpu = 100.0 * cycles / (blocks * GOERTZEL_BLOCK / SAMPLE_HZ * SIM_CYCLES_PER_MS * 1000);
+    finish();
+    double per_sample = (double)cycles / (blocks * GOERTZEL_BLOCK);
+    printf("Cost, %u bins\n", GOERTZEL_BINS);
+    REPORT("GOERTZEL_read", "%.1f cycles per sample per bin, %.0f per sample, %.2f %% CPU", per_sample / GOERTZEL_BINS,
+        per_sample, main_cpu);
+    REPORT("GOERTZEL_read multiplies", "%u 16 x 32-bit per sample (one per bin), not charged", GOERTZEL_BINS);
+    REPORT("sample queueing in the ISR", "%.1f cycles per sample", isr[1] - isr[0]);
+    CHECK_RANGE(isr[1] - isr[0], 0, 40);
+    CHECK_RANGE(per_sample / GOERTZEL_BINS, 0, 100);
+}
+
+// A late read throws away the block that lost samples, and the next block is
+// whole. GOERTZEL_start needs a sampler list of GOERTZEL_CHANNELS channels.
+HOST static void test_overrun(void)
+{
+    uint16_t magnitudes[GOERTZEL_BINS];
+    uint64_t cycles = 0;
+    boot();
+    tone_hz = tones[2];
+    amplitude = 64;
+    noise = 0;
+    next_block(magnitudes, &cycles);
+    sim_run((GOERTZEL_QUEUE_SIZE + 4) * TICK_CYCLES);
+    CHECK(goertzel_overrun);
+    sample_count = 0;
+    CHECK(!GOERTZEL_read(magnitudes));
+    CHECK(!goertzel_overrun && goertzel_count == 0);
+    sample_count = 0;           // The block starts with the next sample
+    const unsigned char *block = next_block(magnitudes, &cycles);
+    CHECK(block == samples);
+    CHECK(block_error(magnitudes, block) < 0.002);
+    CHECK_RANGE(magnitudes[2] / (amplitude * GOERTZEL_BLOCK / 2), 0.97, 1.03);
+    finish();
+
+    static const unsigned char channels[] = { ANH1, ANH2 };
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    ADC_sampler_start(channels, GOERTZEL_CHANNELS + 1, ADC_8BIT);
+    CHECK(!GOERTZEL_start(0));
+    CHECK(goertzel_index == 0xFF);
+    ADC_sampler_stop();
+}
+
+HOST int main(void)
+{
+    test_response();
+    test_full_scale();
+    test_detection();
+    test_cost();
+    test_overrun();
+    TEST_DONE();
+}
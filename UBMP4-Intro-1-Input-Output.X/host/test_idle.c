@@ -0,0 +1,167 @@
+/*==============================================================================
+ File: test_idle.c                      Host power model for IDLE_sleep
+
+ Runs a main loop that handles button events, a 1 s task (with WDT wake-ups)
+ and IDLE_sleep over a scripted button trace, and counts active cycles
+ against sleep cycles. The supply current estimate uses the typical figures
+ below. Also measures the wake-up latency from a press and the TICK_ms error
+ left by button wake-ups.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+#define ACTIVE_MA   7.0         // Typical run current at 48 MHz (mA)
+#define SLEEP_UA    0.5         // Typical sleep current with the WDT on (uA)
+#define RUN_MS      20000
+
+static const sim_step_t presses[] =
+{
+    { 2000 * SIM_CYCLES_PER_MS, SIM_BUTTON, SIM_SW2, 1 },
+    { 2080 * SIM_CYCLES_PER_MS, SIM_BUTTON, SIM_SW2, 0 },
+    { 5500 * SIM_CYCLES_PER_MS, SIM_BUTTON, SIM_SW5, 1 },
+    { 5650 * SIM_CYCLES_PER_MS, SIM_BUTTON, SIM_SW5, 0 },
+    { 9100 * SIM_CYCLES_PER_MS + 777, SIM_BUTTON, SIM_SW1, 1 },
+    { 9160 * SIM_CYCLES_PER_MS, SIM_BUTTON, SIM_SW1, 0 },
+    { 14300 * SIM_CYCLES_PER_MS + 4321, SIM_BUTTON, SIM_SW3, 1 },
+    { 14400 * SIM_CYCLES_PER_MS, SIM_BUTTON, SIM_SW3, 0 },
+    { RUN_MS * SIM_CYCLES_PER_MS, SIM_BUTTON, SIM_SW4, 1 },  // Ends the last sleep
+    { 0, SIM_END, 0, 0 }
+};
+
+static unsigned int heartbeats;
+
+HOST static void heartbeat(void)
+{
+    heartbeats ++;
+}
+
+// Run the main loop for RUN_MS and return the number of button presses seen.
+HOST static unsigned int run(unsigned char wdt, bool sleep, double *latency)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    memset(tasks, 0, sizeof(tasks));
+    tick_ms = 0;                // Device variables keep their values from the last run
+    heartbeats = 0;
+    if(wdt != IDLE_WDT_OFF)
+    {
+        TASK_every(heartbeat, 1000);    // Needs the WDT to wake up for it
+    }
+    sim_script(presses);
+
+    unsigned int seen = 0;
+    unsigned int press = 0;
+    *latency = 0;
+    while(sim_cycles < RUN_MS * SIM_CYCLES_PER_MS)
+    {
+        TASK_run();
+        unsigned char event = BUTTON_event();
+        if(BUTTON_TYPE(event) == BUTTON_PRESS)
+        {
+            seen ++;
+        }
+        if(sleep && IDLE_sleep(wdt))
+        {
+            // Time from a press that came during the sleep to the wake-up
+            while(press < 8 && presses[press].cycle <= sim_cycles)
+            {
+                if(presses[press].b != 0 && sim_cycles - presses[press].cycle < SIM_CYCLES_PER_MS)
+                {
+                    double us = SIM_US(sim_cycles - presses[press].cycle);
+                    *latency = us > *latency ? us : *latency;
+                }
+                press ++;
+            }
+        }
+    }
+    return (seen);
+}
+
+HOST static void test_power(void)
+{
+    static const struct
+    {
+        unsigned char wdt;
+        bool sleep;
+        const char *name;
+    } modes[] =
+    {
+        { IDLE_WDT_OFF, false, "no sleep" },
+        { IDLE_WDT_OFF, true, "sleep, buttons only" },
+        { IDLE_WDT_256MS, true, "sleep, 256 ms WDT" },
+        { IDLE_WDT_1S, true, "sleep, 1 s WDT" },
+    };
+    for(unsigned int i = 0; i != sizeof(modes) / sizeof(modes[0]); i++)
+    {
+        double latency;
+        unsigned int seen = run(modes[i].wdt, modes[i].sleep, &latency);
+        double active = (double)(sim_cycles - sim_sleep_cycles) / sim_cycles;
+        double ma = active * ACTIVE_MA + (1 - active) * SLEEP_UA / 1000;
+        REPORT(modes[i].name, "%6.2f %% active, %4lu wakes, %.3f mA, %.1f us wake", 100 * active, sim_wakes, ma, latency);
+        CHECK(seen == 4);       // Every press is seen
+        CHECK(!modes[i].sleep || latency < 20);
+        if(modes[i].wdt == IDLE_WDT_OFF)
+        {
+            CHECK(!modes[i].sleep || (active < 0.05 && sim_wakes == 5));
+        }
+        else
+        {
+            // Watchdog wake-ups keep TICK_ms and the task running. Time
+            // asleep before each of the 4 button wake-ups is lost.
+            unsigned int lost = RUN_MS - TICK_ms();
+            REPORT("  TICK_ms behind real time", "%u ms", lost);
+            CHECK_RANGE(lost, 0, 4 * (1U << modes[i].wdt) + 100);
+            CHECK(heartbeats >= (RUN_MS - lost) / 1000 - 1);
+            CHECK(active < 0.05);
+        }
+    }
+}
+
+// IDLE_sleep refuses to sleep while a button is held or work is pending.
+HOST static void test_busy(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    memset(tasks, 0, sizeof(tasks));
+    sim_run(50 * SIM_CYCLES_PER_MS);
+    while(BUTTON_event() != BUTTON_NONE)
+        ;
+    sim_button(SIM_SW4, true);
+    sim_run(30 * SIM_CYCLES_PER_MS);
+    CHECK(!IDLE_sleep(IDLE_WDT_OFF));
+    sim_button(SIM_SW4, false);
+    sim_run(30 * SIM_CYCLES_PER_MS);
+    CHECK(!IDLE_sleep(IDLE_WDT_OFF));   // Events are waiting
+    while(BUTTON_event() != BUTTON_NONE)
+        ;
+    TASK_once(heartbeat, 0);
+    CHECK(!IDLE_sleep(IDLE_WDT_32MS));  // The task is due now
+    CHECK(GIE);
+    TASK_run();
+
+    // A task due in 100 ms shortens a 256 ms sleep to 64 ms
+    TASK_once(heartbeat, 100);
+    uint64_t start = sim_cycles;
+    unsigned int ms = TICK_ms();
+    CHECK(IDLE_sleep(IDLE_WDT_256MS));
+    CHECK_RANGE(SIM_MS(sim_cycles - start), 64, 65);
+    CHECK((unsigned int)(TICK_ms() - ms) == 64);
+
+    // A press ends the sleep early
+    sim_script(presses + 4);
+    CHECK(IDLE_sleep(IDLE_WDT_OFF) == false);   // The task is scheduled
+    TASK_remove(0);
+    CHECK(IDLE_sleep(IDLE_WDT_OFF));
+    CHECK(sim_cycles - presses[4].cycle < 20 * SIM_CYCLES_PER_US);
+    CHECK(GIE && sim_wakes == 2 && IOCBF == 0 && IOCAF == 0);
+}
+
+HOST int main(void)
+{
+    test_power();
+    test_busy();
+    TEST_DONE();
+}
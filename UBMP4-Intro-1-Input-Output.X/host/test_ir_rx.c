@@ -0,0 +1,244 @@
+/*==============================================================================
+ File: test_ir_rx.c                     Host tests for the IR receive decoder
+
+ Replays NEC, NEC repeat and RC5 frames into comparator C2 (the IR
+ demodulator on IRIN) with the mark widening and edge jitter of a real
+ demodulator, while LED brightness control is interrupting as well. Reports
+ the decode success rate for increasing timing distortion, checks that no
+ wrong codes are ever queued, and measures the interrupt cost per IR edge.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+#define FRAMES      40          // Frames of each protocol per distortion
+#define MAX_EDGES   80
+
+static sim_step_t script[MAX_EDGES + 1];
+static unsigned int steps;
+static uint64_t edge_time;      // Time of the next edge without distortion
+static unsigned int widen_us, jitter_us;
+static uint32_t random_state = 777;
+
+HOST static unsigned int random_below(unsigned int limit)
+{
+    random_state = random_state * 1103515245 + 12345;
+    return ((random_state >> 16) % limit);
+}
+
+// Add a level lasting 'us' to the script. Marks start on time and end late by
+// the demodulator's widening, and every edge gets random jitter.
+HOST static void add_level(bool mark, unsigned int us)
+{
+    int64_t shift = mark ? 0 : (int64_t)widen_us * SIM_CYCLES_PER_US;
+    if(jitter_us != 0)
+    {
+        shift += ((int64_t)random_below(2 * jitter_us + 1) - jitter_us) * (int64_t)SIM_CYCLES_PER_US;
+    }
+    script[steps++] = (sim_step_t){ edge_time + shift, SIM_COMPARATOR, 2, mark };
+    edge_time += us * SIM_CYCLES_PER_US;
+}
+
+HOST static void frame_start(void)
+{
+    steps = 0;
+    edge_time = sim_cycles + 5 * SIM_CYCLES_PER_MS;
+}
+
+HOST static uint64_t frame_end(void)
+{
+    script[steps++] = (sim_step_t){ edge_time + widen_us * SIM_CYCLES_PER_US, SIM_COMPARATOR, 2, 0 };
+    script[steps] = (sim_step_t){ 0, SIM_END, 0, 0 };
+    sim_script(script);
+    return (edge_time + 20 * SIM_CYCLES_PER_MS);
+}
+
+// Script an NEC frame for an address and command.
+HOST static uint64_t nec_frame(unsigned char address, unsigned char command)
+{
+    uint32_t data = address | (uint32_t)(unsigned char)~address << 8 | (uint32_t)command << 16 | (uint32_t)(unsigned char)~command << 24;
+    frame_start();
+    add_level(true, 9000);
+    add_level(false, 4500);
+    for(unsigned int bit = 0; bit != 32; bit++)
+    {
+        add_level(true, 562);
+        add_level(false, (data >> bit) & 1 ? 1687 : 562);
+    }
+    add_level(true, 562);
+    return (frame_end());
+}
+
+HOST static uint64_t nec_repeat(void)
+{
+    frame_start();
+    add_level(true, 9000);
+    add_level(false, 2250);
+    add_level(true, 562);
+    return (frame_end());
+}
+
+// Script an RC5 frame of two start bits and 12 code bits (toggle, address,
+// command). A 1 bit is a space then a mark, a 0 bit a mark then a space. The
+// idle space before the first mark and after the last one are not levels.
+HOST static uint64_t rc5_frame(unsigned int code)
+{
+    unsigned int bits = 0x3000 | (code & 0x0FFF);
+    bool halves[28];
+    for(unsigned int i = 0; i != 14; i++)
+    {
+        bool one = (bits >> (13 - i)) & 1;
+        halves[2 * i] = !one;
+        halves[2 * i + 1] = one;
+    }
+    unsigned int last = 27;
+    while(!halves[last])
+    {
+        last --;
+    }
+    frame_start();
+    unsigned int first = 1;     // The first start bit's space half is idle
+    for(unsigned int i = first; i <= last; )
+    {
+        unsigned int run = 1;
+        while(i + run <= last && halves[i + run] == halves[i])
+        {
+            run ++;
+        }
+        add_level(halves[i], 889 * run);
+        i += run;
+    }
+    return (frame_end());
+}
+
+HOST static void boot(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    LED_pwm_start();
+    LED_set_duty(1, 100);
+    LED_set_duty(4, 200);
+    sim_comparator(2, false);
+    IR_rx_start();
+    sim_run(SIM_CYCLES_PER_MS);
+    ir_code_t code;
+    while(IR_receive(&code))
+        ;
+}
+
+// Run to the end of a frame and check what was queued. Returns true if exactly
+// the expected code arrived; any other code fails the test.
+HOST static bool expect(uint64_t end, unsigned char protocol, unsigned int code)
+{
+    sim_run_until(end);
+    ir_code_t received;
+    bool seen = false;
+    while(IR_receive(&received))
+    {
+        CHECK(!seen && received.protocol == protocol && received.code == code);
+        seen = true;
+    }
+    return (seen);
+}
+
+// Decode success rate against demodulator distortion.
+HOST static void test_replay(void)
+{
+    static const unsigned int widen[] = { 0, 60, 120, 180, 250 };
+    for(unsigned int d = 0; d != sizeof(widen) / sizeof(widen[0]); d++)
+    {
+        boot();
+        widen_us = widen[d];
+        jitter_us = 40;
+        unsigned int nec = 0, repeats = 0, rc5 = 0;
+        for(unsigned int i = 0; i != FRAMES; i++)
+        {
+            unsigned char address = (unsigned char)random_below(256);
+            unsigned char command = (unsigned char)random_below(256);
+            bool ok = expect(nec_frame(address, command), IR_NEC, (unsigned int)(address << 8 | command));
+            nec += ok;
+            if(ok)
+            {
+                repeats += expect(nec_repeat(), IR_NEC_REPEAT, (unsigned int)(address << 8 | command));
+            }
+            unsigned int code = random_below(0x1000);
+            rc5 += expect(rc5_frame(code), IR_RC5, code);
+        }
+        char name[48];
+        snprintf(name, sizeof(name), "marks +%u us, +/-%u us jitter", widen_us, jitter_us);
+        REPORT(name, "NEC %3u %%, repeat %3u %%, RC5 %3u %%", 100 * nec / FRAMES, 100 * repeats / FRAMES, 100 * rc5 / FRAMES);
+        if(widen_us <= 180)
+        {
+            CHECK(nec == FRAMES && repeats == FRAMES && rc5 == FRAMES);
+        }
+        IR_rx_stop();
+        LED_pwm_stop();
+    }
+}
+
+// Interrupt time per IR edge, over the time taken with only the tick and LED
+// brightness interrupts.
+HOST static void test_cost(void)
+{
+    boot();
+    widen_us = 0;
+    jitter_us = 0;
+    uint64_t start = sim_cycles, isr = sim_isr_cycles;
+    sim_run(500 * SIM_CYCLES_PER_MS);
+    double base = (double)(sim_isr_cycles - isr) / (sim_cycles - start);
+    unsigned long edges = 0;
+    start = sim_cycles;
+    isr = sim_isr_cycles;
+    sim_isr_max = 0;
+    for(unsigned int i = 0; i != 10; i++)
+    {
+        uint64_t end = nec_frame((unsigned char)i, (unsigned char)(i * 7));
+        edges += steps;
+        CHECK(expect(end, IR_NEC, i << 8 | (i * 7)));
+        end = rc5_frame(i * 131);
+        edges += steps;
+        CHECK(expect(end, IR_RC5, i * 131));
+    }
+    double per_edge = ((sim_isr_cycles - isr) - base * (sim_cycles - start)) / edges;
+    REPORT("C2 interrupt per IR edge", "%.0f cycles (%.1f us), %" PRIu64 " cycles worst ISR", per_edge, SIM_US(per_edge), sim_isr_max);
+    CHECK_RANGE(per_edge, 20, 400);
+    IR_rx_stop();
+    LED_pwm_stop();
+}
+
+// Random edges never decode as NEC codes, which carry a check byte.
+HOST static void test_noise(void)
+{
+    boot();
+    unsigned int nec = 0, rc5 = 0;
+    for(unsigned int burst = 0; burst != 50; burst++)
+    {
+        frame_start();
+        widen_us = 0;
+        jitter_us = 0;
+        for(unsigned int i = 0; i != MAX_EDGES - 2; i++)
+        {
+            add_level((i & 1) == 0, 200 + random_below(3000));
+        }
+        sim_run_until(frame_end());
+        ir_code_t code;
+        while(IR_receive(&code))
+        {
+            nec += code.protocol != IR_RC5;
+            rc5 += code.protocol == IR_RC5;
+        }
+    }
+    REPORT("50 bursts of random edges", "%u NEC, %u RC5 codes", nec, rc5);
+    CHECK(nec == 0);
+    IR_rx_stop();
+    LED_pwm_stop();
+}
+
+HOST int main(void)
+{
+    test_replay();
+    test_cost();
+    test_noise();
+    TEST_DONE();
+}
@@ -0,0 +1,192 @@
+/*==============================================================================
+ File: test_ir_tx.c                     Host tests for the IR transmitter
+
+ Records the IRLED (RC5) pin while IR_send sends NEC frames: the PWM1 output
+ while PWM1OE is set, and LATC5 otherwise. Measures the carrier frequency and
+ duty cycle, checks every mark and space against the NEC timing and decodes
+ the frame back, measures the CPU time left to the main program, and checks
+ that LED D3 writes can't reach the pin while a frame is sent.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+#define PWM1CON_OE  0b01000000
+#define PWM1CON_OUT 0b00100000
+#define MAX_LEVELS  80
+
+static sim_edge_t edges[20000];
+
+typedef struct
+{
+    bool mark;
+    double us;
+} level_t;
+
+// Carrier measured by pin_levels
+static double carrier_hz, carrier_duty;
+
+HOST static void boot(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    latc_reserved = 0;
+}
+
+// Rebuild the RC5 pin from the log, starting from the LATC and PWM1CON values
+// at the start of the log, and split it into carrier marks and spaces. A mark
+// runs from its first rising edge to its last falling edge, and a gap of over
+// two carrier periods ends it. Also measures the carrier inside the marks.
+HOST static unsigned int pin_levels(unsigned char latc, unsigned char pwm1con, level_t *levels)
+{
+    const uint64_t gap = 2 * 4 * (sim_sfr[SIM_PR2] + 1u);  // Two carrier periods
+    bool pin = false, in_mark = false;
+    uint64_t mark_start = 0, rise = 0, fall = 0, periods_time = 0, high_time = 0;
+    unsigned long periods = 0;
+    unsigned int count = 0;
+    for(size_t i = 0; i <= sim_log_count() && count < MAX_LEVELS - 1; i++)
+    {
+        bool end = (i == sim_log_count());
+        uint64_t cycle = end ? sim_cycles : edges[i].cycle;
+        if(!end)
+        {
+            latc = (edges[i].reg == SIM_LATC) ? edges[i].value : latc;
+            pwm1con = (edges[i].reg == SIM_PWM1CON) ? edges[i].value : pwm1con;
+        }
+        bool level = (pwm1con & PWM1CON_OE) ? (pwm1con & PWM1CON_OUT) != 0 : (latc & OUT_D3) != 0;
+        if(in_mark && !pin && (end || (level && cycle - fall > gap)))
+        {
+            levels[count++] = (level_t){ true, SIM_US(fall - mark_start) };
+            in_mark = false;
+            if(!end)
+            {
+                levels[count++] = (level_t){ false, SIM_US(cycle - fall) };
+            }
+        }
+        if(level && !pin)
+        {
+            if(in_mark)
+            {
+                periods_time += cycle - rise;
+                high_time += fall - rise;
+                periods ++;
+            }
+            else
+            {
+                mark_start = cycle;
+                in_mark = true;
+            }
+            rise = cycle;
+        }
+        else if(!level && pin)
+        {
+            fall = cycle;
+        }
+        pin = level;
+    }
+    carrier_hz = periods ? 1000.0 * SIM_CYCLES_PER_MS * periods / periods_time : 0;
+    carrier_duty = periods ? (double)high_time / periods_time : 0;
+    return (count);
+}
+
+// Check levels against an NEC frame for a code. Returns the worst timing error
+// (us) and decodes the code.
+HOST static double nec_check(const level_t *levels, unsigned int count, unsigned int *code)
+{
+    static const double leader[2] = { 9000, 4500 };
+    double worst = 0;
+    uint32_t data = 0;
+    CHECK(count == 67);
+    for(unsigned int i = 0; i != count; i++)
+    {
+        double spec;
+        CHECK(levels[i].mark == !(i & 1));
+        if(i < 2)
+        {
+            spec = leader[i];
+        }
+        else if(levels[i].mark || levels[i].us < 1100)
+        {
+            spec = 562.5;
+        }
+        else
+        {
+            spec = 1687.5;
+            data |= 1UL << ((i - 3) / 2);
+        }
+        double error = fabs(levels[i].us - spec);
+        worst = error > worst ? error : worst;
+    }
+    CHECK((unsigned char)(data >> 24) == (unsigned char)~(data >> 16));
+    CHECK((unsigned char)(data >> 8) == (unsigned char)~data);
+    *code = (unsigned int)((data & 0xFF) << 8 | ((data >> 16) & 0xFF));
+    return (worst);
+}
+
+// Carrier, timing and decoded codes of several frames.
+HOST static void test_frames(void)
+{
+    static const unsigned int codes[] = { 0x0000, 0x04A5, 0xFF00, 0x5AC3, 0xFFFF };
+    double worst = 0;
+    for(unsigned int c = 0; c != sizeof(codes) / sizeof(codes[0]); c++)
+    {
+        boot();
+        unsigned char latc = LATC, pwm1con = PWM1CON;
+        sim_log(edges, sizeof(edges) / sizeof(edges[0]));
+        uint64_t start = sim_cycles, isr = sim_isr_cycles;
+        CHECK(IR_send(codes[c]));
+        CHECK(!IR_send(codes[c]));      // Busy until the frame is sent
+        while(IR_tx_busy() && sim_cycles - start < 100 * SIM_CYCLES_PER_MS)
+        {
+            sim_run(SIM_CYCLES_PER_MS / 10);
+        }
+        double frame_ms = SIM_MS(sim_cycles - start);
+        double cpu = 100.0 * (sim_isr_cycles - isr) / (sim_cycles - start);
+        CHECK(!IR_tx_busy() && !TMR2IE && latc_reserved == 0);
+        level_t levels[MAX_LEVELS];
+        unsigned int count = pin_levels(latc, pwm1con, levels);
+        unsigned int code;
+        double error = nec_check(levels, count, &code);
+        CHECK(code == codes[c]);
+        worst = error > worst ? error : worst;
+        if(c == 1)
+        {
+            REPORT("carrier", "%.1f Hz, %.1f %% duty", carrier_hz, 100 * carrier_duty);
+            REPORT("NEC frame 0x04A5", "%.1f ms, %.2f %% CPU in interrupts", frame_ms, cpu);
+            CHECK_RANGE(carrier_hz, 38000 * 0.98, 38000 * 1.02);
+            CHECK_RANGE(carrier_duty, 0.25, 0.40);
+            CHECK_RANGE(cpu, 0, 25);
+        }
+    }
+    REPORT("marks and spaces vs NEC spec", "%.1f us worst error", worst);
+    CHECK_RANGE(worst, 0, 60);          // Within 10 % of the 562.5 us unit
+}
+
+// LED D3 writes wait while a frame is sent, then reach the pin.
+HOST static void test_sharing(void)
+{
+    boot();
+    OUT_write(OUT_D3, 0);
+    OUT_update();
+    CHECK(IR_send(0x1234));
+    OUT_write(OUT_D3, OUT_D3);
+    OUT_update();
+    CHECK((LATC & OUT_D3) == 0);
+    sim_run(20 * SIM_CYCLES_PER_MS);
+    OUT_update();
+    CHECK((LATC & OUT_D3) == 0);
+    while(IR_tx_busy())
+    {
+        sim_run(SIM_CYCLES_PER_MS);
+    }
+    OUT_update();
+    CHECK((LATC & OUT_D3) == OUT_D3 && !PWM1OE);
+}
+
+HOST int main(void)
+{
+    test_frames();
+    test_sharing();
+    TEST_DONE();
+}
@@ -0,0 +1,283 @@
+/*==============================================================================
+ File: test_keypad.c                    Host tests for the analog keypad
+
+ Replays presses of a four-key resistor ladder on AN10 through the ADC
+ sampler. Each press and release bounces like the pushbutton traces in
+ test_button.c, and the ladder's RC time constant makes the voltage pass
+ through the other keys' bands on the way. Every conversion gets Gaussian
+ noise. Counts missed, wrong and extra events for each noise
+ level and measures the latency from the end of the bounce to each event.
+ Also checks a voltage sitting on a threshold doesn't chatter, reports the
+ interrupt cost of decoding, and checks SW2 is handed over and back.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+#define PRESSES     80
+#define AN10_CHANNEL    (AN10 >> 2)     // ADC channel number for the source
+#define OPEN        1023                // No key pressed: pulled up to VDD
+#define TAU_US      100                 // Ladder pull-up and input capacitance
+#define BOUNCES     10                  // Most contact changes in a bounce
+
+static const uint16_t ladder[4] = { 128, 384, 640, 896 };
+static const unsigned int key_level[4] = { 64, 256, 512, 768 };
+static const unsigned char channels[] = { AN10 };
+
+typedef struct
+{
+    uint64_t cycle;             // First contact
+    uint64_t settled;           // End of the bounce
+    uint64_t changes[BOUNCES + 1];  // Contact changes, ending with settled
+    unsigned char key;
+    bool pressed;
+} contact_t;
+
+static contact_t contacts[PRESSES * 2];
+static unsigned int contact_next;       // Contact the source is playing
+static unsigned int change_next;        // Its next contact change
+static double noise;                    // Standard deviation in counts
+static double target;                   // Level the ladder is moving to
+static double voltage;                  // Ladder voltage in ADC counts
+static uint64_t voltage_cycle;          // Time of that voltage
+static uint32_t random_state = 12345;
+
+HOST static unsigned int random_below(unsigned int limit)
+{
+    random_state = random_state * 1103515245 + 12345;
+    return ((random_state >> 16) % limit);
+}
+
+// Gaussian noise (Box-Muller) with the current standard deviation.
+HOST static double gaussian(void)
+{
+    double u = (random_below(65535) + 1) / 65536.0;
+    double v = random_below(65536) / 65536.0;
+    return (noise * sqrt(-2 * log(u)) * cos(2 * M_PI * v));
+}
+
+// Move the ladder voltage towards its target up to a time.
+HOST static void settle_to(uint64_t cycle)
+{
+    double us = SIM_US(cycle - voltage_cycle);
+    voltage = target + (voltage - target) * exp(-us / TAU_US);
+    voltage_cycle = cycle;
+}
+
+// The ladder voltage at the time of a conversion, as an ADC count. Each
+// contact change of the current press or release sets a new target.
+HOST static unsigned int ladder_source(unsigned char channel)
+{
+    if(channel != AN10_CHANNEL)
+    {
+        return (0);
+    }
+    while(contact_next != PRESSES * 2 && contacts[contact_next].changes[change_next] <= sim_cycles)
+    {
+        const contact_t *contact = &contacts[contact_next];
+        settle_to(contact->changes[change_next]);
+        bool closed = contact->pressed ^ (change_next & 1);
+        target = closed ? key_level[contact->key] : OPEN;
+        if(contact->changes[change_next] == contact->settled)
+        {
+            contact_next ++;
+            change_next = 0;
+        }
+        else
+        {
+            change_next ++;
+        }
+    }
+    settle_to(sim_cycles);
+    double level = voltage + gaussian();
+    return ((unsigned int)lround(level < 0 ? 0 : level > 1023 ? 1023 : level));
+}
+
+// Hold the ladder at a level from now on.
+HOST static void hold(unsigned int level)
+{
+    contact_next = PRESSES * 2;
+    target = level;
+    voltage = level;
+    voltage_cycle = sim_cycles;
+}
+
+HOST static void boot(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    hold(OPEN);
+    sim_adc_source = ladder_source;
+    ADC_sampler_start(channels, 1, ADC_10BIT);
+    KEYPAD_start(0, ladder, 4);
+    sim_run(50 * SIM_CYCLES_PER_MS);
+    while(BUTTON_event() != BUTTON_NONE)
+        ;
+}
+
+HOST static void finish(void)
+{
+    KEYPAD_stop();
+    ADC_sampler_stop();
+    sim_adc_source = NULL;
+}
+
+// Random presses of random keys. Each press and release bounces for up to
+// BOUNCES contact changes 30-900 us apart, as in test_button.c. Returns the
+// time the last release settles.
+HOST static uint64_t make_presses(void)
+{
+    uint64_t cycle = sim_cycles + 10 * SIM_CYCLES_PER_MS;
+    for(unsigned int i = 0; i != PRESSES * 2; i++)
+    {
+        contact_t *contact = &contacts[i];
+        contact->cycle = cycle;
+        contact->key = (i & 1) ? contacts[i - 1].key : (unsigned char)random_below(4);
+        contact->pressed = !(i & 1);
+        unsigned int changes = 1 + 2 * random_below(BOUNCES / 2 + 1);
+        for(unsigned int c = 0; c != changes; c++)
+        {
+            contact->changes[c] = cycle;
+            contact->settled = cycle;
+            cycle += (30 + random_below(870)) * SIM_CYCLES_PER_US;
+        }
+        cycle = contact->settled + (30 + random_below(120)) * SIM_CYCLES_PER_MS;
+    }
+    contact_next = 0;
+    change_next = 0;
+    return (contacts[PRESSES * 2 - 1].settled);
+}
+
+// Replay the presses at a noise level: returns the decode errors and
+// measures the worst and average latency from the end of each bounce.
+HOST static unsigned int replay(double sigma, double *worst, double *average)
+{
+    boot();
+    noise = sigma;
+    uint64_t end = make_presses();
+    unsigned int next = 0, errors = 0;
+    double total = 0;
+    *worst = 0;
+    while(sim_cycles < end + 50 * SIM_CYCLES_PER_MS)
+    {
+        sim_run(100 * SIM_CYCLES_PER_US);
+        unsigned char event;
+        while((event = BUTTON_event()) != BUTTON_NONE)
+        {
+            if(BUTTON_TYPE(event) == BUTTON_LONG || BUTTON_TYPE(event) == BUTTON_REPEAT)
+            {
+                errors ++;          // No hold is long enough
+                continue;
+            }
+            bool pressed = BUTTON_TYPE(event) == BUTTON_PRESS;
+            if(next == PRESSES * 2 || BUTTON_ID(event) != BUTTON_KEY(contacts[next].key) ||
+                pressed != contacts[next].pressed || sim_cycles < contacts[next].cycle)
+            {
+                errors ++;          // Wrong key, or an extra event
+                continue;
+            }
+            double latency = SIM_MS((double)sim_cycles - contacts[next].settled);
+            total += latency;
+            *worst = latency > *worst ? latency : *worst;
+            next ++;
+        }
+    }
+    errors += PRESSES * 2 - next;   // Missed
+    *average = total / (next ? next : 1);
+    finish();
+    return (errors);
+}
+
+// Noisy, bouncy presses decode to one press and one release of the right key.
+HOST static void test_replay(void)
+{
+    static const double sigmas[] = { 0, 4, 16, 40, 80 };
+    double sample_ms = 1000.0 / ADC_TRIGGER_HZ;
+    printf("Ladder replay, %u presses, %.2f ms per sample\n", PRESSES, sample_ms);
+    for(unsigned char i = 0; i != sizeof(sigmas) / sizeof(sigmas[0]); i++)
+    {
+        double worst, average;
+        unsigned int errors = replay(sigmas[i], &worst, &average);
+        char name[40];
+        snprintf(name, sizeof(name), "noise %.0f counts rms", sigmas[i]);
+        REPORT(name, "%3u decode errors, latency from last bounce %.2f ms average, %.2f ms worst", errors, average, worst);
+        if(sigmas[i] <= 16)
+        {
+            CHECK(errors == 0);
+            // Settle, debounce, the RC time constant and the event read slice
+            CHECK_RANGE(worst, 0, KEYPAD_SETTLE * sample_ms + (KEYPAD_DEBOUNCE + 1) * BUTTON_SAMPLE_MS + 5 * TAU_US / 1000.0 + 0.1);
+        }
+    }
+}
+
+// A key voltage sitting on a threshold (a worn ladder) gives one press and
+// no chatter between the two keys.
+HOST static void test_threshold(void)
+{
+    boot();
+    noise = 3;
+    hold(ladder[1]);
+    sim_run(1000 * SIM_CYCLES_PER_MS);
+    unsigned int presses = 0, others = 0;
+    unsigned char event;
+    while((event = BUTTON_event()) != BUTTON_NONE)
+    {
+        presses += BUTTON_TYPE(event) == BUTTON_PRESS;
+        others += BUTTON_TYPE(event) == BUTTON_RELEASE;
+    }
+    REPORT("on a threshold, 3 counts rms, 1 s", "%u press, %u release events", presses, others);
+    CHECK(presses == 1 && others == 0);
+    CHECK(KEYPAD_key() == 1 || KEYPAD_key() == 2);
+    finish();
+}
+
+// Decoding costs interrupt time only: no scanning in the main loop.
+HOST static void test_cost(void)
+{
+    double cycles[2];
+    for(unsigned char with = 0; with != 2; with++)
+    {
+        boot();
+        noise = 4;
+        if(!with)
+        {
+            KEYPAD_stop();
+        }
+        uint64_t isr = sim_isr_cycles;
+        unsigned long conversions = sim_conversions;
+        sim_run(200 * SIM_CYCLES_PER_MS);
+        cycles[with] = (double)(sim_isr_cycles - isr) / (sim_conversions - conversions);
+        finish();
+    }
+    REPORT("decode cost", "%.1f ISR cycles per sample (%.0f with the sampler)", cycles[1] - cycles[0], cycles[1]);
+    CHECK_RANGE(cycles[1] - cycles[0], 0, 200);
+}
+
+// SW2 is taken from the debouncer while AN10 is the keypad, and given back.
+HOST static void test_pin(void)
+{
+    boot();
+    CHECK((sim_sfr[SIM_ANSELB] & 0b00010000) && !(sim_sfr[SIM_WPUB] & 0b00010000));
+    CHECK(!(BUTTON_state() & (1 << BUTTON_SW2)));  // Reads 0 V as pressed otherwise
+    hold(key_level[3]);
+    sim_run((KEYPAD_DEBOUNCE + 2) * BUTTON_SAMPLE_MS * SIM_CYCLES_PER_MS);
+    CHECK(KEYPAD_key() == 3 && BUTTON_event() == (BUTTON_PRESS | BUTTON_KEY(3)));
+    finish();
+    sim_run((KEYPAD_DEBOUNCE + 2) * BUTTON_SAMPLE_MS * SIM_CYCLES_PER_MS);
+    CHECK(BUTTON_event() == (BUTTON_RELEASE | BUTTON_KEY(3)));
+    CHECK(!(sim_sfr[SIM_ANSELB] & 0b00010000) && (sim_sfr[SIM_WPUB] & 0b00010000));
+    sim_button(SIM_SW2, true);
+    sim_run(6 * BUTTON_SAMPLE_MS * SIM_CYCLES_PER_MS);
+    CHECK(BUTTON_event() == (BUTTON_PRESS | BUTTON_SW2));
+    sim_button(SIM_SW2, false);
+}
+
+HOST int main(void)
+{
+    test_replay();
+    test_threshold();
+    test_cost();
+    test_pin();
+    TEST_DONE();
+}
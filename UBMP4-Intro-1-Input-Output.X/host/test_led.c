@@ -0,0 +1,182 @@
+/*==============================================================================
+ File: test_led.c                       Host benchmark for LED brightness (BAM)
+
+ Integrates the on-time of LEDs D1-D5 from the recorded LATA and LATC edges
+ to measure the achieved refresh rate and duty accuracy of the bit angle
+ modulation at 48 MHz, and reports the TMR1 interrupt cost and the worst-case
+ interrupt time for several sets of duty values, which should all be the same.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+#define RUN_MS  100
+
+static sim_edge_t edges[20000];
+static const unsigned char led_masks[5] = { 0b00100000, OUT_D2, OUT_D3, OUT_D4, OUT_D5 };
+
+HOST static void boot(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    latc_reserved = 0;
+}
+
+// Return true if LED 'led' (0-4 for D1-D5) is on in a latch value.
+HOST static bool led_on(unsigned int led, unsigned char lata, unsigned char latc)
+{
+    return (led == 0 ? (lata & led_masks[0]) == 0 : (latc & led_masks[led]) != 0);
+}
+
+// Run for RUN_MS with the given duties, and return each LED's measured duty
+// (0-255) and the number of refreshes (D2 turning on from a duty of 1).
+HOST static unsigned int measure(const unsigned char duty[5], double measured[5], uint64_t *isr, uint64_t *isr_max)
+{
+    for(unsigned char led = 1; led <= 5; led++)
+    {
+        LED_set_duty(led, duty[led - 1]);
+    }
+    sim_run(5 * SIM_CYCLES_PER_MS);     // Let the new planes be swapped in
+    unsigned char lata = LATA, latc = LATC;
+    uint64_t start = sim_cycles, on_since[5];
+    double on[5] = { 0 };
+    for(unsigned int led = 0; led != 5; led++)
+    {
+        on_since[led] = start;
+    }
+    sim_isr_max = 0;
+    *isr = sim_isr_cycles;
+    sim_log(edges, sizeof(edges) / sizeof(edges[0]));
+    sim_run(RUN_MS * SIM_CYCLES_PER_MS);
+    *isr = sim_isr_cycles - *isr;
+    *isr_max = sim_isr_max;
+    CHECK(sim_log_count() < sizeof(edges) / sizeof(edges[0]));
+
+    unsigned int rises = 0;
+    for(size_t i = 0; i <= sim_log_count(); i++)
+    {
+        unsigned char new_a = lata, new_c = latc;
+        uint64_t cycle = sim_cycles;
+        if(i != sim_log_count())
+        {
+            cycle = edges[i].cycle;
+            new_a = (edges[i].reg == SIM_LATA) ? edges[i].value : lata;
+            new_c = (edges[i].reg == SIM_LATC) ? edges[i].value : latc;
+        }
+        for(unsigned int led = 0; led != 5; led++)
+        {
+            bool was = led_on(led, lata, latc);
+            bool now = i != sim_log_count() && led_on(led, new_a, new_c);
+            if(was && !now)
+            {
+                on[led] += cycle - on_since[led];
+            }
+            if(!was && now)
+            {
+                on_since[led] = cycle;
+                rises += (led == 1);
+            }
+        }
+        lata = new_a;
+        latc = new_c;
+    }
+    for(unsigned int led = 0; led != 5; led++)
+    {
+        measured[led] = 255.0 * on[led] / (sim_cycles - start);
+    }
+    return (rises);
+}
+
+// Refresh rate, duty accuracy and constant interrupt time.
+HOST static void test_bam(void)
+{
+    static const struct
+    {
+        unsigned char duty[5];
+        const char *name;
+    } sets[] =
+    {
+        { { 0, 0, 0, 0, 0 }, "all off" },
+        { { 255, 255, 255, 255, 255 }, "all full" },
+        { { 1, 1, 1, 1, 1 }, "all 1/255" },
+        { { 128, 1, 64, 200, 37 }, "mixed" },
+        { { 85, 170, 15, 240, 127 }, "mixed 2" },
+    };
+
+    // Interrupt time with the system tick alone
+    boot();
+    uint64_t tick_isr = sim_isr_cycles;
+    sim_run(RUN_MS * SIM_CYCLES_PER_MS);
+    tick_isr = sim_isr_cycles - tick_isr;
+    uint64_t tick_max = sim_isr_max;
+
+    double per_isr[5], worst_isr[5];
+    double worst_error = 0;
+    for(unsigned int s = 0; s != sizeof(sets) / sizeof(sets[0]); s++)
+    {
+        boot();
+        LED_pwm_start();
+        double measured[5];
+        uint64_t isr, isr_max;
+        unsigned int rises = measure(sets[s].duty, measured, &isr, &isr_max);
+        per_isr[s] = (double)(isr - tick_isr) / (8.0 * RUN_MS * SIM_CYCLES_PER_MS / (255.0 * LED_BAM_UNIT));
+        worst_isr[s] = (double)isr_max;
+        double error = 0;
+        for(unsigned int led = 0; led != 5; led++)
+        {
+            double e = fabs(measured[led] - sets[s].duty[led]);
+            error = e > error ? e : error;
+        }
+        worst_error = error > worst_error ? error : worst_error;
+        char name[40];
+        snprintf(name, sizeof(name), "duties %s", sets[s].name);
+        REPORT(name, "%.0f cycles/ISR, %.0f worst ISR, %.2f/255 worst duty error", per_isr[s], worst_isr[s], error);
+        if(sets[s].duty[1] == 1)
+        {
+            double hz = rises * 1000.0 / RUN_MS;
+            REPORT("refresh rate", "%.1f Hz (LED_REFRESH_HZ %lu)", hz, (unsigned long)LED_REFRESH_HZ);
+            CHECK_RANGE(hz, LED_REFRESH_HZ - 10, LED_REFRESH_HZ + 10);
+        }
+        LED_pwm_stop();
+        CHECK(LATC == 0 && D1 == 1);
+    }
+    REPORT("system tick ISR alone", "%" PRIu64 " cycles worst", tick_max);
+
+    // The interrupt does the same work whatever the duty values are
+    for(unsigned int s = 1; s != sizeof(sets) / sizeof(sets[0]); s++)
+    {
+        CHECK_RANGE(per_isr[s], per_isr[0] - 1, per_isr[0] + 1);
+        CHECK_RANGE(worst_isr[s], worst_isr[0] - 8, worst_isr[0] + 8);
+    }
+    REPORT("BAM interrupt load", "%.2f %% CPU", 100.0 * per_isr[0] * 8 * LED_REFRESH_HZ / (1000.0 * SIM_CYCLES_PER_MS));
+    CHECK_RANGE(per_isr[0], 10, LED_BAM_UNIT);  // Done within the shortest slot
+    CHECK_RANGE(worst_error, 0, 1.5);
+}
+
+// Gamma-corrected levels are monotonic and reach full brightness.
+HOST static void test_levels(void)
+{
+    boot();
+    memset(led_duty, 0, sizeof(led_duty));  // Device variables keep their values from the last run
+    LED_pwm_start();
+    LED_set_level(3, 0);
+    CHECK(led_duty[2] == 0);
+    LED_set_level(3, 255);
+    CHECK(led_duty[2] == 255);
+    for(unsigned int level = 1; level != 256; level++)
+    {
+        CHECK(led_gamma[level] >= led_gamma[level - 1]);
+    }
+    LED_set_duty(6, 100);                       // Out of range LEDs are ignored
+    LED_set_duty(0, 100);
+    CHECK(led_duty[0] == 0 && led_duty[4] == 0);
+    LED_pwm_stop();
+}
+
+HOST int main(void)
+{
+    test_bam();
+    test_levels();
+    TEST_DONE();
+}
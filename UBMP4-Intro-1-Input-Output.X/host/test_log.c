@@ -0,0 +1,268 @@
+/*==============================================================================
+ File: test_log.c                       Host tests for the HEF ring logger
+
+ Runs the logger against the simulator's program memory model, which counts
+ the erases and writes of each row and stalls the CPU for each one. Checks
+ that records read back in order across rows, that the rows wear evenly and
+ nothing outside the logger's rows is touched, that LOG_start finds the head
+ after every number of rows written (through sequence number wrap) and after
+ a row write cut off by a power loss, and that the tick keeps time through
+ the write stalls. Reports the logging throughput, the stall per row, and the
+ time LOG_start takes at boot.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+#define ROW(r)  (LOG_ROW_ADDRESS(r) / SIM_FLASH_ROW)    // Simulator row number
+
+// Boot with erased flash and an empty log.
+HOST static void boot(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    LOG_start();
+    CHECK(log_row == 0 && log_sequence == 0 && log_count == 0);
+}
+
+// Record n of a test run: alternating 10-bit samples and events.
+HOST static void log_record(unsigned long n)
+{
+    if(n % 4 == 3)
+    {
+        LOG_event((unsigned char)(n >> 2));
+    }
+    else
+    {
+        LOG_adc((uint16_t)(n * 37 & 1023));
+    }
+}
+
+HOST static bool record_is(const unsigned char *record, unsigned long n)
+{
+    if(n % 4 == 3)
+    {
+        return (record[0] == LOG_EVENT && record[1] == (unsigned char)(n >> 2));
+    }
+    unsigned int sample = n * 37 & 1023;
+    return (record[0] == (LOG_ADC | sample >> 8) && record[1] == (unsigned char)sample);
+}
+
+// Check that the rows in the log hold the last records of a run of n.
+HOST static void check_rows(unsigned long n)
+{
+    unsigned char records[2 * LOG_RECORDS];
+    unsigned long end = n - log_count;          // Records in RAM aren't written yet
+    for(unsigned char age = 0; age != LOG_ROWS && end != 0; age++)
+    {
+        unsigned char count = LOG_read(age, records);
+        CHECK(count == LOG_RECORDS);
+        for(unsigned char i = 0; i != count; i++)
+        {
+            CHECK(record_is(&records[2 * i], end - count + i));
+        }
+        end -= count;
+    }
+}
+
+// Records read back in order, and the rows wear evenly.
+HOST static void test_records(void)
+{
+    boot();
+    unsigned long n;
+    for(n = 0; n != 1000; n++)
+    {
+        log_record(n);
+        if(n % 97 == 0)
+        {
+            check_rows(n + 1);
+        }
+    }
+    check_rows(n);
+    unsigned long rows = n / LOG_RECORDS;
+    unsigned long least = ~0UL, most = 0;
+    for(unsigned char r = 0; r != LOG_ROWS; r++)
+    {
+        unsigned long erases = sim_flash_erases[ROW(r)];
+        least = erases < least ? erases : least;
+        most = erases > most ? erases : most;
+        CHECK(sim_flash_writes[ROW(r)] == erases);
+    }
+    unsigned long total = 0;
+    for(unsigned int row = 0; row != SIM_FLASH_WORDS / SIM_FLASH_ROW; row++)
+    {
+        total += sim_flash_erases[row];
+    }
+    printf("Wear, %lu records\n", n);
+    REPORT("row erases", "%lu to %lu per row, %lu in all, 1 per %.1f records", least, most, total, (double)n / total);
+    REPORT("records to 100k erases per row", "%.2g", 100000.0 * LOG_ROWS * LOG_RECORDS);
+    CHECK(total == rows && most - least <= 1);
+    CHECK(sim_flash_erases[TEMP_CAL_ADDRESS / SIM_FLASH_ROW] == 0);
+
+    // LOG_flush writes a part row, and reading stops at its end
+    unsigned char waiting = log_count + 1;
+    LOG_event(0xAB);
+    LOG_flush();
+    unsigned char records[2 * LOG_RECORDS];
+    CHECK(waiting < LOG_RECORDS && LOG_read(0, records) == waiting);
+    CHECK(record_is(records, n - waiting + 1) && records[2 * waiting - 2] == LOG_EVENT && records[2 * waiting - 1] == 0xAB);
+    CHECK(LOG_read(LOG_ROWS, records) == 0);
+    LOG_flush();                // Nothing to write
+    CHECK(total + 1 == sim_flash_erases[ROW(0)] + sim_flash_erases[ROW(1)] + sim_flash_erases[ROW(2)]);
+}
+
+// Logging rate, the stall per row, and the tick through the stalls.
+HOST static void test_throughput(void)
+{
+    boot();
+    uint16_t ms = TICK_ms();
+    uint64_t start = sim_cycles;
+    uint64_t longest = 0;
+    unsigned long n;
+    for(n = 0; n != 30 * LOG_RECORDS; n++)
+    {
+        uint64_t before = sim_cycles;
+        LOG_adc((uint16_t)n);
+        longest = sim_cycles - before > longest ? sim_cycles - before : longest;
+    }
+    double elapsed = SIM_MS(sim_cycles - start);
+    printf("Logging\n");
+    REPORT("LOG_adc back to back", "%.0f records/s, %.2f ms per row write", n * 1000 / elapsed, SIM_MS(longest));
+    REPORT("interrupts held off", "%.2f ms", SIM_MS(sim_gie_off_max));
+    REPORT("TICK_ms drift", "%d ms in %.0f ms", (int)(uint16_t)(TICK_ms() - ms) - (int)lround(elapsed), elapsed);
+    CHECK_RANGE(SIM_MS(longest), 2 * HEF_STALL_MS, 2 * HEF_STALL_MS + 0.5);
+    CHECK_RANGE(n * 1000 / elapsed, 0.9 * LOG_RECORDS * 1000 / (2 * HEF_STALL_MS), LOG_RECORDS * 1000 / (2 * HEF_STALL_MS));
+    CHECK_RANGE((uint16_t)(TICK_ms() - ms), elapsed - 0.1 * n / LOG_RECORDS - 1, elapsed + 1);   // Was 3.7 ms/row slow
+
+    // Every sample from the sampler, logged from the main loop
+    static const unsigned char channel = ANQ1;
+    boot();
+    ADC_sampler_start(&channel, 1, ADC_10BIT);
+    ADC_stream_start(0);
+    unsigned long logged = 0;
+    start = sim_cycles;
+    while(sim_cycles - start < 1000 * SIM_CYCLES_PER_MS)
+    {
+        uint16_t sample;
+        while(ADC_stream_read(&sample))
+        {
+            LOG_adc(sample);
+            logged ++;
+        }
+        sim_run(100 * SIM_CYCLES_PER_US);
+    }
+    // The sampler's interrupts can't run while the CPU is stalled, so its
+    // conversions stop for each row write (but for one left waiting in the
+    // ADC), and the rest are all logged
+    unsigned long rows = 0;
+    for(unsigned char r = 0; r != LOG_ROWS; r++)
+    {
+        rows += sim_flash_erases[ROW(r)];
+    }
+    double sampled = 1 - rows * 2 * HEF_STALL_MS / 1000.0;
+    REPORT("sampler to log, 1 channel", "%lu records/s, %.0f %% of the time sampling", logged, 100 * sampled);
+    CHECK_RANGE(logged, sampled * ADC_TRIGGER_HZ - 2, sampled * ADC_TRIGGER_HZ + rows + 2);
+    CHECK(ADC_stream_overruns() == 0);
+    ADC_stream_stop();
+    ADC_sampler_stop();
+}
+
+// LOG_start finds the next row and sequence number after any number of rows.
+HOST static void test_start(void)
+{
+    boot();
+    uint64_t worst = 0;
+    uint64_t reads = 0, worst_reads = 0;
+    for(unsigned int rows = 0; rows != 3 * 256 + LOG_ROWS + 1; rows++)
+    {
+        unsigned char row = log_row;
+        unsigned char sequence = log_sequence;
+        log_row = 0x55;         // Power off: RAM is lost
+        log_sequence = 0x55;
+        reads = sim_access_count[SIM_PMDATL];
+        uint64_t start = sim_cycles;
+        LOG_start();
+        uint64_t cycles = sim_cycles - start;
+        reads = sim_access_count[SIM_PMDATL] - reads;
+        worst = cycles > worst ? cycles : worst;
+        worst_reads = reads > worst_reads ? reads : worst_reads;
+        CHECK(log_row == row && log_sequence == sequence);
+        for(unsigned char i = 0; i != LOG_RECORDS; i++)
+        {
+            LOG_event(i);
+        }
+    }
+    printf("LOG_start, %u rows\n", LOG_ROWS);
+    REPORT("binary search", "%.1f us, %llu flash reads worst case", SIM_US(worst), (unsigned long long)worst_reads);
+    REPORT("full scan would read", "%u header bytes", 2 * LOG_ROWS);
+    CHECK(worst_reads <= 2 + 2 * 2);            // Row 0, then a binary search of the others
+    CHECK_RANGE(SIM_US(worst), 0, 50);
+}
+
+// Erase a row as a power loss between its erase and write would leave it.
+HOST static void cut_off(unsigned char row)
+{
+    for(unsigned int i = 0; i != SIM_FLASH_ROW; i++)
+    {
+        sim_flash[LOG_ROW_ADDRESS(row) + i] = 0x3FFF;
+    }
+}
+
+// A row cut off by a power loss reads as unwritten, and logging carries on
+// without reusing the sequence numbers of the older rows.
+HOST static void test_power_loss(void)
+{
+    for(unsigned char torn = 0; torn != LOG_ROWS; torn++)
+    {
+        boot();
+        for(unsigned int rows = 0; rows != 2U * LOG_ROWS + torn + 1; rows++)
+        {
+            for(unsigned char i = 0; i != LOG_RECORDS; i++)
+            {
+                LOG_event((unsigned char)rows);
+            }
+        }
+        unsigned char next = log_sequence;
+        CHECK(log_row == (torn + 1) % LOG_ROWS);
+        cut_off(torn);
+        LOG_start();
+        CHECK(log_row == torn && log_sequence == (unsigned char)(next - 1));
+        unsigned char records[2 * LOG_RECORDS];
+        CHECK(LOG_read(0, records) == LOG_RECORDS && records[1] == (unsigned char)(2 * LOG_ROWS + torn - 1));
+
+        // The next rows follow on, and LOG_start still finds them
+        for(unsigned int rows = 0; rows != LOG_ROWS; rows++)
+        {
+            for(unsigned char i = 0; i != LOG_RECORDS; i++)
+            {
+                LOG_event(0xE0 + rows);
+            }
+            unsigned char row = log_row;
+            unsigned char sequence = log_sequence;
+            LOG_start();
+            CHECK(log_row == row && log_sequence == sequence);
+            CHECK(LOG_read(0, records) == LOG_RECORDS && records[1] == 0xE0 + rows);
+        }
+    }
+
+    // The first row ever written, cut off: the log is empty
+    boot();
+    for(unsigned char i = 0; i != LOG_RECORDS; i++)
+    {
+        LOG_event(i);
+    }
+    cut_off(0);
+    LOG_start();
+    unsigned char records[2 * LOG_RECORDS];
+    CHECK(log_row == 0 && log_sequence == 0 && LOG_read(0, records) == 0);
+}
+
+HOST int main(void)
+{
+    test_records();
+    test_throughput();
+    test_start();
+    test_power_loss();
+    TEST_DONE();
+}
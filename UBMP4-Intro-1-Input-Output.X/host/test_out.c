@@ -0,0 +1,143 @@
+/*==============================================================================
+ File: test_out.c                       Host tests for the output shadow latch
+
+ Counts the simulated LATC and LATA accesses and output edges made by each
+ OUT_update and each OUT_pattern frame, to check that a change to several
+ LEDs and header outputs is a single glitch-free latch write per port, and
+ checks pattern frame timing, the repeat and stop behaviour, and that bits
+ outside the mask and reserved bits are left alone.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+static sim_edge_t edges[256];
+
+HOST static void boot(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    OUT_pattern_stop();
+    latc_reserved = 0;
+    out_latc_changed = 0;
+    out_lata_changed = 0;
+}
+
+// Return the number of logged edges on one register.
+HOST static unsigned int edge_count(unsigned char reg)
+{
+    unsigned int count = 0;
+    for(size_t i = 0; i != sim_log_count(); i++)
+    {
+        count += (edges[i].reg == reg);
+    }
+    return (count);
+}
+
+// Several shadow latch changes reach each port in one read and one write.
+HOST static void test_update(void)
+{
+    boot();
+    OUT_D1(false);
+    OUT_update();
+    sim_log(edges, sizeof(edges) / sizeof(edges[0]));
+    uint64_t latc = sim_access_count[SIM_LATC];
+    uint64_t lata = sim_access_count[SIM_LATA];
+    OUT_write(OUT_D2 | OUT_D3 | OUT_D4 | OUT_D5, OUT_D2 | OUT_D4);
+    OUT_write(OUT_H1 | OUT_H3, OUT_H1 | OUT_H3);
+    OUT_D1(true);
+    CHECK(sim_access_count[SIM_LATC] == latc && sim_access_count[SIM_LATA] == lata);
+    CHECK(sim_log_count() == 0);                // Nothing changes before the update
+    OUT_update();
+    latc = sim_access_count[SIM_LATC] - latc;
+    lata = sim_access_count[SIM_LATA] - lata;
+    REPORT("OUT_update, 6 outputs on 2 ports", "%" PRIu64 " LATC, %" PRIu64 " LATA accesses, %zu edges", latc, lata, sim_log_count());
+    CHECK(latc == 2 && lata == 2);
+    CHECK(edge_count(SIM_LATC) == 1 && edge_count(SIM_LATA) == 1);
+    CHECK(LATC == (OUT_D2 | OUT_D4 | OUT_H1 | OUT_H3));
+    CHECK((LATA & 0b00100000) == 0);
+    CHECK(GIE);
+
+    // Nothing changed: no latch accesses at all
+    latc = sim_access_count[SIM_LATC];
+    lata = sim_access_count[SIM_LATA];
+    OUT_update();
+    CHECK(sim_access_count[SIM_LATC] == latc && sim_access_count[SIM_LATA] == lata);
+
+    // Reserved bits keep the value their owner wrote
+    latc_reserved = OUT_H1;
+    OUT_write(OUT_H1 | OUT_D2, 0);
+    OUT_update();
+    CHECK(LATC == (OUT_D4 | OUT_H1 | OUT_H3));
+    latc_reserved = 0;
+    OUT_update();
+    CHECK(LATC == (OUT_D4 | OUT_H3));
+}
+
+// Each pattern frame is one LATC edge, on time, leaving other bits alone.
+HOST static void test_pattern(void)
+{
+    static const unsigned char chaser[] = { OUT_D2, OUT_D3, OUT_D4, OUT_D5 };
+    boot();
+    OUT_write(OUT_H2 | OUT_H4, OUT_H2 | OUT_H4);
+    OUT_update();
+    sim_log(edges, sizeof(edges) / sizeof(edges[0]));
+    uint64_t latc = sim_access_count[SIM_LATC];
+    uint64_t start = sim_cycles;
+    OUT_pattern(chaser, 4, 50, OUT_LEDS, true);
+    sim_run(1000 * SIM_CYCLES_PER_MS - (sim_cycles - start));
+    latc = sim_access_count[SIM_LATC] - latc;
+
+    unsigned int frames = edge_count(SIM_LATC);
+    double worst = 0;
+    for(size_t i = 0; i != sim_log_count(); i++)
+    {
+        CHECK(edges[i].reg == SIM_LATC);
+        CHECK((edges[i].value & ~OUT_LEDS) == (OUT_H2 | OUT_H4));
+        CHECK(edges[i].value == (chaser[i % 4] | OUT_H2 | OUT_H4));
+        double error = fabs(SIM_MS(edges[i].cycle - start) - 50.0 * i);
+        worst = (i != 0 && error > worst) ? error : worst;
+    }
+    REPORT("4-frame 50 ms chaser, 1 s", "%u frames, %.1f LATC accesses/frame, %.3f ms worst error", frames, (double)latc / frames, worst);
+    CHECK(frames == 20);
+    CHECK(latc == 2 * frames);
+    CHECK_RANGE(worst, 0, 1.01);
+    CHECK(OUT_pattern_busy());
+
+    // OUT_write outside the pattern mask still works while it plays
+    OUT_write(OUT_H2, 0);
+    OUT_update();
+    CHECK((LATC & (OUT_H2 | OUT_H4)) == OUT_H4);
+
+    // Stop leaves the last frame showing
+    OUT_pattern_stop();
+    unsigned char shown = LATC;
+    sim_run(200 * SIM_CYCLES_PER_MS);
+    CHECK(!OUT_pattern_busy() && LATC == shown);
+}
+
+// A pattern that does not repeat ends on its last frame.
+HOST static void test_once(void)
+{
+    static const unsigned char blink[] = { OUT_D5, 0, OUT_D5 | OUT_D2 };
+    boot();
+    sim_log(edges, sizeof(edges) / sizeof(edges[0]));
+    OUT_pattern(blink, 3, 20, OUT_D2 | OUT_D5, false);
+    sim_run(59 * SIM_CYCLES_PER_MS);
+    CHECK(OUT_pattern_busy());
+    sim_run(2 * SIM_CYCLES_PER_MS);
+    CHECK(!OUT_pattern_busy());
+    CHECK(LATC == (OUT_D5 | OUT_D2));
+    CHECK(edge_count(SIM_LATC) == 3);
+    OUT_pattern(blink, 0, 20, OUT_LEDS, true);  // An empty pattern is not played
+    CHECK(!OUT_pattern_busy());
+}
+
+HOST int main(void)
+{
+    test_update();
+    test_pattern();
+    test_once();
+    TEST_DONE();
+}
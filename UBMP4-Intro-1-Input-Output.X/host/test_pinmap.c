@@ -0,0 +1,113 @@
+/*==============================================================================
+ File: test_pinmap.c                    Host tests for the UBMP4.h pin table
+
+ Checks that UBMP4_config and ADC_config leave the port registers with the
+ values that were written by hand before the pin table, that each pin name
+ and its aliases reach only their own latch or port bit, and that setting a
+ pin name costs the same SFR accesses as a single bit instruction would.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+// Port registers set up by hand in UBMP4_config and ADC_config before the pin
+// table was added
+static const struct
+{
+    unsigned char reg;
+    unsigned char value;
+    const char *name;
+} original[] =
+{
+    { SIM_LATA, 0b00000000, "LATA" },
+    { SIM_ANSELA, 0b00000000, "ANSELA" },
+    { SIM_WPUA, 0b00001000, "WPUA" },
+    { SIM_TRISA, 0b00001111, "TRISA" },
+    { SIM_LATB, 0b00000000, "LATB" },
+    { SIM_ANSELB, 0b00000000, "ANSELB" },
+    { SIM_WPUB, 0b11110000, "WPUB" },
+    { SIM_TRISB, 0b11110000, "TRISB" },
+    { SIM_LATC, 0b00000000, "LATC" },
+    { SIM_ANSELC, 0b00001000, "ANSELC" },
+    { SIM_TRISC, 0b00001111, "TRISC" },
+};
+
+// The generated port settings match the hand-written constants.
+HOST static void test_config(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    ADC_config();
+    for(unsigned int i = 0; i != sizeof(original) / sizeof(original[0]); i++)
+    {
+        if(sim_sfr[original[i].reg] != original[i].value)
+        {
+            sim_fail("%s = 0x%02X, was set to 0x%02X by hand", original[i].name, sim_sfr[original[i].reg], original[i].value);
+        }
+        test_checks ++;
+    }
+    REPORT("port registers vs hand-written", "%zu match", sizeof(original) / sizeof(original[0]));
+    CHECK(PINMAP_PINS == 15);
+}
+
+// Each pin name and alias writes one latch bit, in one SFR access.
+HOST static void test_aliases(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+
+#define ALIAS_CHECK(pin, reg, mask) \
+    do { \
+        sim_sfr[reg] = 0; \
+        uint64_t accesses = sim_access_count[reg]; \
+        pin = 1; \
+        CHECK(sim_sfr[reg] == (mask) && sim_access_count[reg] == accesses + 1); \
+        pin = 0; \
+        CHECK(sim_sfr[reg] == 0); \
+    } while(0)
+
+    GIE = 0;                    // Keep the tick interrupt out of the counts
+    ALIAS_CHECK(BEEPER, SIM_LATA, 0b00010000);
+    ALIAS_CHECK(LS1, SIM_LATA, 0b00010000);
+    ALIAS_CHECK(D1, SIM_LATA, 0b00100000);
+    ALIAS_CHECK(LED1, SIM_LATA, 0b00100000);
+    ALIAS_CHECK(H1OUT, SIM_LATC, OUT_H1);
+    ALIAS_CHECK(H2OUT, SIM_LATC, OUT_H2);
+    ALIAS_CHECK(H3OUT, SIM_LATC, OUT_H3);
+    ALIAS_CHECK(H4OUT, SIM_LATC, OUT_H4);
+    ALIAS_CHECK(H5OUT, SIM_LATC, OUT_D2);
+    ALIAS_CHECK(D2, SIM_LATC, OUT_D2);
+    ALIAS_CHECK(LED2, SIM_LATC, OUT_D2);
+    ALIAS_CHECK(H6OUT, SIM_LATC, OUT_D3);
+    ALIAS_CHECK(D3, SIM_LATC, OUT_D3);
+    ALIAS_CHECK(LED3, SIM_LATC, OUT_D3);
+    ALIAS_CHECK(D6, SIM_LATC, OUT_D3);
+    ALIAS_CHECK(LED6, SIM_LATC, OUT_D3);
+    ALIAS_CHECK(IRLED, SIM_LATC, OUT_D3);
+    ALIAS_CHECK(H7OUT, SIM_LATC, OUT_D4);
+    ALIAS_CHECK(D4, SIM_LATC, OUT_D4);
+    ALIAS_CHECK(LED4, SIM_LATC, OUT_D4);
+    ALIAS_CHECK(H8OUT, SIM_LATC, OUT_D5);
+    ALIAS_CHECK(D5, SIM_LATC, OUT_D5);
+    ALIAS_CHECK(LED5, SIM_LATC, OUT_D5);
+    GIE = 1;
+
+    // Input names read their own pin
+    sim_button(SIM_SW1, true);
+    sim_button(SIM_SW4, true);
+    CHECK(SW1 == 0 && SW2 == 1 && SW3 == 1 && SW4 == 0 && SW5 == 1);
+    sim_pin(SIM_PORT_C, 0, false);
+    sim_pin(SIM_PORT_C, 2, true);
+    CHECK(IRIN == 1 && H3IN == 1 && H1IN == 0);
+    sim_pin(SIM_PORT_C, 2, false);
+    CHECK(IRIN == 0 && H3IN == 0);
+}
+
+HOST int main(void)
+{
+    test_config();
+    test_aliases();
+    TEST_DONE();
+}
@@ -0,0 +1,89 @@
+/*==============================================================================
+ File: test_sim.c                       Host simulator self-test
+
+ Checks the simulator models that the other tests rely on: delay timing,
+ oscillator start-up, port reads of scripted buttons, and ADC conversions.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+static const sim_step_t buttons[] =
+{
+    { 10 * SIM_CYCLES_PER_MS, SIM_BUTTON, SIM_SW2, 1 },
+    { 11 * SIM_CYCLES_PER_MS, SIM_BUTTON, SIM_SW2, 0 },
+    { 11 * SIM_CYCLES_PER_MS, SIM_BUTTON, SIM_SW5, 1 },
+    { 0, SIM_END, 0, 0 }
+};
+
+// __delay_ms and __delay_us advance exactly their time with interrupts off.
+HOST static void test_delays(void)
+{
+    sim_reset();
+    uint64_t start = sim_cycles;
+    __delay_ms(10);
+    CHECK(sim_cycles - start == 10 * SIM_CYCLES_PER_MS);
+    start = sim_cycles;
+    __delay_us(5);
+    CHECK(sim_cycles - start == 5 * SIM_CYCLES_PER_US);
+    CHECK(sim_delay_cycles == 10 * SIM_CYCLES_PER_MS + 5 * SIM_CYCLES_PER_US);
+}
+
+// OSC_config writes OSCCON and ACTCON, and waits for the PLL model to lock.
+HOST static void test_oscillator(void)
+{
+    sim_reset();
+    OSC_config();
+    CHECK(sim_sfr[SIM_OSCCON] == 0xFC && sim_sfr[SIM_ACTCON] == 0x90);
+    CHECK(sim_cycles >= SIM_PLL_LOCK_CYCLES && sim_cycles < SIM_PLL_LOCK_CYCLES + 100);
+    CHECK(BOOT_pll_wait() != 0);
+}
+
+// Scripted presses read as 0 on the pushbutton inputs at their times.
+HOST static void test_buttons(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    sim_script(buttons);
+    CHECK(SW2 == 1 && SW5 == 1);
+    sim_run_until(10 * SIM_CYCLES_PER_MS);
+    CHECK(SW2 == 0 && SW5 == 1 && SW1 == 1);
+    sim_run_until(11 * SIM_CYCLES_PER_MS);
+    CHECK(SW2 == 1 && SW5 == 0);
+}
+
+// ADC_read_channel converts the scripted value, left justified.
+HOST static void test_adc(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    ADC_config();
+    sim_adc(7, 1023);
+    CHECK(ADC_read_channel(ANQ1) == 255);
+    sim_adc(7, 100);
+    CHECK(ADC_read_channel(ANQ1) == 100 >> 2);
+    CHECK(sim_conversions == 2);
+}
+
+// TMR0 ticks count milliseconds in virtual time.
+HOST static void test_tick(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    unsigned int start = TICK_ms();
+    sim_run(1000 * SIM_CYCLES_PER_MS);
+    CHECK_RANGE((unsigned int)(TICK_ms() - start), 999, 1001);
+}
+
+HOST int main(void)
+{
+    test_delays();
+    test_oscillator();
+    test_buttons();
+    test_adc();
+    test_tick();
+    TEST_DONE();
+}
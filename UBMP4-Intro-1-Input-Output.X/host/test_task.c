@@ -0,0 +1,143 @@
+/*==============================================================================
+ File: test_task.c                      Host tests for the tick and scheduler
+
+ Checks TICK_ms accuracy against virtual time, the timing jitter and drift
+ of periodic tasks, one-shot tasks, slot use and TICK_ms wrap-around.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+#define RUNS    2000
+
+static uint64_t runs[RUNS];
+static unsigned int run_count;
+static unsigned int once_count;
+
+HOST static void periodic(void)
+{
+    if(run_count != RUNS)
+    {
+        runs[run_count] = sim_cycles;
+    }
+    run_count ++;
+}
+
+HOST static void once(void)
+{
+    once_count ++;
+}
+
+// A task that takes 3 ms, as a slow task sharing the main loop would.
+HOST static void slow(void)
+{
+    __delay_ms(3);
+}
+
+HOST static void boot(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    memset(tasks, 0, sizeof(tasks));
+    run_count = once_count = 0;
+}
+
+// Run the main loop (TASK_run only) until a virtual time.
+HOST static void main_loop(uint64_t end)
+{
+    while(sim_cycles < end)
+    {
+        TASK_run();
+    }
+}
+
+// TICK_ms counts whole milliseconds of virtual time with no drift.
+HOST static void test_tick_accuracy(void)
+{
+    boot();
+    uint64_t start = sim_cycles;
+    unsigned int ms = TICK_ms();
+    unsigned long ticks = tick_count_h * 256UL + tick_count;
+    sim_run(60000 * SIM_CYCLES_PER_MS);
+    unsigned int counted = TICK_ms() - ms;
+    REPORT("TICK_ms after 60 s", "%u ms", counted);
+    CHECK_RANGE(counted, 59999, 60001);
+    ticks = (tick_count_h * 256UL + tick_count - ticks) & 0xFFFF;
+    CHECK_RANGE(ticks, ((sim_cycles - start) / TICK_CYCLES - 1) & 0xFFFF, ((sim_cycles - start) / TICK_CYCLES + 1) & 0xFFFF);
+}
+
+// A 10 ms task runs every 10 ms on average, within one tick plus one pass of
+// the main loop, even while a slow task delays it.
+HOST static void test_task_jitter(bool with_slow)
+{
+    boot();
+    CHECK(TASK_every(periodic, 10) != TASK_NONE);
+    if(with_slow)
+    {
+        CHECK(TASK_every(slow, 7) != TASK_NONE);
+    }
+    uint64_t start = sim_cycles;
+    main_loop(start + 10000 * SIM_CYCLES_PER_MS);
+
+    double worst = 0;
+    for(unsigned int i = 1; i != run_count && i != RUNS; i++)
+    {
+        double error = fabs(SIM_US(runs[i] - runs[i - 1]) - 10000.0);
+        worst = error > worst ? error : worst;
+    }
+    double average = SIM_US(runs[run_count - 1] - runs[0]) / (run_count - 1);
+    REPORT(with_slow ? "10 ms task period, with 3 ms task" : "10 ms task period", "%.3f us average, %.1f us worst jitter", average, worst);
+    CHECK_RANGE(run_count, 999, 1000);
+    CHECK_RANGE(average, 9990, 10010);
+    CHECK_RANGE(worst, 0, SIM_US(TICK_CYCLES) + (with_slow ? 3100 : 100));
+}
+
+// One-shot tasks run once and free their slot. All slots can be used.
+HOST static void test_slots(void)
+{
+    boot();
+    CHECK(TASK_once(once, 5) == 0);
+    for(unsigned char i = 1; i != TASK_SLOTS; i++)
+    {
+        CHECK(TASK_every(periodic, 1000) == i);
+    }
+    CHECK(TASK_add(once, 0, 0) == TASK_NONE);
+    main_loop(sim_cycles + 4 * SIM_CYCLES_PER_MS);
+    CHECK(once_count == 0);
+    main_loop(sim_cycles + 2 * SIM_CYCLES_PER_MS);
+    CHECK(once_count == 1 && tasks[0].function == NULL);
+    main_loop(sim_cycles + 10 * SIM_CYCLES_PER_MS);
+    CHECK(once_count == 1);
+    TASK_remove(3);
+    CHECK(TASK_once(once, 0) == 0 && TASK_once(once, 0) == 3);
+    TASK_run();
+    CHECK(once_count == 3);
+}
+
+// Tasks stay on schedule when TICK_ms wraps from 65535 to 0.
+HOST static void test_wrap(void)
+{
+    boot();
+    GIE = 0;
+    tick_ms = 65530;
+    GIE = 1;
+    CHECK(TASK_once(once, 10) != TASK_NONE);
+    CHECK(TASK_every(periodic, 4) != TASK_NONE);
+    main_loop(sim_cycles + 9 * SIM_CYCLES_PER_MS);
+    CHECK(once_count == 0 && run_count == 2);
+    main_loop(sim_cycles + 2 * SIM_CYCLES_PER_MS);
+    CHECK(once_count == 1 && TICK_ms() < 10);
+    main_loop(sim_cycles + 10 * SIM_CYCLES_PER_MS);
+    CHECK(once_count == 1 && run_count == 5);
+}
+
+HOST int main(void)
+{
+    test_tick_accuracy();
+    test_task_jitter(false);
+    test_task_jitter(true);
+    test_slots();
+    test_wrap();
+    TEST_DONE();
+}
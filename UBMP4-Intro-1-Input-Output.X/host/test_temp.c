@@ -0,0 +1,224 @@
+/*==============================================================================
+ File: test_temp.c                      Host tests for the temperature monitor
+
+ Drives the ANTIM channel from a model of the high range indicator (VDD - 4
+ Vt, Vt falling 1.32 mV/C from 573 mV at 25 C) and checks TEMP_get against
+ the model temperature over -40 to 85 C, before and after TEMP_calibrate on a
+ board whose diode is off by several degrees. Also checks the indicator is
+ only on between TEMP_start and TEMP_stop, the calibration row in HEF, the
+ cost of TEMP_get, and the sample rate the other channels give up to ANTIM.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+#define ANTIM_CHANNEL   (ANTIM >> 2)    // ADC channel number for sim_adc
+#define SETTLE_MS       10              // More than FILTER_AVERAGE_SIZE sweeps of 3
+
+static const unsigned char channels[] = { ANQ1, ANH1, ANTIM };
+
+// ADC count of the indicator at a temperature, for a diode voltage offset.
+HOST static unsigned int indicator_count(double celsius, double offset_mv)
+{
+    double vt = 573 + offset_mv - 1.32 * (celsius - 25);
+    double count = 1023 * (TEMP_VDD_MV - 4 * vt) / TEMP_VDD_MV;
+    return ((unsigned int)lround(count < 0 ? 0 : count > 1023 ? 1023 : count));
+}
+
+// Tenths of a degree per count, and the temperature in tenths the conversion
+// should give for a count.
+#define PER_COUNT   (10.0 * TEMP_VDD_MV / 1023 / 4 / 1.32)
+
+HOST static double exact_tenths(unsigned int count)
+{
+    return (temp_cal_tenths + ((double)count - temp_cal_count) * PER_COUNT);
+}
+
+// Largest difference from exact_tenths allowed for TEMP_get: rounding, plus
+// the error of the 8.8 fixed-point TEMP_SLOPE over the distance from the
+// calibration count.
+HOST static double allowed(unsigned int count)
+{
+    return (0.5 + fabs((double)count - temp_cal_count) * fabs(TEMP_SLOPE / 256.0 - PER_COUNT) + 1e-9);
+}
+
+// Boot with erased HEF and the sampler converting Q1, H1 and ANTIM.
+HOST static void boot(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    TEMP_stop();                // Device variables keep their values from the last run
+    ADC_sampler_start(channels, 3, ADC_10BIT);
+}
+
+// Set the indicator's count and let the average settle.
+HOST static void settle(unsigned int count)
+{
+    sim_adc(ANTIM_CHANNEL, count);
+    sim_run(SETTLE_MS * SIM_CYCLES_PER_MS);
+}
+
+// The indicator is only powered between TEMP_start and TEMP_stop.
+HOST static void test_indicator(void)
+{
+    boot();
+    settle(550);
+    CHECK((sim_sfr[SIM_FVRCON] & 0b00110000) == 0);
+    CHECK(ADC_filtered(2) == 0 && TEMP_get() == 0);
+    TEMP_start(2);
+    CHECK((sim_sfr[SIM_FVRCON] & 0b00110000) == 0b00110000);
+    settle(550);
+    CHECK(ADC_filtered(2) == 550);
+    CHECK(temp_cal_count == TEMP_DEFAULT_COUNT && temp_cal_tenths == TEMP_DEFAULT_TENTHS);
+    TEMP_stop();
+    CHECK((sim_sfr[SIM_FVRCON] & 0b00110000) == 0 && TEMP_get() == 0);
+    ADC_sampler_stop();
+}
+
+// Worst |TEMP_get - model| in tenths from -40 to 85 C, and the worst
+// difference from the exact conversion of the count the ADC read.
+HOST static double sweep(double offset_mv, double *arithmetic)
+{
+    double worst = 0;
+    *arithmetic = 0;
+    for(int celsius = -40; celsius <= 85; celsius++)
+    {
+        unsigned int count = indicator_count(celsius, offset_mv);
+        settle(count);
+        int tenths = TEMP_get();
+        double error = fabs(tenths - 10.0 * celsius);
+        double math = fabs(tenths - exact_tenths(count));
+        CHECK(math <= allowed(count));
+        worst = error > worst ? error : worst;
+        *arithmetic = math > *arithmetic ? math : *arithmetic;
+    }
+    return (worst);
+}
+
+// TEMP_get follows the model to within a count, and its fixed-point math
+// rounds to the nearest tenth of the exact conversion.
+HOST static void test_conversion(void)
+{
+    boot();
+    TEMP_start(2);
+    double arithmetic;
+    double worst = sweep(0, &arithmetic);
+    printf("Conversion, -40 to 85 C\n");
+    REPORT("typical diode, default calibration", "%4.1f C worst error, %.2f tenths from exact math", worst / 10, arithmetic);
+    CHECK_RANGE(worst, 0, PER_COUNT / 2 + 1);     // Half a count, plus rounding
+
+    // The ends of the ADC range don't overflow
+    settle(0);
+    CHECK(fabs(TEMP_get() - exact_tenths(0)) <= allowed(0));
+    settle(1023);
+    CHECK(fabs(TEMP_get() - exact_tenths(1023)) <= allowed(1023));
+
+    // TEMP_get only does the math when the average changes
+    settle(indicator_count(25, 0));
+    TEMP_get();
+    uint64_t start = sim_cycles;
+    int cached = TEMP_get();
+    uint64_t cached_cycles = sim_cycles - start;
+    temp_count = 0xFFFF;
+    start = sim_cycles;
+    CHECK(TEMP_get() == cached);
+    uint64_t math_cycles = sim_cycles - start;
+    REPORT("TEMP_get", "%llu cycles cached, %llu cycles recalculated", (unsigned long long)cached_cycles,
+        (unsigned long long)math_cycles);
+    CHECK(cached_cycles < math_cycles);
+    TEMP_stop();
+    ADC_sampler_stop();
+}
+
+// A diode 8 mV off reads about 6 C wrong until calibrated at one temperature,
+// and the calibration is saved in HEF and loaded by TEMP_start.
+HOST static void test_calibration(void)
+{
+    boot();
+    TEMP_start(2);
+    double arithmetic;
+    double before = sweep(8, &arithmetic);
+
+    settle(indicator_count(21.5, 8));
+    GIE = 1;
+    uint64_t start = sim_cycles;
+    TEMP_calibrate(215);
+    uint64_t stall = sim_cycles - start;
+    CHECK(GIE);
+    unsigned int row = TEMP_CAL_ADDRESS / SIM_FLASH_ROW;
+    CHECK(sim_flash_erases[row] == 1 && sim_flash_writes[row] == 1);
+    CHECK((sim_flash[TEMP_CAL_ADDRESS] & 0xFF) == TEMP_CAL_MARK);
+    CHECK(TEMP_get() == 215);
+    double after = sweep(8, &arithmetic);
+    printf("Calibration, diode 8 mV high\n");
+    REPORT("before TEMP_calibrate(215)", "%4.1f C worst error", before / 10);
+    REPORT("after", "%4.1f C worst error", after / 10);
+    REPORT("TEMP_calibrate stall", "%.2f ms", SIM_MS(stall));
+    CHECK(before > 50 && after < 10);
+
+    // Restarting loads the saved calibration
+    unsigned int count = temp_cal_count;
+    TEMP_stop();
+    temp_cal_count = 0;
+    temp_cal_tenths = 0;
+    TEMP_start(2);
+    CHECK(temp_cal_count == count && temp_cal_tenths == 215);
+    settle(count);
+    CHECK(TEMP_get() == 215);
+    TEMP_stop();
+    ADC_sampler_stop();
+}
+
+// Conversions per second of Q1 and the ISR CPU with and without ANTIM.
+static unsigned long q1_conversions;
+
+HOST static unsigned int counting_source(unsigned char channel)
+{
+    q1_conversions += (channel == (ANQ1 >> 2));
+    return (500);
+}
+
+HOST static void test_throughput(void)
+{
+    printf("Sampler with ANTIM\n");
+    double rates[2];
+    for(unsigned char with = 0; with != 2; with++)
+    {
+        boot();
+        ADC_sampler_stop();
+        ADC_sampler_start(channels, 2 + with, ADC_10BIT);
+        if(with)
+        {
+            TEMP_start(2);
+        }
+        sim_adc_source = counting_source;
+        sim_run(10 * SIM_CYCLES_PER_MS);
+        q1_conversions = 0;
+        uint64_t isr = sim_isr_cycles;
+        uint64_t start = sim_cycles;
+        for(unsigned int ms = 0; ms != 1000; ms++)
+        {
+            sim_run(SIM_CYCLES_PER_MS);
+            TEMP_get();         // Main loop use
+        }
+        rates[with] = q1_conversions * 1000 / SIM_MS(sim_cycles - start);
+        double cpu = 100.0 * (sim_isr_cycles - isr) / (sim_cycles - start);
+        REPORT(with ? "Q1, H1, ANTIM" : "Q1, H1", "%6.1f Q1 samples/s, %.2f %% ISR CPU", rates[with], cpu);
+        CHECK_RANGE(rates[with], ADC_TRIGGER_HZ / (2.0 + with) - 1, ADC_TRIGGER_HZ / (2.0 + with) + 1);
+        CHECK_RANGE(cpu, 0, 10);
+        sim_adc_source = NULL;
+        TEMP_stop();
+        ADC_sampler_stop();
+    }
+    CHECK_RANGE(rates[1] / rates[0], 2.0 / 3 - 0.01, 2.0 / 3 + 0.01);
+}
+
+HOST int main(void)
+{
+    test_indicator();
+    test_conversion();
+    test_calibration();
+    test_throughput();
+    TEST_DONE();
+}
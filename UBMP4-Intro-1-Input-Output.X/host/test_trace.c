@@ -0,0 +1,163 @@
+/*==============================================================================
+ File: test_trace.c                     Host tests for the trace markers
+
+ Builds UBMP4.c with UBMP4_TRACE and UBMP4_TRACE_PULSE, runs a main loop that
+ reads two ADC channels while LED brightness control is interrupting it, and
+ decodes the H8OUT waveform: the TRACE_dump serial data back into entries, and
+ the marker pulses into times. Prints histograms of the ADC_read_channel spin
+ time and the loop period, and checks them against the simulator's clock.
+==============================================================================*/
+
+#define UBMP4_TRACE
+#define UBMP4_TRACE_PULSE
+
+#include    "test.h"
+#include    "trace.h"
+#include    "build/UBMP4.c"
+
+#define ROUNDS      40
+#define LOOPS       5           // Loop passes per dump (3 markers each)
+#define LOOP_MARK   1
+
+static sim_edge_t edges[4000];
+static uint32_t random_state = 4321;
+
+HOST static unsigned int random_below(unsigned int limit)
+{
+    random_state = random_state * 1103515245 + 12345;
+    return ((random_state >> 16) % limit);
+}
+
+// Markers survive a round trip through TRACE_dump and the decoder, and time
+// the loop as the simulator does.
+HOST static void test_dump(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    LED_pwm_start();            // Interrupts stretch the loop and delay bit edges
+    LED_set_duty(2, 100);
+    LED_set_duty(3, 30);
+    LED_set_duty(5, 0);         // H8 carries the trace
+    trace_count = 0;
+
+    trace_histogram_t spin, period;
+    trace_histogram_init(&spin, 1);
+    trace_histogram_init(&period, 25);
+    double true_period = 0, worst_pulse = 0;
+    unsigned long periods = 0;
+    unsigned int errors = 0;
+    for(unsigned int round = 0; round != ROUNDS; round++)
+    {
+        // Work load: two ADC reads and a varying delay per pass
+        uint64_t loop_start[LOOPS];
+        bool level = H8OUT;
+        sim_log(edges, sizeof(edges) / sizeof(edges[0]));
+        for(unsigned int pass = 0; pass != LOOPS; pass++)
+        {
+            loop_start[pass] = sim_cycles;
+            TRACE(LOOP_MARK);
+            ADC_read_channel(ANQ1);
+            __delay_us(100 + random_below(300));
+        }
+        for(unsigned int pass = 1; pass != LOOPS; pass++)
+        {
+            true_period += SIM_US(loop_start[pass] - loop_start[pass - 1]);
+            periods ++;
+        }
+        trace_t expected[TRACE_SIZE];
+        unsigned char expected_count = trace_count;
+        for(unsigned char i = 0; i != trace_count; i++)
+        {
+            expected[i] = trace_buffer[(trace_head - trace_count + i) & (TRACE_SIZE - 1)];
+        }
+        uint64_t pulses[TRACE_SIZE];
+        size_t pulse_count = trace_pulses(edges, sim_log_count(), SIM_LATC, 7, level, pulses, TRACE_SIZE);
+        CHECK(pulse_count == expected_count);
+
+        // Dump and decode the serial data
+        level = H8OUT;
+        sim_log(edges, sizeof(edges) / sizeof(edges[0]));
+        CHECK(TRACE_dump());
+        unsigned char bytes[2 + 3 * TRACE_SIZE];
+        unsigned int framing;
+        size_t byte_count = trace_uart(edges, sim_log_count(), SIM_LATC, 7, level,
+            TIME_US(TRACE_BIT_US) * TRACE_COUNT_CYCLES, bytes, sizeof(bytes), &framing);
+        errors += framing;
+        trace_entry_t entries[TRACE_SIZE];
+        size_t count = trace_parse(bytes, byte_count, entries, TRACE_SIZE);
+        CHECK(count == expected_count && count == 3 * LOOPS);
+        for(size_t i = 0; i != count; i++)
+        {
+            CHECK(entries[i].id == expected[i].id);
+            CHECK((uint16_t)(entries[i].time - entries[0].time + (expected[0].time_h << 8 | expected[0].time_l))
+                == (uint16_t)(expected[i].time_h << 8 | expected[i].time_l));
+
+            // The marker pulses agree with the timestamps
+            if(i != 0)
+            {
+                double stamp = (double)(entries[i].time - entries[i - 1].time) * TRACE_COUNT_CYCLES;
+                double error = fabs(stamp - (double)(pulses[i] - pulses[i - 1]));
+                worst_pulse = error > worst_pulse ? error : worst_pulse;
+            }
+        }
+        trace_histogram_add(&spin, entries, count, TRACE_ADC_START, TRACE_ADC_DONE);
+        trace_histogram_add(&period, entries, count, LOOP_MARK, LOOP_MARK);
+        CHECK(trace_count == 0);
+    }
+    LED_pwm_stop();
+
+    trace_histogram_print("ADC_read_channel spin (TRACE_ADC_START to DONE)", &spin);
+    trace_histogram_print("loop period", &period);
+    REPORT("decoded loop period vs simulator", "%.2f us vs %.2f us average", period.total_us / period.count, true_period / periods);
+    REPORT("pulse interval vs timestamps", "%.1f us worst difference", SIM_US(worst_pulse));
+    CHECK(errors == 0);
+    CHECK(spin.count == ROUNDS * LOOPS && period.count == ROUNDS * (LOOPS - 1));
+    CHECK_RANGE(spin.min_us, 11.5 * 1.333, 25);     // At least 11.5 TAD at Fosc/64
+    CHECK_RANGE(spin.max_us - spin.min_us, 0, SIM_US(2 * sim_isr_max) + 2);
+    CHECK_RANGE(period.total_us / period.count, true_period / periods - 1.5, true_period / periods + 1.5);
+    CHECK_RANGE(SIM_US(worst_pulse), 0, SIM_US(TRACE_COUNT_CYCLES + sim_isr_max));
+}
+
+// A full buffer keeps the newest entries, and the dump refuses to run with
+// interrupts off or while H8 is in use.
+HOST static void test_ring(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    trace_count = 0;
+    for(unsigned char id = 0; id != TRACE_SIZE + 5; id++)
+    {
+        TRACE(id);
+    }
+    CHECK(trace_count == TRACE_SIZE);
+    CHECK(trace_buffer[(trace_head - TRACE_SIZE) & (TRACE_SIZE - 1)].id == 5);
+    GIE = 0;
+    CHECK(!TRACE_dump());
+    GIE = 1;
+    latc_reserved |= OUT_D5;
+    CHECK(!TRACE_dump());
+    latc_reserved &= ~OUT_D5;
+    H8OUT = 0;
+    sim_log(edges, sizeof(edges) / sizeof(edges[0]));
+    uint64_t start = sim_cycles;
+    CHECK(TRACE_dump());
+    REPORT("full buffer dump", "%.1f ms", SIM_MS(sim_cycles - start));
+    CHECK_RANGE(SIM_MS(sim_cycles - start), 50, 55);
+    CHECK(H8OUT == 0 && latc_reserved == 0);
+    unsigned char bytes[2 + 3 * TRACE_SIZE];
+    unsigned int errors;
+    size_t byte_count = trace_uart(edges, sim_log_count(), SIM_LATC, 7, false,
+        TIME_US(TRACE_BIT_US) * TRACE_COUNT_CYCLES, bytes, sizeof(bytes), &errors);
+    trace_entry_t entries[TRACE_SIZE];
+    CHECK(trace_parse(bytes, byte_count, entries, TRACE_SIZE) == TRACE_SIZE && errors == 0);
+    CHECK(entries[0].id == 5 && entries[TRACE_SIZE - 1].id == TRACE_SIZE + 4);
+}
+
+HOST int main(void)
+{
+    test_dump();
+    test_ring();
+    TEST_DONE();
+}
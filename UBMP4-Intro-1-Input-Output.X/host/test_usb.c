@@ -0,0 +1,282 @@
+/*==============================================================================
+ File: test_usb.c                       Host loopback tests for USB CDC
+
+ Runs the device's USB code against the SIE and host controller stand-in in
+ usb_host.h, raising SOFIF every 1 ms frame while the PC polls EP2 IN. The
+ tests enumerate the device, stream ADC samples and button events through
+ the packetizer and parse the byte stream the PC would see, stop reading to
+ check the ring buffer's flow control, and echo data through the OUT and IN
+ endpoints.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+#include    "usb_host.h"
+
+#define POLLS           20              // Host polls of EP2 IN per frame
+
+// PC side of the stream
+static unsigned char received[32768];
+static uint64_t arrived[32768];
+static size_t received_count;
+
+// Boot, start USB, and enumerate and open the serial port as a PC would.
+HOST static void enumerate(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    USB_stop();
+    usb_stream_sequence = 0;    // Device variables keep their values from the last run
+    usb_event_count = 0;
+    usb_streaming = false;
+    received_count = 0;
+    usb_host_attach();
+}
+
+// Run frames with the PC polling EP2 IN (or not), appending what it reads.
+HOST static void run_frames(unsigned int frames, bool reading)
+{
+    unsigned char packet[64];
+    for(unsigned int frame = 0; frame != frames; frame++)
+    {
+        uint64_t start = sim_cycles;
+        usb_interrupt(UIR_SOFIF);
+        for(unsigned int poll = 0; poll != POLLS; poll++)
+        {
+            sim_run_until(start + (poll + 1) * SIM_CYCLES_PER_MS / POLLS);
+            int count;
+            while(reading && (count = bus_in(2, packet)) != NAK)
+            {
+                CHECK(count <= 64 && received_count + (size_t)count <= sizeof(received));
+                if(count > USB_HEADER_SIZE)
+                {
+                    // Samples are sent from the ring buffer, not copied
+                    CHECK(last_in_address >= USB_RING_ADDRESS && last_in_address < USB_RING_ADDRESS + sizeof(adc_ring));
+                }
+                for(int i = 0; i != count; i++)
+                {
+                    arrived[received_count] = sim_cycles;
+                    received[received_count++] = packet[i];
+                }
+            }
+        }
+    }
+}
+
+// ADC source counting conversions, with the time of each
+#define CONVERSIONS 12000
+
+static uint64_t converted[CONVERSIONS];
+static unsigned int conversions;
+
+HOST static unsigned int counting_source(unsigned char channel)
+{
+    (void)channel;
+    if(conversions != CONVERSIONS)
+    {
+        converted[conversions] = sim_cycles;
+    }
+    return (conversions++ & 1023);
+}
+
+// Stream results parsed from the bytes the PC received
+typedef struct
+{
+    unsigned int packets;       // Stream packets
+    unsigned int samples;       // Samples received
+    unsigned int missing;       // Samples skipped in the count sequence
+    unsigned int events;        // Events received
+    unsigned int errors;        // Bad sync, sequence or event bytes
+    double latency;             // Average conversion to PC time (ms)
+    double worst;               // Worst conversion to PC time (ms)
+} stream_t;
+
+// Parse the stream: sync, sequence, sample bytes, event count, events, samples.
+HOST static stream_t parse_stream(unsigned int first_event)
+{
+    stream_t stream = { 0 };
+    size_t i = 0;
+    unsigned int sample = 0;
+    unsigned char sequence = 0;
+    double total = 0;
+    while(i + 4 <= received_count)
+    {
+        unsigned char bytes = received[i + 2];
+        unsigned char events = received[i + 3];
+        if(received[i] != USB_STREAM_SYNC || received[i + 1] != sequence || (bytes & 1) || events > USB_STREAM_EVENTS)
+        {
+            stream.errors ++;
+            break;
+        }
+        sequence ++;
+        stream.packets ++;
+        i += 4;
+        for(unsigned char e = 0; e != events; e++)
+        {
+            stream.errors += (received[i++] != (unsigned char)(first_event + stream.events++));
+        }
+        for(unsigned char s = 0; s != bytes / 2; s++, i += 2)
+        {
+            unsigned int value = received[i] | (unsigned int)received[i + 1] << 8;
+            unsigned int skipped = (value - sample) & 1023;
+            stream.missing += skipped;
+            sample += skipped;
+            if(sample < CONVERSIONS)
+            {
+                double ms = SIM_MS(arrived[i + 1] - converted[sample]);
+                total += ms;
+                stream.worst = ms > stream.worst ? ms : stream.worst;
+            }
+            sample ++;
+            stream.samples ++;
+        }
+    }
+    stream.errors += (i != received_count);
+    stream.latency = stream.samples ? total / stream.samples : 0;
+    return (stream);
+}
+
+// Start the sampler on one channel with the stream going to USB.
+HOST static void stream_start(void)
+{
+    static const unsigned char channel = ANQ1;
+    conversions = 0;
+    sim_adc_source = counting_source;
+    ADC_sampler_start(&channel, 1, ADC_10BIT);
+    ADC_trigger(ADC_TRIGGER_TMR0);
+    ADC_stream_start(0);
+    USB_stream(true);
+}
+
+HOST static void stream_stop(void)
+{
+    USB_stream(false);
+    ADC_stream_stop();
+    ADC_sampler_stop();
+    sim_adc_source = NULL;
+}
+
+// Every sample and event arrives in order, within a batch time, from the ring.
+HOST static void test_stream(void)
+{
+    enumerate();
+    stream_start();
+    usb_isr = 0;
+    uint64_t start = sim_cycles;
+    unsigned int queued = 0;
+    for(unsigned int ms = 0; ms != 1000; ms += 20)
+    {
+        queued += USB_stream_event((unsigned char)queued);  // A button event every 20 ms
+        run_frames(20, true);
+    }
+    double elapsed = (double)(sim_cycles - start);
+    stream_t stream = parse_stream(0);
+    REPORT("stream, 1 channel, 1 s", "%u samples, %u packets, %u missing, %u errors", stream.samples, stream.packets, stream.missing, stream.errors);
+    REPORT("  sample to PC latency", "%.2f ms average, %.2f ms worst", stream.latency, stream.worst);
+    REPORT("  USB ISR cost", "%.0f cycles/batch, %.2f %% CPU", (double)usb_isr / stream.packets, 100.0 * usb_isr / elapsed);
+    REPORT("  throughput", "%.0f bytes/s", received_count * SIM_CYCLES_PER_MS * 1000.0 / elapsed);
+    CHECK(stream.errors == 0 && stream.missing == 0 && toggle_errors == 0);
+    CHECK_RANGE(stream.samples, conversions - ADC_RING_SIZE, conversions);
+    CHECK(stream.events == queued && queued == 50);
+    CHECK(ADC_stream_overruns() == 0);
+    CHECK_RANGE(stream.worst, 0, USB_BATCH_MS + 1);
+    CHECK_RANGE(100.0 * usb_isr / elapsed, 0, 5);
+
+    // Events fill the header up to USB_STREAM_EVENTS
+    USB_stream(false);
+    run_frames(2 * USB_BATCH_MS, true);
+    unsigned int refused = 0;
+    for(unsigned int i = 0; i != USB_STREAM_EVENTS + 2; i++)
+    {
+        refused += !USB_stream_event((unsigned char)(queued + i));
+    }
+    CHECK(refused == 2);
+    stream_stop();
+}
+
+// When the PC stops reading, the ring fills and counts each dropped sample,
+// and the stream picks up again with no lost or repeated packets.
+HOST static void test_flow_control(void)
+{
+    enumerate();
+    stream_start();
+    run_frames(100, true);
+    run_frames(40, false);      // About 117 samples, the ring holds 31
+    run_frames(100, true);
+    unsigned char overruns = ADC_stream_overruns();
+    stream_t stream = parse_stream(0);
+    REPORT("PC stops reading for 40 ms", "%u samples dropped, %u missing from stream", overruns, stream.missing);
+    CHECK(stream.errors == 0 && toggle_errors == 0);
+    CHECK_RANGE(overruns, 40 * ADC_TRIGGER_HZ / 1000 - ADC_RING_SIZE, 40 * ADC_TRIGGER_HZ / 1000 + 2);
+    CHECK(stream.missing == overruns);
+    stream_stop();
+}
+
+// Bytes sent to EP2 OUT are read by USB_read_byte and echoed with USB_write.
+HOST static void test_echo(void)
+{
+    enumerate();
+    unsigned char out[100], echo[128], packet[64];
+    for(unsigned int i = 0; i != sizeof(out); i++)
+    {
+        out[i] = (unsigned char)(i * 7 + 3);
+    }
+
+    // Both receive buffers fill, then the device NAKs until it reads
+    CHECK(bus_out(2, PID_OUT, out, USB_RX_SIZE));
+    CHECK(bus_out(2, PID_OUT, out + USB_RX_SIZE, USB_RX_SIZE));
+    CHECK(!bus_out(2, PID_OUT, out + 2 * USB_RX_SIZE, USB_RX_SIZE));
+
+    unsigned int sent = 2 * USB_RX_SIZE, echoed = 0, read = 0;
+    unsigned char line[USB_WRITE_SIZE];
+    unsigned char length = 0;
+    uint64_t start = sim_cycles;
+    while(echoed != sizeof(out) && sim_cycles - start < 100 * SIM_CYCLES_PER_MS)
+    {
+        // Device main loop: read bytes and echo them a packet at a time
+        while(length != USB_WRITE_SIZE && USB_read_byte(&line[length]))
+        {
+            length ++;
+        }
+        if(length != 0 && USB_write(line, length))
+        {
+            length = 0;
+        }
+
+        // PC: send the rest and read the echo
+        unsigned char count = (unsigned char)(sizeof(out) - sent < USB_RX_SIZE ? sizeof(out) - sent : USB_RX_SIZE);
+        if(count != 0 && bus_out(2, PID_OUT, out + sent, count))
+        {
+            sent += count;
+        }
+        int in = bus_in(2, packet);
+        if(in != NAK)
+        {
+            memcpy(echo + echoed, packet, (size_t)in);
+            echoed += (unsigned int)in;
+            read ++;
+        }
+        sim_run(50 * SIM_CYCLES_PER_US);
+    }
+    REPORT("echo through EP2 OUT and IN", "%u bytes in %u packets, %.2f ms", echoed, read, SIM_MS(sim_cycles - start));
+    CHECK(echoed == sizeof(out) && memcmp(echo, out, sizeof(out)) == 0);
+    CHECK(toggle_errors == 0);
+    CHECK(!USB_write(out, USB_WRITE_SIZE + 1));
+    USB_stop();
+    CHECK(!USB_ready() && !USB_write(out, 1));
+}
+
+HOST int main(void)
+{
+    // The USB RAM buffers are in address order without overlaps
+    for(unsigned int i = 1; i != sizeof(usb_ram) / sizeof(usb_ram[0]); i++)
+    {
+        CHECK(usb_ram[i - 1].address + usb_ram[i - 1].size <= usb_ram[i].address);
+    }
+    CHECK(USB_EP0_OUT_ADDRESS == USB_BDT_ADDRESS + sizeof(usb_bdt));
+    test_stream();
+    test_flow_control();
+    test_echo();
+    TEST_DONE();
+}
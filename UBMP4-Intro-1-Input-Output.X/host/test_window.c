@@ -0,0 +1,350 @@
+/*==============================================================================
+ File: test_window.c                    Host tests for the ADC window events
+
+ Plays a scripted light profile into ANQ1: night, dawn, a passing cloud, a
+ level hovering just inside the hysteresis, dusk, a 1 ms flash and a 50 ms
+ flash, with 100 Hz lamp flicker and Gaussian noise on top. Checks the window
+ events against the zones of the noise-free profile (no missed, wrong or
+ extra events, and a bounded delay) and that the flicker near a threshold
+ and the short flash raise no events. Compares the CPU time per second of
+ watching the light with window events against the polling pattern, which
+ reads ADC_read_channel(ANQ1) and compares in the main loop, either back to
+ back or at a fixed rate.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+#define PROFILE_MS  10000       // Length of the light profile
+#define STEP_US     250         // Script step spacing
+#define STEPS       (PROFILE_MS * 1000 / STEP_US)
+#define NOISE       3.0         // Gaussian noise, counts rms
+#define FLICKER     0.01        // 100 Hz flicker, fraction of the level
+#define LOW         300         // Window thresholds (10-bit counts)
+#define HIGH        700
+#define HYSTERESIS  16
+#define DWELL       8           // Filtered values in a row
+#define GLITCH_MS   10          // Excursions shorter than this are noise
+#define EVENTS_MAX  32
+
+static sim_step_t script[STEPS + 1];
+static uint32_t random_state = 4242;
+
+// One recorded or expected zone change.
+typedef struct
+{
+    unsigned char zone;
+    double ms;
+} change_t;
+
+static change_t expected[EVENTS_MAX];
+static unsigned int expected_count;
+
+HOST static double random_uniform(void)
+{
+    random_state = random_state * 1103515245 + 12345;
+    return (((random_state >> 8) & 0xFFFF) + 0.5) / 65536.0;
+}
+
+HOST static double random_gaussian(void)
+{
+    return (sqrt(-2 * log(random_uniform())) * cos(2 * M_PI * random_uniform()));
+}
+
+// Linear ramp from a to b between times t0 and t1.
+HOST static double ramp(double t, double t0, double t1, double a, double b)
+{
+    return (a + (b - a) * (t - t0) / (t1 - t0));
+}
+
+// Noise-free light level (10-bit counts) at a time in the profile.
+HOST static double profile(double ms)
+{
+    if(ms < 1000) return (120);                                 // Night
+    if(ms < 2000) return (ramp(ms, 1000, 2000, 120, 820));      // Dawn
+    if(ms < 3000) return (820);
+    if(ms < 3200) return (ramp(ms, 3000, 3200, 820, 500));      // Cloud
+    if(ms < 3600) return (500);
+    if(ms < 3800) return (ramp(ms, 3600, 3800, 500, 820));
+    if(ms < 4500) return (820);
+    if(ms < 4700) return (ramp(ms, 4500, 4700, 820, 705));      // Hover
+    if(ms < 5700) return (705 + 5 * sin(2 * M_PI * (ms - 4700) / 250));
+    if(ms < 7000) return (ramp(ms, 5700, 7000, 705, 120));      // Dusk
+    if(ms >= 8000 && ms < 8001) return (900);                   // Flash
+    if(ms >= 9000 && ms < 9050) return (900);                   // Headlights
+    return (120);
+}
+
+// Zone of a level, given the zone it is in now (the same rule as the ISR).
+HOST static unsigned char zone_of(double level, unsigned char zone)
+{
+    double low = LOW, high = HIGH;
+    if(zone == ADC_ZONE_LOW)
+    {
+        low += HYSTERESIS;
+    }
+    else if(zone == ADC_ZONE_HIGH)
+    {
+        high -= HYSTERESIS;
+    }
+    else if(zone == ADC_ZONE_IN)
+    {
+        low -= HYSTERESIS;
+        high += HYSTERESIS;
+    }
+    return (level < low ? ADC_ZONE_LOW : level > high ? ADC_ZONE_HIGH : ADC_ZONE_IN);
+}
+
+// Script the profile with flicker and noise, and find the zone changes of
+// the noise-free profile that last at least GLITCH_MS.
+HOST static void make_profile(void)
+{
+    unsigned char zone = ADC_ZONE_NONE;
+    expected_count = 0;
+    for(unsigned int i = 0; i != STEPS; i++)
+    {
+        double ms = i * STEP_US / 1000.0;
+        double level = profile(ms);
+        double value = level * (1 + FLICKER * sin(2 * M_PI * ms / 10)) + NOISE * random_gaussian();
+        value = floor(value + 0.5);
+        script[i] = (sim_step_t){ (uint64_t)(ms * SIM_CYCLES_PER_MS), SIM_ADC, ANQ1 >> 2,
+            (unsigned int)(value < 0 ? 0 : value > 1023 ? 1023 : value) };
+        unsigned char next = zone_of(level, zone);
+        if(next != zone)
+        {
+            if(expected_count != 0 && ms - expected[expected_count - 1].ms < GLITCH_MS)
+            {
+                expected_count --;  // Back out of a glitch
+                zone = expected_count ? expected[expected_count - 1].zone : ADC_ZONE_NONE;
+                continue;
+            }
+            expected[expected_count++] = (change_t){ next, ms };
+            zone = next;
+        }
+    }
+    script[STEPS].kind = SIM_END;
+}
+
+// Boot with the profile scripted from time 0.
+HOST static void boot(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    ADC_config();
+    for(unsigned char i = 0; i != ADC_SAMPLER_SLOTS; i++)
+    {
+        ADC_window_off(i);      // Device variables keep their values from the last run
+    }
+    while(ADC_event() != ADC_EVENT_NONE)
+        ;
+    for(unsigned int i = 0; i != STEPS; i++)
+    {
+        script[i].cycle += sim_cycles;
+    }
+    sim_script(script);
+}
+
+HOST static void unscript(uint64_t start)
+{
+    sim_script(NULL);
+    for(unsigned int i = 0; i != STEPS; i++)
+    {
+        script[i].cycle -= start;
+    }
+}
+
+// Count the differences between recorded and expected zone changes, and the
+// worst delay of the matching ones.
+HOST static unsigned int compare(const change_t *changes, unsigned int count, double *worst)
+{
+    unsigned int errors = 0;
+    *worst = 0;
+    for(unsigned int i = 0; i < count || i < expected_count; i++)
+    {
+        if(i >= count || i >= expected_count || changes[i].zone != expected[i].zone)
+        {
+            errors ++;
+            continue;
+        }
+        double delay = changes[i].ms - expected[i].ms;
+        *worst = fabs(delay) > fabs(*worst) ? delay : *worst;
+    }
+    return (errors);
+}
+
+// CPU cycles per second used by the tick alone, to leave out of the others.
+HOST static double idle_cpu(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    uint64_t isr = sim_isr_cycles;
+    uint64_t start = sim_cycles;
+    sim_run(1000 * SIM_CYCLES_PER_MS);
+    return ((double)(sim_isr_cycles - isr) * SIM_CYCLES_PER_MS * 1000 / (sim_cycles - start));
+}
+
+// Watch the light with window events: the ISR samples, filters and compares,
+// and the main loop checks ADC_event every millisecond. Returns the CPU
+// cycles per second, and the window's own share of them.
+HOST static double run_events(change_t *changes, unsigned int *count, double *window_share)
+{
+    static const unsigned char channel = ANQ1;
+    double cpu[2];
+    for(unsigned char with = 0; with != 2; with++)
+    {
+        boot();
+        uint64_t start = sim_cycles;
+        ADC_sampler_start(&channel, 1, ADC_10BIT);
+        ADC_filter(0, FILTER_AVERAGE, 0);
+        if(with)
+        {
+            ADC_window(0, LOW, HIGH, HYSTERESIS, DWELL);
+        }
+        uint64_t isr = sim_isr_cycles;
+        uint64_t main = 0;
+        *count = 0;
+        while(sim_cycles - start < PROFILE_MS * SIM_CYCLES_PER_MS)
+        {
+            sim_run(SIM_CYCLES_PER_MS);
+            uint64_t before = sim_cycles;
+            unsigned char event = ADC_event();
+            main += sim_cycles - before;
+            if(event != ADC_EVENT_NONE && *count != EVENTS_MAX)
+            {
+                changes[(*count)++] = (change_t){ ADC_EVENT_TYPE(event) >> 4, SIM_MS(sim_cycles - start) };
+                CHECK(ADC_EVENT_INDEX(event) == 0 && ADC_zone(0) == ADC_EVENT_TYPE(event) >> 4);
+            }
+        }
+        cpu[with] = (double)(sim_isr_cycles - isr + main) * 1000 / PROFILE_MS;
+        ADC_window_off(0);
+        ADC_sampler_stop();
+        unscript(start);
+    }
+    *window_share = cpu[1] - cpu[0];
+    return (cpu[1]);
+}
+
+// Watch the light by polling: read ANQ1 every 'period_us' (0 for back to back)
+// and compare in the main loop, with the same thresholds and hysteresis in
+// 8 bits. Returns the CPU cycles per second, and the reads per second.
+HOST static double run_polling(unsigned int period_us, change_t *changes, unsigned int *count, double *reads)
+{
+    boot();
+    uint64_t start = sim_cycles;
+    uint64_t isr = sim_isr_cycles;
+    uint64_t main = 0;
+    unsigned long n = 0;
+    unsigned char zone = ADC_ZONE_NONE;
+    *count = 0;
+    while(sim_cycles - start < PROFILE_MS * SIM_CYCLES_PER_MS)
+    {
+        uint64_t before = sim_cycles;
+        unsigned char light = ADC_read_channel(ANQ1);
+        main += sim_cycles - before;
+        n ++;
+        unsigned char next = zone_of(light * 4 + 2, zone);
+        if(next != zone && *count != EVENTS_MAX)
+        {
+            changes[(*count)++] = (change_t){ next, SIM_MS(sim_cycles - start) };
+        }
+        zone = next;
+        if(period_us)
+        {
+            sim_run_until(start + n * period_us * SIM_CYCLES_PER_US);
+        }
+    }
+    unscript(start);
+    *reads = n * 1000.0 / PROFILE_MS;
+    return ((double)(sim_isr_cycles - isr + main) * 1000 / PROFILE_MS);
+}
+
+// Window events follow the profile with no extra events from the flicker,
+// noise or the short flash.
+HOST static void test_events(void)
+{
+    change_t changes[EVENTS_MAX];
+    unsigned int count;
+    double share, worst;
+    run_events(changes, &count, &share);
+    unsigned int errors = compare(changes, count, &worst);
+    printf("Light profile, %u s, %u zone changes\n", PROFILE_MS / 1000, expected_count);
+    REPORT("window events", "%u events, %u errors, %+.1f ms worst delay", count, errors, worst);
+    CHECK(expected_count == 9);  // Night, dawn (2), cloud (2), dusk (2), headlights (2)
+    CHECK(errors == 0);
+
+    // Filter delay and dwell, plus the noise moving a crossing on the slowest
+    // ramp (0.45 counts/ms) and the 1 ms main loop
+    double sample_ms = 1000.0 / ADC_TRIGGER_HZ;
+    CHECK_RANGE(worst, -4 * NOISE / 0.45, (FILTER_AVERAGE_SIZE / 2 + DWELL) * sample_ms + 4 * NOISE / 0.45 + 1);
+}
+
+// CPU time per second of each pattern, beyond the tick's own interrupts.
+HOST static void test_cpu(void)
+{
+    double idle = idle_cpu();
+    change_t changes[EVENTS_MAX];
+    unsigned int count;
+    double share, worst, reads;
+    double events = run_events(changes, &count, &share) - idle;
+    printf("CPU time watching the light, beyond the tick\n");
+    REPORT("window events", "%5.2f %% (%.2f %% for the window), main loop free", 100 * events / (SIM_CYCLES_PER_MS * 1000),
+        100 * share / (SIM_CYCLES_PER_MS * 1000));
+
+    double back_to_back = run_polling(0, changes, &count, &reads) - idle;
+    unsigned int errors = compare(changes, count, &worst);
+    REPORT("polling back to back", "%5.2f %%, %.0f reads/s, %u event errors", 100 * back_to_back / (SIM_CYCLES_PER_MS * 1000),
+        reads, errors);
+    CHECK(back_to_back > 0.9 * SIM_CYCLES_PER_MS * 1000 - idle);
+
+    double same_rate = run_polling(1000000 / ADC_TRIGGER_HZ, changes, &count, &reads) - idle;
+    errors = compare(changes, count, &worst);
+    REPORT("polling at the sampler rate", "%5.2f %%, %.0f reads/s, %u event errors", 100 * same_rate / (SIM_CYCLES_PER_MS * 1000),
+        reads, errors);
+    double every_ms = run_polling(1000, changes, &count, &reads) - idle;
+    errors = compare(changes, count, &worst);
+    REPORT("polling every 1 ms", "%5.2f %%, %.0f reads/s, %u event errors", 100 * every_ms / (SIM_CYCLES_PER_MS * 1000),
+        reads, errors);
+
+    // Events cost less than polling as often as the sampler converts, and
+    // far less than the loop that polls back to back
+    CHECK(events < same_rate && events < back_to_back / 10);
+    CHECK_RANGE(share, 0, 0.02 * SIM_CYCLES_PER_MS * 1000);
+}
+
+// A full event queue drops events, but ADC_zone still gives the settled zone.
+HOST static void test_queue_full(void)
+{
+    static const unsigned char channel = ANQ1;
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    ADC_sampler_start(&channel, 1, ADC_10BIT);
+    ADC_filter(0, FILTER_NONE, 0);
+    ADC_window(0, LOW, HIGH, 0, 1);
+    for(unsigned int i = 0; i != ADC_EVENT_QUEUE_SIZE + 4; i++)
+    {
+        sim_adc(ANQ1 >> 2, (i & 1) ? 900 : 100);
+        sim_run(2 * TICK_CYCLES);
+    }
+    unsigned int events = 0;
+    while(ADC_event() != ADC_EVENT_NONE)
+    {
+        events ++;
+    }
+    CHECK(events == ADC_EVENT_QUEUE_SIZE - 1);
+    CHECK(ADC_zone(0) == ADC_ZONE_HIGH);
+    ADC_window_off(0);
+    CHECK(ADC_zone(0) == ADC_ZONE_NONE);
+    ADC_sampler_stop();
+}
+
+HOST int main(void)
+{
+    make_profile();
+    test_events();
+    test_cpu();
+    test_queue_full();
+    TEST_DONE();
+}
@@ -0,0 +1,210 @@
+/*==============================================================================
+ File: test_ws.c                        Host tests for the WS2812 LED driver
+
+ Runs ws_send() in the simulator's inline assembly interpreter, which times
+ each instruction exactly, and decodes the data pin's edges back into bytes.
+ Checks that every bit has the WS_BIT_CYCLES period and a T0H or T1H high
+ time inside the WS2812 data sheet limits, that the bytes are the frame in
+ GRB order and the frame buffer is left as it was, that only the pixels up
+ to the last changed one are sent, and that the latch time is kept between
+ frames and no tick is lost while interrupts are off. Reports the frame rate
+ for each strip length up to WS_PIXELS.
+==============================================================================*/
+
+#include    "test.h"
+#include    "build/UBMP4.c"
+
+#define WS_MASK     (1 << WS_BIT)
+#define EDGES       (WS_PIXELS * 24 * 2 + 16)
+#define TICK_US     ((double)TICK_CYCLES / SIM_CYCLES_PER_US)
+
+static sim_edge_t edges[EDGES];
+
+// Boot with the strip driver started and its variables mapped for the asm.
+HOST static void boot(void)
+{
+    sim_reset();
+    OSC_config();
+    UBMP4_config();
+    sim_asm_symbol("_ws_frame", ws_frame, sizeof(ws_frame));
+    sim_asm_symbol("_ws_bytes", &ws_bytes, sizeof(ws_bytes));
+    WS_start();
+}
+
+// A frame decoded from the data pin's edges.
+typedef struct
+{
+    unsigned int bits;
+    unsigned char bytes[WS_PIXELS * 3];
+    bool timing_ok;             // Every period and high time exact
+    uint64_t first_rise;
+    uint64_t last_fall;
+} decoded_t;
+
+// Decode the data pin edges logged during one WS_show.
+HOST static decoded_t decode(size_t count)
+{
+    decoded_t frame = { 0 };
+    frame.timing_ok = true;
+    bool level = false;
+    uint64_t rise = 0, last_rise = 0;
+    for(size_t i = 0; i != count; i++)
+    {
+        if(edges[i].reg != SIM_LATC || ((edges[i].value & WS_MASK) != 0) == level)
+        {
+            continue;
+        }
+        level = !level;
+        if(level)
+        {
+            rise = edges[i].cycle;
+            if(frame.bits == 0)
+            {
+                frame.first_rise = rise;
+            }
+            else if(rise - last_rise != WS_BIT_CYCLES)
+            {
+                frame.timing_ok = false;
+            }
+            last_rise = rise;
+            continue;
+        }
+        uint64_t high = edges[i].cycle - rise;
+        bool one = (high == WS_T1H_CYCLES);
+        if(!one && high != WS_T0H_CYCLES)
+        {
+            frame.timing_ok = false;
+        }
+        if(frame.bits < 8 * sizeof(frame.bytes))
+        {
+            frame.bytes[frame.bits / 8] |= (unsigned char)(one << (7 - frame.bits % 8));
+        }
+        frame.bits ++;
+        frame.last_fall = edges[i].cycle;
+    }
+    CHECK(!level);              // Data idles low
+    return (frame);
+}
+
+// Show the frame, waiting for the driver to be ready, and decode what it sent.
+HOST static decoded_t show(void)
+{
+    sim_log(edges, EDGES);
+    while(!WS_show())
+    {
+    }
+    decoded_t frame = decode(sim_log_count());
+    sim_log(NULL, 0);
+    return (frame);
+}
+
+// Bits have exact periods and high times, and the bytes are the pixels in
+// GRB order.
+HOST static void test_bits(void)
+{
+    boot();
+    decoded_t frame = show();   // WS_start turns every pixel off
+    CHECK(frame.timing_ok && frame.bits == 24 * WS_PIXELS);
+    for(unsigned char i = 0; i != WS_PIXELS * 3; i++)
+    {
+        CHECK(frame.bytes[i] == 0);
+    }
+
+    // Every bit pattern, in each of the three colours
+    for(unsigned int value = 0; value != 256; value += WS_PIXELS)
+    {
+        unsigned char expected[WS_PIXELS * 3];
+        for(unsigned char pixel = 0; pixel != WS_PIXELS; pixel++)
+        {
+            unsigned char red = (unsigned char)(value + pixel);
+            unsigned char green = (unsigned char)~red;
+            unsigned char blue = (unsigned char)(red * 37);
+            WS_set(pixel, red, green, blue);
+            expected[pixel * 3] = green;
+            expected[pixel * 3 + 1] = red;
+            expected[pixel * 3 + 2] = blue;
+        }
+        frame = show();
+        CHECK(frame.timing_ok && frame.bits == 24 * WS_PIXELS);
+        CHECK(memcmp(frame.bytes, expected, sizeof(expected)) == 0);
+        CHECK(memcmp(ws_frame, expected, sizeof(expected)) == 0);  // Rotated back
+    }
+    printf("Bit timing, %u MHz\n", (unsigned int)(_XTAL_FREQ / 1000000));
+    REPORT("0 bit", "%.0f ns high of %.0f ns", WS_T0H_CYCLES * 1000.0 / SIM_CYCLES_PER_US, WS_BIT_CYCLES * 1000.0 / SIM_CYCLES_PER_US);
+    REPORT("1 bit", "%.0f ns high of %.0f ns", WS_T1H_CYCLES * 1000.0 / SIM_CYCLES_PER_US, WS_BIT_CYCLES * 1000.0 / SIM_CYCLES_PER_US);
+    CHECK_RANGE(WS_T0H_CYCLES * 1000.0 / SIM_CYCLES_PER_US, 250, 550);
+    CHECK_RANGE(WS_T1H_CYCLES * 1000.0 / SIM_CYCLES_PER_US, 650, 950);
+    CHECK_RANGE(WS_BIT_CYCLES * 1000.0 / SIM_CYCLES_PER_US, 1100, 1400);
+    WS_stop();
+}
+
+// Only the pixels up to the last changed one are sent, and nothing is sent
+// until something changes and the last frame has latched.
+HOST static void test_changed(void)
+{
+    boot();
+    decoded_t frame = show();
+    sim_log(edges, EDGES);
+    CHECK(!WS_show());          // Nothing changed
+    WS_set(2, 10, 20, 30);
+    CHECK(!WS_show());          // Still latching
+    CHECK(decode(sim_log_count()).bits == 0);
+    sim_log(NULL, 0);
+    uint64_t latched = frame.last_fall;
+    frame = show();
+    CHECK(frame.timing_ok && frame.bits == 24 * 3);
+    CHECK(frame.bytes[6] == 20 && frame.bytes[7] == 10 && frame.bytes[8] == 30);
+    CHECK_RANGE(SIM_US(frame.first_rise - latched), WS_RESET_US, WS_RESET_US + TICK_US + 50);
+
+    // Setting a pixel to its own colour changes nothing
+    WS_set(2, 10, 20, 30);
+    WS_set(WS_PIXELS, 1, 2, 3); // Past the end
+    sim_run(WS_RESET_US * 2 * SIM_CYCLES_PER_US);
+    CHECK(!WS_show());
+    WS_stop();
+}
+
+// Frame rate by strip length: changing the last pixel of an n-pixel strip
+// sends n pixels. Interrupts are off for the frame, but no tick is lost.
+HOST static void test_frame_rate(void)
+{
+    printf("Frame rate, changing the last pixel each frame\n");
+    for(unsigned char pixels = 1; pixels <= WS_PIXELS; pixels++)
+    {
+        boot();
+        uint64_t latched = show().last_fall;
+        uint16_t ms = TICK_ms();
+        uint64_t start = sim_cycles;
+        sim_gie_off_max = 0;
+        double gap = 1e9;
+        unsigned int frames;
+        for(frames = 0; frames != 200; frames++)
+        {
+            WS_set(pixels - 1, (unsigned char)(frames + 1), 0, 0);
+            decoded_t frame = show();
+            CHECK(frame.timing_ok && frame.bits == 24U * pixels && frame.bytes[3 * pixels - 2] == (unsigned char)(frames + 1));
+            gap = SIM_US(frame.first_rise - latched) < gap ? SIM_US(frame.first_rise - latched) : gap;
+            latched = frame.last_fall;
+        }
+        CHECK(gap >= WS_RESET_US);
+        double elapsed = SIM_MS(sim_cycles - start);
+        double fps = frames * 1000 / elapsed;
+        double formula = 1000000.0 / WS_FRAME_US(pixels);
+        char name[32];
+        snprintf(name, sizeof(name), "%u pixel%s", pixels, pixels == 1 ? "" : "s");
+        REPORT(name, "%4.0f fps (%4.0f fps without the tick wait), %5.1f us interrupts off, %3.0f us latch", fps, formula,
+            SIM_US(sim_gie_off_max), gap);
+        CHECK_RANGE(fps, 1000000.0 / (WS_FRAME_US(pixels) + TICK_US + 50), formula);
+        CHECK_RANGE(sim_gie_off_max, pixels * 24 * WS_BIT_CYCLES, WS_FRAME_CYCLES(pixels * 3) + 4 * TICK_CYCLES / 256);
+        CHECK_RANGE((uint16_t)(TICK_ms() - ms), elapsed - 1, elapsed + 1);
+        WS_stop();
+    }
+}
+
+HOST int main(void)
+{
+    test_bits();
+    test_changed();
+    test_frame_rate();
+    TEST_DONE();
+}
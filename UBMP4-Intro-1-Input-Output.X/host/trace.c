@@ -0,0 +1,178 @@
+/*==============================================================================
+ File: trace.c                          Host decoder for UBMP4 trace output
+
+ See trace.h.
+==============================================================================*/
+
+#include    <float.h>
+
+#include    "trace.h"
+
+// Return the level of a bit at a time, moving *index forward through the log.
+static bool level_at(const sim_edge_t *edges, size_t count, unsigned char reg, unsigned char mask,
+    uint64_t cycle, size_t *index, bool *level)
+{
+    while(*index != count && edges[*index].cycle <= cycle)
+    {
+        if(edges[*index].reg == reg)
+        {
+            *level = (edges[*index].value & mask) != 0;
+        }
+        (*index) ++;
+    }
+    return (*level);
+}
+
+size_t trace_uart(const sim_edge_t *edges, size_t count, unsigned char reg, unsigned char bit, bool level,
+    double bit_cycles, unsigned char *bytes, size_t size, unsigned int *errors)
+{
+    unsigned char mask = (unsigned char)(1 << bit);
+    size_t bytes_found = 0;
+    size_t index = 0;
+    *errors = 0;
+    while(bytes_found != size)
+    {
+        // Find the falling edge of the next start bit
+        while(index != count && !(edges[index].reg == reg && level && (edges[index].value & mask) == 0))
+        {
+            if(edges[index].reg == reg)
+            {
+                level = (edges[index].value & mask) != 0;
+            }
+            index ++;
+        }
+        if(index == count)
+        {
+            break;
+        }
+        double start = (double)edges[index].cycle;
+
+        // Sample the data and stop bits in the middle of each bit
+        unsigned char data = 0;
+        for(unsigned int i = 1; i <= 8; i++)
+        {
+            bool high = level_at(edges, count, reg, mask, (uint64_t)(start + (i + 0.5) * bit_cycles), &index, &level);
+            data |= (unsigned char)(high << (i - 1));
+        }
+        if(!level_at(edges, count, reg, mask, (uint64_t)(start + 9.5 * bit_cycles), &index, &level))
+        {
+            if(data == 0)
+            {
+                continue;       // Break: the pin was left low after the data
+            }
+            (*errors) ++;
+        }
+        bytes[bytes_found++] = data;
+    }
+    return (bytes_found);
+}
+
+size_t trace_parse(const unsigned char *bytes, size_t count, trace_entry_t *entries, size_t size)
+{
+    if(count < 2 || bytes[0] != 0x55 || count != 2 + 3 * (size_t)bytes[1] || bytes[1] > size)
+    {
+        return (0);
+    }
+    uint32_t time = 0;
+    uint16_t last = 0;
+    for(size_t i = 0; i != bytes[1]; i++)
+    {
+        const unsigned char *entry = &bytes[2 + 3 * i];
+        uint16_t stamp = (uint16_t)(entry[1] << 8 | entry[2]);
+        time += (i == 0) ? 0 : (uint16_t)(stamp - last);    // Unwrap
+        last = stamp;
+        entries[i].id = entry[0];
+        entries[i].time = time;
+    }
+    return (bytes[1]);
+}
+
+size_t trace_pulses(const sim_edge_t *edges, size_t count, unsigned char reg, unsigned char bit, bool level,
+    uint64_t *times, size_t size)
+{
+    unsigned char mask = (unsigned char)(1 << bit);
+    size_t pulses = 0;
+    for(size_t i = 0; i != count && pulses != size; i++)
+    {
+        if(edges[i].reg != reg)
+        {
+            continue;
+        }
+        bool high = (edges[i].value & mask) != 0;
+        if(high && !level)
+        {
+            times[pulses++] = edges[i].cycle;
+        }
+        level = high;
+    }
+    return (pulses);
+}
+
+void trace_histogram_init(trace_histogram_t *histogram, double bin_us)
+{
+    memset(histogram, 0, sizeof(*histogram));
+    histogram->bin_us = bin_us;
+    histogram->min_us = DBL_MAX;
+}
+
+void trace_histogram_add(trace_histogram_t *histogram, const trace_entry_t *entries, size_t count, unsigned char from, unsigned char to)
+{
+    for(size_t i = 0; i != count; i++)
+    {
+        if(entries[i].id != from)
+        {
+            continue;
+        }
+        size_t j = i + 1;
+        while(j != count && entries[j].id != to)
+        {
+            j ++;
+        }
+        if(j == count)
+        {
+            break;
+        }
+        double us = (double)(entries[j].time - entries[i].time) * TRACE_COUNT_CYCLES / SIM_CYCLES_PER_US;
+        size_t bin = (size_t)(us / histogram->bin_us);
+        if(bin < TRACE_BINS)
+        {
+            histogram->bins[bin] ++;
+        }
+        else
+        {
+            histogram->over ++;
+        }
+        histogram->count ++;
+        histogram->total_us += us;
+        histogram->min_us = us < histogram->min_us ? us : histogram->min_us;
+        histogram->max_us = us > histogram->max_us ? us : histogram->max_us;
+    }
+}
+
+void trace_histogram_print(const char *name, const trace_histogram_t *histogram)
+{
+    if(histogram->count == 0)
+    {
+        printf("  %s: no samples\n", name);
+        return;
+    }
+    printf("  %s: %lu samples, %.1f us min, %.1f us average, %.1f us max\n", name, histogram->count,
+        histogram->min_us, histogram->total_us / histogram->count, histogram->max_us);
+    unsigned long most = 1;
+    for(size_t i = 0; i != TRACE_BINS; i++)
+    {
+        most = histogram->bins[i] > most ? histogram->bins[i] : most;
+    }
+    for(size_t i = 0; i != TRACE_BINS; i++)
+    {
+        if(histogram->bins[i] != 0)
+        {
+            printf("    %7.1f - %7.1f us %6lu %.*s\n", i * histogram->bin_us, (i + 1) * histogram->bin_us,
+                histogram->bins[i], (int)(40 * histogram->bins[i] / most), "########################################");
+        }
+    }
+    if(histogram->over != 0)
+    {
+        printf("    %7.1f us and up   %6lu\n", TRACE_BINS * histogram->bin_us, histogram->over);
+    }
+}
@@ -0,0 +1,58 @@
+/*==============================================================================
+ File: trace.h                          Host decoder for UBMP4 trace output
+
+ Turns an output pin waveform recorded by the simulator (or converted from a
+ logic analyzer capture) back into trace entries, and collects latency
+ histograms from them. TRACE_dump sends the ring buffer as 8N1 serial data on
+ a header pin, and UBMP4_TRACE_PULSE builds pulse the pin at each marker.
+==============================================================================*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include    "sim.h"
+
+#define TRACE_COUNT_CYCLES  16      // Instruction cycles per timestamp count
+#define TRACE_BINS          24      // Histogram bins, plus an overflow count
+
+// A decoded trace entry with its timestamp unwrapped to 32 bits
+typedef struct
+{
+    unsigned char id;
+    uint32_t time;              // Timestamp counts since the first entry
+} trace_entry_t;
+
+// Latency histogram
+typedef struct
+{
+    double bin_us;              // Width of each bin
+    unsigned long bins[TRACE_BINS];
+    unsigned long over;         // Latencies past the last bin
+    unsigned long count;
+    double total_us, min_us, max_us;
+} trace_histogram_t;
+
+// Decode 8N1 bytes from one bit of an output register in an edge log. The line
+// is at 'level' before the first edge. Returns the number of bytes, and counts
+// bytes with a low stop bit in *errors. A line that goes low and stays low (a
+// break, as when TRACE_dump puts back a low H8 level) is not a byte.
+size_t trace_uart(const sim_edge_t *edges, size_t count, unsigned char reg, unsigned char bit, bool level,
+    double bit_cycles, unsigned char *bytes, size_t size, unsigned int *errors);
+
+// Parse TRACE_dump bytes (sync, count, then id, time high, time low per
+// entry) into entries. Returns the number of entries, or 0 if the data is
+// not a whole dump.
+size_t trace_parse(const unsigned char *bytes, size_t count, trace_entry_t *entries, size_t size);
+
+// Collect the times of the rising edges of one output bit (marker pulses). The
+// bit is at 'level' before the first edge.
+size_t trace_pulses(const sim_edge_t *edges, size_t count, unsigned char reg, unsigned char bit, bool level,
+    uint64_t *times, size_t size);
+
+// Add the latency from each 'from' entry to the next 'to' entry (the loop
+// period when they are the same id) to a histogram.
+void trace_histogram_init(trace_histogram_t *histogram, double bin_us);
+void trace_histogram_add(trace_histogram_t *histogram, const trace_entry_t *entries, size_t count, unsigned char from, unsigned char to);
+void trace_histogram_print(const char *name, const trace_histogram_t *histogram);
+
+#endif
@@ -0,0 +1,318 @@
+/*==============================================================================
+ File: ubmp4cmd.c                       Command line tool for CMD_poll
+
+ Sends command frames to a UBMP4 running CMD_poll, over its USB serial port
+ or a serial adapter on the H1/H2 software UART, and prints the results.
+ Operations are packed into as few frames as they fit in, and a ';' starts a
+ new frame. With -n, the whole list is repeated and the round-trip time and
+ operation rate are printed, with -p frames in flight.
+
+ Usage: ubmp4cmd [-d port] [-b baud] [-p depth] [-n repeats] operation...
+
+   out MASK VALUE           OUT_write (LATC bits, see OUT_ in UBMP4.h)
+   adc CHANNEL              ADC_read_channel: Q1, H1-H4, H7, H8, TIM or a number
+   pattern MS REPEAT F,F,.. OUT_pattern of up to 8 LED frames
+   buttons                  BUTTON_state
+   beep HZ MS               BEEPER_tone
+   led N LEVEL              LED_set_level
+   tick                     TICK_ms
+
+ Example: ubmp4cmd -d /dev/ttyACM0 out 0x3C 0x14 adc Q1 buttons
+==============================================================================*/
+
+#include    <errno.h>
+#include    <fcntl.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <termios.h>
+#include    <time.h>
+#include    <unistd.h>
+
+#include    "command.h"
+
+#define MAX_BATCHES     256
+#define TIMEOUT_DS      10              // Reply byte timeout (tenths of a second)
+
+static command_batch_t batches[MAX_BATCHES];
+static unsigned char opcodes[MAX_BATCHES][CMD_FRAME_SIZE];  // For printing results
+static command_reply_t replies[MAX_BATCHES];
+
+static bool port_send(void *context, const unsigned char *bytes, size_t count)
+{
+    int fd = *(int *)context;
+    while(count != 0)
+    {
+        ssize_t written = write(fd, bytes, count);
+        if(written < 0 && errno != EINTR)
+        {
+            return (false);
+        }
+        if(written > 0)
+        {
+            bytes += written;
+            count -= (size_t)written;
+        }
+    }
+    return (true);
+}
+
+static int port_receive(void *context)
+{
+    int fd = *(int *)context;
+    unsigned char byte;
+    ssize_t count;
+    do
+    {
+        count = read(fd, &byte, 1);
+    } while(count < 0 && errno == EINTR);
+    return (count == 1 ? byte : -1);
+}
+
+// Open a serial port in raw mode.
+static int port_open(const char *name, unsigned long baud)
+{
+    static const struct { unsigned long baud; speed_t speed; } speeds[] =
+    {
+        { 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+        { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 }
+    };
+    int fd = open(name, O_RDWR | O_NOCTTY);
+    struct termios tio;
+    if(fd < 0 || tcgetattr(fd, &tio) != 0)
+    {
+        perror(name);
+        exit(1);
+    }
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = TIMEOUT_DS;
+    for(size_t i = 0; i != sizeof(speeds) / sizeof(speeds[0]); i++)
+    {
+        if(speeds[i].baud == baud)
+        {
+            cfsetspeed(&tio, speeds[i].speed);
+        }
+    }
+    if(tcsetattr(fd, TCSANOW, &tio) != 0)
+    {
+        perror(name);
+        exit(1);
+    }
+    tcflush(fd, TCIOFLUSH);
+    return (fd);
+}
+
+static unsigned long number(const char *text)
+{
+    char *end;
+    unsigned long value = strtoul(text, &end, 0);
+    if(*text == '\0' || *end != '\0')
+    {
+        fprintf(stderr, "ubmp4cmd: '%s' is not a number\n", text);
+        exit(2);
+    }
+    return (value);
+}
+
+static unsigned char channel(const char *name)
+{
+    static const struct { const char *name; unsigned char channel; } channels[] =
+    {
+        { "Q1", ANQ1 }, { "H1", ANH1 }, { "H2", ANH2 }, { "H3", ANH3 }, { "H4", ANH4 },
+        { "H7", ANH7 }, { "H8", ANH8 }, { "TIM", ANTIM }
+    };
+    for(size_t i = 0; i != sizeof(channels) / sizeof(channels[0]); i++)
+    {
+        if(strcmp(name, channels[i].name) == 0)
+        {
+            return (channels[i].channel);
+        }
+    }
+    return ((unsigned char)number(name));
+}
+
+// Add one operation from argv to the batch. Returns the arguments used, or 0
+// if it doesn't fit.
+static int add_operation(command_batch_t *batch, char **argv, int argc)
+{
+    const char *op = argv[0];
+    int need = !strcmp(op, "out") || !strcmp(op, "beep") || !strcmp(op, "led") ? 3 :
+        !strcmp(op, "pattern") ? 4 : !strcmp(op, "adc") ? 2 : 1;
+    if(argc < need)
+    {
+        fprintf(stderr, "ubmp4cmd: %s needs %d arguments\n", op, need - 1);
+        exit(2);
+    }
+    bool added;
+    if(!strcmp(op, "out"))
+    {
+        added = command_out_write(batch, (unsigned char)number(argv[1]), (unsigned char)number(argv[2]));
+    }
+    else if(!strcmp(op, "adc"))
+    {
+        added = command_adc_read(batch, channel(argv[1]));
+    }
+    else if(!strcmp(op, "pattern"))
+    {
+        unsigned char frames[CMD_PATTERN_FRAMES];
+        unsigned char count = 0;
+        char *list = strdup(argv[3]);
+        for(char *frame = strtok(list, ","); frame != NULL; frame = strtok(NULL, ","))
+        {
+            if(count == CMD_PATTERN_FRAMES)
+            {
+                fprintf(stderr, "ubmp4cmd: pattern has more than %d frames\n", CMD_PATTERN_FRAMES);
+                exit(2);
+            }
+            frames[count++] = (unsigned char)number(frame);
+        }
+        free(list);
+        added = command_pattern(batch, frames, count, (uint16_t)number(argv[1]), (unsigned char)number(argv[2]));
+    }
+    else if(!strcmp(op, "buttons"))
+    {
+        added = command_buttons(batch);
+    }
+    else if(!strcmp(op, "beep"))
+    {
+        added = command_beep(batch, (uint16_t)number(argv[1]), (uint16_t)number(argv[2]));
+    }
+    else if(!strcmp(op, "led"))
+    {
+        added = command_led_level(batch, (unsigned char)number(argv[1]), (unsigned char)number(argv[2]));
+    }
+    else if(!strcmp(op, "tick"))
+    {
+        added = command_tick(batch);
+    }
+    else
+    {
+        fprintf(stderr, "ubmp4cmd: unknown operation '%s'\n", op);
+        exit(2);
+    }
+    return (added ? need : 0);
+}
+
+// Print the results of one batch from its reply.
+static void print_reply(size_t index)
+{
+    const command_reply_t *reply = &replies[index];
+    unsigned char at = 0;
+    if(reply->status != CMD_OK)
+    {
+        printf("frame %zu: %s\n", index + 1, command_status_name(reply->status));
+    }
+    for(unsigned char i = 0; i != batches[index].count && at < reply->length; i++)
+    {
+        switch(opcodes[index][i])
+        {
+            case CMD_ADC_READ:
+                printf("adc %u\n", reply->results[at++]);
+                break;
+            case CMD_BUTTONS:
+                printf("buttons 0x%02X\n", reply->results[at++]);
+                break;
+            case CMD_TICK:
+                printf("tick %u\n", reply->results[at] | reply->results[at + 1] << 8);
+                at += 2;
+                break;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *port = "/dev/ttyACM0";
+    unsigned long baud = 4800, repeats = 1;
+    command_link_t link = { NULL, port_send, port_receive, 1 };
+    int option;
+    while((option = getopt(argc, argv, "d:b:p:n:")) != -1)
+    {
+        switch(option)
+        {
+            case 'd': port = optarg; break;
+            case 'b': baud = number(optarg); break;
+            case 'p': link.depth = (unsigned int)number(optarg); break;
+            case 'n': repeats = number(optarg); break;
+            default:
+                fprintf(stderr, "usage: ubmp4cmd [-d port] [-b baud] [-p depth] [-n repeats] operation...\n");
+                return (2);
+        }
+    }
+
+    // Pack the operations into frames
+    size_t count = 1;
+    command_begin(&batches[0]);
+    for(int arg = optind; arg < argc; )
+    {
+        if(!strcmp(argv[arg], ";"))
+        {
+            arg ++;
+            count += (batches[count - 1].count != 0);
+        }
+        else
+        {
+            command_batch_t *batch = &batches[count - 1];
+            unsigned char at = batch->length;
+            int used = add_operation(batch, &argv[arg], argc - arg);
+            if(used != 0)
+            {
+                opcodes[count - 1][batch->count - 1] = batch->ops[at];
+                arg += used;
+                continue;
+            }
+            if(batch->count == 0)
+            {
+                fprintf(stderr, "ubmp4cmd: %s does not fit in a frame\n", argv[arg]);
+                return (2);
+            }
+            count ++;           // Full, start the next frame
+        }
+        if(count > MAX_BATCHES)
+        {
+            fprintf(stderr, "ubmp4cmd: more than %d frames\n", MAX_BATCHES);
+            return (2);
+        }
+        command_begin(&batches[count - 1]);
+    }
+    count -= (batches[count - 1].count == 0);
+    if(count == 0)
+    {
+        fprintf(stderr, "ubmp4cmd: no operations\n");
+        return (2);
+    }
+
+    int fd = port_open(port, baud);
+    link.context = &fd;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(unsigned long repeat = 0; repeat != repeats; repeat++)
+    {
+        size_t received = command_run(&link, batches, count, replies);
+        if(received != count)
+        {
+            fprintf(stderr, "ubmp4cmd: no reply to frame %zu\n", received + 1);
+            return (1);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    for(size_t i = 0; i != count; i++)
+    {
+        print_reply(i);
+    }
+    if(repeats > 1)
+    {
+        double seconds = (double)(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        unsigned long ops = 0;
+        for(size_t i = 0; i != count; i++)
+        {
+            ops += batches[i].count;
+        }
+        printf("%lu frames in %.3f s: %.2f ms per frame, %.0f operations/s\n", repeats * count, seconds,
+            1000 * seconds / (repeats * count), repeats * ops / seconds);
+    }
+    close(fd);
+    return (0);
+}
@@ -0,0 +1,229 @@
+/*==============================================================================
+ File: usb_host.h                       Host USB model for the USB tests
+
+ A stand-in for the USB module's serial interface engine (SIE) and the PC's
+ host controller. It reads and writes the buffer descriptor table and the
+ USB RAM buffers as the SIE would, and sets USTAT and the UIR flags for each
+ transaction. The USB registers are plain storage in the simulator, so this
+ is what makes the device's USB interrupt code run. Include it after
+ build/UBMP4.c, as it uses the device's static buffers.
+==============================================================================*/
+
+#ifndef USB_HOST_H
+#define USB_HOST_H
+
+
+#define UIR_URSTIF      0x01
+#define UIR_TRNIF       0x08
+#define UIR_SOFIF       0x40
+#define UCON_PKTDIS     0x10
+#define PID_OUT         0x01
+#define PID_IN          0x09
+#define NAK             -1
+
+// USB RAM buffers by their address in the device's USB RAM map
+static const struct
+{
+    unsigned int address;
+    volatile void *buffer;
+    size_t size;
+} usb_ram[] =
+{
+    { USB_EP0_OUT_ADDRESS, usb_ep0_out, sizeof(usb_ep0_out) },
+    { USB_EP0_IN_ADDRESS, usb_ep0_in, sizeof(usb_ep0_in) },
+    { USB_RX_ADDRESS, usb_rx, sizeof(usb_rx) },
+    { USB_HEADER_ADDRESS, usb_header, sizeof(usb_header) },
+    { USB_TX_ADDRESS, usb_tx, sizeof(usb_tx) },
+    { USB_RING_ADDRESS, adc_ring, sizeof(adc_ring) },
+};
+
+// SIE state: the ping-pong buffer and next data toggle for each endpoint
+static unsigned char ppbi[3][2];
+static unsigned char toggle[3][2];
+static unsigned int toggle_errors;
+static unsigned int last_in_address;    // USB RAM address of the last IN packet
+static uint64_t usb_isr;                // ISR cycles handling SOF and transactions
+
+// Return the host buffer holding count bytes at a USB RAM address.
+HOST static volatile unsigned char *usb_memory(unsigned int address, unsigned char count)
+{
+    for(unsigned int i = 0; i != sizeof(usb_ram) / sizeof(usb_ram[0]); i++)
+    {
+        if(address >= usb_ram[i].address && address + count <= usb_ram[i].address + usb_ram[i].size)
+        {
+            return ((volatile unsigned char *)usb_ram[i].buffer + (address - usb_ram[i].address));
+        }
+    }
+    sim_fail("BD address 0x%04X (%u bytes) is outside the USB RAM buffers", address, count);
+    return (NULL);
+}
+
+// Return the buffer descriptor the SIE uses next for an endpoint direction.
+HOST static volatile usb_bd_t *next_bd(unsigned char endpoint, bool in)
+{
+    unsigned char bd = (endpoint == 0) ? in : 2 + (endpoint - 1) * 4 + in * 2 + ppbi[endpoint][in];
+    return (&usb_bdt[bd]);
+}
+
+// Raise a USB interrupt flag and wait for the ISR to clear it.
+HOST static void usb_interrupt(unsigned char flag)
+{
+    uint64_t isr = sim_isr_cycles;
+    uint64_t limit = sim_cycles + SIM_CYCLES_PER_MS;
+    sim_sfr[SIM_UIR] |= flag;
+    while(sim_sfr[SIM_UIR] & flag)
+    {
+        sim_run(8);
+        if(sim_cycles > limit)
+        {
+            sim_fail("USB interrupt 0x%02X not handled", flag);
+        }
+    }
+    usb_isr += sim_isr_cycles - isr;
+}
+
+// Report a completed transaction to the device and wait for its ISR.
+HOST static void complete(unsigned char endpoint, bool in)
+{
+    sim_sfr[SIM_USTAT] = (unsigned char)((endpoint << 3) | (in << 2) | (ppbi[endpoint][in] << 1));
+    if(endpoint != 0)
+    {
+        ppbi[endpoint][in] ^= 1;
+    }
+    usb_interrupt(UIR_TRNIF);
+}
+
+// Send an OUT or SETUP packet. Returns false if the device NAKs it.
+HOST static bool bus_out(unsigned char endpoint, unsigned char pid, const unsigned char *data, unsigned char count)
+{
+    volatile usb_bd_t *bd = next_bd(endpoint, false);
+    if((bd->stat & BD_UOWN) == 0)
+    {
+        return (false);
+    }
+    if(pid == PID_SETUP)
+    {
+        toggle[0][0] = 0;       // SETUP is DATA0, and the next IN is DATA1
+        toggle[0][1] = 1;
+    }
+    if((bd->stat & BD_DTSEN) && ((bd->stat & BD_DTS) != 0) != toggle[endpoint][0])
+    {
+        toggle_errors ++;       // The SIE would ignore the packet
+    }
+    CHECK(count <= bd->cnt);
+    volatile unsigned char *buffer = usb_memory((unsigned int)(bd->adrh << 8 | bd->adrl), count);
+    for(unsigned char i = 0; i != count; i++)
+    {
+        buffer[i] = data[i];
+    }
+    bd->cnt = count;
+    bd->stat = (unsigned char)((pid << 2) | (toggle[endpoint][0] ? BD_DTS : 0));
+    toggle[endpoint][0] ^= 1;
+    if(pid == PID_SETUP)
+    {
+        sim_sfr[SIM_UCON] |= UCON_PKTDIS;
+    }
+    complete(endpoint, false);
+    return (true);
+}
+
+// Read an IN packet. Returns its length, or NAK.
+HOST static int bus_in(unsigned char endpoint, unsigned char *data)
+{
+    volatile usb_bd_t *bd = next_bd(endpoint, true);
+    if((bd->stat & BD_UOWN) == 0 || (bd->stat & BD_BSTALL))
+    {
+        return (NAK);
+    }
+    if(((bd->stat & BD_DTS) != 0) != toggle[endpoint][1])
+    {
+        toggle_errors ++;       // The host would drop it as a repeat
+    }
+    toggle[endpoint][1] ^= 1;
+    unsigned char count = bd->cnt;
+    last_in_address = (unsigned int)(bd->adrh << 8 | bd->adrl);
+    volatile unsigned char *buffer = usb_memory(last_in_address, count);
+    for(unsigned char i = 0; i != count; i++)
+    {
+        data[i] = buffer[i];
+    }
+    bd->stat = (unsigned char)((PID_IN << 2) | (bd->stat & BD_DTS));
+    complete(endpoint, true);
+    return (count);
+}
+
+// Retry an IN token until the device answers.
+HOST static int bus_in_wait(unsigned char endpoint, unsigned char *data)
+{
+    for(unsigned int i = 0; i != 100; i++)
+    {
+        int count = bus_in(endpoint, data);
+        if(count != NAK)
+        {
+            return (count);
+        }
+        sim_run(20 * SIM_CYCLES_PER_US);
+    }
+    sim_fail("EP%u IN NAKs", endpoint);
+    return (NAK);
+}
+
+// Run a control transfer. Returns the number of IN data bytes received.
+HOST static unsigned int control(unsigned char type, unsigned char request, unsigned int value, unsigned int length, unsigned char *data)
+{
+    const unsigned char setup[8] = { type, request, (unsigned char)value, (unsigned char)(value >> 8), 0, 0, (unsigned char)length, (unsigned char)(length >> 8) };
+    CHECK(bus_out(0, PID_SETUP, setup, 8));
+    unsigned int count = 0;
+    if(type & 0x80)
+    {
+        int packet;
+        do
+        {
+            packet = bus_in_wait(0, data + count);
+            count += (unsigned int)packet;
+        } while(packet == USB_EP0_SIZE && count < length);
+        CHECK(bus_out(0, PID_OUT, NULL, 0));    // Status stage
+    }
+    else
+    {
+        if(length != 0)
+        {
+            toggle[0][0] = 1;
+            CHECK(bus_out(0, PID_OUT, data, (unsigned char)length));
+        }
+        unsigned char status[USB_EP0_SIZE];
+        CHECK(bus_in_wait(0, status) == 0);
+    }
+    return (count);
+}
+
+// Start USB, then enumerate the device and open the serial port as a PC would.
+HOST static void usb_host_attach(void)
+{
+    unsigned char data[256];
+    memset(ppbi, 0, sizeof(ppbi));
+    memset(toggle, 0, sizeof(toggle));
+    toggle_errors = 0;
+    USB_start();
+    usb_interrupt(UIR_URSTIF);                  // Bus reset
+    CHECK(!USB_ready());
+
+    CHECK(control(0x80, 0x06, 0x0100, 64, data) == 18);    // GET_DESCRIPTOR device
+    CHECK(memcmp(data, usb_device_descriptor, 18) == 0);
+    control(0x00, 0x05, 7, 0, NULL);                        // SET_ADDRESS
+    CHECK(sim_sfr[SIM_UADDR] == 7);
+    CHECK(control(0x80, 0x06, 0x0200, 255, data) == 67);   // GET_DESCRIPTOR configuration
+    CHECK(memcmp(data, usb_config_descriptor, 67) == 0);
+    CHECK(control(0x80, 0x06, 0x0200, 16, data) == 16);    // Shorter than the descriptor
+    memset(ppbi, 0, sizeof(ppbi));  // SET_CONFIGURATION pulses PPBRST
+    control(0x00, 0x09, 1, 0, NULL);                        // SET_CONFIGURATION
+    static const unsigned char coding[7] = { 0x00, 0xC2, 0x01, 0x00, 0, 0, 8 };  // 115200 8N1
+    memcpy(data, coding, 7);
+    control(0x21, 0x20, 0, 7, data);                        // SET_LINE_CODING
+    CHECK(control(0xA1, 0x21, 0, 7, data) == 7 && memcmp(data, coding, 7) == 0);
+    CHECK(!USB_ready());
+    control(0x21, 0x22, 1, 0, NULL);                        // SET_CONTROL_LINE_STATE, DTR on
+    CHECK(USB_ready());
+}
+
+#endif
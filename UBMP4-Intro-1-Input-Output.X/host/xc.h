@@ -0,0 +1,1028 @@
+/*==============================================================================
+ File: xc.h                             Host simulator for UBMP4.c
+
+ Host replacement for the XC8 device header, used by the Makefile in this
+ folder. SFRs and their bit fields are accessed through sim_access() (see
+ sim.h), so every access takes virtual time and can be interrupted, and the
+ XC8 built-in macros are mapped onto the simulator. Only the registers and
+ bits used by UBMP4.c are defined.
+==============================================================================*/
+
+#ifndef XC_H
+#define XC_H
+
+#include    "sim.h"
+
+// XC8 packs structures without padding
+#pragma pack(1)
+
+// XC8 keywords and built-in macros
+#define __interrupt(...)
+#define __at(address)
+#define __persistent
+#define __section(name)
+#define __bank(bank)
+#define __pack
+#define __delay_us(x)   sim_delay((unsigned long)((x) * (_XTAL_FREQ / 4000000.0)))
+#define __delay_ms(x)   sim_delay((unsigned long)((x) * (_XTAL_FREQ / 4000.0)))
+#define _delay(x)       sim_delay(x)
+#define NOP()           sim_nop()
+#define __nop()         sim_nop()
+#define CLRWDT()        sim_nop()
+#define SLEEP()         sim_sleep()
+#define RESET()         sim_device_reset()
+#define di()            (INTCONbits.GIE = 0)
+#define ei()            (INTCONbits.GIE = 1)
+#define asm(line)       sim_asm(line)
+
+// 16-bit SFR pairs, low byte first
+typedef uint16_t __attribute__((may_alias, aligned(1))) sim_word_t;
+#define TMR1        (*(volatile sim_word_t *)sim_access(SIM_TMR1L))
+#define ADRES       (*(volatile sim_word_t *)sim_access(SIM_ADRESL))
+#define PMADR       (*(volatile sim_word_t *)sim_access(SIM_PMADRL))
+#define PMDAT       (*(volatile sim_word_t *)sim_access(SIM_PMDATL))
+
+// SFRs and bit structures
+typedef struct
+{
+    unsigned char RA0 : 1;
+    unsigned char RA1 : 1;
+    unsigned char RA2 : 1;
+    unsigned char RA3 : 1;
+    unsigned char RA4 : 1;
+    unsigned char RA5 : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+} __attribute__((may_alias)) PORTAbits_t;
+#define PORTA        (*sim_access(SIM_PORTA))
+#define PORTAbits    (*(volatile PORTAbits_t *)sim_access(SIM_PORTA))
+
+typedef struct
+{
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char RB4 : 1;
+    unsigned char RB5 : 1;
+    unsigned char RB6 : 1;
+    unsigned char RB7 : 1;
+} __attribute__((may_alias)) PORTBbits_t;
+#define PORTB        (*sim_access(SIM_PORTB))
+#define PORTBbits    (*(volatile PORTBbits_t *)sim_access(SIM_PORTB))
+
+typedef struct
+{
+    unsigned char RC0 : 1;
+    unsigned char RC1 : 1;
+    unsigned char RC2 : 1;
+    unsigned char RC3 : 1;
+    unsigned char RC4 : 1;
+    unsigned char RC5 : 1;
+    unsigned char RC6 : 1;
+    unsigned char RC7 : 1;
+} __attribute__((may_alias)) PORTCbits_t;
+#define PORTC        (*sim_access(SIM_PORTC))
+#define PORTCbits    (*(volatile PORTCbits_t *)sim_access(SIM_PORTC))
+
+typedef struct
+{
+    unsigned char LATA0 : 1;
+    unsigned char LATA1 : 1;
+    unsigned char LATA2 : 1;
+    unsigned char LATA3 : 1;
+    unsigned char LATA4 : 1;
+    unsigned char LATA5 : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+} __attribute__((may_alias)) LATAbits_t;
+#define LATA         (*sim_access(SIM_LATA))
+#define LATAbits     (*(volatile LATAbits_t *)sim_access(SIM_LATA))
+
+typedef struct
+{
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char LATB4 : 1;
+    unsigned char LATB5 : 1;
+    unsigned char LATB6 : 1;
+    unsigned char LATB7 : 1;
+} __attribute__((may_alias)) LATBbits_t;
+#define LATB         (*sim_access(SIM_LATB))
+#define LATBbits     (*(volatile LATBbits_t *)sim_access(SIM_LATB))
+
+typedef struct
+{
+    unsigned char LATC0 : 1;
+    unsigned char LATC1 : 1;
+    unsigned char LATC2 : 1;
+    unsigned char LATC3 : 1;
+    unsigned char LATC4 : 1;
+    unsigned char LATC5 : 1;
+    unsigned char LATC6 : 1;
+    unsigned char LATC7 : 1;
+} __attribute__((may_alias)) LATCbits_t;
+#define LATC         (*sim_access(SIM_LATC))
+#define LATCbits     (*(volatile LATCbits_t *)sim_access(SIM_LATC))
+
+typedef struct
+{
+    unsigned char TRISA0 : 1;
+    unsigned char TRISA1 : 1;
+    unsigned char TRISA2 : 1;
+    unsigned char TRISA3 : 1;
+    unsigned char TRISA4 : 1;
+    unsigned char TRISA5 : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+} __attribute__((may_alias)) TRISAbits_t;
+#define TRISA        (*sim_access(SIM_TRISA))
+#define TRISAbits    (*(volatile TRISAbits_t *)sim_access(SIM_TRISA))
+
+typedef struct
+{
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char TRISB4 : 1;
+    unsigned char TRISB5 : 1;
+    unsigned char TRISB6 : 1;
+    unsigned char TRISB7 : 1;
+} __attribute__((may_alias)) TRISBbits_t;
+#define TRISB        (*sim_access(SIM_TRISB))
+#define TRISBbits    (*(volatile TRISBbits_t *)sim_access(SIM_TRISB))
+
+typedef struct
+{
+    unsigned char TRISC0 : 1;
+    unsigned char TRISC1 : 1;
+    unsigned char TRISC2 : 1;
+    unsigned char TRISC3 : 1;
+    unsigned char TRISC4 : 1;
+    unsigned char TRISC5 : 1;
+    unsigned char TRISC6 : 1;
+    unsigned char TRISC7 : 1;
+} __attribute__((may_alias)) TRISCbits_t;
+#define TRISC        (*sim_access(SIM_TRISC))
+#define TRISCbits    (*(volatile TRISCbits_t *)sim_access(SIM_TRISC))
+
+typedef struct
+{
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char ANSA4 : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+} __attribute__((may_alias)) ANSELAbits_t;
+#define ANSELA       (*sim_access(SIM_ANSELA))
+#define ANSELAbits   (*(volatile ANSELAbits_t *)sim_access(SIM_ANSELA))
+
+typedef struct
+{
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char ANSB4 : 1;
+    unsigned char ANSB5 : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+} __attribute__((may_alias)) ANSELBbits_t;
+#define ANSELB       (*sim_access(SIM_ANSELB))
+#define ANSELBbits   (*(volatile ANSELBbits_t *)sim_access(SIM_ANSELB))
+
+typedef struct
+{
+    unsigned char ANSC0 : 1;
+    unsigned char ANSC1 : 1;
+    unsigned char ANSC2 : 1;
+    unsigned char ANSC3 : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char ANSC6 : 1;
+    unsigned char ANSC7 : 1;
+} __attribute__((may_alias)) ANSELCbits_t;
+#define ANSELC       (*sim_access(SIM_ANSELC))
+#define ANSELCbits   (*(volatile ANSELCbits_t *)sim_access(SIM_ANSELC))
+
+typedef struct
+{
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char WPUA3 : 1;
+    unsigned char WPUA4 : 1;
+    unsigned char WPUA5 : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+} __attribute__((may_alias)) WPUAbits_t;
+#define WPUA         (*sim_access(SIM_WPUA))
+#define WPUAbits     (*(volatile WPUAbits_t *)sim_access(SIM_WPUA))
+
+typedef struct
+{
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char WPUB4 : 1;
+    unsigned char WPUB5 : 1;
+    unsigned char WPUB6 : 1;
+    unsigned char WPUB7 : 1;
+} __attribute__((may_alias)) WPUBbits_t;
+#define WPUB         (*sim_access(SIM_WPUB))
+#define WPUBbits     (*(volatile WPUBbits_t *)sim_access(SIM_WPUB))
+
+#define IOCAP        (*sim_access(SIM_IOCAP))
+#define IOCAN        (*sim_access(SIM_IOCAN))
+#define IOCAF        (*sim_access(SIM_IOCAF))
+typedef struct
+{
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char IOCBP4 : 1;
+    unsigned char IOCBP5 : 1;
+    unsigned char IOCBP6 : 1;
+    unsigned char IOCBP7 : 1;
+} __attribute__((may_alias)) IOCBPbits_t;
+#define IOCBP        (*sim_access(SIM_IOCBP))
+#define IOCBPbits    (*(volatile IOCBPbits_t *)sim_access(SIM_IOCBP))
+
+typedef struct
+{
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char IOCBN4 : 1;
+    unsigned char IOCBN5 : 1;
+    unsigned char IOCBN6 : 1;
+    unsigned char IOCBN7 : 1;
+} __attribute__((may_alias)) IOCBNbits_t;
+#define IOCBN        (*sim_access(SIM_IOCBN))
+#define IOCBNbits    (*(volatile IOCBNbits_t *)sim_access(SIM_IOCBN))
+
+typedef struct
+{
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char IOCBF4 : 1;
+    unsigned char IOCBF5 : 1;
+    unsigned char IOCBF6 : 1;
+    unsigned char IOCBF7 : 1;
+} __attribute__((may_alias)) IOCBFbits_t;
+#define IOCBF        (*sim_access(SIM_IOCBF))
+#define IOCBFbits    (*(volatile IOCBFbits_t *)sim_access(SIM_IOCBF))
+
+typedef struct
+{
+    unsigned char PS0 : 1;
+    unsigned char PS1 : 1;
+    unsigned char PS2 : 1;
+    unsigned char PSA : 1;
+    unsigned char TMR0SE : 1;
+    unsigned char TMR0CS : 1;
+    unsigned char INTEDG : 1;
+    unsigned char nWPUEN : 1;
+} __attribute__((may_alias)) OPTION_REGbits_t;
+#define OPTION_REG   (*sim_access(SIM_OPTION_REG))
+#define OPTION_REGbits (*(volatile OPTION_REGbits_t *)sim_access(SIM_OPTION_REG))
+
+typedef struct
+{
+    unsigned char IOCIF : 1;
+    unsigned char INTF : 1;
+    unsigned char TMR0IF : 1;
+    unsigned char IOCIE : 1;
+    unsigned char INTE : 1;
+    unsigned char TMR0IE : 1;
+    unsigned char PEIE : 1;
+    unsigned char GIE : 1;
+} __attribute__((may_alias)) INTCONbits_t;
+#define INTCON       (*sim_access(SIM_INTCON))
+#define INTCONbits   (*(volatile INTCONbits_t *)sim_access(SIM_INTCON))
+
+typedef struct
+{
+    unsigned char TMR1IF : 1;
+    unsigned char TMR2IF : 1;
+    unsigned char : 1;
+    unsigned char SSP1IF : 1;
+    unsigned char TXIF : 1;
+    unsigned char RCIF : 1;
+    unsigned char ADIF : 1;
+    unsigned char TMR1GIF : 1;
+} __attribute__((may_alias)) PIR1bits_t;
+#define PIR1         (*sim_access(SIM_PIR1))
+#define PIR1bits     (*(volatile PIR1bits_t *)sim_access(SIM_PIR1))
+
+typedef struct
+{
+    unsigned char TMR1IE : 1;
+    unsigned char TMR2IE : 1;
+    unsigned char : 1;
+    unsigned char SSP1IE : 1;
+    unsigned char TXIE : 1;
+    unsigned char RCIE : 1;
+    unsigned char ADIE : 1;
+    unsigned char TMR1GIE : 1;
+} __attribute__((may_alias)) PIE1bits_t;
+#define PIE1         (*sim_access(SIM_PIE1))
+#define PIE1bits     (*(volatile PIE1bits_t *)sim_access(SIM_PIE1))
+
+typedef struct
+{
+    unsigned char : 1;
+    unsigned char ACTIF : 1;
+    unsigned char BCL1IF : 1;
+    unsigned char USBIF : 1;
+    unsigned char : 1;
+    unsigned char C1IF : 1;
+    unsigned char C2IF : 1;
+    unsigned char OSFIF : 1;
+} __attribute__((may_alias)) PIR2bits_t;
+#define PIR2         (*sim_access(SIM_PIR2))
+#define PIR2bits     (*(volatile PIR2bits_t *)sim_access(SIM_PIR2))
+
+typedef struct
+{
+    unsigned char : 1;
+    unsigned char ACTIE : 1;
+    unsigned char BCL1IE : 1;
+    unsigned char USBIE : 1;
+    unsigned char : 1;
+    unsigned char C1IE : 1;
+    unsigned char C2IE : 1;
+    unsigned char OSFIE : 1;
+} __attribute__((may_alias)) PIE2bits_t;
+#define PIE2         (*sim_access(SIM_PIE2))
+#define PIE2bits     (*(volatile PIE2bits_t *)sim_access(SIM_PIE2))
+
+typedef struct
+{
+    unsigned char SCS0 : 1;
+    unsigned char SCS1 : 1;
+    unsigned char IRCF0 : 1;
+    unsigned char IRCF1 : 1;
+    unsigned char IRCF2 : 1;
+    unsigned char IRCF3 : 1;
+    unsigned char SPLLMULT : 1;
+    unsigned char SPLLEN : 1;
+} __attribute__((may_alias)) OSCCONbits_t;
+#define OSCCON       (*sim_access(SIM_OSCCON))
+#define OSCCONbits   (*(volatile OSCCONbits_t *)sim_access(SIM_OSCCON))
+
+typedef struct
+{
+    unsigned char HFIOFS : 1;
+    unsigned char LFIOFR : 1;
+    unsigned char : 1;
+    unsigned char HFIOFR : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char PLLRDY : 1;
+    unsigned char SOSCR : 1;
+} __attribute__((may_alias)) OSCSTATbits_t;
+#define OSCSTAT      (*sim_access(SIM_OSCSTAT))
+#define OSCSTATbits  (*(volatile OSCSTATbits_t *)sim_access(SIM_OSCSTAT))
+
+typedef struct
+{
+    unsigned char : 1;
+    unsigned char ACTSRC : 1;
+    unsigned char : 1;
+    unsigned char ACTUPD : 1;
+    unsigned char ACTLOCK : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char ACTEN : 1;
+} __attribute__((may_alias)) ACTCONbits_t;
+#define ACTCON       (*sim_access(SIM_ACTCON))
+#define ACTCONbits   (*(volatile ACTCONbits_t *)sim_access(SIM_ACTCON))
+
+typedef struct
+{
+    unsigned char ADON : 1;
+    unsigned char GO : 1;
+    unsigned char CHS0 : 1;
+    unsigned char CHS1 : 1;
+    unsigned char CHS2 : 1;
+    unsigned char CHS3 : 1;
+    unsigned char CHS4 : 1;
+    unsigned char : 1;
+} __attribute__((may_alias)) ADCON0bits_t;
+#define ADCON0       (*sim_access(SIM_ADCON0))
+#define ADCON0bits   (*(volatile ADCON0bits_t *)sim_access(SIM_ADCON0))
+
+typedef struct
+{
+    unsigned char ADPREF0 : 1;
+    unsigned char ADPREF1 : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char ADCS0 : 1;
+    unsigned char ADCS1 : 1;
+    unsigned char ADCS2 : 1;
+    unsigned char ADFM : 1;
+} __attribute__((may_alias)) ADCON1bits_t;
+#define ADCON1       (*sim_access(SIM_ADCON1))
+#define ADCON1bits   (*(volatile ADCON1bits_t *)sim_access(SIM_ADCON1))
+
+typedef struct
+{
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char TRIGSEL0 : 1;
+    unsigned char TRIGSEL1 : 1;
+    unsigned char TRIGSEL2 : 1;
+    unsigned char TRIGSEL3 : 1;
+} __attribute__((may_alias)) ADCON2bits_t;
+#define ADCON2       (*sim_access(SIM_ADCON2))
+#define ADCON2bits   (*(volatile ADCON2bits_t *)sim_access(SIM_ADCON2))
+
+#define ADRESL       (*sim_access(SIM_ADRESL))
+#define ADRESH       (*sim_access(SIM_ADRESH))
+#define TMR0         (*sim_access(SIM_TMR0))
+#define TMR1L        (*sim_access(SIM_TMR1L))
+#define TMR1H        (*sim_access(SIM_TMR1H))
+#define TMR2         (*sim_access(SIM_TMR2))
+#define PR2          (*sim_access(SIM_PR2))
+typedef struct
+{
+    unsigned char TMR1ON : 1;
+    unsigned char : 1;
+    unsigned char nT1SYNC : 1;
+    unsigned char T1OSCEN : 1;
+    unsigned char T1CKPS0 : 1;
+    unsigned char T1CKPS1 : 1;
+    unsigned char TMR1CS0 : 1;
+    unsigned char TMR1CS1 : 1;
+} __attribute__((may_alias)) T1CONbits_t;
+#define T1CON        (*sim_access(SIM_T1CON))
+#define T1CONbits    (*(volatile T1CONbits_t *)sim_access(SIM_T1CON))
+
+typedef struct
+{
+    unsigned char T1GSS0 : 1;
+    unsigned char T1GSS1 : 1;
+    unsigned char T1GVAL : 1;
+    unsigned char T1GGO_nDONE : 1;
+    unsigned char T1GSPM : 1;
+    unsigned char T1GTM : 1;
+    unsigned char T1GPOL : 1;
+    unsigned char TMR1GE : 1;
+} __attribute__((may_alias)) T1GCONbits_t;
+#define T1GCON       (*sim_access(SIM_T1GCON))
+#define T1GCONbits   (*(volatile T1GCONbits_t *)sim_access(SIM_T1GCON))
+
+typedef struct
+{
+    unsigned char T2CKPS0 : 1;
+    unsigned char T2CKPS1 : 1;
+    unsigned char TMR2ON : 1;
+    unsigned char T2OUTPS0 : 1;
+    unsigned char T2OUTPS1 : 1;
+    unsigned char T2OUTPS2 : 1;
+    unsigned char T2OUTPS3 : 1;
+    unsigned char : 1;
+} __attribute__((may_alias)) T2CONbits_t;
+#define T2CON        (*sim_access(SIM_T2CON))
+#define T2CONbits    (*(volatile T2CONbits_t *)sim_access(SIM_T2CON))
+
+typedef struct
+{
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char PWM1POL : 1;
+    unsigned char PWM1OUT : 1;
+    unsigned char PWM1OE : 1;
+    unsigned char PWM1EN : 1;
+} __attribute__((may_alias)) PWM1CONbits_t;
+#define PWM1CON      (*sim_access(SIM_PWM1CON))
+#define PWM1CONbits  (*(volatile PWM1CONbits_t *)sim_access(SIM_PWM1CON))
+
+#define PWM1DCH      (*sim_access(SIM_PWM1DCH))
+#define PWM1DCL      (*sim_access(SIM_PWM1DCL))
+typedef struct
+{
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char PWM2POL : 1;
+    unsigned char PWM2OUT : 1;
+    unsigned char PWM2OE : 1;
+    unsigned char PWM2EN : 1;
+} __attribute__((may_alias)) PWM2CONbits_t;
+#define PWM2CON      (*sim_access(SIM_PWM2CON))
+#define PWM2CONbits  (*(volatile PWM2CONbits_t *)sim_access(SIM_PWM2CON))
+
+#define PWM2DCH      (*sim_access(SIM_PWM2DCH))
+#define PWM2DCL      (*sim_access(SIM_PWM2DCL))
+typedef struct
+{
+    unsigned char ADFVR0 : 1;
+    unsigned char ADFVR1 : 1;
+    unsigned char CDAFVR0 : 1;
+    unsigned char CDAFVR1 : 1;
+    unsigned char TSRNG : 1;
+    unsigned char TSEN : 1;
+    unsigned char FVRRDY : 1;
+    unsigned char FVREN : 1;
+} __attribute__((may_alias)) FVRCONbits_t;
+#define FVRCON       (*sim_access(SIM_FVRCON))
+#define FVRCONbits   (*(volatile FVRCONbits_t *)sim_access(SIM_FVRCON))
+
+typedef struct
+{
+    unsigned char C1SYNC : 1;
+    unsigned char C1HYS : 1;
+    unsigned char C1SP : 1;
+    unsigned char : 1;
+    unsigned char C1POL : 1;
+    unsigned char C1OE : 1;
+    unsigned char C1OUT : 1;
+    unsigned char C1ON : 1;
+} __attribute__((may_alias)) CM1CON0bits_t;
+#define CM1CON0      (*sim_access(SIM_CM1CON0))
+#define CM1CON0bits  (*(volatile CM1CON0bits_t *)sim_access(SIM_CM1CON0))
+
+typedef struct
+{
+    unsigned char C1NCH0 : 1;
+    unsigned char C1NCH1 : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char C1PCH0 : 1;
+    unsigned char C1PCH1 : 1;
+    unsigned char C1INTN : 1;
+    unsigned char C1INTP : 1;
+} __attribute__((may_alias)) CM1CON1bits_t;
+#define CM1CON1      (*sim_access(SIM_CM1CON1))
+#define CM1CON1bits  (*(volatile CM1CON1bits_t *)sim_access(SIM_CM1CON1))
+
+typedef struct
+{
+    unsigned char C2SYNC : 1;
+    unsigned char C2HYS : 1;
+    unsigned char C2SP : 1;
+    unsigned char : 1;
+    unsigned char C2POL : 1;
+    unsigned char C2OE : 1;
+    unsigned char C2OUT : 1;
+    unsigned char C2ON : 1;
+} __attribute__((may_alias)) CM2CON0bits_t;
+#define CM2CON0      (*sim_access(SIM_CM2CON0))
+#define CM2CON0bits  (*(volatile CM2CON0bits_t *)sim_access(SIM_CM2CON0))
+
+typedef struct
+{
+    unsigned char C2NCH0 : 1;
+    unsigned char C2NCH1 : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char C2PCH0 : 1;
+    unsigned char C2PCH1 : 1;
+    unsigned char C2INTN : 1;
+    unsigned char C2INTP : 1;
+} __attribute__((may_alias)) CM2CON1bits_t;
+#define CM2CON1      (*sim_access(SIM_CM2CON1))
+#define CM2CON1bits  (*(volatile CM2CON1bits_t *)sim_access(SIM_CM2CON1))
+
+typedef struct
+{
+    unsigned char MC1OUT : 1;
+    unsigned char MC2OUT : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+} __attribute__((may_alias)) CMOUTbits_t;
+#define CMOUT        (*sim_access(SIM_CMOUT))
+#define CMOUTbits    (*(volatile CMOUTbits_t *)sim_access(SIM_CMOUT))
+
+typedef struct
+{
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char DACNSS : 1;
+    unsigned char DACPSS0 : 1;
+    unsigned char DACPSS1 : 1;
+    unsigned char DACOE2 : 1;
+    unsigned char DACOE1 : 1;
+    unsigned char DACEN : 1;
+} __attribute__((may_alias)) DACCON0bits_t;
+#define DACCON0      (*sim_access(SIM_DACCON0))
+#define DACCON0bits  (*(volatile DACCON0bits_t *)sim_access(SIM_DACCON0))
+
+#define DACCON1      (*sim_access(SIM_DACCON1))
+typedef struct
+{
+    unsigned char SWDTEN : 1;
+    unsigned char WDTPS0 : 1;
+    unsigned char WDTPS1 : 1;
+    unsigned char WDTPS2 : 1;
+    unsigned char WDTPS3 : 1;
+    unsigned char WDTPS4 : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+} __attribute__((may_alias)) WDTCONbits_t;
+#define WDTCON       (*sim_access(SIM_WDTCON))
+#define WDTCONbits   (*(volatile WDTCONbits_t *)sim_access(SIM_WDTCON))
+
+typedef struct
+{
+    unsigned char C : 1;
+    unsigned char DC : 1;
+    unsigned char Z : 1;
+    unsigned char nPD : 1;
+    unsigned char nTO : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+} __attribute__((may_alias)) STATUSbits_t;
+#define STATUS       (*sim_access(SIM_STATUS))
+#define STATUSbits   (*(volatile STATUSbits_t *)sim_access(SIM_STATUS))
+
+typedef struct
+{
+    unsigned char nBOR : 1;
+    unsigned char nPOR : 1;
+    unsigned char nRI : 1;
+    unsigned char nRMCLR : 1;
+    unsigned char nRWDT : 1;
+    unsigned char : 1;
+    unsigned char STKUNF : 1;
+    unsigned char STKOVF : 1;
+} __attribute__((may_alias)) PCONbits_t;
+#define PCON         (*sim_access(SIM_PCON))
+#define PCONbits     (*(volatile PCONbits_t *)sim_access(SIM_PCON))
+
+typedef struct
+{
+    unsigned char RD : 1;
+    unsigned char WR : 1;
+    unsigned char WREN : 1;
+    unsigned char WRERR : 1;
+    unsigned char FREE : 1;
+    unsigned char LWLO : 1;
+    unsigned char CFGS : 1;
+    unsigned char : 1;
+} __attribute__((may_alias)) PMCON1bits_t;
+#define PMCON1       (*sim_access(SIM_PMCON1))
+#define PMCON1bits   (*(volatile PMCON1bits_t *)sim_access(SIM_PMCON1))
+
+#define PMCON2       (*sim_access(SIM_PMCON2))
+#define PMADRL       (*sim_access(SIM_PMADRL))
+#define PMADRH       (*sim_access(SIM_PMADRH))
+#define PMDATL       (*sim_access(SIM_PMDATL))
+#define PMDATH       (*sim_access(SIM_PMDATH))
+typedef struct
+{
+    unsigned char : 1;
+    unsigned char SUSPND : 1;
+    unsigned char RESUME : 1;
+    unsigned char USBEN : 1;
+    unsigned char PKTDIS : 1;
+    unsigned char SE0 : 1;
+    unsigned char PPBRST : 1;
+    unsigned char : 1;
+} __attribute__((may_alias)) UCONbits_t;
+#define UCON         (*sim_access(SIM_UCON))
+#define UCONbits     (*(volatile UCONbits_t *)sim_access(SIM_UCON))
+
+typedef struct
+{
+    unsigned char PPB0 : 1;
+    unsigned char PPB1 : 1;
+    unsigned char FSEN : 1;
+    unsigned char UPUEN : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char UTEYE : 1;
+} __attribute__((may_alias)) UCFGbits_t;
+#define UCFG         (*sim_access(SIM_UCFG))
+#define UCFGbits     (*(volatile UCFGbits_t *)sim_access(SIM_UCFG))
+
+typedef struct
+{
+    unsigned char : 1;
+    unsigned char PPBI : 1;
+    unsigned char DIR : 1;
+    unsigned char ENDP0 : 1;
+    unsigned char ENDP1 : 1;
+    unsigned char ENDP2 : 1;
+    unsigned char ENDP3 : 1;
+    unsigned char : 1;
+} __attribute__((may_alias)) USTATbits_t;
+#define USTAT        (*sim_access(SIM_USTAT))
+#define USTATbits    (*(volatile USTATbits_t *)sim_access(SIM_USTAT))
+
+typedef struct
+{
+    unsigned char URSTIF : 1;
+    unsigned char UERRIF : 1;
+    unsigned char ACTVIF : 1;
+    unsigned char TRNIF : 1;
+    unsigned char IDLEIF : 1;
+    unsigned char STALLIF : 1;
+    unsigned char SOFIF : 1;
+    unsigned char : 1;
+} __attribute__((may_alias)) UIRbits_t;
+#define UIR          (*sim_access(SIM_UIR))
+#define UIRbits      (*(volatile UIRbits_t *)sim_access(SIM_UIR))
+
+typedef struct
+{
+    unsigned char URSTIE : 1;
+    unsigned char UERRIE : 1;
+    unsigned char ACTVIE : 1;
+    unsigned char TRNIE : 1;
+    unsigned char IDLEIE : 1;
+    unsigned char STALLIE : 1;
+    unsigned char SOFIE : 1;
+    unsigned char : 1;
+} __attribute__((may_alias)) UIEbits_t;
+#define UIE          (*sim_access(SIM_UIE))
+#define UIEbits      (*(volatile UIEbits_t *)sim_access(SIM_UIE))
+
+#define UADDR        (*sim_access(SIM_UADDR))
+typedef struct
+{
+    unsigned char EPSTALL : 1;
+    unsigned char EPINEN : 1;
+    unsigned char EPOUTEN : 1;
+    unsigned char EPCONDIS : 1;
+    unsigned char EPHSHK : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+} __attribute__((may_alias)) UEP0bits_t;
+#define UEP0         (*sim_access(SIM_UEP0))
+#define UEP0bits     (*(volatile UEP0bits_t *)sim_access(SIM_UEP0))
+
+#define UEP1         (*sim_access(SIM_UEP1))
+#define UEP2         (*sim_access(SIM_UEP2))
+#define UEP3         (*sim_access(SIM_UEP3))
+#define UEIR         (*sim_access(SIM_UEIR))
+#define UFRML        (*sim_access(SIM_UFRML))
+#define UFRMH        (*sim_access(SIM_UFRMH))
+typedef struct
+{
+    unsigned char BORRDY : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char SBOREN : 1;
+} __attribute__((may_alias)) BORCONbits_t;
+#define BORCON       (*sim_access(SIM_BORCON))
+#define BORCONbits   (*(volatile BORCONbits_t *)sim_access(SIM_BORCON))
+
+typedef struct
+{
+    unsigned char VREGRSV : 1;
+    unsigned char VREGPM : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+    unsigned char : 1;
+} __attribute__((may_alias)) VREGCONbits_t;
+#define VREGCON      (*sim_access(SIM_VREGCON))
+#define VREGCONbits  (*(volatile VREGCONbits_t *)sim_access(SIM_VREGCON))
+
+
+// Bit names
+#define PS0          OPTION_REGbits.PS0
+#define PS1          OPTION_REGbits.PS1
+#define PS2          OPTION_REGbits.PS2
+#define PSA          OPTION_REGbits.PSA
+#define TMR0SE       OPTION_REGbits.TMR0SE
+#define TMR0CS       OPTION_REGbits.TMR0CS
+#define INTEDG       OPTION_REGbits.INTEDG
+#define nWPUEN       OPTION_REGbits.nWPUEN
+#define IOCIF        INTCONbits.IOCIF
+#define INTF         INTCONbits.INTF
+#define TMR0IF       INTCONbits.TMR0IF
+#define IOCIE        INTCONbits.IOCIE
+#define INTE         INTCONbits.INTE
+#define TMR0IE       INTCONbits.TMR0IE
+#define PEIE         INTCONbits.PEIE
+#define GIE          INTCONbits.GIE
+#define TMR1IF       PIR1bits.TMR1IF
+#define TMR2IF       PIR1bits.TMR2IF
+#define SSP1IF       PIR1bits.SSP1IF
+#define TXIF         PIR1bits.TXIF
+#define RCIF         PIR1bits.RCIF
+#define ADIF         PIR1bits.ADIF
+#define TMR1GIF      PIR1bits.TMR1GIF
+#define TMR1IE       PIE1bits.TMR1IE
+#define TMR2IE       PIE1bits.TMR2IE
+#define SSP1IE       PIE1bits.SSP1IE
+#define TXIE         PIE1bits.TXIE
+#define RCIE         PIE1bits.RCIE
+#define ADIE         PIE1bits.ADIE
+#define TMR1GIE      PIE1bits.TMR1GIE
+#define ACTIF        PIR2bits.ACTIF
+#define BCL1IF       PIR2bits.BCL1IF
+#define USBIF        PIR2bits.USBIF
+#define C1IF         PIR2bits.C1IF
+#define C2IF         PIR2bits.C2IF
+#define OSFIF        PIR2bits.OSFIF
+#define ACTIE        PIE2bits.ACTIE
+#define BCL1IE       PIE2bits.BCL1IE
+#define USBIE        PIE2bits.USBIE
+#define C1IE         PIE2bits.C1IE
+#define C2IE         PIE2bits.C2IE
+#define OSFIE        PIE2bits.OSFIE
+#define SCS0         OSCCONbits.SCS0
+#define SCS1         OSCCONbits.SCS1
+#define IRCF0        OSCCONbits.IRCF0
+#define IRCF1        OSCCONbits.IRCF1
+#define IRCF2        OSCCONbits.IRCF2
+#define IRCF3        OSCCONbits.IRCF3
+#define SPLLMULT     OSCCONbits.SPLLMULT
+#define SPLLEN       OSCCONbits.SPLLEN
+#define HFIOFS       OSCSTATbits.HFIOFS
+#define LFIOFR       OSCSTATbits.LFIOFR
+#define HFIOFR       OSCSTATbits.HFIOFR
+#define PLLRDY       OSCSTATbits.PLLRDY
+#define SOSCR        OSCSTATbits.SOSCR
+#define ACTSRC       ACTCONbits.ACTSRC
+#define ACTUPD       ACTCONbits.ACTUPD
+#define ACTLOCK      ACTCONbits.ACTLOCK
+#define ACTEN        ACTCONbits.ACTEN
+#define ADON         ADCON0bits.ADON
+#define GO           ADCON0bits.GO
+#define CHS0         ADCON0bits.CHS0
+#define CHS1         ADCON0bits.CHS1
+#define CHS2         ADCON0bits.CHS2
+#define CHS3         ADCON0bits.CHS3
+#define CHS4         ADCON0bits.CHS4
+#define ADPREF0      ADCON1bits.ADPREF0
+#define ADPREF1      ADCON1bits.ADPREF1
+#define ADCS0        ADCON1bits.ADCS0
+#define ADCS1        ADCON1bits.ADCS1
+#define ADCS2        ADCON1bits.ADCS2
+#define ADFM         ADCON1bits.ADFM
+#define TRIGSEL0     ADCON2bits.TRIGSEL0
+#define TRIGSEL1     ADCON2bits.TRIGSEL1
+#define TRIGSEL2     ADCON2bits.TRIGSEL2
+#define TRIGSEL3     ADCON2bits.TRIGSEL3
+#define TMR1ON       T1CONbits.TMR1ON
+#define nT1SYNC      T1CONbits.nT1SYNC
+#define T1OSCEN      T1CONbits.T1OSCEN
+#define T1CKPS0      T1CONbits.T1CKPS0
+#define T1CKPS1      T1CONbits.T1CKPS1
+#define TMR1CS0      T1CONbits.TMR1CS0
+#define TMR1CS1      T1CONbits.TMR1CS1
+#define T1GSS0       T1GCONbits.T1GSS0
+#define T1GSS1       T1GCONbits.T1GSS1
+#define T1GVAL       T1GCONbits.T1GVAL
+#define T1GGO_nDONE  T1GCONbits.T1GGO_nDONE
+#define T1GSPM       T1GCONbits.T1GSPM
+#define T1GTM        T1GCONbits.T1GTM
+#define T1GPOL       T1GCONbits.T1GPOL
+#define TMR1GE       T1GCONbits.TMR1GE
+#define T2CKPS0      T2CONbits.T2CKPS0
+#define T2CKPS1      T2CONbits.T2CKPS1
+#define TMR2ON       T2CONbits.TMR2ON
+#define T2OUTPS0     T2CONbits.T2OUTPS0
+#define T2OUTPS1     T2CONbits.T2OUTPS1
+#define T2OUTPS2     T2CONbits.T2OUTPS2
+#define T2OUTPS3     T2CONbits.T2OUTPS3
+#define PWM1POL      PWM1CONbits.PWM1POL
+#define PWM1OUT      PWM1CONbits.PWM1OUT
+#define PWM1OE       PWM1CONbits.PWM1OE
+#define PWM1EN       PWM1CONbits.PWM1EN
+#define PWM2POL      PWM2CONbits.PWM2POL
+#define PWM2OUT      PWM2CONbits.PWM2OUT
+#define PWM2OE       PWM2CONbits.PWM2OE
+#define PWM2EN       PWM2CONbits.PWM2EN
+#define ADFVR0       FVRCONbits.ADFVR0
+#define ADFVR1       FVRCONbits.ADFVR1
+#define CDAFVR0      FVRCONbits.CDAFVR0
+#define CDAFVR1      FVRCONbits.CDAFVR1
+#define TSRNG        FVRCONbits.TSRNG
+#define TSEN         FVRCONbits.TSEN
+#define FVRRDY       FVRCONbits.FVRRDY
+#define FVREN        FVRCONbits.FVREN
+#define C1SYNC       CM1CON0bits.C1SYNC
+#define C1HYS        CM1CON0bits.C1HYS
+#define C1SP         CM1CON0bits.C1SP
+#define C1POL        CM1CON0bits.C1POL
+#define C1OE         CM1CON0bits.C1OE
+#define C1OUT        CM1CON0bits.C1OUT
+#define C1ON         CM1CON0bits.C1ON
+#define C1NCH0       CM1CON1bits.C1NCH0
+#define C1NCH1       CM1CON1bits.C1NCH1
+#define C1PCH0       CM1CON1bits.C1PCH0
+#define C1PCH1       CM1CON1bits.C1PCH1
+#define C1INTN       CM1CON1bits.C1INTN
+#define C1INTP       CM1CON1bits.C1INTP
+#define C2SYNC       CM2CON0bits.C2SYNC
+#define C2HYS        CM2CON0bits.C2HYS
+#define C2SP         CM2CON0bits.C2SP
+#define C2POL        CM2CON0bits.C2POL
+#define C2OE         CM2CON0bits.C2OE
+#define C2OUT        CM2CON0bits.C2OUT
+#define C2ON         CM2CON0bits.C2ON
+#define C2NCH0       CM2CON1bits.C2NCH0
+#define C2NCH1       CM2CON1bits.C2NCH1
+#define C2PCH0       CM2CON1bits.C2PCH0
+#define C2PCH1       CM2CON1bits.C2PCH1
+#define C2INTN       CM2CON1bits.C2INTN
+#define C2INTP       CM2CON1bits.C2INTP
+#define MC1OUT       CMOUTbits.MC1OUT
+#define MC2OUT       CMOUTbits.MC2OUT
+#define DACNSS       DACCON0bits.DACNSS
+#define DACPSS0      DACCON0bits.DACPSS0
+#define DACPSS1      DACCON0bits.DACPSS1
+#define DACOE2       DACCON0bits.DACOE2
+#define DACOE1       DACCON0bits.DACOE1
+#define DACEN        DACCON0bits.DACEN
+#define SWDTEN       WDTCONbits.SWDTEN
+#define WDTPS0       WDTCONbits.WDTPS0
+#define WDTPS1       WDTCONbits.WDTPS1
+#define WDTPS2       WDTCONbits.WDTPS2
+#define WDTPS3       WDTCONbits.WDTPS3
+#define WDTPS4       WDTCONbits.WDTPS4
+#define nPD          STATUSbits.nPD
+#define nTO          STATUSbits.nTO
+#define nBOR         PCONbits.nBOR
+#define nPOR         PCONbits.nPOR
+#define nRI          PCONbits.nRI
+#define nRMCLR       PCONbits.nRMCLR
+#define nRWDT        PCONbits.nRWDT
+#define STKUNF       PCONbits.STKUNF
+#define STKOVF       PCONbits.STKOVF
+#define RD           PMCON1bits.RD
+#define WR           PMCON1bits.WR
+#define WREN         PMCON1bits.WREN
+#define WRERR        PMCON1bits.WRERR
+#define FREE         PMCON1bits.FREE
+#define LWLO         PMCON1bits.LWLO
+#define CFGS         PMCON1bits.CFGS
+#define SUSPND       UCONbits.SUSPND
+#define RESUME       UCONbits.RESUME
+#define USBEN        UCONbits.USBEN
+#define PKTDIS       UCONbits.PKTDIS
+#define SE0          UCONbits.SE0
+#define PPBRST       UCONbits.PPBRST
+#define PPB0         UCFGbits.PPB0
+#define PPB1         UCFGbits.PPB1
+#define FSEN         UCFGbits.FSEN
+#define UPUEN        UCFGbits.UPUEN
+#define UTEYE        UCFGbits.UTEYE
+#define PPBI         USTATbits.PPBI
+#define DIR          USTATbits.DIR
+#define ENDP0        USTATbits.ENDP0
+#define ENDP1        USTATbits.ENDP1
+#define ENDP2        USTATbits.ENDP2
+#define ENDP3        USTATbits.ENDP3
+#define URSTIF       UIRbits.URSTIF
+#define UERRIF       UIRbits.UERRIF
+#define ACTVIF       UIRbits.ACTVIF
+#define TRNIF        UIRbits.TRNIF
+#define IDLEIF       UIRbits.IDLEIF
+#define STALLIF      UIRbits.STALLIF
+#define SOFIF        UIRbits.SOFIF
+#define URSTIE       UIEbits.URSTIE
+#define UERRIE       UIEbits.UERRIE
+#define ACTVIE       UIEbits.ACTVIE
+#define TRNIE        UIEbits.TRNIE
+#define IDLEIE       UIEbits.IDLEIE
+#define STALLIE      UIEbits.STALLIE
+#define SOFIE        UIEbits.SOFIE
+#define EPSTALL      UEP0bits.EPSTALL
+#define EPINEN       UEP0bits.EPINEN
+#define EPOUTEN      UEP0bits.EPOUTEN
+#define EPCONDIS     UEP0bits.EPCONDIS
+#define EPHSHK       UEP0bits.EPHSHK
+#define BORRDY       BORCONbits.BORRDY
+#define SBOREN       BORCONbits.SBOREN
+#define VREGRSV      VREGCONbits.VREGRSV
+#define VREGPM       VREGCONbits.VREGPM
+
+#endif